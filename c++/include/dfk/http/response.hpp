@@ -37,6 +37,7 @@ public:
   Response& keepalive();
   ssize_t write(char* buf, std::size_t nbytes);
   ssize_t writev(IoVec* iov, std::size_t niov);
+  ssize_t sendfile(int fd, off_t offset, std::size_t nbytes);
   Response& set(const char* name, std::size_t namelen, const char* value, std::size_t valuelen);
 };
 
@@ -7,6 +7,7 @@
  */
 
 #pragma once
+#include <cstdint>
 #include <dfk/middleware/fileserver.h>
 #include <dfk/wrapper.hpp>
 #include <dfk/context.hpp>
@@ -23,6 +24,11 @@ public:
   explicit Server(Context* context, const Buffer& basepath);
   void setAutoindex(bool enabled);
   void setIOBufferSize(std::size_t size);
+  void setCacheSize(std::size_t size);
+  void setCacheTtl(std::uint64_t ttl);
+  void setCacheMemory(std::size_t size);
+  void setCacheFileSize(std::size_t size);
+  void setPrecompressed(bool enabled);
 
   int handle(http::Server*, http::Request&, http::Response&);
 };
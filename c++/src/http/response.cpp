@@ -76,6 +76,11 @@ ssize_t Response::writev(IoVec* iov, std::size_t niov)
   return dfk_http_response_writev(nativeHandle(), reinterpret_cast<dfk_iovec_t*>(iov), niov);
 }
 
+ssize_t Response::sendfile(int fd, off_t offset, std::size_t nbytes)
+{
+  return dfk_http_response_sendfile(nativeHandle(), fd, offset, nbytes);
+}
+
 Response& Response::set(const char* name, std::size_t namelen, const char* value, std::size_t valuelen)
 {
   return *this;
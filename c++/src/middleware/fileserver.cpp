@@ -30,6 +30,31 @@ void Server::setIOBufferSize(std::size_t size)
   nativeHandle()->io_buf_size = size;
 }
 
+void Server::setCacheSize(std::size_t size)
+{
+  nativeHandle()->cache_size = size;
+}
+
+void Server::setCacheTtl(std::uint64_t ttl)
+{
+  nativeHandle()->cache_ttl = ttl;
+}
+
+void Server::setCacheMemory(std::size_t size)
+{
+  nativeHandle()->cache_memory = size;
+}
+
+void Server::setCacheFileSize(std::size_t size)
+{
+  nativeHandle()->cache_file_size = size;
+}
+
+void Server::setPrecompressed(bool enabled)
+{
+  nativeHandle()->precompressed = enabled;
+}
+
 int Server::handle(http::Server* server, http::Request& request, http::Response& response)
 {
   dfk_userdata_t user = (dfk_userdata_t) {nativeHandle()};
@@ -16,8 +16,28 @@
 extern "C" {
 #endif
 
+/**
+ * Memory usage counters of an arena
+ *
+ * Counters are accumulated over the whole lifetime of the arena, they are
+ * not cleared by dfk_arena_reset() or dfk_arena_rewind().
+ */
+typedef struct dfk_arena_stats_t {
+  /** Number of bytes requested by the callers */
+  size_t nbytes_allocated;
+  /** Number of bytes lost to alignment and unused tails of segments */
+  size_t nbytes_wasted;
+  /** Number of data segments taken from the allocator */
+  size_t nsegments;
+  /** Number of objects allocated in a dedicated chunk of memory */
+  size_t noversize;
+} dfk_arena_stats_t;
+
 /**
  * Memory arena, manages small object allocation.
+ *
+ * Allocations are aligned to #DFK_MALLOC_ALIGNMENT, unless requested
+ * otherwise via dfk_arena_alloc_aligned().
  */
 typedef struct dfk_arena_t {
   /**
@@ -26,19 +46,66 @@ typedef struct dfk_arena_t {
    */
   dfk_t* dfk;
 
+  /**
+   * @warning Readonly
+   * @public
+   */
+  dfk_arena_stats_t stats;
+
   /**
    * Data segments
    * @private
    */
   dfk_list_t _segments;
 
+  /**
+   * Dedicated chunks of memory for large objects
+   * @private
+   */
+  dfk_list_t _oversize;
+
   /**
    * Objects with cleanup
    * @private
    */
   dfk_list_t _owc;
+
+  /**
+   * Segments retained by dfk_arena_reset() and dfk_arena_rewind() for reuse
+   * @private
+   */
+  dfk_list_t _spare;
 } dfk_arena_t;
 
+/**
+ * A position within arena, see dfk_arena_mark()
+ */
+typedef struct dfk_arena_mark_t {
+  /**
+   * Current segment at the moment of dfk_arena_mark() call
+   * @private
+   */
+  void* _segment;
+
+  /**
+   * Number of bytes used in the current segment
+   * @private
+   */
+  size_t _used;
+
+  /**
+   * Last chunk for a large object
+   * @private
+   */
+  void* _oversize;
+
+  /**
+   * Last object with cleanup
+   * @private
+   */
+  void* _owc;
+} dfk_arena_mark_t;
+
 /**
  * Initialize empty arena.
  */
@@ -49,11 +116,47 @@ void dfk_arena_init(dfk_arena_t* arena, dfk_t* dfk);
  */
 void dfk_arena_free(dfk_arena_t* arena);
 
+/**
+ * Release all objects allocated within arena, but keep memory for reuse.
+ *
+ * Cleanup callbacks are invoked, as for dfk_arena_free(). Up to @p nsegments
+ * data segments are retained, so that subsequent allocations of the same
+ * pattern do not touch the allocator. Other segments are released.
+ *
+ * All marks obtained via dfk_arena_mark() become invalid.
+ */
+void dfk_arena_reset(dfk_arena_t* arena, size_t nsegments);
+
+/**
+ * Remember current position within arena.
+ *
+ * Allocations made after the mark can be released at once with
+ * dfk_arena_rewind(), which is useful for scoped temporary buffers.
+ */
+void dfk_arena_mark(dfk_arena_t* arena, dfk_arena_mark_t* mark);
+
+/**
+ * Release all objects allocated after the @p mark was taken.
+ *
+ * Cleanup callbacks of released objects are invoked in the reverse order of
+ * allocation. Segments allocated after the mark are retained for reuse.
+ * Marks taken after @p mark become invalid, @p mark itself remains valid.
+ */
+void dfk_arena_rewind(dfk_arena_t* arena, dfk_arena_mark_t* mark);
+
 /**
  * Allocate uninitialized buffer of the given size.
  */
 void* dfk_arena_alloc(dfk_arena_t* arena, size_t size);
 
+/**
+ * Allocate uninitialized buffer of the given size and alignment.
+ *
+ * @pre @p alignment is a power of two
+ */
+void* dfk_arena_alloc_aligned(dfk_arena_t* arena, size_t size,
+    size_t alignment);
+
 /**
  * Allocate and initialize buffer.
  */
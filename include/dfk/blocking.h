@@ -0,0 +1,36 @@
+/**
+ * @file dfk/blocking.h
+ * Contains dfk_blocking_call - a facility for running blocking code
+ * without stalling the event loop.
+ *
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#pragma once
+#include <dfk/config.h>
+#include <dfk/context.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Run @p func in a thread of the blocking calls pool
+ *
+ * Current fiber is suspended until @p func returns, other fibers keep
+ * running meanwhile. Intended for calls that could block for a long time
+ * and have no non-blocking alternative, e.g. stat(2), open(2) or read(2)
+ * of a regular file. Results should be passed back via @p arg, @p func
+ * should not call dfk functions that require a fiber.
+ *
+ * The pool is started on the first call, it grows on demand up to
+ * dfk_t.blocking_threads threads. If #DFK_MAILBOX is disabled, or
+ * dfk_t.blocking_threads is zero, @p func is called in the current fiber.
+ */
+int dfk_blocking_call(dfk_t* dfk, void (*func)(void*), void* arg);
+
+#ifdef __cplusplus
+}
+#endif
@@ -12,6 +12,10 @@
 #include <dfk/context.h>
 #include <dfk/mutex.h>
 
+#if DFK_THREADS
+#include <pthread.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -33,6 +37,21 @@ typedef struct dfk_cond_t {
    * @private
    */
   dfk_list_t _waitqueue;
+
+  /**
+   * A mutex passed to the most recent dfk_cond_wait call
+   * @private
+   */
+  dfk_mutex_t* _mutex;
+
+#if DFK_THREADS
+  /**
+   * Protects _waitqueue against concurrent access by worker threads
+   *
+   * @private
+   */
+  pthread_mutex_t _guard;
+#endif
 } dfk_cond_t;
 
 void dfk_cond_init(dfk_cond_t* cond, dfk_t* dfk);
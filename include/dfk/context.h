@@ -14,6 +14,10 @@
 #include <dfk/list.h>
 #include <dfk/thirdparty/libcoro/coro.h>
 
+#if DFK_THREADS || DFK_MAILBOX
+#include <pthread.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -58,6 +62,110 @@ typedef struct dfk_t {
    */
   size_t default_stack_size;
 
+  /**
+   * Maximum number of spare fiber stacks kept for reuse
+   *
+   * Once the pool grows above this limit, it is shrunk down to
+   * dfk_t.stack_pool_low stacks.
+   *
+   * @note default: #DFK_STACK_POOL_HIGH
+   */
+  size_t stack_pool_high;
+
+  /**
+   * Number of fiber stacks pre-allocated by dfk_work()
+   *
+   * @note default: #DFK_STACK_POOL_LOW
+   */
+  size_t stack_pool_low;
+
+#if DFK_STACK_LAZY
+  /**
+   * Keep at most N bytes of a spare fiber stack resident
+   *
+   * Memory of the deeper stack pages is released once the stack is
+   * returned to the pool.
+   *
+   * @note default: #DFK_STACK_RESIDENT_SIZE
+   */
+  size_t stack_resident_size;
+#endif
+
+  /**
+   * Maximum number of spare memory buffers kept for reuse
+   *
+   * Arena segments and HTTP request headers buffers are returned to the
+   * pool once released.
+   *
+   * @note default: #DFK_BUFFER_POOL_SIZE
+   */
+  size_t buffer_pool_size;
+
+  /**
+   * Maximum number of IO events dispatched by a single event loop iteration
+   *
+   * @note default: #DFK_IO_MAXEVENTS
+   */
+  size_t io_maxevents;
+
+  /**
+   * Poll for IO events without blocking for N microseconds before sleeping
+   *
+   * Spinning trades CPU time for lower wake up latency of fibers waiting
+   * for IO. Zero value makes the event loop block as soon as it is idle.
+   *
+   * @note default: #DFK_IDLE_SPIN_USEC
+   */
+  size_t idle_spin_usec;
+
+  /**
+   * Maximum number of consecutive direct handoffs
+   *
+   * If non-zero, dfk_mutex_unlock() switches straight to the next owner of
+   * the mutex, while the caller is put to the run queue. Once the limit is
+   * reached, new owners are scheduled as usual until the scheduler regains
+   * control, so that callers can not be starved. Fibers woken up by
+   * dfk_cond_signal() or dfk_cond_broadcast() while the caller holds the
+   * mutex are moved to the mutex wait queue instead of the run queue.
+   *
+   * Has no effect if #DFK_THREADS is enabled.
+   *
+   * @note default: #DFK_HANDOFF_LIMIT
+   */
+  size_t handoff_limit;
+
+  /**
+   * Maximum number of connections accepted in a row
+   *
+   * Once the limit is reached, the accepting fiber yields, so that fibers
+   * serving new connections could run before the backlog is drained
+   * further.
+   *
+   * @note default: #DFK_TCP_ACCEPT_BURST
+   */
+  size_t accept_burst;
+
+  /**
+   * Maximum number of threads serving dfk_blocking_call()
+   *
+   * Zero value makes dfk_blocking_call() run functions in the calling
+   * fiber.
+   * The pool is created by the first call, it does not grow beyond the
+   * value set at that moment.
+   *
+   * @note default: #DFK_BLOCKING_THREADS
+   */
+  size_t blocking_threads;
+
+#if DFK_THREADS
+  /**
+   * Number of worker threads started by dfk_work()
+   *
+   * @note default: number of online CPUs
+   */
+  size_t nworkers;
+#endif
+
   int sys_errno;
   int dfk_errno;
 
@@ -84,6 +192,30 @@ typedef struct dfk_t {
    * A list of active tcp servers to wait for when dfk_stop() is called.
    */
   dfk_list_t _tcp_servers;
+
+  /**
+   * A pool of spare fiber stacks
+   */
+  dfk_list_t _stack_pool;
+#if DFK_THREADS
+  pthread_mutex_t _stack_pool_lock;
+#endif
+
+  /**
+   * A pool of spare memory buffers
+   */
+  dfk_list_t _buffer_pool;
+#if DFK_THREADS || DFK_MAILBOX
+  pthread_mutex_t _buffer_pool_lock;
+#endif
+
+  /**
+   * A pool of threads serving dfk_blocking_call(), started on demand
+   */
+  struct dfk_blocking_pool_t* _blocking;
+#if DFK_THREADS
+  pthread_mutex_t _blocking_lock;
+#endif
 } dfk_t;
 
 /**
@@ -8,6 +8,7 @@
  */
 
 #pragma once
+#include <stdint.h>
 #include <dfk/context.h>
 #include <dfk/list.h>
 #include <dfk/misc.h>
@@ -17,6 +18,31 @@
 extern "C" {
 #endif
 
+/**
+ * Fiber priority class
+ *
+ * Runnable fibers of a higher class are executed first. Fibers with
+ * a deadline set via dfk_fiber_deadline() are executed in the
+ * earliest-deadline-first order after control fibers, but before any
+ * other class.
+ */
+typedef enum dfk_fiber_priority_e {
+  /**
+   * Control fibers - accept loops, signal watchers, health checks
+   */
+  dfk_fiber_priority_control = 0,
+
+  /**
+   * Request handling, the default class
+   */
+  dfk_fiber_priority_request = 1,
+
+  /**
+   * Background work that may be delayed under overload
+   */
+  dfk_fiber_priority_background = 2
+} dfk_fiber_priority_e;
+
 /**
  * Fiber - a lightweight userspace thread
  */
@@ -48,12 +74,30 @@ typedef struct dfk_fiber_t {
 
   /** Argument provided to the entry point */
   void* _arg;
+
+  /** Stack of the fiber */
+  struct dfk_stack_t* _stack;
+
+  /** Priority class, see dfk_fiber_priority() */
+  dfk_fiber_priority_e _priority;
+
+  /** Absolute deadline, see dfk_fiber_deadline() */
+  uint64_t _deadline;
 #if DFK_NAMED_FIBERS
   char _name[DFK_FIBER_NAME_LENGTH];
 #endif
 #if DFK_VALGRIND
   int _stack_id;
 #endif
+#if DFK_THREADS
+  /**
+   * Set while fiber is executed by some worker thread.
+   *
+   * Protects against resuming the fiber on another worker until its context
+   * is saved.
+   */
+  dfk_atomic_size_t _busy;
+#endif
 } dfk_fiber_t;
 
 /**
@@ -78,6 +122,24 @@ dfk_fiber_t* dfk_spawn(dfk_t* dfk, void (*ep)(dfk_fiber_t*, void*),
  */
 void dfk_fiber_name(dfk_fiber_t* fiber, const char* fmt, ...);
 
+/**
+ * Set priority class of the fiber
+ *
+ * New fibers are created with #dfk_fiber_priority_request class. Change
+ * takes effect the next time the fiber is scheduled for execution.
+ */
+void dfk_fiber_priority(dfk_fiber_t* fiber, dfk_fiber_priority_e priority);
+
+/**
+ * Move the fiber into the earliest-deadline-first lane
+ *
+ * @p deadline is an absolute value of dfk_now(). Zero value returns the
+ * fiber back to its priority class. Control fibers are not affected by
+ * deadlines. Change takes effect the next time the fiber is scheduled for
+ * execution.
+ */
+void dfk_fiber_deadline(dfk_fiber_t* fiber, uint64_t deadline);
+
 /**
  * Switch execution context to another fiber.
  *
@@ -89,6 +151,34 @@ void dfk_fiber_name(dfk_fiber_t* fiber, const char* fmt, ...);
  */
 void dfk_yield(dfk_fiber_t* from, dfk_fiber_t* to);
 
+/**
+ * Suspend current fiber for at least @p nsec nanoseconds
+ *
+ * Timers have a resolution of 1 millisecond. Zero @p nsec lets other
+ * runnable fibers proceed before the current one is resumed.
+ */
+int dfk_sleep(dfk_t* dfk, uint64_t nsec);
+
+/**
+ * Returns monotonic time, in nanoseconds
+ *
+ * A base for deadlines accepted by dfk_tcp_socket_read_deadline and
+ * dfk_tcp_socket_write_deadline.
+ */
+uint64_t dfk_now(dfk_t* dfk);
+
+/**
+ * Returns stack high-water mark of the fiber, in bytes
+ *
+ * Stack usage is derived from memory pages residency, therefore the value
+ * is accurate up to a memory page. Size of the whole stack is returned if
+ * the platform does not provide residency information.
+ *
+ * @note If #DFK_STACK is FIXED, stacks are pre-allocated with all pages
+ * committed, and the returned value is not indicative.
+ */
+size_t dfk_fiber_stack_hwm(dfk_fiber_t* fiber);
+
 /**
  * Returns size of the dfk_fiber_t structure.
  *
@@ -19,6 +19,18 @@ extern "C" {
 #define DFK_HTTP_CONTENT_TYPE "Content-Type"
 #define DFK_HTTP_CONTENT_LENGTH "Content-Length"
 #define DFK_HTTP_CONNECTION "Connection"
+#define DFK_HTTP_ETAG "ETag"
+#define DFK_HTTP_LAST_MODIFIED "Last-Modified"
+#define DFK_HTTP_IF_NONE_MATCH "If-None-Match"
+#define DFK_HTTP_IF_MODIFIED_SINCE "If-Modified-Since"
+#define DFK_HTTP_RANGE "Range"
+#define DFK_HTTP_IF_RANGE "If-Range"
+#define DFK_HTTP_ACCEPT_RANGES "Accept-Ranges"
+#define DFK_HTTP_CONTENT_RANGE "Content-Range"
+#define DFK_HTTP_ACCEPT_ENCODING "Accept-Encoding"
+#define DFK_HTTP_CONTENT_ENCODING "Content-Encoding"
+#define DFK_HTTP_VARY "Vary"
+#define DFK_HTTP_TRANSFER_ENCODING "Transfer-Encoding"
 
 typedef enum dfk_http_method_e {
   DFK_HTTP_DELETE = 0,
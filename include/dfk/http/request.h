@@ -57,8 +57,17 @@ typedef struct dfk_http_request_t {
   struct dfk_arena_t* _request_arena;
   dfk_tcp_socket_t* _socket;
   dfk_list_t _buffers;
+  /**
+   * Headers buffer owned by the connection, used first if not NULL.
+   * Its size is dfk_http_t.headers_buffer_size.
+   */
+  char* _headers_buffer;
   dfk_buf_t _remainder;
   size_t _body_nread;
+  /** Set once http_parser reaches the end of request */
+  unsigned int _message_complete : 1;
+  /** Deadline for reading from the socket, see dfk_tcp_socket_read_deadline */
+  uint64_t _deadline;
   http_parser _parser;
 
 #if DFK_MOCKS
@@ -36,14 +36,39 @@ typedef struct dfk_http_response_t {
   dfk__sponge_t* _socket_mock;
 #endif
 
+  /** Output buffer shared by responses of a connection, may be NULL */
+  char* _obuf;
+  size_t _obufsize;
+  /** Number of bytes in _obuf not yet sent */
+  size_t _obufnbytes;
+
   int _headers_flushed : 1;
+  /**
+   * Connection header is added along with the other headers, according to
+   * the keepalive field
+   */
+  int _connection_header : 1;
 
   /** @publicsection */
   struct dfk_http_t* http;
   unsigned short major_version;
   unsigned short minor_version;
   dfk_http_status_e status;
+  /**
+   * Size of the response body, (size_t) -1 if not known in advance
+   *
+   * If the body size is not known by the time headers are sent, chunked
+   * transfer encoding is used for HTTP/1.1 clients, and connection is
+   * closed after the response for HTTP/1.0 ones.
+   */
   size_t content_length;
+  /**
+   * Send body with chunked transfer encoding
+   *
+   * Each dfk_http_response_write call produces a chunk, the last chunk is
+   * sent once request handler returns. Set automatically if the body is
+   * written before content_length is specified.
+   */
   int chunked : 1;
   int keepalive : 1;
   dfk_strmap_t headers;
@@ -63,6 +88,15 @@ ssize_t dfk_http_response_write(dfk_http_response_t* resp,
 ssize_t dfk_http_response_writev(dfk_http_response_t* resp,
     dfk_iovec_t* iov, size_t niov);
 
+/**
+ * Send @p nbytes of the file @p fd starting from @p offset as a response body
+ *
+ * Response headers are flushed first, if not yet.
+ * @see dfk_tcp_socket_sendfile
+ */
+ssize_t dfk_http_response_sendfile(dfk_http_response_t* resp,
+    int fd, off_t offset, size_t nbytes);
+
 int dfk_http_response_set(dfk_http_response_t* resp,
     const char* name, size_t namelen, const char* value, size_t valuelen);
 
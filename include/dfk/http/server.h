@@ -9,6 +9,7 @@
 
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
 #include <dfk/context.h>
 #include <dfk/list.h>
 #include <dfk/tcp_server.h>
@@ -36,6 +37,14 @@ typedef struct dfk_http_t {
   /** @publicsection */
   dfk_userdata_t user;
 
+  /**
+   * Number of listening sockets bound with SO_REUSEPORT option
+   *
+   * @see dfk_tcp_server_t.reuseport
+   * @note default: #DFK_TCP_REUSEPORT
+   */
+  size_t reuseport;
+
   /**
    * Maximum number of requests for a single keepalive connection.
    *
@@ -44,6 +53,16 @@ typedef struct dfk_http_t {
    */
   ssize_t keepalive_requests;
 
+  /**
+   * Close connection if the next request does not arrive within N
+   * nanoseconds.
+   *
+   * Applies to idle keepalive connections, as well as to the headers of
+   * the first request. Zero value means no timeout.
+   * @note default: #DFK_HTTP_KEEPALIVE_TIMEOUT milliseconds
+   */
+  uint64_t keepalive_timeout;
+
   /**
    * Size of the buffer allocated for HTTP header parsing.
    *
@@ -65,6 +84,17 @@ typedef struct dfk_http_t {
    * @note default: #DFK_HTTP_HEADER_MAX_SIZE
    */
   size_t header_max_size;
+
+  /**
+   * Size of the response output buffer, allocated once per connection.
+   *
+   * Response headers and body writes are accumulated in the buffer, and
+   * sent with a single system call when the buffer is full or request
+   * handler returns. Writes that do not fit are sent together with the
+   * buffered data. Zero value disables buffering.
+   * @note default: #DFK_HTTP_OUTPUT_BUFFER_SIZE
+   */
+  size_t output_buffer_size;
 } dfk_http_t;
 
 void dfk_http_init(dfk_http_t* http, dfk_t* dfk);
@@ -0,0 +1,132 @@
+/**
+ * @file dfk/mailbox.h
+ * Contains a definition of dfk_mailbox_t and related routines.
+ *
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#pragma once
+#include <dfk/config.h>
+#include <dfk/context.h>
+#include <dfk/fiber.h>
+
+#if DFK_MAILBOX
+#include <stdatomic.h>
+#if DFK_THREADS
+#include <pthread.h>
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if DFK_MAILBOX
+
+/**
+ * A message posted to the mailbox
+ *
+ * Generally embedded into a larger structure that describes a job
+ * offloaded to a foreign thread.
+ */
+typedef struct dfk_mailbox_msg_t {
+  /**
+   * @privatesection
+   */
+  struct dfk_mailbox_msg_t* _next;
+
+  /** A fiber waiting for the message, NULL if nobody waits yet */
+  dfk_fiber_t* _fiber;
+
+  /** Set once the message is received by the scheduler */
+  int _delivered;
+} dfk_mailbox_msg_t;
+
+/**
+ * A channel for waking fibers up from foreign threads
+ *
+ * Messages are posted by arbitrary OS threads to a lock-free
+ * multiple-producer single-consumer queue, and the eventfd is signalled.
+ * A dispatcher fiber, which runs while there are fibers waiting for
+ * messages, drains the queue and resumes receivers in batches.
+ *
+ * @code
+ * void job_thread(job_t* job) {
+ *   job->result = compress(job->data);
+ *   dfk_mailbox_post(job->mailbox, &job->msg);
+ * }
+ *
+ * void fiber_main(dfk_fiber_t* fiber, void* arg) {
+ *   ...
+ *   dfk_mailbox_msg_init(&job.msg);
+ *   submit_job(&job);
+ *   dfk_mailbox_wait(&mailbox, &job.msg);
+ *   use(job.result);
+ * }
+ * @endcode
+ */
+typedef struct dfk_mailbox_t {
+  /**
+   * @warning Readonly
+   * @public
+   */
+  dfk_t* dfk;
+
+  /**
+   * @privatesection
+   */
+
+  /** Top of the stack of posted messages, in reversed posting order */
+  _Atomic(dfk_mailbox_msg_t*) _head;
+
+  int _eventfd;
+
+  /** Number of fibers suspended in dfk_mailbox_wait */
+  size_t _nwaiting;
+
+  /** Non-zero if the dispatcher fiber is running */
+  int _dispatching;
+
+#if DFK_THREADS
+  /**
+   * Protects _nwaiting, _dispatching and messages that are being waited for
+   * against concurrent access by worker threads
+   */
+  pthread_mutex_t _guard;
+#endif
+} dfk_mailbox_t;
+
+int dfk_mailbox_init(dfk_mailbox_t* mailbox, dfk_t* dfk);
+
+/**
+ * @pre No fibers are waiting for messages
+ */
+int dfk_mailbox_free(dfk_mailbox_t* mailbox);
+
+void dfk_mailbox_msg_init(dfk_mailbox_msg_t* msg);
+
+/**
+ * Suspend current fiber until the @p msg is posted to the mailbox
+ *
+ * Returns immediately if the message has been already received.
+ */
+int dfk_mailbox_wait(dfk_mailbox_t* mailbox, dfk_mailbox_msg_t* msg);
+
+/**
+ * Post the message to the mailbox
+ *
+ * Thread-safe, can be called from any thread, including the ones not
+ * managed by dfk. Message should not be accessed by the caller afterwards.
+ */
+int dfk_mailbox_post(dfk_mailbox_t* mailbox, dfk_mailbox_msg_t* msg);
+
+size_t dfk_mailbox_sizeof(void);
+size_t dfk_mailbox_msg_sizeof(void);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
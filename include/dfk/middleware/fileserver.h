@@ -8,8 +8,11 @@
  */
 
 #pragma once
+#include <stdint.h>
 #include <dfk/config.h>
 #include <dfk/context.h>
+#include <dfk/avltree.h>
+#include <dfk/list.h>
 #include <dfk/http.h>
 
 #ifdef __cplusplus
@@ -25,10 +28,82 @@ typedef struct dfk_fileserver_t {
    */
   char* _basepath;
   size_t _basepathlen;
+  /** Cached files and directories, ordered by path */
+  dfk_avltree_t _cache;
+  /** Cached entries, most recently used first */
+  dfk_list_t _cache_lru;
+  size_t _cache_nentries;
+  /** Memory occupied by pre-built responses of the cached entries */
+  size_t _cache_nbytes;
+  /** Precompressed variants of regular files, ordered by path */
+  dfk_avltree_t _variants;
+  /** Variants cache records, most recently used first */
+  dfk_list_t _variants_lru;
+  size_t _variants_nentries;
+#if DFK_THREADS
+  /** Protects both the cache and the variants cache */
+  pthread_mutex_t _cache_lock;
+#endif
 
   /** @publicsection */
   dfk_t* dfk;
+  /**
+   * @deprecated Regular files are sent with dfk_http_response_sendfile,
+   * buffer is not used anymore
+   */
   size_t io_buf_size;
+  /**
+   * Maximum number of files and directories kept in the cache
+   *
+   * Cache entry holds an open descriptor and stat(2) results for a file,
+   * or a rendered index page for a directory. Zero value disables cache.
+   * @note default: #DFK_FILESERVER_CACHE_SIZE
+   */
+  size_t cache_size;
+  /**
+   * Cache entries older than N milliseconds are revalidated
+   *
+   * Applies to the variants cache as well.
+   * @note default: #DFK_FILESERVER_CACHE_TTL milliseconds
+   */
+  uint64_t cache_ttl;
+  /**
+   * Memory budget for the pre-built responses of small files, in bytes
+   *
+   * Complete response, including status line, headers and file contents,
+   * is kept in memory for regular files not larger than cache_file_size,
+   * and sent with a single system call. Least recently used entries are
+   * evicted from the cache to stay within the budget. Has no effect if
+   * cache is disabled.
+   * @note default: #DFK_FILESERVER_CACHE_MEMORY
+   */
+  size_t cache_memory;
+  /**
+   * Maximum size of a file kept in memory, in bytes
+   *
+   * @note default: #DFK_FILESERVER_CACHE_FILE_SIZE
+   */
+  size_t cache_file_size;
+  /**
+   * Serve precompressed variants of regular files
+   *
+   * If file.br or file.gz exists next to the requested file, and the
+   * encoding is accepted by the client, the variant is sent instead, with
+   * an appropriate Content-Encoding header. Brotli is preferred if both are
+   * equally acceptable. Which variants exist is remembered for
+   * variants_cache_size paths.
+   * @note default: #DFK_FILESERVER_PRECOMPRESSED
+   */
+  int precompressed;
+  /**
+   * Maximum number of paths the precompressed variants are remembered for
+   *
+   * Lookup of the variants costs two stat(2) calls, which are made once per
+   * cache_ttl milliseconds for a path, even if the open file cache is
+   * disabled. Zero value disables the variants cache.
+   * @note default: #DFK_FILESERVER_VARIANTS_CACHE_SIZE
+   */
+  size_t variants_cache_size;
   /** Generate index for directories */
   int autoindex : 1;
 } dfk_fileserver_t;
@@ -38,6 +113,12 @@ typedef struct dfk_fileserver_t {
  * @param basepathlen Size of the basepath, in bytes, excluding zero termination byte, if presented
  */
 int dfk_fileserver_init(dfk_fileserver_t* fs, dfk_t* dfk, const char* basepath, ssize_t basepathlen);
+
+/**
+ * Release cached files and directories
+ *
+ * @pre No requests are being served by @p fs
+ */
 int dfk_fileserver_free(dfk_fileserver_t* fs);
 
 size_t dfk_fileserver_sizeof(void);
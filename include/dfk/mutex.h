@@ -12,6 +12,10 @@
 #include <dfk/context.h>
 #include <dfk/fiber.h>
 
+#if DFK_THREADS
+#include <pthread.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -47,6 +51,15 @@ typedef struct dfk_mutex_t {
    * @private
    */
   dfk_fiber_t* _owner;
+
+#if DFK_THREADS
+  /**
+   * Protects _waitqueue and _owner against concurrent access by worker threads
+   *
+   * @private
+   */
+  pthread_mutex_t _guard;
+#endif
 } dfk_mutex_t;
 
 void dfk_mutex_init(dfk_mutex_t* mutex, dfk_t* dfk);
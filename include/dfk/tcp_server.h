@@ -15,12 +15,40 @@ extern "C" {
 
 typedef struct dfk_tcp_server_t {
   dfk_t* dfk;
+
+  /**
+   * Number of listening sockets bound with SO_REUSEPORT option
+   *
+   * If non-zero, dfk_tcp_serve() opens @p reuseport listening sockets on
+   * the same endpoint, each one is served by a separate fiber, and the
+   * kernel spreads incoming connections among them. Set it to 1 to share
+   * the port among several processes, or to dfk_t.nworkers to have one
+   * acceptor per worker thread. Zero value means a single socket without
+   * SO_REUSEPORT.
+   *
+   * @note default: #DFK_TCP_REUSEPORT
+   */
+  size_t reuseport;
+
+  /**
+   * Counters of the accept loops of all listening sockets
+   *
+   * @warning Readonly
+   */
+  dfk_tcp_accept_stats_t accept_stats;
+
   /**
    * @privatesection
    */
   dfk_list_hook_t _hook;
   dfk_tcp_socket_t _s;
 
+  /** Additional listening sockets, reuseport - 1 elements */
+  dfk_tcp_socket_t* _listeners;
+
+  /** Number of fibers serving additional listening sockets */
+  dfk_atomic_size_t _nlisteners;
+
   dfk_atomic_size_t _active_connections;
 
   /**
@@ -29,7 +57,9 @@ typedef struct dfk_tcp_server_t {
    * 0 - initialized, not serving yet
    * 1 - serving
    * 2 - stopping
-   * 3 - stopped
+   * 3 - waiting for additional listeners to stop
+   * 4 - waiting for active connections to finish
+   * 5 - stopped
    */
   sig_atomic_t _state;
 } dfk_tcp_server_t;
@@ -10,6 +10,7 @@
 #pragma once
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/types.h>
 #include <dfk/context.h>
 #include <dfk/misc.h>
 #include <dfk/fiber.h>
@@ -33,8 +34,57 @@ typedef enum {
   DFK_SHUT_RDWR = 3
 } dfk_shutdown_type;
 
+/**
+ * Registration of a file descriptor in the event loop
+ *
+ * If #DFK_IO_WATCH is enabled, each socket keeps its registration for the
+ * whole lifetime.
+ *
+ * @private
+ */
+typedef struct dfk_io_watch_t {
+  /** Event loop the descriptor is registered in */
+  struct dfk_eventloop_t* loop;
+  /** A fiber waiting for the descriptor to become readable */
+  dfk_fiber_t* reader;
+  /** A fiber waiting for the descriptor to become writable */
+  dfk_fiber_t* writer;
+  /**
+   * Deadline timers of the reader and of the writer, NULL if none
+   *
+   * Disarmed by the event loop before the fiber is resumed.
+   */
+  struct dfk_timer_t* reader_timer;
+  struct dfk_timer_t* writer_timer;
+  /** Readiness events reported by the event loop */
+  int ready;
+  int fd;
+} dfk_io_watch_t;
+
+/**
+ * Counters of the accept loop run by dfk_tcp_socket_listen()
+ *
+ * Average number of connections accepted per wakeup is
+ * naccepted / nwakeups.
+ *
+ * Counters are updated atomically, several accept loops may share a single
+ * instance.
+ */
+typedef struct dfk_tcp_accept_stats_t {
+  /** Number of accepted connections */
+  dfk_atomic_size_t naccepted;
+  /** Number of times the listening socket has been reported readable */
+  dfk_atomic_size_t nwakeups;
+  /** Number of times the accept loop has yielded on dfk_t.accept_burst */
+  dfk_atomic_size_t nyields;
+} dfk_tcp_accept_stats_t;
+
 /**
  * TCP socket object
+ *
+ * @warning If #DFK_IO_WATCH is enabled, socket object is registered in the
+ * event loop by address, therefore it should not be moved in memory
+ * between dfk_tcp_socket_init() and dfk_tcp_socket_close() calls.
  */
 typedef struct dfk_tcp_socket_t {
   /**
@@ -45,6 +95,11 @@ typedef struct dfk_tcp_socket_t {
 
   /** @private */
   int _socket;
+
+#if DFK_IO_WATCH
+  /** @private */
+  dfk_io_watch_t _watch;
+#endif
 } dfk_tcp_socket_t;
 
 /**
@@ -86,11 +141,32 @@ ssize_t dfk_tcp_socket_read(dfk_tcp_socket_t* sock, char* buf, size_t nbytes);
  */
 ssize_t dfk_tcp_socket_write(dfk_tcp_socket_t* sock, char* buf, size_t nbytes);
 
+/**
+ * Read at most nbytes from the socket, give up once the deadline has expired
+ *
+ * @param deadline Monotonic time, in nanoseconds, see dfk_now. Zero value
+ * means no deadline.
+ * @returns -1 and sets dfk_t.dfk_errno to dfk_err_timeout if no data has
+ * arrived before the deadline.
+ */
+ssize_t dfk_tcp_socket_read_deadline(dfk_tcp_socket_t* sock, char* buf,
+    size_t nbytes, uint64_t deadline);
+
+/**
+ * Write data to socket, give up once the deadline has expired
+ *
+ * @see dfk_tcp_socket_read_deadline
+ */
+ssize_t dfk_tcp_socket_write_deadline(dfk_tcp_socket_t* sock, char* buf,
+    size_t nbytes, uint64_t deadline);
+
 /**
  * Listen for connections on endpoint:port
  *
  * To stop listening, call dfk_tcp_socket_close.
  * Callback is executed for each incoming connection.
+ * Pending connections are accepted in bursts of at most dfk_t.accept_burst
+ * connections, a fiber is spawned for each of them.
  */
 int dfk_tcp_socket_listen(dfk_tcp_socket_t* sock,
     const char* endpoint, uint16_t port,
@@ -107,7 +183,10 @@ int dfk_tcp_socket_shutdown(dfk_tcp_socket_t* sock, dfk_shutdown_type how);
 /**
  * Read data from the socket into several buffers at once
  *
- * @todo Provide optimal implementation
+ * Performs a single readv(2) system call, suspending current fiber until
+ * data is available. Returns number of bytes read, which could be less
+ * than the total size of buffers, or -1 on error. At most 64 buffers are
+ * filled by a single call.
  */
 ssize_t dfk_tcp_socket_readv(dfk_tcp_socket_t* sock,
     dfk_iovec_t* iov, size_t niov);
@@ -115,11 +194,31 @@ ssize_t dfk_tcp_socket_readv(dfk_tcp_socket_t* sock,
 /**
  * Write data from several buffers to socket at once
  *
- * @todo Provide optimal implementation
+ * Buffers are passed to writev(2) in chunks of at most 64 elements, so
+ * @p niov is not limited by IOV_MAX. A header block is written with
+ * a single system call.
+ * Partial writes are resumed, current fiber is suspended while the socket
+ * is not writable. Unlike dfk_tcp_socket_write, returns only when all
+ * buffers are written, or -1 on error. Contents of @p iov is not modified.
  */
 ssize_t dfk_tcp_socket_writev(dfk_tcp_socket_t* sock,
     dfk_iovec_t* iov, size_t niov);
 
+/**
+ * Send @p nbytes of the file @p fd starting from @p offset to the socket
+ *
+ * Data is copied by the kernel with sendfile(2), current fiber is
+ * suspended while the socket is not writable. Returns number of bytes
+ * sent, which is less than @p nbytes only if end of file is reached,
+ * or -1 on error. File offset of @p fd is not changed.
+ *
+ * @note Reading a file that is not in the page cache blocks the thread.
+ * If sendfile(2) is not available, file is read with pread(2) into
+ * a buffer on the stack.
+ */
+ssize_t dfk_tcp_socket_sendfile(dfk_tcp_socket_t* sock, int fd,
+    off_t offset, size_t nbytes);
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,16 +5,40 @@
  */
 
 #include <assert.h>
+#include <stdint.h>
 #include <dfk/arena.h>
+#include <dfk/error.h>
 #include <dfk/malloc.h>
 #include <dfk/internal.h>
+#include <dfk/internal/buffer_pool.h>
 
+/**
+ * Objects larger than that are allocated in a dedicated chunk of memory,
+ * unless they fit into the current segment or the arena has no segments yet
+ */
+#define DFK_ARENA_OVERSIZE (DFK_ARENA_SEGMENT_SIZE / 4)
+
+#define ALIGN_UP(n, alignment) \
+  (((n) + (alignment) - 1) / (alignment) * (alignment))
+
+/**
+ * Number of bytes to skip to get @p p aligned
+ */
+#define PADDING(p, alignment) \
+  (((alignment) - (uintptr_t) (p) % (alignment)) % (alignment))
+
+/**
+ * A data segment of DFK_ARENA_SEGMENT_SIZE bytes, or an oversize chunk
+ */
 typedef struct segment_t {
   dfk_list_hook_t hook;
+  /** Size of the segment, including segment_t header */
   size_t size;
   size_t used;
 } segment_t;
 
+#define SEGMENT_HEADER_SIZE ALIGN_UP(sizeof(segment_t), DFK_MALLOC_ALIGNMENT)
+
 /**
  * A structure to hold Object With Cleanup (OWC)
  */
@@ -23,75 +47,228 @@ typedef struct owc_t {
   dfk_arena_cleanup cleanup;
 } owc_t;
 
+#define OWC_HEADER_SIZE ALIGN_UP(sizeof(owc_t), DFK_MALLOC_ALIGNMENT)
+
 void dfk_arena_init(dfk_arena_t* arena, dfk_t* dfk)
 {
   assert(arena);
   assert(dfk);
   dfk_list_init(&arena->_segments);
+  dfk_list_init(&arena->_oversize);
   dfk_list_init(&arena->_owc);
+  dfk_list_init(&arena->_spare);
   arena->dfk = dfk;
+  arena->stats = (dfk_arena_stats_t) {0};
 }
 
-void dfk_arena_free(dfk_arena_t* arena)
+static void dfk__arena_cleanup(dfk_arena_t* arena)
 {
-  assert(arena);
-
-  /* release objects with cleanup */
   dfk_list_it it, end;
   dfk_list_begin(&arena->_owc, &it);
   dfk_list_end(&arena->_owc, &end);
   while (!dfk_list_it_equal(&it, &end)) {
-    ((owc_t*) it.value)->cleanup(arena, ((char*) it.value) + sizeof(owc_t));
+    ((owc_t*) it.value)->cleanup(arena, ((char*) it.value) + OWC_HEADER_SIZE);
     dfk_list_it_next(&it);
   }
+  dfk_list_clear(&arena->_owc);
+}
+
+static void dfk__arena_release_oversize(dfk_arena_t* arena)
+{
+  while (!dfk_list_empty(&arena->_oversize)) {
+    segment_t* chunk = (segment_t*) dfk_list_front(&arena->_oversize);
+    dfk_list_pop_front(&arena->_oversize);
+    dfk__free(arena->dfk, chunk);
+  }
+}
+
+void dfk_arena_free(dfk_arena_t* arena)
+{
+  assert(arena);
+
+  /* release objects with cleanup */
+  dfk__arena_cleanup(arena);
+
+  dfk__arena_release_oversize(arena);
 
   /* release plain segments */
   while (!dfk_list_empty(&arena->_segments)) {
-    dfk_list_hook_t* segment = dfk_list_front(&arena->_segments);
+    segment_t* segment = (segment_t*) dfk_list_front(&arena->_segments);
     dfk_list_pop_front(&arena->_segments);
-    dfk__free(arena->dfk, segment);
+    dfk__buffer_free(arena->dfk, segment, segment->size);
+  }
+  while (!dfk_list_empty(&arena->_spare)) {
+    segment_t* segment = (segment_t*) dfk_list_front(&arena->_spare);
+    dfk_list_pop_front(&arena->_spare);
+    dfk__buffer_free(arena->dfk, segment, segment->size);
   }
 
   DFK_IF_DEBUG(arena->dfk = DFK_PDEADBEEF);
 }
 
-static segment_t* dfk__arena_current_segment(dfk_arena_t* arena)
+void dfk_arena_reset(dfk_arena_t* arena, size_t nsegments)
 {
-  return (segment_t*) dfk_list_back(&arena->_segments);
+  assert(arena);
+  dfk__arena_cleanup(arena);
+  dfk__arena_release_oversize(arena);
+  /* Segments that were used first are retained first */
+  dfk_list_t segments;
+  dfk_list_init(&segments);
+  dfk_list_move(&arena->_segments, &segments);
+  while (!dfk_list_empty(&arena->_spare)) {
+    dfk_list_hook_t* hook = dfk_list_front(&arena->_spare);
+    dfk_list_pop_front(&arena->_spare);
+    dfk_list_append(&segments, hook);
+  }
+  size_t nretained = 0;
+  while (!dfk_list_empty(&segments)) {
+    segment_t* segment = (segment_t*) dfk_list_front(&segments);
+    dfk_list_pop_front(&segments);
+    if (nretained < nsegments) {
+      dfk_list_append(&arena->_spare, &segment->hook);
+      nretained++;
+    } else {
+      dfk__buffer_free(arena->dfk, segment, segment->size);
+    }
+  }
+  DFK_DBG(arena->dfk, "{%p} reset, %lu segments retained", (void*) arena,
+      (unsigned long) nretained);
 }
 
-static size_t dfk__arena_bytes_available(dfk_arena_t* arena)
+void dfk_arena_mark(dfk_arena_t* arena, dfk_arena_mark_t* mark)
 {
   assert(arena);
-  segment_t* seg = dfk__arena_current_segment(arena);
-  assert(seg);
-  assert(seg->size > seg->used);
-  return seg->size - seg->used;
+  assert(mark);
+  segment_t* seg = (segment_t*) dfk_list_back(&arena->_segments);
+  mark->_segment = seg;
+  mark->_used = seg ? seg->used : 0;
+  mark->_oversize = dfk_list_back(&arena->_oversize);
+  mark->_owc = dfk_list_back(&arena->_owc);
 }
 
-void* dfk_arena_alloc(dfk_arena_t* arena, size_t size)
+void dfk_arena_rewind(dfk_arena_t* arena, dfk_arena_mark_t* mark)
 {
   assert(arena);
-  assert(size);
+  assert(mark);
+  while ((void*) dfk_list_back(&arena->_owc) != mark->_owc) {
+    owc_t* owc = (owc_t*) dfk_list_back(&arena->_owc);
+    dfk_list_pop_back(&arena->_owc);
+    owc->cleanup(arena, ((char*) owc) + OWC_HEADER_SIZE);
+  }
+  while ((void*) dfk_list_back(&arena->_oversize) != mark->_oversize) {
+    segment_t* chunk = (segment_t*) dfk_list_back(&arena->_oversize);
+    dfk_list_pop_back(&arena->_oversize);
+    dfk__free(arena->dfk, chunk);
+  }
+  while ((void*) dfk_list_back(&arena->_segments) != mark->_segment) {
+    segment_t* segment = (segment_t*) dfk_list_back(&arena->_segments);
+    dfk_list_pop_back(&arena->_segments);
+    dfk_list_append(&arena->_spare, &segment->hook);
+  }
+  if (mark->_segment) {
+    segment_t* seg = (segment_t*) mark->_segment;
+    assert(seg->used <= seg->size);
+    assert(mark->_used <= seg->used);
+    seg->used = mark->_used;
+  }
+}
+
+/**
+ * Allocate a dedicated chunk of memory for a large object
+ */
+static void* dfk__arena_alloc_oversize(dfk_arena_t* arena, size_t size,
+    size_t alignment)
+{
+  size_t slack = alignment > DFK_MALLOC_ALIGNMENT
+    ? alignment - DFK_MALLOC_ALIGNMENT : 0;
+  size_t toalloc = SEGMENT_HEADER_SIZE + slack + size;
+  segment_t* chunk = dfk__malloc(arena->dfk, toalloc);
+  if (!chunk) {
+    arena->dfk->dfk_errno = dfk_err_nomem;
+    return NULL;
+  }
+  dfk_list_hook_init(&chunk->hook);
+  dfk_list_append(&arena->_oversize, &chunk->hook);
+  chunk->size = toalloc;
+  chunk->used = toalloc;
+  char* p = ((char*) chunk) + SEGMENT_HEADER_SIZE;
+  size_t padding = PADDING(p, alignment);
+  arena->stats.nbytes_allocated += size;
+  arena->stats.nbytes_wasted += slack;
+  arena->stats.noversize++;
+  return p + padding;
+}
+
+static void* dfk__arena_alloc(dfk_arena_t* arena, size_t size,
+    size_t alignment)
+{
+  segment_t* seg = (segment_t*) dfk_list_back(&arena->_segments);
+  if (seg) {
+    assert(seg->size >= seg->used);
+    size_t padding = PADDING(((char*) seg) + seg->used, alignment);
+    if (seg->size - seg->used >= padding + size) {
+      void* ret = ((char*) seg) + seg->used + padding;
+      seg->used += padding + size;
+      arena->stats.nbytes_allocated += size;
+      arena->stats.nbytes_wasted += padding;
+      return ret;
+    }
+  }
+
+  /*
+   * Large object does not fit into the current segment. Do not retire it,
+   * smaller objects that follow might still fit.
+   */
+  size_t slack = alignment > DFK_MALLOC_ALIGNMENT
+    ? alignment - DFK_MALLOC_ALIGNMENT : 0;
+  if ((seg && size > DFK_ARENA_OVERSIZE)
+      || SEGMENT_HEADER_SIZE + slack + size > DFK_ARENA_SEGMENT_SIZE) {
+    return dfk__arena_alloc_oversize(arena, size, alignment);
+  }
 
-  if (dfk_list_empty(&arena->_segments)
-      || dfk__arena_bytes_available(arena) < size) {
-    size_t toalloc = DFK_MAX(DFK_ARENA_SEGMENT_SIZE, size + sizeof(segment_t));
-    segment_t* s = dfk__malloc(arena->dfk, toalloc);
+  segment_t* s = NULL;
+  if (!dfk_list_empty(&arena->_spare)) {
+    s = (segment_t*) dfk_list_front(&arena->_spare);
+    dfk_list_pop_front(&arena->_spare);
+  } else {
+    s = dfk__buffer_alloc(arena->dfk, DFK_ARENA_SEGMENT_SIZE);
     if (!s) {
       return NULL;
     }
-    dfk_list_hook_init(&s->hook);
-    dfk_list_append(&arena->_segments, &s->hook);
-    s->size = DFK_ARENA_SEGMENT_SIZE - sizeof(segment_t);
-    s->used = sizeof(segment_t) + size;
-    return ((char*) s) + sizeof(segment_t);
+    s->size = DFK_ARENA_SEGMENT_SIZE;
+    arena->stats.nsegments++;
   }
+  if (seg) {
+    /* Tail of the current segment is never used again */
+    arena->stats.nbytes_wasted += seg->size - seg->used;
+  }
+  dfk_list_hook_init(&s->hook);
+  dfk_list_append(&arena->_segments, &s->hook);
+  s->used = SEGMENT_HEADER_SIZE;
+  char* p = ((char*) s) + s->used;
+  size_t padding = PADDING(p, alignment);
+  s->used += padding + size;
+  arena->stats.nbytes_allocated += size;
+  arena->stats.nbytes_wasted += padding;
+  return p + padding;
+}
+
+void* dfk_arena_alloc(dfk_arena_t* arena, size_t size)
+{
+  assert(arena);
+  assert(size);
+  return dfk__arena_alloc(arena, size, DFK_MALLOC_ALIGNMENT);
+}
 
-  segment_t* seg = dfk__arena_current_segment(arena);
-  void* ret = ((char*) seg) + seg->used;
-  seg->used += size;
-  return ret;
+void* dfk_arena_alloc_aligned(dfk_arena_t* arena, size_t size,
+    size_t alignment)
+{
+  assert(arena);
+  assert(size);
+  assert(alignment);
+  /* Power of two */
+  assert(!(alignment & (alignment - 1)));
+  return dfk__arena_alloc(arena, size, alignment);
 }
 
 void* dfk_arena_alloc_copy(dfk_arena_t* arena, const char* data, size_t size)
@@ -113,14 +290,14 @@ void* dfk_arena_alloc_ex(dfk_arena_t* arena, size_t size,
   assert(arena);
   assert(size);
   assert(cleanup);
-  owc_t* owc = dfk_arena_alloc(arena, sizeof(owc_t) + size);
+  owc_t* owc = dfk_arena_alloc(arena, OWC_HEADER_SIZE + size);
   if (!owc) {
     return NULL;
   }
   dfk_list_hook_init(&owc->hook);
   dfk_list_append(&arena->_owc, &owc->hook);
   owc->cleanup = cleanup;
-  return ((char*) owc) + sizeof(owc_t);
+  return ((char*) owc) + OWC_HEADER_SIZE;
 }
 
 void* dfk_arena_alloc_copy_ex(dfk_arena_t* arena, const char* data, size_t size,
@@ -136,4 +313,3 @@ void* dfk_arena_alloc_copy_ex(dfk_arena_t* arena, const char* data, size_t size,
   }
   return allocated;
 }
-
@@ -0,0 +1,211 @@
+/**
+ * @file blocking.c
+ *
+ * Contains dfk_blocking_call implementation.
+ *
+ * Calls are put into a queue served by a bounded pool of threads. The
+ * calling fiber waits for completion on the mailbox of the pool, so that
+ * completions of concurrent calls are delivered in batches.
+ *
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LISENSE)
+ */
+
+#include <assert.h>
+#include <dfk/config.h>
+#include <dfk/error.h>
+#include <dfk/blocking.h>
+#include <dfk/internal.h>
+#include <dfk/internal/blocking.h>
+
+#if DFK_MAILBOX
+#include <pthread.h>
+#include <dfk/mailbox.h>
+
+#define TO_CALL(expr) DFK_CONTAINER_OF((expr), dfk_blocking_call_t, hook)
+
+typedef struct dfk_blocking_call_t {
+  dfk_list_hook_t hook;
+  dfk_mailbox_msg_t msg;
+  void (*func)(void*);
+  void* arg;
+} dfk_blocking_call_t;
+
+typedef struct dfk_blocking_pool_t {
+  dfk_t* dfk;
+  dfk_mailbox_t mailbox;
+  /** Protects all fields below */
+  pthread_mutex_t lock;
+  /** Signalled when a call is queued, or the pool is stopping */
+  pthread_cond_t cond;
+  /** Calls waiting for a free thread */
+  dfk_list_t queue;
+  /** Array of capacity elements, first nthreads are started */
+  pthread_t* threads;
+  size_t nthreads;
+  /** Value of dfk_t.blocking_threads when the pool was created */
+  size_t capacity;
+  /** Number of threads waiting for calls */
+  size_t nidle;
+  int stopping;
+} dfk_blocking_pool_t;
+
+static void* dfk__blocking_thread(void* arg)
+{
+  dfk_blocking_pool_t* pool = (dfk_blocking_pool_t*) arg;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (dfk_list_empty(&pool->queue) && !pool->stopping) {
+      pool->nidle++;
+      pthread_cond_wait(&pool->cond, &pool->lock);
+      pool->nidle--;
+    }
+    if (dfk_list_empty(&pool->queue)) {
+      break;
+    }
+    dfk_blocking_call_t* call = TO_CALL(dfk_list_front(&pool->queue));
+    dfk_list_pop_front(&pool->queue);
+    pthread_mutex_unlock(&pool->lock);
+    call->func(call->arg);
+    /* Call object is released by the caller once the message is posted */
+    if (dfk_mailbox_post(&pool->mailbox, &call->msg) != dfk_err_ok) {
+      DFK_ERROR(pool->dfk, "{%p} can not post completion", (void*) pool);
+    }
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static dfk_blocking_pool_t* dfk__blocking_pool(dfk_t* dfk)
+{
+#if DFK_THREADS
+  pthread_mutex_lock(&dfk->_blocking_lock);
+#endif
+  dfk_blocking_pool_t* pool = dfk->_blocking;
+  if (pool) {
+    goto done;
+  }
+  pool = dfk->malloc(dfk, sizeof(dfk_blocking_pool_t));
+  if (!pool) {
+    dfk->dfk_errno = dfk_err_nomem;
+    goto done;
+  }
+  pool->threads = dfk->malloc(dfk, dfk->blocking_threads * sizeof(pthread_t));
+  if (!pool->threads) {
+    dfk->free(dfk, pool);
+    pool = NULL;
+    dfk->dfk_errno = dfk_err_nomem;
+    goto done;
+  }
+  int err = dfk_mailbox_init(&pool->mailbox, dfk);
+  if (err != dfk_err_ok) {
+    dfk->free(dfk, pool->threads);
+    dfk->free(dfk, pool);
+    pool = NULL;
+    dfk->dfk_errno = err;
+    goto done;
+  }
+  pool->dfk = dfk;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  dfk_list_init(&pool->queue);
+  pool->nthreads = 0;
+  pool->capacity = dfk->blocking_threads;
+  pool->nidle = 0;
+  pool->stopping = 0;
+  dfk->_blocking = pool;
+  DFK_DBG(dfk, "{%p} blocking calls pool of up to %lu threads",
+      (void*) pool, (unsigned long) dfk->blocking_threads);
+done:
+#if DFK_THREADS
+  pthread_mutex_unlock(&dfk->_blocking_lock);
+#endif
+  return pool;
+}
+
+int dfk_blocking_call(dfk_t* dfk, void (*func)(void*), void* arg)
+{
+  assert(dfk);
+  assert(func);
+  if (!dfk->blocking_threads) {
+    func(arg);
+    return dfk_err_ok;
+  }
+  dfk_blocking_pool_t* pool = dfk__blocking_pool(dfk);
+  if (!pool) {
+    return dfk->dfk_errno;
+  }
+  dfk_blocking_call_t call;
+  dfk_list_hook_init(&call.hook);
+  dfk_mailbox_msg_init(&call.msg);
+  call.func = func;
+  call.arg = arg;
+  pthread_mutex_lock(&pool->lock);
+  if (!pool->nidle && pool->nthreads < pool->capacity) {
+    int err = pthread_create(pool->threads + pool->nthreads, NULL,
+        dfk__blocking_thread, pool);
+    if (err) {
+      if (!pool->nthreads) {
+        pthread_mutex_unlock(&pool->lock);
+        dfk->sys_errno = err;
+        DFK_ERROR(dfk, "{%p} can not start thread: %s", (void*) pool,
+            dfk_strerr(dfk, dfk_err_sys));
+        return dfk_err_sys;
+      }
+      /* Not fatal, the call will be served by one of running threads */
+      DFK_WARNING(dfk, "{%p} can not start thread, %lu running",
+          (void*) pool, (unsigned long) pool->nthreads);
+    } else {
+      pool->nthreads++;
+    }
+  }
+  dfk_list_append(&pool->queue, &call.hook);
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  DFK_DBG(dfk, "{%p} call %p(%p)", (void*) pool, (void*) &call, arg);
+  return dfk_mailbox_wait(&pool->mailbox, &call.msg);
+}
+
+void dfk__blocking_pool_free(dfk_t* dfk)
+{
+  assert(dfk);
+  dfk_blocking_pool_t* pool = dfk->_blocking;
+  if (!pool) {
+    return;
+  }
+  DFK_DBG(dfk, "{%p} stop %lu threads", (void*) pool,
+      (unsigned long) pool->nthreads);
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (size_t i = 0; i < pool->nthreads; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  dfk_mailbox_free(&pool->mailbox);
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+  dfk->free(dfk, pool->threads);
+  dfk->free(dfk, pool);
+  dfk->_blocking = NULL;
+}
+
+#else /* DFK_MAILBOX */
+
+int dfk_blocking_call(dfk_t* dfk, void (*func)(void*), void* arg)
+{
+  assert(dfk);
+  assert(func);
+  DFK_UNUSED(dfk);
+  func(arg);
+  return dfk_err_ok;
+}
+
+void dfk__blocking_pool_free(dfk_t* dfk)
+{
+  DFK_UNUSED(dfk);
+}
+
+#endif /* DFK_MAILBOX */
@@ -0,0 +1,118 @@
+/**
+ * @file buffer_pool.c
+ *
+ * Contains a per-context pool of spare memory buffers.
+ *
+ * Memory that is allocated and released at a high rate - arena segments,
+ * HTTP request headers buffers - is returned to the pool instead of being
+ * freed, so that serving a request on a keepalive connection does not
+ * touch the allocator. Spare buffers are kept in a single list, since only
+ * a few distinct buffer sizes are used at a time.
+ *
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LISENSE)
+ */
+
+#include <assert.h>
+#include <dfk/config.h>
+#include <dfk/error.h>
+#include <dfk/malloc.h>
+#include <dfk/internal.h>
+#include <dfk/internal/buffer_pool.h>
+
+#define TO_SPARE_BUFFER(expr) DFK_CONTAINER_OF((expr), spare_buffer_t, hook)
+
+/*
+ * Besides worker threads, arenas are used by functions offloaded with
+ * dfk_blocking_call()
+ */
+#if DFK_THREADS || DFK_MAILBOX
+#define DFK_BUFFER_POOL_LOCK(dfk) \
+  pthread_mutex_lock(&(dfk)->_buffer_pool_lock)
+#define DFK_BUFFER_POOL_UNLOCK(dfk) \
+  pthread_mutex_unlock(&(dfk)->_buffer_pool_lock)
+#else
+#define DFK_BUFFER_POOL_LOCK(dfk)
+#define DFK_BUFFER_POOL_UNLOCK(dfk)
+#endif
+
+/**
+ * Header placed at the beginning of a buffer while it is in the pool
+ */
+typedef struct spare_buffer_t {
+  dfk_list_hook_t hook;
+  size_t size;
+} spare_buffer_t;
+
+void* dfk__buffer_alloc(dfk_t* dfk, size_t size)
+{
+  assert(dfk);
+  assert(size >= sizeof(spare_buffer_t));
+  spare_buffer_t* buf = NULL;
+  DFK_BUFFER_POOL_LOCK(dfk);
+  dfk_list_rit it, end;
+  dfk_list_rbegin(&dfk->_buffer_pool, &it);
+  dfk_list_rend(&dfk->_buffer_pool, &end);
+  while (!dfk_list_rit_equal(&it, &end)) {
+    spare_buffer_t* spare = TO_SPARE_BUFFER(it.value);
+    if (spare->size == size) {
+      /* Most recently returned buffer is the most likely to be cached */
+      dfk_list_rerase(&dfk->_buffer_pool, &it);
+      buf = spare;
+      break;
+    }
+    dfk_list_rit_next(&it);
+  }
+  DFK_BUFFER_POOL_UNLOCK(dfk);
+  if (buf) {
+    DFK_DBG(dfk, "{%p} reuse %lu bytes buffer from the pool", (void*) buf,
+        (unsigned long) size);
+    return buf;
+  }
+  void* res = dfk__malloc(dfk, size);
+  if (!res) {
+    dfk->dfk_errno = dfk_err_nomem;
+  }
+  return res;
+}
+
+void dfk__buffer_free(dfk_t* dfk, void* buf, size_t size)
+{
+  assert(dfk);
+  assert(buf);
+  assert(size >= sizeof(spare_buffer_t));
+  spare_buffer_t* spare = buf;
+  DFK_BUFFER_POOL_LOCK(dfk);
+  int pooled = dfk_list_size(&dfk->_buffer_pool) < dfk->buffer_pool_size;
+  if (pooled) {
+    dfk_list_hook_init(&spare->hook);
+    spare->size = size;
+    dfk_list_append(&dfk->_buffer_pool, &spare->hook);
+  }
+  DFK_BUFFER_POOL_UNLOCK(dfk);
+  if (!pooled) {
+    dfk__free(dfk, buf);
+  }
+}
+
+void dfk__buffer_pool_shrink(dfk_t* dfk, size_t nbuffers)
+{
+  assert(dfk);
+  DFK_BUFFER_POOL_LOCK(dfk);
+  dfk_list_t released;
+  dfk_list_init(&released);
+  while (dfk_list_size(&dfk->_buffer_pool) > nbuffers) {
+    dfk_list_hook_t* hook = dfk_list_front(&dfk->_buffer_pool);
+    dfk_list_pop_front(&dfk->_buffer_pool);
+    dfk_list_append(&released, hook);
+  }
+  DFK_BUFFER_POOL_UNLOCK(dfk);
+  DFK_DBG(dfk, "release %lu buffers, %lu buffers left",
+      (unsigned long) dfk_list_size(&released), (unsigned long) nbuffers);
+  while (!dfk_list_empty(&released)) {
+    spare_buffer_t* spare = TO_SPARE_BUFFER(dfk_list_front(&released));
+    dfk_list_pop_front(&released);
+    dfk__free(dfk, spare);
+  }
+}
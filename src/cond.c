@@ -7,17 +7,30 @@
 #include <assert.h>
 #include <dfk/cond.h>
 #include <dfk/internal.h>
+#include <dfk/internal/mutex.h>
 #include <dfk/scheduler.h>
 
 #define TO_FIBER(expr) DFK_CONTAINER_OF((expr), dfk_fiber_t, _hook)
 
+#if DFK_THREADS
+#define DFK_COND_GUARD(cond) pthread_mutex_lock(&(cond)->_guard)
+#define DFK_COND_UNGUARD(cond) pthread_mutex_unlock(&(cond)->_guard)
+#else
+#define DFK_COND_GUARD(cond)
+#define DFK_COND_UNGUARD(cond)
+#endif
+
 void dfk_cond_init(dfk_cond_t* cond, dfk_t* dfk)
 {
   assert(cond);
   assert(dfk);
   DFK_DBG(dfk, "{%p}", (void*) cond);
   dfk_list_init(&cond->_waitqueue);
+  cond->_mutex = NULL;
   cond->dfk = dfk;
+#if DFK_THREADS
+  pthread_mutex_init(&cond->_guard, NULL);
+#endif
 }
 
 void dfk_cond_free(dfk_cond_t* cond)
@@ -26,6 +39,9 @@ void dfk_cond_free(dfk_cond_t* cond)
   DFK_DBG(cond->dfk, "{%p}", (void*) cond);
   /* Attempt to free non-empty condition variable */
   assert(dfk_list_empty(&cond->_waitqueue));
+#if DFK_THREADS
+  pthread_mutex_destroy(&cond->_guard);
+#endif
 }
 
 void dfk_cond_wait(dfk_cond_t* cond, dfk_mutex_t* mutex)
@@ -38,35 +54,58 @@ void dfk_cond_wait(dfk_cond_t* cond, dfk_mutex_t* mutex)
   assert(dfk == mutex->dfk);
   assert(mutex->_owner);
   assert(mutex->_owner == this);
-  if (dfk_list_empty(&mutex->_waitqueue)) {
-    DFK_DBG(mutex->dfk, "{%p} is now unlocked, no fiber is waiting for lock",
-        (void*) mutex);
-    mutex->_owner = NULL;
-  } else {
-    dfk_fiber_t* next = TO_FIBER(dfk_list_front(&mutex->_waitqueue));
-    dfk_list_pop_front(&mutex->_waitqueue);
-    DFK_DBG(mutex->dfk, "{%p} is acquired by {%p}, wait queue size %llu",
-        (void*) mutex, (void*) next,
-        (unsigned long long) dfk_list_size(&mutex->_waitqueue));
-    mutex->_owner = next;
-    dfk__resume(dfk->_scheduler, next);
-  }
+  /*
+   * Fiber is enqueued before the mutex is released - otherwise a signal
+   * sent by another worker thread in between could be lost.
+   */
+  DFK_COND_GUARD(cond);
   dfk_list_append(&cond->_waitqueue, &this->_hook);
+  cond->_mutex = mutex;
+  DFK_COND_UNGUARD(cond);
+  dfk__mutex_unlock(mutex, 0);
   dfk__suspend(dfk->_scheduler);
+  /* Lock could have been already passed to us by dfk__cond_wakeup */
   dfk_mutex_lock(mutex);
 }
 
+/**
+ * Schedule a fiber removed from the wait queue of the condition variable
+ */
+static void dfk__cond_wakeup(dfk_cond_t* cond, dfk_fiber_t* fiber)
+{
+  dfk_t* dfk = cond->dfk;
+  DFK_DBG(dfk, "{%p} wake up {%p}", (void*) cond, (void*) fiber);
+#if !DFK_THREADS
+  if (dfk->handoff_limit) {
+    dfk_mutex_t* mutex = cond->_mutex;
+    if (mutex->_owner == DFK_THIS_FIBER(dfk)) {
+      /*
+       * Woken fiber would block on the mutex held by the caller anyway.
+       * Move it to the wait queue of the mutex instead, dfk_mutex_unlock
+       * will pass the lock to it directly.
+       */
+      dfk_list_append(&mutex->_waitqueue, &fiber->_hook);
+      return;
+    }
+  }
+#endif
+  dfk__resume(dfk->_scheduler, fiber);
+}
+
 void dfk_cond_signal(dfk_cond_t* cond)
 {
   assert(cond);
   dfk_t* dfk = cond->dfk;
   DFK_DBG(dfk, "{%p} fibers waiting: %llu",
       (void*) cond, (unsigned long long) dfk_list_size(&cond->_waitqueue));
+  DFK_COND_GUARD(cond);
   if (!dfk_list_empty(&cond->_waitqueue)) {
     dfk_fiber_t* fiber = TO_FIBER(dfk_list_front(&cond->_waitqueue));
-    DFK_DBG(dfk, "{%p} wake up {%p}", (void*) cond, (void*) fiber);
     dfk_list_pop_front(&cond->_waitqueue);
-    dfk__resume(dfk->_scheduler, fiber);
+    DFK_COND_UNGUARD(cond);
+    dfk__cond_wakeup(cond, fiber);
+  } else {
+    DFK_COND_UNGUARD(cond);
   }
 }
 
@@ -78,12 +117,13 @@ void dfk_cond_broadcast(dfk_cond_t* cond)
       (void*) cond, (unsigned long long) dfk_list_size(&cond->_waitqueue));
   dfk_list_t waitqueue;
   dfk_list_init(&waitqueue);
+  DFK_COND_GUARD(cond);
   dfk_list_move(&cond->_waitqueue, &waitqueue);
+  DFK_COND_UNGUARD(cond);
   while (!dfk_list_empty(&waitqueue)) {
     dfk_fiber_t* fiber = TO_FIBER(dfk_list_front(&waitqueue));
     dfk_list_pop_front(&waitqueue);
-    DFK_DBG(dfk, "{%p} wake up {%p}", (void*) cond, (void*) fiber);
-    dfk__resume(dfk->_scheduler, fiber);
+    dfk__cond_wakeup(cond, fiber);
   }
 }
 
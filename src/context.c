@@ -15,6 +15,9 @@
 #include <dfk/fiber.h>
 #include <dfk/tcp_server.h>
 #include <dfk/internal/fiber.h>
+#include <dfk/internal/stack.h>
+#include <dfk/internal/buffer_pool.h>
+#include <dfk/internal/blocking.h>
 #include <dfk/scheduler.h>
 #include <dfk/eventloop.h>
 
@@ -22,6 +25,7 @@
 
 #if DFK_THREADS
 #include <pthread.h>
+#include <unistd.h>
 #endif
 
 size_t dfk_sizeof(void)
@@ -87,6 +91,23 @@ void dfk_init(dfk_t* dfk)
 #endif
   dfk->log_is_signal_safe = 1;
   dfk->default_stack_size = DFK_STACK_SIZE;
+  dfk->stack_pool_high = DFK_STACK_POOL_HIGH;
+  dfk->stack_pool_low = DFK_STACK_POOL_LOW;
+#if DFK_STACK_LAZY
+  dfk->stack_resident_size = DFK_STACK_RESIDENT_SIZE;
+#endif
+  dfk->buffer_pool_size = DFK_BUFFER_POOL_SIZE;
+  dfk->io_maxevents = DFK_IO_MAXEVENTS;
+  dfk->idle_spin_usec = DFK_IDLE_SPIN_USEC;
+  dfk->handoff_limit = DFK_HANDOFF_LIMIT;
+  dfk->accept_burst = DFK_TCP_ACCEPT_BURST;
+  dfk->blocking_threads = DFK_BLOCKING_THREADS;
+#if DFK_THREADS
+  {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    dfk->nworkers = ncpu > 0 ? (size_t) ncpu : 1;
+  }
+#endif
 
   dfk->sys_errno = 0;
   dfk->dfk_errno = 0;
@@ -97,12 +118,33 @@ void dfk_init(dfk_t* dfk)
   memset(&dfk->_comeback, 0, sizeof(dfk->_comeback));;
   dfk->_stopped = 0;
   dfk_list_init(&dfk->_tcp_servers);
+  dfk_list_init(&dfk->_stack_pool);
+#if DFK_THREADS
+  pthread_mutex_init(&dfk->_stack_pool_lock, NULL);
+#endif
+  dfk_list_init(&dfk->_buffer_pool);
+#if DFK_THREADS || DFK_MAILBOX
+  pthread_mutex_init(&dfk->_buffer_pool_lock, NULL);
+#endif
+  dfk->_blocking = NULL;
+#if DFK_THREADS
+  pthread_mutex_init(&dfk->_blocking_lock, NULL);
+#endif
 }
 
 void dfk_free(dfk_t* dfk)
 {
-  DFK_UNUSED(dfk);
   assert(dfk);
+  dfk__stack_pool_shrink(dfk, 0);
+  dfk__blocking_pool_free(dfk);
+  dfk__buffer_pool_shrink(dfk, 0);
+#if DFK_THREADS || DFK_MAILBOX
+  pthread_mutex_destroy(&dfk->_buffer_pool_lock);
+#endif
+#if DFK_THREADS
+  pthread_mutex_destroy(&dfk->_stack_pool_lock);
+  pthread_mutex_destroy(&dfk->_blocking_lock);
+#endif
 }
 
 int dfk_work(dfk_t* dfk, void (*ep)(dfk_fiber_t*, void*), void* arg,
@@ -115,6 +157,16 @@ int dfk_work(dfk_t* dfk, void (*ep)(dfk_fiber_t*, void*), void* arg,
   (void) signal(SIGPIPE, SIG_IGN);
 #endif
 
+  /*
+   * Warm up the pool of fiber stacks. Failure is not fatal, stacks will be
+   * allocated on demand.
+   */
+  if (dfk__stack_pool_reserve(dfk, dfk->default_stack_size,
+        dfk->stack_pool_low) != dfk_err_ok) {
+    DFK_INFO(dfk, "{%p} can not pre-allocate %lu fiber stacks", (void*) dfk,
+        (unsigned long) dfk->stack_pool_low);
+  }
+
   /* mainf stands for main fiber */
   dfk_fiber_t* mainf = dfk__spawn(dfk, ep, arg, argsize);
   if (!mainf) {
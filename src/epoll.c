@@ -8,13 +8,9 @@
 #include <sys/epoll.h>
 #include <dfk/eventloop.h>
 #include <dfk/internal.h>
+#include <dfk/malloc.h>
 #include <dfk/error.h>
-
-typedef struct dfk_epoll_arg_t {
-  dfk_fiber_t* yieldback;
-  int events;
-  int fd;
-} dfk_epoll_arg_t;
+#include <dfk/tcp_socket.h>
 
 int dfk__eventloop_init(dfk_eventloop_t* epoll, dfk_t* dfk)
 {
@@ -27,6 +23,10 @@ int dfk__eventloop_init(dfk_eventloop_t* epoll, dfk_t* dfk)
   }
   epoll->dfk = dfk;
   epoll->fd = fd;
+  epoll->events = epoll->preallocated;
+  epoll->nevents = DFK_SIZE(epoll->preallocated);
+  epoll->idle_since = 0;
+  dfk__timer_wheel_init(&epoll->timers);
   DFK_DBG(dfk, "{%p} epoll_create() = %d", (void*) epoll, fd);
   return dfk_err_ok;
 }
@@ -35,6 +35,9 @@ int dfk__eventloop_free(dfk_eventloop_t* epoll)
 {
   assert(epoll);
   assert(epoll->fd);
+  if (epoll->events != epoll->preallocated) {
+    dfk__free(epoll->dfk, epoll->events);
+  }
   int ret = close(epoll->fd);
   if (ret < 0) {
     DFK_ERROR_SYSCALL(epoll->dfk, "close(2)");
@@ -43,6 +46,87 @@ int dfk__eventloop_free(dfk_eventloop_t* epoll)
   return dfk_err_ok;
 }
 
+/**
+ * Disarm deadline timer of a fiber waiting for the watch
+ *
+ * Called in the event loop fiber before the waiting fiber is resumed.
+ * Resumed fiber may be stolen by another worker, and the timer wheel is
+ * only touched by the worker it belongs to.
+ */
+static void dfk__io_watch_disarm(dfk_io_watch_t* watch,
+    struct dfk_timer_t** timer)
+{
+  if (*timer) {
+    dfk__timer_wheel_del(&watch->loop->timers, *timer);
+    *timer = NULL;
+  }
+}
+
+/**
+ * Wake up fibers waiting for the file descriptor, if it is ready
+ */
+static void dfk__io_watch_notify(dfk_io_watch_t* watch)
+{
+  int rdready = watch->ready & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP);
+  int wrready = watch->ready & (EPOLLOUT | EPOLLERR | EPOLLHUP);
+  dfk_fiber_t* reader = NULL;
+  dfk_fiber_t* writer = NULL;
+  if (watch->reader && rdready) {
+    reader = watch->reader;
+    watch->reader = NULL;
+    dfk__io_watch_disarm(watch, &watch->reader_timer);
+  }
+  if (watch->writer && (wrready || watch->writer == reader)) {
+    writer = watch->writer;
+    watch->writer = NULL;
+    dfk__io_watch_disarm(watch, &watch->writer_timer);
+  }
+  if (writer && watch->reader == writer) {
+    watch->reader = NULL;
+    dfk__io_watch_disarm(watch, &watch->reader_timer);
+  }
+  /*
+   * Watch is not touched once a fiber is resumed. One-shot watch lives on
+   * the stack of the fiber, which may be resumed by another worker and
+   * return right away.
+   */
+  if (reader) {
+    DFK_IORESUME(reader);
+  }
+  if (writer && writer != reader) {
+    DFK_IORESUME(writer);
+  }
+}
+
+/**
+ * Grow events buffer if the last epoll_wait(2) call has filled it entirely
+ *
+ * Buffer is left untouched if memory allocation fails - remaining events
+ * will be reported by the next epoll_wait(2) call.
+ */
+static void dfk__eventloop_grow(dfk_eventloop_t* epoll)
+{
+  dfk_t* dfk = epoll->dfk;
+  if (epoll->nevents >= dfk->io_maxevents) {
+    return;
+  }
+  size_t nevents = DFK_MIN(epoll->nevents * 2, dfk->io_maxevents);
+  struct epoll_event* events = dfk__malloc(dfk,
+      nevents * sizeof(struct epoll_event));
+  if (!events) {
+    DFK_WARNING(dfk, "{%p} can not grow events buffer up to %lu",
+        (void*) epoll, (unsigned long) nevents);
+    return;
+  }
+  if (epoll->events != epoll->preallocated) {
+    dfk__free(dfk, epoll->events);
+  }
+  DFK_DBG(dfk, "{%p} grow events buffer %lu -> %lu", (void*) epoll,
+      (unsigned long) epoll->nevents, (unsigned long) nevents);
+  epoll->events = events;
+  epoll->nevents = nevents;
+}
+
 void dfk__eventloop_main(dfk_fiber_t* fiber, void* arg)
 {
   assert(fiber);
@@ -54,8 +138,12 @@ void dfk__eventloop_main(dfk_fiber_t* fiber, void* arg)
   assert(epoll->fd);
 
   while (1) {
-    struct epoll_event fds[64];
-    int nfd = epoll_wait(epoll->fd, fds, DFK_SIZE(fds), -1);
+    struct epoll_event* fds = epoll->events;
+    int64_t timeout = dfk__eventloop_timeout(dfk, &epoll->idle_since,
+        &epoll->timers);
+    /* Round up to milliseconds, so that timers do not fire prematurely */
+    int timeout_ms = timeout < 0 ? -1 : (int) ((timeout + 999999) / 1000000);
+    int nfd = epoll_wait(epoll->fd, fds, (int) epoll->nevents, timeout_ms);
     if (nfd == -1) {
       if (errno == EINTR) {
         DFK_INFO(dfk, "{%p} epoll_wait() interrupted by signal, restarting",
@@ -66,60 +154,196 @@ void dfk__eventloop_main(dfk_fiber_t* fiber, void* arg)
       break;
     }
     DFK_DBG(dfk, "%d fds ready", nfd);
-    if (nfd == 0) {
-      DFK_SUSPEND(dfk);
-      continue;
+    if (nfd) {
+      epoll->idle_since = 0;
     }
     for (int i = 0; i < nfd; ++i) {
-      dfk_epoll_arg_t* arg = (dfk_epoll_arg_t*) fds[i].data.ptr;
-      arg->events = fds[i].events;
+      dfk_io_watch_t* watch = (dfk_io_watch_t*) fds[i].data.ptr;
+      watch->ready |= fds[i].events;
 #if DFK_DEBUG
       char strev[16];
-      size_t nwritten = dfk__io_events_to_str(arg->events, strev,
+      size_t nwritten = dfk__io_events_to_str(watch->ready, strev,
           DFK_SIZE(strev));
-      DFK_DBG(dfk, "{%p} fd %d, events %d (%.*s), yieldback fiber %p",
-          (void*) epoll, arg->fd, arg->events, (int) nwritten, strev,
-          (void*) arg->yieldback);
+      DFK_DBG(dfk, "{%p} fd %d, events %d (%.*s), reader %p, writer %p",
+          (void*) epoll, watch->fd, watch->ready, (int) nwritten, strev,
+          (void*) watch->reader, (void*) watch->writer);
 #endif
-      DFK_IORESUME(arg->yieldback);
-      int ret = epoll_ctl(epoll->fd, EPOLL_CTL_DEL, arg->fd, NULL);
-      if (ret == -1) {
-        DFK_ERROR_SYSCALL(dfk, "epoll_ctl(2)");
-        break;
-      }
+      dfk__io_watch_notify(watch);
     }
-    if (nfd) {
-      DFK_SUSPEND(dfk);
+    if ((size_t) nfd == epoll->nevents) {
+      dfk__eventloop_grow(epoll);
     }
+    dfk__timer_wheel_advance(&epoll->timers, dfk__clock());
+    DFK_SUSPEND(dfk);
   }
 }
 
-int dfk__io(dfk_eventloop_t* epoll, int socket, int events)
+static int dfk__io_watch_register(dfk_eventloop_t* epoll,
+    dfk_io_watch_t* watch, int fd, int events)
 {
-  assert(epoll);
   dfk_t* dfk = epoll->dfk;
-  assert(dfk);
-  dfk_epoll_arg_t arg = {
-    .yieldback = DFK_THIS_FIBER(dfk),
-    .events = 0,
-    .fd = socket,
-  };
+  watch->loop = epoll;
+  watch->reader = NULL;
+  watch->writer = NULL;
+  watch->reader_timer = NULL;
+  watch->writer_timer = NULL;
+  watch->ready = 0;
+  watch->fd = fd;
   struct epoll_event event;
-  event.data.ptr = &arg;
-  event.events = events;
-  int ret = epoll_ctl(epoll->fd, EPOLL_CTL_ADD, socket, &event);
+  event.data.ptr = watch;
+  event.events = (uint32_t) events;
+  int ret = epoll_ctl(epoll->fd, EPOLL_CTL_ADD, fd, &event);
   if (ret == -1) {
     DFK_ERROR_SYSCALL(dfk, "epoll_ctl(2)");
+    return dfk_err_sys;
+  }
+  DFK_DBG(dfk, "{%p} add fd %d to epoll, events %d", (void*) epoll, fd,
+      events);
+  return dfk_err_ok;
+}
+
+static int dfk__io_watch_unregister(dfk_io_watch_t* watch)
+{
+  int ret = epoll_ctl(watch->loop->fd, EPOLL_CTL_DEL, watch->fd, NULL);
+  if (ret == -1) {
+    DFK_ERROR_SYSCALL(watch->loop->dfk, "epoll_ctl(2)");
+    return dfk_err_sys;
+  }
+  return dfk_err_ok;
+}
+
+/**
+ * Deadline of the fiber waiting for the watch, allocated on the fiber's stack
+ */
+typedef struct dfk_io_deadline_t {
+  dfk_timer_t timer;
+  dfk_io_watch_t* watch;
+  dfk_fiber_t* fiber;
+  int expired;
+} dfk_io_deadline_t;
+
+static void dfk__io_deadline_expired(dfk_timer_t* timer)
+{
+  dfk_io_deadline_t* deadline =
+    DFK_CONTAINER_OF(timer, dfk_io_deadline_t, timer);
+  dfk_io_watch_t* watch = deadline->watch;
+  dfk_fiber_t* fiber = deadline->fiber;
+  if (watch->reader != fiber && watch->writer != fiber) {
+    /* Fiber has been woken up by IO event during the same iteration */
+    return;
+  }
+  /* Timer has been removed from the wheel already */
+  if (watch->reader == fiber) {
+    watch->reader = NULL;
+    watch->reader_timer = NULL;
+  }
+  if (watch->writer == fiber) {
+    watch->writer = NULL;
+    watch->writer_timer = NULL;
+  }
+  DFK_DBG(fiber->dfk, "{%p} deadline for fd %d expired",
+      (void*) watch->loop, watch->fd);
+  deadline->expired = 1;
+  DFK_IORESUME(fiber);
+}
+
+static int dfk__io_watch_suspend(dfk_io_watch_t* watch, int events,
+    uint64_t deadline)
+{
+  dfk_t* dfk = watch->loop->dfk;
+  dfk_fiber_t* this = DFK_THIS_FIBER(dfk);
+  if (events & DFK_IO_IN) {
+    watch->reader = this;
+  }
+  if (events & DFK_IO_OUT) {
+    watch->writer = this;
+  }
+  if (!deadline) {
+    DFK_IOSUSPEND(dfk);
+    return watch->ready;
+  }
+  dfk_io_deadline_t d = {
+    .watch = watch,
+    .fiber = this,
+    .expired = 0
+  };
+  dfk__timer_init(&d.timer, dfk__io_deadline_expired, NULL);
+  dfk__timer_wheel_add(&watch->loop->timers, &d.timer, deadline);
+  if (events & DFK_IO_IN) {
+    watch->reader_timer = &d.timer;
+  }
+  if (events & DFK_IO_OUT) {
+    watch->writer_timer = &d.timer;
+  }
+  DFK_IOSUSPEND(dfk);
+  /*
+   * Timer is disarmed by the event loop, the fiber might be resumed by
+   * another worker and should not touch the wheel of this one
+   */
+  assert(!d.timer.slot);
+  return d.expired ? 0 : watch->ready;
+}
+
+#if DFK_IO_WATCH
+int dfk__io_watch_init(dfk_eventloop_t* epoll, dfk_io_watch_t* watch, int fd)
+{
+  assert(epoll);
+  assert(watch);
+  return dfk__io_watch_register(epoll, watch, fd,
+      EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+}
+
+int dfk__io_watch_free(dfk_io_watch_t* watch)
+{
+  assert(watch);
+  assert(watch->loop);
+  int err = dfk__io_watch_unregister(watch);
+  /* Interrupt pending operations */
+  watch->ready |= EPOLLERR;
+  dfk__io_watch_notify(watch);
+  DFK_IF_DEBUG(watch->loop = DFK_PDEADBEEF);
+  return err;
+}
+
+int dfk__io_watch_wait(dfk_io_watch_t* watch, int events, uint64_t deadline)
+{
+  assert(watch);
+  assert(watch->loop);
+  assert(!(events & DFK_IO_IN) || !watch->reader);
+  assert(!(events & DFK_IO_OUT) || !watch->writer);
+  /*
+   * Caller has just seen EAGAIN, hence readiness reported earlier is stale.
+   * Event loop is not executed in between, so no edge could be missed.
+   */
+  watch->ready &= ~(events | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+  DFK_DBG(watch->loop->dfk, "{%p} wait for fd %d, events %d",
+      (void*) watch->loop, watch->fd, events);
+  return dfk__io_watch_suspend(watch, events, deadline);
+}
+#endif
+
+int dfk__io(dfk_eventloop_t* epoll, int socket, int events, uint64_t deadline)
+{
+  assert(epoll);
+  dfk_t* dfk = epoll->dfk;
+  assert(dfk);
+  /*
+   * One-shot registration - event loop will not touch the watch allocated
+   * on the fiber's stack after the fiber is resumed.
+   */
+  dfk_io_watch_t watch;
+  if (dfk__io_watch_register(epoll, &watch, socket,
+        events | EPOLLONESHOT) != dfk_err_ok) {
     dfk->dfk_errno = dfk_err_sys;
     return DFK_IO_ERR;
   }
 #if DFK_DEBUG
   char strev[16];
   size_t nwritten = dfk__io_events_to_str(events, strev, DFK_SIZE(strev));
-  DFK_DBG(dfk, "{%p} add fd %d to epoll, events %d (%.*s)", (void*) epoll,
+  DFK_DBG(dfk, "{%p} wait for fd %d, events %d (%.*s)", (void*) epoll,
       socket, events, (int) nwritten, strev);
 #endif
-  DFK_IOSUSPEND(dfk);
-  return arg.events;
+  int ready = dfk__io_watch_suspend(&watch, events, deadline);
+  dfk__io_watch_unregister(&watch);
+  return ready;
 }
-
@@ -37,3 +37,27 @@ size_t dfk__io_events_to_str(int events, char* buf, size_t buflen)
   }
   return buf - orig_buf;
 }
+
+int dfk__eventloop_spin(dfk_t* dfk, uint64_t* idle_since)
+{
+  assert(dfk);
+  assert(idle_since);
+  if (!dfk->idle_spin_usec) {
+    return 0;
+  }
+  uint64_t now = dfk__clock() / 1000;
+  if (!*idle_since) {
+    *idle_since = now;
+  }
+  return now - *idle_since < dfk->idle_spin_usec;
+}
+
+int64_t dfk__eventloop_timeout(dfk_t* dfk, uint64_t* idle_since,
+    dfk_timer_wheel_t* timers)
+{
+  assert(timers);
+  if (dfk__eventloop_spin(dfk, idle_since)) {
+    return 0;
+  }
+  return dfk__timer_wheel_timeout(timers, dfk__clock());
+}
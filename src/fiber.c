@@ -11,15 +11,7 @@
 #include <dfk/internal.h>
 #include <dfk/malloc.h>
 #include <dfk/scheduler.h>
-
-#if DFK_STACK_GUARD_SIZE
-#if DFK_HAVE_SYS_MMAN_H
-#include <sys/mman.h>
-#endif
-#if DFK_HAVE_SYS_TYPES_H
-#include <sys/types.h>
-#endif
-#endif
+#include <dfk/internal/stack.h>
 
 #if DFK_NAMED_FIBERS
 #include <stdarg.h>
@@ -48,35 +40,34 @@ dfk_fiber_t* dfk__spawn(dfk_t* dfk, void (*ep)(dfk_fiber_t*, void*),
 {
   assert(dfk);
   assert(ep);
-  dfk_fiber_t* fiber = dfk__malloc(dfk, dfk->default_stack_size);
+  dfk_fiber_t* fiber = dfk__malloc(dfk, sizeof(dfk_fiber_t));
   if (!fiber) {
     dfk->dfk_errno = dfk_err_nomem;
     return NULL;
   }
-  char* stack_base = (char*) fiber + sizeof(dfk_fiber_t);
-  char* stack_end = (char*) fiber + dfk->default_stack_size;
+  dfk_stack_t* stack = dfk__stack_alloc(dfk, dfk->default_stack_size);
+  if (!stack) {
+    dfk__free(dfk, fiber);
+    return NULL;
+  }
+  char* stack_base = stack->bottom;
+  char* stack_end = stack->top;
+  /* Argument is copied to the top of the stack, far from the guard pages */
   if (argsize) {
-    memcpy(stack_base, arg, argsize);
-    fiber->_arg = stack_base;
-    stack_base += argsize;
+    stack_end -= argsize;
+    memcpy(stack_end, arg, argsize);
+    fiber->_arg = stack_end;
   } else {
     fiber->_arg = arg;
   }
 
-#if DFK_STACK_GUARD_SIZE
-  /** @todo check return code */
-  mprotect(stack_base, DFK_STACK_GUARD_SIZE, PROT_NONE);
-  stack_base += DFK_STACK_GUARD_SIZE;
-#endif
-
-  /* Align stack_base */
-  if ((ptrdiff_t) stack_base % DFK_STACK_ALIGNMENT) {
-    size_t padding = DFK_STACK_ALIGNMENT -
-      ((ptrdiff_t) stack_base % DFK_STACK_ALIGNMENT);
+  /* Align stack_end */
+  if ((ptrdiff_t) stack_end % DFK_STACK_ALIGNMENT) {
+    size_t padding = (ptrdiff_t) stack_end % DFK_STACK_ALIGNMENT;
     DFK_DBG(dfk, "stack pointer %p is not aligned to %d bytes, "
-        "adjust by %lu bytes", (void*) stack_base, DFK_STACK_ALIGNMENT,
+        "adjust by %lu bytes", (void*) stack_end, DFK_STACK_ALIGNMENT,
         (unsigned long) padding);
-    stack_base += padding;
+    stack_end -= padding;
   }
 
 #if DFK_VALGRIND
@@ -86,6 +77,12 @@ dfk_fiber_t* dfk__spawn(dfk_t* dfk, void (*ep)(dfk_fiber_t*, void*),
   fiber->dfk = dfk;
   dfk_list_hook_init(&fiber->_hook);
   fiber->_ep = ep;
+  fiber->_stack = stack;
+  fiber->_priority = dfk_fiber_priority_request;
+  fiber->_deadline = 0;
+#if DFK_THREADS
+  atomic_init(&fiber->_busy, 0);
+#endif
 
   dfk_fiber_name(fiber, "%p", (void*) fiber);
 
@@ -100,11 +97,10 @@ dfk_fiber_t* dfk__spawn(dfk_t* dfk, void (*ep)(dfk_fiber_t*, void*),
 void dfk__fiber_free(dfk_t* dfk, dfk_fiber_t* fiber)
 {
 #if DFK_VALGRIND
-  char* stack_base = (char*) fiber + sizeof(dfk_fiber_t);
-  stack_base += DFK_STACK_ALIGNMENT - 1;
-  stack_base -= ((ptrdiff_t) stack_base) % DFK_STACK_ALIGNMENT;
-  VALGRIND_STACK_DEREGISTER(stack_base);
+  VALGRIND_STACK_DEREGISTER(fiber->_stack_id);
 #endif
+  dfk__stack_free(dfk, fiber->_stack);
+  DFK_IF_DEBUG(fiber->_stack = DFK_PDEADBEEF);
   dfk__free(dfk, fiber);
 }
 
@@ -135,6 +131,23 @@ void dfk_fiber_name(dfk_fiber_t* fiber, const char* fmt, ...)
 #endif
 }
 
+void dfk_fiber_priority(dfk_fiber_t* fiber, dfk_fiber_priority_e priority)
+{
+  assert(fiber);
+  assert(priority <= dfk_fiber_priority_background);
+  DFK_DBG(fiber->dfk, "{%p} priority %d -> %d", (void*) fiber,
+      (int) fiber->_priority, (int) priority);
+  fiber->_priority = priority;
+}
+
+void dfk_fiber_deadline(dfk_fiber_t* fiber, uint64_t deadline)
+{
+  assert(fiber);
+  DFK_DBG(fiber->dfk, "{%p} deadline %llu", (void*) fiber,
+      (unsigned long long) deadline);
+  fiber->_deadline = deadline;
+}
+
 void dfk_yield(dfk_fiber_t* from, dfk_fiber_t* to)
 {
   assert(from);
@@ -150,6 +163,12 @@ void dfk_yield(dfk_fiber_t* from, dfk_fiber_t* to)
   coro_transfer(&from->_ctx, &to->_ctx);
 }
 
+size_t dfk_fiber_stack_hwm(dfk_fiber_t* fiber)
+{
+  assert(fiber);
+  return dfk__stack_hwm(fiber->_stack);
+}
+
 size_t dfk_fiber_sizeof(void)
 {
   return sizeof(dfk_fiber_t);
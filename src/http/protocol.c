@@ -8,6 +8,8 @@
 #include <dfk/internal.h>
 #include <dfk/error.h>
 #include <dfk/http/protocol.h>
+#include <dfk/portable/memmem.h>
+#include <dfk/internal/buffer_pool.h>
 #include <dfk/internal/http/request.h>
 #include <dfk/internal/http/response.h>
 
@@ -35,22 +37,65 @@ void dfk__http_protocol(dfk_http_t* http, dfk_fiber_t* fiber, dfk_tcp_socket_t*
   DFK_DBG(dfk, "{%p} initialize connection arena %p",
       (void*) sock, (void*) &connection_arena);
 
+  /* Response output buffer, reused by all requests of the connection */
+  char* obuf = NULL;
+  if (http->output_buffer_size) {
+    obuf = dfk_arena_alloc(&connection_arena, http->output_buffer_size);
+    if (!obuf) {
+      DFK_WARNING(dfk, "{%p} can not allocate output buffer, responses "
+          "will not be buffered", (void*) http);
+    }
+  }
+
+  /*
+   * Headers buffer reused by all requests of the connection. Failure is not
+   * fatal, buffers will be allocated per request.
+   */
+  char* hbuf = dfk__buffer_alloc(dfk, http->headers_buffer_size);
+
+#if DFK_HTTP_PIPELINING
+  /* Bytes of the next pipelined request read along with the previous one */
+  char* carry = NULL;
+  size_t ncarry = 0;
+  /* Size of the output buffered, but not sent by the previous response */
+  size_t npending = 0;
+#endif
+
+  /*
+   * Arena for per-request data, reset after each request. The first segment
+   * is retained, so that typical requests do not touch the allocator.
+   */
+  dfk_arena_t request_arena;
+  dfk_arena_init(&request_arena, http->dfk);
+  DFK_DBG(dfk, "{%p} initialize request arena %p",
+      (void*) sock, (void*) &request_arena);
+
   /* Requests processed within this connection */
   ssize_t nrequests = 0;
   int keepalive = 1;
 
   while (keepalive) {
-    /* Arena for per-request data */
-    dfk_arena_t request_arena;
-    dfk_arena_init(&request_arena, http->dfk);
-    DFK_DBG(dfk, "{%p} initialize request arena %p",
-        (void*) sock, (void*) &request_arena);
-
     dfk_http_request_t req;
     /** @todo check return value */
     dfk__http_request_init(&req, http, &request_arena, &connection_arena, sock);
+    req._headers_buffer = hbuf;
+#if DFK_HTTP_PIPELINING
+    req._remainder = (dfk_buf_t) {carry, ncarry};
+#endif
 
+    if (http->keepalive_timeout) {
+      req._deadline = dfk_now(dfk) + http->keepalive_timeout;
+    }
     int err = dfk__http_request_read_headers(&req);
+    /* Request handler reads body without deadline */
+    req._deadline = 0;
+    if (err == dfk_err_timeout) {
+      DFK_INFO(dfk, "{%p} no request within %llu ms, close connection",
+          (void*) http,
+          (unsigned long long) (http->keepalive_timeout / 1000000));
+      keepalive = 0;
+      goto cleanup;
+    }
     if (err != dfk_err_ok) {
       DFK_ERROR(dfk, "{%p} dfk__http_request_read_headers failed with %s",
           (void*) http, dfk_strerr(dfk, err));
@@ -83,9 +128,31 @@ void dfk__http_protocol(dfk_http_t* http, dfk_fiber_t* fiber, dfk_tcp_socket_t*
     DFK_DBG(http->dfk, "{%p} client requested %skeepalive connection",
         (void*) http, keepalive ? "" : "not ");
 
+    /*
+     * Request handler sees the final value of dfk_http_response_t.keepalive,
+     * e.g. to avoid responses that omit Connection header
+     */
+    if (keepalive
+        && http->keepalive_requests >= 0
+        && nrequests + 1 >= http->keepalive_requests) {
+      DFK_INFO(http->dfk, "{%p} maximum number of keepalive requests (%llu) "
+          "for connection {%p} has reached, close connection",
+          (void*) http, (unsigned long long) http->keepalive_requests,
+          (void*) sock);
+      keepalive = 0;
+    }
+
     dfk_http_response_t resp;
     /** @todo check return value */
-    dfk__http_response_init(&resp, &req, &request_arena, &connection_arena, sock, keepalive);
+    dfk__http_response_init(&resp, &req, &request_arena, &connection_arena,
+        sock, keepalive, obuf, http->output_buffer_size);
+    /* Headers may be flushed by the request handler */
+    resp._connection_header |= 1;
+#if DFK_HTTP_PIPELINING
+    /* Responses to the previous requests are sent along with this one */
+    resp._obufnbytes = npending;
+    npending = 0;
+#endif
 
     DFK_DBG(http->dfk, "{%p} run request handler", (void*) http);
     int hres = handler(http, &req, &resp, user);
@@ -122,16 +189,6 @@ void dfk__http_protocol(dfk_http_t* http, dfk_fiber_t* fiber, dfk_tcp_socket_t*
      */
     keepalive = keepalive && resp.keepalive;
 
-    if (keepalive
-        && http->keepalive_requests >= 0
-        && nrequests + 1 >= http->keepalive_requests) {
-      DFK_INFO(http->dfk, "{%p} maximum number of keepalive requests (%llu) "
-          "for connection {%p} has reached, close connection",
-          (void*) http, (unsigned long long) http->keepalive_requests,
-          (void*) sock);
-      keepalive = 0;
-    }
-
 #if DFK_DEBUG
     {
       dfk_buf_t connection = dfk_strmap_get(&req.headers,
@@ -145,38 +202,76 @@ void dfk__http_protocol(dfk_http_t* http, dfk_fiber_t* fiber, dfk_tcp_socket_t*
     }
 #endif
 
-    if (!keepalive) {
-      dfk_http_response_set(&resp,
-          DFK_HTTP_CONNECTION, sizeof(DFK_HTTP_CONNECTION) - 1, "close", 5);
-    } else {
-      dfk_http_response_set(&resp,
-          DFK_HTTP_CONNECTION, sizeof(DFK_HTTP_CONNECTION) - 1, "Keep-Alive", 10);
-    }
+    /* Connection header is added by dfk__http_response_flush_headers */
+    resp.keepalive = keepalive;
 
-    /** @todo remove kludge */
-    dfk_http_response_set(&resp, "Content-Length", 14, "0", 1);
+    err = dfk__http_response_complete(&resp);
+    if (err != dfk_err_ok) {
+      DFK_ERROR(dfk, "{%p} dfk__http_response_complete failed with %s",
+          (void*) http, dfk_strerr(dfk, err));
+      keepalive = 0;
+      goto cleanup;
+    }
+    /* Response without known length is terminated by closing connection */
+    keepalive = keepalive && resp.keepalive;
 
-    dfk__http_response_flush_headers(&resp);
+    if (!req._message_complete && (req.chunked
+        || req._remainder.size <= req.content_length - req._body_nread)) {
+      /*
+       * The rest of body is to be read from the socket, while the client
+       * may wait for the response before sending it
+       */
+      err = dfk__http_response_flush_output(&resp);
+      if (err != dfk_err_ok) {
+        DFK_ERROR(dfk, "{%p} dfk__http_response_flush_output failed with %s",
+            (void*) http, dfk_strerr(dfk, err));
+        keepalive = 0;
+        goto cleanup;
+      }
+    }
+    err = dfk__http_request_finish(&req);
+    if (err != dfk_err_ok) {
+      DFK_ERROR(dfk, "{%p} failed to flush request body: %s",
+          (void*) http, dfk_strerr(dfk, err));
+      keepalive = 0;
+    }
 
-    /*
-     * If request handler hasn't read all bytes of the body, we have to
-     * skip them at this point.
-     */
-    if (req.content_length > 0 && (int64_t) req._body_nread < req.content_length) {
-      size_t bytesremain = req.content_length - req._body_nread;
-      DFK_DBG(dfk, "{%p} bytes read by handler %llu, need to flush %llu",
-          (void*) http, (unsigned long long ) req._body_nread,
-          (unsigned long long) bytesremain);
-      char buf[1024];
-      while (bytesremain) {
-        ssize_t nread = dfk_http_request_read(&req, buf,
-            DFK_MIN(bytesremain, sizeof(buf)));
-        if (nread < 0) {
-          DFK_ERROR(dfk, "{%p} failed to flush request body", (void*) http);
-          keepalive = 0;
-          goto cleanup;
-        }
-        bytesremain -= nread;
+    int flush = 1;
+#if DFK_HTTP_PIPELINING
+    ncarry = 0;
+    if (keepalive && req._remainder.size) {
+      if (!carry) {
+        carry = dfk_arena_alloc(&connection_arena, http->headers_buffer_size);
+      }
+      if (!carry || req._remainder.size > http->headers_buffer_size) {
+        DFK_WARNING(dfk, "{%p} can not carry %llu bytes of pipelined request, "
+            "close connection", (void*) http,
+            (unsigned long long) req._remainder.size);
+        keepalive = 0;
+      } else {
+        ncarry = req._remainder.size;
+        memcpy(carry, req._remainder.data, ncarry);
+        /*
+         * Headers of the next request are already received, its response
+         * will be sent along with this one. Otherwise the client may be
+         * waiting for this response before sending more requests.
+         */
+        flush = !dfkp_memmem(carry, ncarry, "\r\n\r\n", 4);
+      }
+    }
+    if (!flush) {
+      DFK_DBG(dfk, "{%p} pipelined request follows, defer %llu bytes of "
+          "response", (void*) http, (unsigned long long) resp._obufnbytes);
+      npending = resp._obufnbytes;
+    }
+#endif
+    if (flush) {
+      err = dfk__http_response_flush_output(&resp);
+      if (err != dfk_err_ok) {
+        DFK_ERROR(dfk, "{%p} dfk__http_response_flush_output failed with %s",
+            (void*) http, dfk_strerr(dfk, err));
+        keepalive = 0;
+        goto cleanup;
       }
     }
 
@@ -194,9 +289,23 @@ void dfk__http_protocol(dfk_http_t* http, dfk_fiber_t* fiber, dfk_tcp_socket_t*
 cleanup:
     DFK_DBG(dfk, "{%p} cleaup per-request resources", (void*) http);
     dfk__http_request_free(&req);
-    dfk_arena_free(&request_arena);
+    dfk_arena_reset(&request_arena, 1);
+  }
+
+#if DFK_HTTP_PIPELINING
+  if (npending) {
+    /* Next request has failed, send what is left from the previous one */
+    if (dfk_tcp_socket_write(sock, obuf, npending) < 0) {
+      DFK_ERROR(dfk, "{%p} failed to send response: %s",
+          (void*) http, dfk_strerr(dfk, dfk->dfk_errno));
+    }
   }
+#endif
 
+  if (hbuf) {
+    dfk__buffer_free(dfk, hbuf, http->headers_buffer_size);
+  }
+  dfk_arena_free(&request_arena);
   dfk_arena_free(&connection_arena);
 
   /*
@@ -12,6 +12,7 @@
 #include <dfk/http/server.h>
 #include <dfk/http/request.h>
 #include <dfk/internal/http/request.h>
+#include <dfk/internal/buffer_pool.h>
 #include <dfk/internal.h>
 
 #define TO_BUFLIST_ITEM(expr) DFK_CONTAINER_OF((expr), buflist_item_t, hook)
@@ -53,10 +54,12 @@ static ssize_t dfk__mocked_read(dfk_http_request_t* req,
   if (req->_socket_mocked) {
     return dfk__sponge_read(req->_socket_mock, buf, toread);
   } else {
-    return dfk_tcp_socket_read(req->_socket, buf, toread);
+    return dfk_tcp_socket_read_deadline(req->_socket, buf, toread,
+        req->_deadline);
   }
 #else
-  return dfk_tcp_socket_read(req->_socket, buf, toread);
+  return dfk_tcp_socket_read_deadline(req->_socket, buf, toread,
+      req->_deadline);
 #endif
 }
 
@@ -64,9 +67,13 @@ static int dfk__http_request_allocate_headers_buf(dfk_http_request_t* req, dfk_b
 {
   assert(req);
   assert(outbuf);
-  char* buf = dfk__malloc(req->http->dfk, req->http->headers_buffer_size);
-  if (!buf) {
-    return dfk_err_nomem;
+  dfk_t* dfk = req->http->dfk;
+  char* buf = req->_headers_buffer;
+  if (!buf || !dfk_list_empty(&req->_buffers)) {
+    buf = dfk__buffer_alloc(dfk, req->http->headers_buffer_size);
+    if (!buf) {
+      return dfk_err_nomem;
+    }
   }
   *outbuf = (dfk_buf_t) {buf, req->http->headers_buffer_size};
 
@@ -74,7 +81,9 @@ static int dfk__http_request_allocate_headers_buf(dfk_http_request_t* req, dfk_b
       dfk_arena_alloc(req->_request_arena, sizeof(buflist_item_t));
 
   if (!buflist_item) {
-    dfk__free(req->http->dfk, buf);
+    if (buf != req->_headers_buffer) {
+      dfk__buffer_free(dfk, buf, outbuf->size);
+    }
     return dfk_err_nomem;
   }
   buflist_item->buf = *outbuf;
@@ -110,7 +119,9 @@ void dfk__http_request_free(dfk_http_request_t* req)
   dfk_list_end(&req->_buffers, &end);
   while (!dfk_list_it_equal(&it, &end)) {
     buflist_item_t* blitem = TO_BUFLIST_ITEM(it.value);
-    dfk__free(req->http->dfk, blitem->buf.data);
+    if (blitem->buf.data != req->_headers_buffer) {
+      dfk__buffer_free(req->http->dfk, blitem->buf.data, blitem->buf.size);
+    }
     dfk_list_it_next(&it);
   }
 }
@@ -234,6 +245,7 @@ static int dfk_http_request_on_message_complete(http_parser* parser)
    * could be stored in parser->data as well
    */
   DFK_DBG(p->req->http->dfk, "{%p}", (void*) p->req);
+  p->req->_message_complete = 1;
   http_parser_pause(parser, 1);
   return 0;
 }
@@ -322,10 +334,30 @@ int dfk__http_request_read_headers(dfk_http_request_t* req)
   dfk_buf_t curbuf;
   DFK_CALL(dfk, dfk__http_request_allocate_headers_buf(req, &curbuf));
 
+  /*
+   * Bytes of a pipelined request could have been read along with the
+   * previous one, they are parsed before reading from the socket.
+   */
+  size_t ncarried = req->_remainder.size;
+  if (ncarried) {
+    assert(ncarried <= curbuf.size);
+    DFK_DBG(dfk, "{%p} %llu bytes carried from the previous request",
+        (void*) req, (unsigned long long) ncarried);
+    memcpy(curbuf.data, req->_remainder.data, ncarried);
+    req->_remainder = (dfk_buf_t) {NULL, 0};
+  }
+
   while (1) {
     assert(curbuf.size >= DFK_HTTP_HEADER_MAX_SIZE);
 
-    ssize_t nread = dfk__mocked_read(req, curbuf.data, curbuf.size);
+    ssize_t nread = ncarried;
+    ncarried = 0;
+    if (!nread) {
+      nread = dfk__mocked_read(req, curbuf.data, curbuf.size);
+    }
+    if (nread < 0 && dfk->dfk_errno == dfk_err_timeout) {
+      return dfk_err_timeout;
+    }
     if (nread <= 0) {
       return dfk_err_eof;
     }
@@ -338,7 +370,7 @@ int dfk__http_request_read_headers(dfk_http_request_t* req)
      * Note that size_t -> ssize_t cast occurs in the line below
      */
     ssize_t nparsed = http_parser_execute(
-        &req->_parser, &dfk_parser_settings, curbuf.data, curbuf.size);
+        &req->_parser, &dfk_parser_settings, curbuf.data, nread);
     assert(nparsed <= nread);
     DFK_DBG(dfk, "{%p} %llu bytes parsed",
         (void*) req, (unsigned long long) nparsed);
@@ -377,13 +409,17 @@ int dfk__http_request_read_headers(dfk_http_request_t* req)
       if (dfk_list_size(&req->_buffers) == req->http->headers_buffer_count) {
         return dfk_err_overflow;
       }
+      /* Current header is moved to the beginning of the new buffer */
+      size_t tomove = curbuf.data + nparsed - pdata.cheader_field.data;
       DFK_CALL(dfk, dfk__http_request_allocate_headers_buf(req, &curbuf));
-      memcpy(curbuf.data, pdata.cheader_field.data, nparsed);
+      memcpy(curbuf.data, pdata.cheader_field.data, tomove);
       if (pdata.cheader_value.data) {
         pdata.cheader_value.data = curbuf.data +
           (pdata.cheader_value.data - pdata.cheader_field.data);
       }
       pdata.cheader_field.data = curbuf.data;
+      curbuf = (dfk_buf_t) {curbuf.data + tomove, curbuf.size - tomove};
+      continue;
     }
     curbuf = (dfk_buf_t) {curbuf.data + nparsed, curbuf.size - nparsed};
   }
@@ -571,6 +607,10 @@ ssize_t dfk_http_request_read(dfk_http_request_t* req, char* buf, size_t size)
   pdata.outbuf = (dfk_buf_t) {buf, size};
 
   while (size && (pdata.outbuf.data == bufcopy || req->_remainder.size)) {
+    if (req->_message_complete) {
+      /* The rest of req->_remainder belongs to the next request */
+      break;
+    }
     size_t toread = DFK_MIN(size, req->content_length - req->_body_nread);
     DFK_DBG(req->http->dfk, "{%p} bytes cached: %llu, user-provided buffer used: %llu/%llu bytes",
         (void*) req, (unsigned long long) req->_remainder.size,
@@ -595,7 +635,7 @@ ssize_t dfk_http_request_read(dfk_http_request_t* req, char* buf, size_t size)
       inbuf = (dfk_buf_t) {req->_remainder.data, toread};
     } else {
       DFK_DBG(req->http->dfk, "{%p} cache is empty, read new bytes", (void*) req);
-      size_t nread = dfk__mocked_read(req, buf, toread);
+      ssize_t nread = dfk__mocked_read(req, buf, toread);
       if (nread <= 0) {
         /* preserve dfk->dfk_errno from dfk_tcp_socket_read or dfk__sponge_read */
         return nread;
@@ -625,6 +665,17 @@ ssize_t dfk_http_request_read(dfk_http_request_t* req, char* buf, size_t size)
       /* bytes from remainder were parsed */
       req->_remainder.data += nparsed;
       req->_remainder.size -= nparsed;
+    } else if (nparsed < inbuf.size) {
+      /* Request is complete, save bytes of the next one */
+      assert(req->_message_complete);
+      size_t nextra = inbuf.size - nparsed;
+      char* extra = dfk_arena_alloc(req->_request_arena, nextra);
+      if (!extra) {
+        req->http->dfk->dfk_errno = dfk_err_nomem;
+        return -1;
+      }
+      memcpy(extra, inbuf.data + nparsed, nextra);
+      req->_remainder = (dfk_buf_t) {extra, nextra};
     }
     buf = pdata.outbuf.data;
     size = pdata.outbuf.size;
@@ -642,3 +693,56 @@ ssize_t dfk_http_request_readv(dfk_http_request_t* req, dfk_iovec_t* iov, size_t
   return dfk_http_request_read(req, iov[0].data, iov[0].size);
 }
 
+
+int dfk__http_request_finish(dfk_http_request_t* req)
+{
+  assert(req);
+  dfk_t* dfk = req->http->dfk;
+  /*
+   * If request handler hasn't read all bytes of the body, we have to
+   * skip them at this point.
+   */
+  char buf[1024];
+  while (!req->_message_complete
+      && (req->chunked || (int64_t) req->_body_nread < req->content_length)) {
+    DFK_DBG(dfk, "{%p} bytes read by handler %llu, skip the rest of body",
+        (void*) req, (unsigned long long) req->_body_nread);
+    ssize_t nread = dfk_http_request_read(req, buf, sizeof(buf));
+    if (nread < 0) {
+      return dfk->dfk_errno;
+    }
+    if (!nread && !req->_message_complete) {
+      return dfk_err_eof;
+    }
+  }
+  if (req->_message_complete) {
+    return dfk_err_ok;
+  }
+  /*
+   * Request has no body. http_parser has stopped right after the headers,
+   * feed it with the remaining line feed to complete the request.
+   */
+  if (!req->_remainder.size) {
+    return dfk_err_protocol;
+  }
+  dfk_body_parser_data_t pdata = {
+    .req = req,
+    .outbuf = {NULL, 0},
+    .dfk_errno = dfk_err_ok
+  };
+  req->_parser.data = &pdata;
+  size_t nparsed = http_parser_execute(&req->_parser, &dfk_parser_settings,
+      req->_remainder.data, req->_remainder.size);
+  if (!req->_message_complete) {
+    DFK_DBG(dfk, "{%p} http parser returned %d (%s) - %s",
+        (void*) req, req->_parser.http_errno,
+        http_errno_name(req->_parser.http_errno),
+        http_errno_description(req->_parser.http_errno));
+    return dfk_err_protocol;
+  }
+  req->_remainder.data += nparsed;
+  req->_remainder.size -= nparsed;
+  DFK_DBG(dfk, "{%p} request complete, %llu bytes of the next one",
+      (void*) req, (unsigned long long) req->_remainder.size);
+  return dfk_err_ok;
+}
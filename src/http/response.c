@@ -5,6 +5,9 @@
  */
 
 #include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <dfk/error.h>
 #include <dfk/http/response.h>
 #include <dfk/internal/http/response.h>
@@ -25,6 +28,12 @@ static ssize_t dfk__mocked_write(dfk_http_response_t* resp,
 #endif
 }
 
+/**
+ * Maximum number of buffers written with a single call without allocating
+ * iovec array from the request arena
+ */
+#define DFK_HTTP_RESPONSE_IOV 16
+
 static ssize_t dfk__mocked_writev(dfk_http_response_t* resp,
     dfk_iovec_t* iov, size_t niov)
 {
@@ -39,10 +48,36 @@ static ssize_t dfk__mocked_writev(dfk_http_response_t* resp,
 #endif
 }
 
+static ssize_t dfk__mocked_sendfile(dfk_http_response_t* resp,
+    int fd, off_t offset, size_t nbytes)
+{
+#if DFK_MOCKS
+    if (resp->_socket_mocked) {
+      char buf[4096];
+      size_t totalread = 0;
+      while (totalread < nbytes) {
+        ssize_t nread = pread(fd, buf, DFK_MIN(sizeof(buf), nbytes - totalread),
+            offset + totalread);
+        if (nread <= 0) {
+          break;
+        }
+        if (dfk__sponge_write(resp->_socket_mock, buf, nread) != dfk_err_ok) {
+          return -1;
+        }
+        totalread += nread;
+      }
+      return totalread;
+    } else {
+      return dfk_tcp_socket_sendfile(resp->_socket, fd, offset, nbytes);
+    }
+#else
+    return dfk_tcp_socket_sendfile(resp->_socket, fd, offset, nbytes);
+#endif
+}
 
 void dfk__http_response_init(dfk_http_response_t* resp, dfk_http_request_t* req,
     dfk_arena_t* request_arena, dfk_arena_t* connection_arena,
-    dfk_tcp_socket_t* sock, int keepalive)
+    dfk_tcp_socket_t* sock, int keepalive, char* obuf, size_t obufsize)
 {
   assert(resp);
   assert(req);
@@ -58,7 +93,11 @@ void dfk__http_response_init(dfk_http_response_t* resp, dfk_http_request_t* req,
   resp->_socket_mocked = 0;
   resp->_socket_mock = 0;
 #endif
+  resp->_obuf = obuf;
+  resp->_obufsize = obuf ? obufsize : 0;
+  resp->_obufnbytes = 0;
   resp->_headers_flushed = 0;
+  resp->_connection_header = 0;
 
   resp->http = req->http;
   resp->major_version = req->major_version;
@@ -74,6 +113,81 @@ size_t dfk_http_response_sizeof(void)
   return sizeof(dfk_http_response_t);
 }
 
+int dfk__http_response_flush_output(dfk_http_response_t* resp)
+{
+  if (!resp->_obufnbytes) {
+    return dfk_err_ok;
+  }
+  size_t nbytes = resp->_obufnbytes;
+  resp->_obufnbytes = 0;
+  if (dfk__mocked_write(resp, resp->_obuf, nbytes) < 0) {
+    return resp->http->dfk->dfk_errno;
+  }
+  return dfk_err_ok;
+}
+
+/**
+ * Send buffers preceded by the buffered output, within the same system call
+ *
+ * Returns total size of the buffers, or -1 on error.
+ */
+static ssize_t dfk__http_response_output_direct(dfk_http_response_t* resp,
+    dfk_iovec_t* iov, size_t niov, size_t nbytes)
+{
+  if (!resp->_obufnbytes) {
+    ssize_t nwritten = dfk__mocked_writev(resp, iov, niov);
+    return nwritten < 0 ? nwritten : (ssize_t) nbytes;
+  }
+  dfk_iovec_t stackiov[DFK_HTTP_RESPONSE_IOV];
+  dfk_iovec_t* out = stackiov;
+  if (niov + 1 > DFK_SIZE(stackiov)) {
+    out = dfk_arena_alloc(resp->_request_arena,
+        (niov + 1) * sizeof(dfk_iovec_t));
+    if (!out) {
+      resp->http->dfk->dfk_errno = dfk_err_nomem;
+      return -1;
+    }
+  }
+  out[0] = (dfk_iovec_t) {resp->_obuf, resp->_obufnbytes};
+  memcpy(out + 1, iov, niov * sizeof(dfk_iovec_t));
+  resp->_obufnbytes = 0;
+  ssize_t nwritten = dfk__mocked_writev(resp, out, niov + 1);
+  return nwritten < 0 ? nwritten : (ssize_t) nbytes;
+}
+
+/**
+ * Append buffers to the output buffer, or send them along with the
+ * buffered output if they do not fit
+ *
+ * Returns total size of the buffers, or -1 on error.
+ */
+static ssize_t dfk__http_response_output(dfk_http_response_t* resp,
+    dfk_iovec_t* iov, size_t niov)
+{
+  size_t nbytes = 0;
+  for (size_t i = 0; i < niov; ++i) {
+    nbytes += iov[i].size;
+  }
+  if (resp->_obuf && nbytes <= resp->_obufsize - resp->_obufnbytes) {
+    for (size_t i = 0; i < niov; ++i) {
+      memcpy(resp->_obuf + resp->_obufnbytes, iov[i].data, iov[i].size);
+      resp->_obufnbytes += iov[i].size;
+    }
+    return nbytes;
+  }
+  return dfk__http_response_output_direct(resp, iov, niov, nbytes);
+}
+
+/**
+ * Check if response status does not allow message body
+ */
+static int dfk__http_response_nobody(dfk_http_response_t* resp)
+{
+  return (resp->status >= 100 && resp->status < 200)
+    || resp->status == DFK_HTTP_NO_CONTENT
+    || resp->status == DFK_HTTP_NOT_MODIFIED;
+}
+
 int dfk__http_response_flush_headers(dfk_http_response_t* resp)
 {
   assert(resp);
@@ -81,8 +195,33 @@ int dfk__http_response_flush_headers(dfk_http_response_t* resp)
     return dfk_err_ok;
   }
 
+  if (dfk__http_response_nobody(resp)) {
+    resp->chunked = 0;
+  } else if (resp->chunked) {
+    if (resp->major_version == 1 && resp->minor_version == 0) {
+      /* Chunked encoding is not supported, body ends when connection closes */
+      DFK_DBG(resp->http->dfk, "{%p} chunked encoding is not supported by "
+          "HTTP/1.0, disable keepalive", (void*) resp);
+      resp->chunked = 0;
+      resp->keepalive = 0;
+    } else {
+      dfk_http_response_set(resp, DFK_HTTP_TRANSFER_ENCODING,
+          sizeof(DFK_HTTP_TRANSFER_ENCODING) - 1, "chunked", 7);
+    }
+  }
+
+  if (resp->_connection_header) {
+    if (resp->keepalive) {
+      dfk_http_response_set(resp, DFK_HTTP_CONNECTION,
+          sizeof(DFK_HTTP_CONNECTION) - 1, "Keep-Alive", 10);
+    } else {
+      dfk_http_response_set(resp, DFK_HTTP_CONNECTION,
+          sizeof(DFK_HTTP_CONNECTION) - 1, "close", 5);
+    }
+  }
+
   /* Set "Content-Length" header if not specified manually */
-  if (resp->content_length != (size_t) -1) {
+  if (resp->content_length != (size_t) -1 && !resp->chunked) {
     dfk_buf_t content_length = dfk_strmap_get(&resp->headers, DFK_HTTP_CONTENT_LENGTH, sizeof(DFK_HTTP_CONTENT_LENGTH) - 1);
     if (!content_length.data) {
       char buf[64] = {0};
@@ -105,7 +244,8 @@ int dfk__http_response_flush_headers(dfk_http_response_t* resp)
                        dfk_http_reason_phrase(resp->status));
   if (!iov) {
     /** @todo return value */
-    dfk__mocked_write(resp, sbuf, ssize);
+    dfk_iovec_t status = {sbuf, ssize};
+    dfk__http_response_output(resp, &status, 1);
   } else {
     size_t i = 0;
     iov[i++] = (dfk_iovec_t) {sbuf, ssize};
@@ -122,12 +262,30 @@ int dfk__http_response_flush_headers(dfk_http_response_t* resp)
     }
     iov[i++] = (dfk_iovec_t) {"\r\n", 2};
     /** @todo return code */
-    dfk__mocked_writev(resp, iov, niov);
+    dfk__http_response_output(resp, iov, niov);
   }
   resp->_headers_flushed |= 1;
   return dfk_err_ok;
 }
 
+/**
+ * Choose body framing before the first write, if size is not known
+ */
+static void dfk__http_response_begin_body(dfk_http_response_t* resp)
+{
+  if (resp->_headers_flushed || resp->content_length != (size_t) -1
+      || dfk__http_response_nobody(resp)) {
+    return;
+  }
+  if (resp->major_version == 1 && resp->minor_version == 0) {
+    DFK_DBG(resp->http->dfk, "{%p} unknown body size, disable keepalive",
+        (void*) resp);
+    resp->keepalive = 0;
+  } else {
+    resp->chunked |= 1;
+  }
+}
+
 ssize_t dfk_http_response_write(dfk_http_response_t* resp, char* buf, size_t nbytes)
 {
   assert(resp);
@@ -136,12 +294,137 @@ ssize_t dfk_http_response_write(dfk_http_response_t* resp, char* buf, size_t nby
   return dfk_http_response_writev(resp, &iov, 1);
 }
 
+/**
+ * Write buffers as a single chunk: size line, data and trailing CRLF
+ */
+static ssize_t dfk__http_response_write_chunk(dfk_http_response_t* resp,
+    dfk_iovec_t* iov, size_t niov)
+{
+  size_t nbytes = 0;
+  for (size_t i = 0; i < niov; ++i) {
+    nbytes += iov[i].size;
+  }
+  if (!nbytes) {
+    /* Zero-sized chunk would terminate the body */
+    return 0;
+  }
+  dfk_iovec_t stackiov[DFK_HTTP_RESPONSE_IOV];
+  dfk_iovec_t* chunk = stackiov;
+  if (niov + 2 > DFK_SIZE(stackiov)) {
+    chunk = dfk_arena_alloc(resp->_request_arena,
+        (niov + 2) * sizeof(dfk_iovec_t));
+    if (!chunk) {
+      resp->http->dfk->dfk_errno = dfk_err_nomem;
+      return -1;
+    }
+  }
+  char size[32];
+  int sizelen = snprintf(size, sizeof(size), "%llx\r\n",
+      (unsigned long long) nbytes);
+  chunk[0] = (dfk_iovec_t) {size, sizelen};
+  memcpy(chunk + 1, iov, niov * sizeof(dfk_iovec_t));
+  chunk[niov + 1] = (dfk_iovec_t) {"\r\n", 2};
+  ssize_t nwritten = dfk__http_response_output(resp, chunk, niov + 2);
+  if (nwritten < 0) {
+    return nwritten;
+  }
+  return nbytes;
+}
+
 ssize_t dfk_http_response_writev(dfk_http_response_t* resp, dfk_iovec_t* iov, size_t niov)
 {
   assert(resp);
   assert(iov && niov);
+  dfk__http_response_begin_body(resp);
+  dfk__http_response_flush_headers(resp);
+  if (resp->chunked) {
+    return dfk__http_response_write_chunk(resp, iov, niov);
+  }
+  return dfk__http_response_output(resp, iov, niov);
+}
+
+int dfk__http_response_complete(dfk_http_response_t* resp)
+{
+  assert(resp);
+  if (!resp->_headers_flushed) {
+    if (resp->content_length == (size_t) -1 && !resp->chunked
+        && !dfk__http_response_nobody(resp)) {
+      /* Handler has not written anything, body is empty */
+      resp->content_length = 0;
+    }
+    dfk__http_response_flush_headers(resp);
+  } else if (resp->chunked) {
+    dfk_iovec_t last = {"0\r\n\r\n", 5};
+    if (dfk__http_response_output(resp, &last, 1) < 0) {
+      return resp->http->dfk->dfk_errno;
+    }
+  }
+  return dfk_err_ok;
+}
+
+int dfk__http_response_flush(dfk_http_response_t* resp)
+{
+  assert(resp);
+  int err = dfk__http_response_complete(resp);
+  if (err != dfk_err_ok) {
+    return err;
+  }
+  return dfk__http_response_flush_output(resp);
+}
+
+ssize_t dfk__http_response_write_prebuilt(dfk_http_response_t* resp,
+    dfk_iovec_t* iov, size_t niov)
+{
+  assert(resp);
+  assert(iov && niov);
+  assert(!resp->_headers_flushed);
+  resp->_headers_flushed |= 1;
+  size_t nbytes = 0;
+  for (size_t i = 0; i < niov; ++i) {
+    nbytes += iov[i].size;
+  }
+  /* Output of the previous pipelined responses goes first */
+  return dfk__http_response_output_direct(resp, iov, niov, nbytes);
+}
+
+ssize_t dfk_http_response_sendfile(dfk_http_response_t* resp,
+    int fd, off_t offset, size_t nbytes)
+{
+  assert(resp);
+  assert(fd >= 0);
+  assert(nbytes);
+  dfk__http_response_begin_body(resp);
   dfk__http_response_flush_headers(resp);
-  return dfk__mocked_writev(resp, iov, niov);
+  if (resp->chunked) {
+    /* Chunk size is not known until the file is read, send it piecewise */
+    char size[32];
+    int sizelen = snprintf(size, sizeof(size), "%llx\r\n",
+        (unsigned long long) nbytes);
+    dfk_iovec_t iov = {size, sizelen};
+    if (dfk__http_response_output(resp, &iov, 1) < 0
+        || dfk__http_response_flush_output(resp) != dfk_err_ok) {
+      return -1;
+    }
+    ssize_t nsent = dfk__mocked_sendfile(resp, fd, offset, nbytes);
+    if (nsent < 0) {
+      return nsent;
+    }
+    if ((size_t) nsent < nbytes) {
+      /* Chunk can not be completed, connection is unusable */
+      resp->keepalive = 0;
+      return nsent;
+    }
+    /* Chunk trailer is sent along with the following output */
+    iov = (dfk_iovec_t) {"\r\n", 2};
+    if (dfk__http_response_output(resp, &iov, 1) < 0) {
+      return -1;
+    }
+    return nsent;
+  }
+  if (dfk__http_response_flush_output(resp) != dfk_err_ok) {
+    return -1;
+  }
+  return dfk__mocked_sendfile(resp, fd, offset, nbytes);
 }
 
 int dfk_http_response_set(dfk_http_response_t* resp,
@@ -27,10 +27,13 @@ void dfk_http_init(dfk_http_t* http, dfk_t* dfk)
   assert(http);
   assert(dfk);
   DFK_DBG(dfk, "{%p}", (void*) http);
+  http->reuseport = DFK_TCP_REUSEPORT;
   http->keepalive_requests = DFK_HTTP_KEEPALIVE_REQUESTS;
+  http->keepalive_timeout = DFK_HTTP_KEEPALIVE_TIMEOUT * 1000000ULL;
   http->header_max_size = DFK_HTTP_HEADER_MAX_SIZE;
   http->headers_buffer_size = DFK_HTTP_HEADERS_BUFFER_SIZE;
   http->headers_buffer_count = DFK_HTTP_HEADERS_BUFFER_COUNT;
+  http->output_buffer_size = DFK_HTTP_OUTPUT_BUFFER_SIZE;
   dfk_tcp_server_init(&http->_server, dfk);
 }
 
@@ -73,6 +76,7 @@ int dfk_http_serve(dfk_http_t* http,
     .handler = handler,
     .user = user
   };
+  http->_server.reuseport = http->reuseport;
   return dfk_tcp_serve(&http->_server, endpoint, port, backlog,
       dfk_http_connection, (dfk_userdata_t) {.data = &args});
 }
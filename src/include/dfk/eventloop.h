@@ -8,8 +8,11 @@
  */
 
 #pragma once
+#include <stdint.h>
+#include <sys/types.h>
 #include <dfk/config.h>
 #include <dfk/fiber.h>
+#include <dfk/internal/timer.h>
 
 /**
  * @par Writing a new event loop implementation
@@ -24,6 +27,22 @@
  * - DFK_IO_ERR
  * and declare a structure
  * - dfk_eventloop_t
+ * with members
+ * - dfk_t* dfk
+ * - dfk_timer_wheel_t timers
+ *
+ * Event loop should not block longer than dfk__eventloop_timeout
+ * suggests, and should call dfk__timer_wheel_advance on each iteration.
+ *
+ * If #DFK_IO_WATCH is enabled, following functions are required as well:
+ * - dfk__io_watch_init
+ * - dfk__io_watch_free
+ * - dfk__io_watch_wait
+ *
+ * Completion-based implementations may additionally define
+ * DFK_EVENT_LOOP_HAVE_RW and implement
+ * - dfk__io_read
+ * - dfk__io_write
  */
 
 /*
@@ -42,6 +61,13 @@
 #undef DFK_INCLUDE_EVENTLOOP_SELECT_H_DIRECTLY
 #endif
 
+#if DFK_EVENT_LOOP_URING
+#define DFK_INCLUDE_EVENTLOOP_URING_H_DIRECTLY
+#include <dfk/eventloop/uring.h>
+#undef DFK_INCLUDE_EVENTLOOP_URING_H_DIRECTLY
+#define DFK_EVENT_LOOP_HAVE_RW 1
+#endif
+
 int dfk__eventloop_init(dfk_eventloop_t* loop, dfk_t* dfk);
 
 int dfk__eventloop_free(dfk_eventloop_t* loop);
@@ -56,8 +82,63 @@ void dfk__eventloop_main(dfk_fiber_t* fiber, void* arg);
  *
  * This call enqueues IO request and suspends current fiber until
  * result arrives.
+ *
+ * @param deadline Monotonic time, in nanoseconds, to wait until.
+ * Zero value means no deadline.
+ * @returns events reported by the event loop, or 0 if @p deadline has
+ * expired
+ */
+int dfk__io(dfk_eventloop_t* loop, int socket, int events, uint64_t deadline);
+
+#if DFK_IO_WATCH
+struct dfk_io_watch_t;
+
+/**
+ * Register file descriptor in the event loop for its whole lifetime
+ */
+int dfk__io_watch_init(dfk_eventloop_t* loop, struct dfk_io_watch_t* watch,
+    int fd);
+
+/**
+ * Unregister file descriptor, wake up fibers waiting for it with DFK_IO_ERR
+ */
+int dfk__io_watch_free(struct dfk_io_watch_t* watch);
+
+/**
+ * Suspend current fiber until file descriptor becomes ready
+ *
+ * Should be called only after non-blocking operation has returned EAGAIN,
+ * since readiness for @p events is considered to be consumed.
+ *
+ * @returns events reported by the event loop, or 0 if @p deadline has
+ * expired
+ */
+int dfk__io_watch_wait(struct dfk_io_watch_t* watch, int events,
+    uint64_t deadline);
+#endif
+
+#if DFK_EVENT_LOOP_HAVE_RW
+/**
+ * Read from the file descriptor, suspend current fiber until data arrives
+ *
+ * Unlike dfk__io, read operation is performed by the event loop itself,
+ * therefore no additional read(2) call is needed upon wake up.
+ *
+ * @returns number of bytes read, or -1 with errno set. errno is set to
+ * ETIMEDOUT if @p deadline has expired.
  */
-int dfk__io(dfk_eventloop_t* loop, int socket, int events);
+ssize_t dfk__io_read(dfk_eventloop_t* loop, int fd, char* buf, size_t nbytes,
+    uint64_t deadline);
+
+/**
+ * Write to the file descriptor, suspend current fiber until it is done
+ *
+ * @returns number of bytes written, or -1 with errno set. errno is set to
+ * ETIMEDOUT if @p deadline has expired.
+ */
+ssize_t dfk__io_write(dfk_eventloop_t* loop, int fd, char* buf,
+    size_t nbytes, uint64_t deadline);
+#endif
 
 /**
  * Writes string representation of the event set events to the buffer
@@ -66,3 +147,26 @@ int dfk__io(dfk_eventloop_t* loop, int socket, int events);
  */
 size_t dfk__io_events_to_str(int events, char* buf, size_t buflen);
 
+
+/**
+ * Spin-then-block idle policy shared by event loop implementations
+ *
+ * Should be called before waiting for IO events. During the first
+ * dfk_t.idle_spin_usec microseconds of an idle period returns non-zero,
+ * which means that event loop should poll without blocking. Event loop
+ * resets @p idle_since to zero once any event is dispatched.
+ *
+ * @param idle_since Beginning of the current idle period, in microseconds,
+ * or zero if the event loop was not idle.
+ */
+int dfk__eventloop_spin(dfk_t* dfk, uint64_t* idle_since);
+
+/**
+ * Returns number of nanoseconds the event loop may block waiting for IO,
+ * or -1 if it may block indefinitely.
+ *
+ * Combines spin-then-block idle policy with expiration time of the nearest
+ * timer.
+ */
+int64_t dfk__eventloop_timeout(dfk_t* dfk, uint64_t* idle_since,
+    dfk_timer_wheel_t* timers);
@@ -10,6 +10,7 @@
 #pragma once
 #include <sys/epoll.h>
 #include <dfk/context.h>
+#include <dfk/internal/timer.h>
 
 #ifndef DFK_INCLUDE_EVENTLOOP_EPOLL_H_DIRECTLY
 #error("Do not include this header directly, use <dfk/eventloop.h>")
@@ -24,5 +25,17 @@ typedef enum dfk_io_event_e {
 typedef struct dfk_eventloop_t {
   dfk_t* dfk;
   int fd;
+  /**
+   * Buffer for epoll_wait(2) results
+   *
+   * Initially points to the preallocated array, grows up to
+   * dfk_t.io_maxevents if the buffer is filled entirely.
+   */
+  struct epoll_event* events;
+  size_t nevents;
+  /** Beginning of the current idle period, see dfk__eventloop_spin */
+  uint64_t idle_since;
+  dfk_timer_wheel_t timers;
+  struct epoll_event preallocated[64];
 } dfk_eventloop_t;
 
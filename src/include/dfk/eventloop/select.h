@@ -12,6 +12,7 @@
 #include <dfk/list.h>
 #include <dfk/context.h>
 #include <dfk/fiber.h>
+#include <dfk/internal/timer.h>
 
 #ifndef DFK_INCLUDE_EVENTLOOP_SELECT_H_DIRECTLY
 #error("Do not include this header directly, use <dfk/eventloop.h>")
@@ -28,9 +29,14 @@ typedef struct dfk_fdlist_element_t {
   int fd;
   int events;
   dfk_fiber_t* yieldback;
+  /** Interrupts waiting once the deadline has expired */
+  dfk_timer_t timer;
 } dfk_fdlist_element_t;
 
 typedef struct dfk_eventloop_t {
   dfk_t* dfk;
   dfk_list_t fds;
+  /** Beginning of the current idle period, see dfk__eventloop_spin */
+  uint64_t idle_since;
+  dfk_timer_wheel_t timers;
 } dfk_eventloop_t;
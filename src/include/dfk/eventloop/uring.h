@@ -0,0 +1,56 @@
+/**
+ * @file dfk/eventloop/uring.h
+ * Contains io_uring-based event loop implementation
+ *
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#pragma once
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <dfk/context.h>
+#include <dfk/internal/timer.h>
+
+#ifndef DFK_INCLUDE_EVENTLOOP_URING_H_DIRECTLY
+#error("Do not include this header directly, use <dfk/eventloop.h>")
+#endif
+
+typedef enum dfk_io_event_e {
+  DFK_IO_IN = POLLIN,
+  DFK_IO_OUT = POLLOUT,
+  DFK_IO_ERR = POLLERR,
+} dfk_io_event_e;
+
+typedef struct dfk_eventloop_t {
+  dfk_t* dfk;
+  /** io_uring file descriptor */
+  int fd;
+  /** Number of entries in the submission queue */
+  unsigned int entries;
+  /** Number of queued, but not yet submitted entries */
+  unsigned int nqueued;
+  /** Beginning of the current idle period, see dfk__eventloop_spin */
+  uint64_t idle_since;
+  dfk_timer_wheel_t timers;
+  /** Relative timeout of the request that wakes up the event loop */
+  struct __kernel_timespec timeout;
+
+  /* Submission queue ring, mapped from the kernel */
+  void* sqring;
+  size_t sqring_size;
+  unsigned int* sqhead;
+  unsigned int* sqtail;
+  unsigned int* sqmask;
+  unsigned int* sqarray;
+  struct io_uring_sqe* sqes;
+
+  /* Completion queue ring, mapped from the kernel */
+  void* cqring;
+  size_t cqring_size;
+  unsigned int* cqhead;
+  unsigned int* cqtail;
+  unsigned int* cqmask;
+  struct io_uring_cqe* cqes;
+} dfk_eventloop_t;
@@ -191,7 +191,30 @@ do { \
  * @see dfk__io
  */
 #define DFK_IO(dfk, socket, flags) \
-  dfk__io((dfk)->_eventloop, (socket), (flags));
+  dfk__io(dfk__this_eventloop((dfk)->_scheduler), (socket), (flags), 0);
+
+/**
+ * Same as DFK_IO, but gives up once the @p deadline has expired
+ */
+#define DFK_IO_DEADLINE(dfk, socket, flags, deadline) \
+  dfk__io(dfk__this_eventloop((dfk)->_scheduler), (socket), (flags), \
+      (deadline))
+
+#if DFK_EVENT_LOOP_HAVE_RW
+/**
+ * @see dfk__io_read
+ */
+#define DFK_IO_READ(dfk, fd, buf, nbytes, deadline) \
+  dfk__io_read(dfk__this_eventloop((dfk)->_scheduler), (fd), (buf), \
+      (nbytes), (deadline))
+
+/**
+ * @see dfk__io_write
+ */
+#define DFK_IO_WRITE(dfk, fd, buf, nbytes, deadline) \
+  dfk__io_write(dfk__this_eventloop((dfk)->_scheduler), (fd), (buf), \
+      (nbytes), (deadline))
+#endif
 
 /**
  * @see dfk__iosuspend
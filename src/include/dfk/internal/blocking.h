@@ -0,0 +1,18 @@
+/**
+ * @file dfk/internal/blocking.h
+ * Contains private functions of the blocking calls pool.
+ *
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#pragma once
+#include <dfk/context.h>
+
+/**
+ * Stop threads of the blocking calls pool and release its resources
+ *
+ * @pre No blocking calls are in progress
+ */
+void dfk__blocking_pool_free(dfk_t* dfk);
@@ -0,0 +1,32 @@
+/**
+ * @file dfk/internal/buffer_pool.h
+ * Contains a pool of reusable memory buffers.
+ *
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#pragma once
+#include <dfk/config.h>
+#include <dfk/context.h>
+
+/**
+ * Take a buffer of @p size bytes from the pool, or allocate a new one
+ *
+ * @returns NULL and sets dfk->dfk_errno to dfk_err_nomem on failure
+ */
+void* dfk__buffer_alloc(dfk_t* dfk, size_t size);
+
+/**
+ * Return buffer of @p size bytes to the pool
+ *
+ * @p size should be the same as passed to dfk__buffer_alloc. Buffer is
+ * released if the pool already holds dfk_t.buffer_pool_size buffers.
+ */
+void dfk__buffer_free(dfk_t* dfk, void* buf, size_t size);
+
+/**
+ * Release spare buffers until the pool contains at most @p nbuffers buffers
+ */
+void dfk__buffer_pool_shrink(dfk_t* dfk, size_t nbuffers);
@@ -25,6 +25,9 @@ void dfk__http_request_init(dfk_http_request_t* req, struct dfk_http_t* http,
 /**
  * Cleanup resources allocated for dfk_http_request_t
  *
+ * Headers buffers are returned to the buffer pool of dfk_t, except for
+ * dfk_http_request_t._headers_buffer owned by the connection.
+ *
  * dfk_http_request_t objects are created and free'd within
  * dfk_http function, therefore this function is marked as private.
  */
@@ -42,3 +45,12 @@ void dfk__http_request_free(dfk_http_request_t* req);
  */
 int dfk__http_request_read_headers(dfk_http_request_t* req);
 
+
+/**
+ * Complete reading of HTTP request.
+ *
+ * Skips the part of request body not read by request handler. On success,
+ * dfk_http_request_t._remainder holds bytes of the next pipelined request
+ * read along with this one, if any.
+ */
+int dfk__http_request_finish(dfk_http_request_t* req);
@@ -10,9 +10,42 @@
 #pragma once
 #include <dfk/http/response.h>
 
+/**
+ * @param obuf Output buffer of @p obufsize bytes, NULL disables buffering
+ */
 void dfk__http_response_init(dfk_http_response_t* resp, dfk_http_request_t* req,
     dfk_arena_t* request_arena, dfk_arena_t* connection_arena,
-    dfk_tcp_socket_t* sock, int keepalive);
+    dfk_tcp_socket_t* sock, int keepalive, char* obuf, size_t obufsize);
 
 int dfk__http_response_flush_headers(dfk_http_response_t* resp);
 
+/**
+ * Complete the response once request handler returns
+ *
+ * Flushes headers if the handler has not written anything, or the last
+ * chunk of a chunked response. Output may remain in the output buffer,
+ * see dfk__http_response_flush_output.
+ */
+int dfk__http_response_complete(dfk_http_response_t* resp);
+
+/**
+ * Send buffered output
+ */
+int dfk__http_response_flush_output(dfk_http_response_t* resp);
+
+/**
+ * Complete the response and send buffered output
+ */
+int dfk__http_response_flush(dfk_http_response_t* resp);
+
+
+/**
+ * Write a complete pre-built response: status line, headers and body
+ *
+ * Response headers are not rendered, dfk_http_response_t.headers,
+ * status and content_length are ignored. Output buffer is bypassed, bytes
+ * already buffered are sent first.
+ * @pre Headers are not flushed yet
+ */
+ssize_t dfk__http_response_write_prebuilt(dfk_http_response_t* resp,
+    dfk_iovec_t* iov, size_t niov);
@@ -0,0 +1,52 @@
+/**
+ * @file dfk/internal/middleware/fileserver.h
+ * Static files server - private functions
+ *
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#pragma once
+#include <stdint.h>
+#include <time.h>
+#include <dfk/misc.h>
+
+/** Maximum number of ranges served in a single multipart response */
+#define DFK_FILESERVER_MAX_RANGES 16
+
+/**
+ * A range of bytes requested by the client, both ends are inclusive
+ */
+typedef struct dfk_fileserver_range_t {
+  uint64_t first;
+  uint64_t last;
+} dfk_fileserver_range_t;
+
+/**
+ * Parse value of the Range header for a file of @p size bytes
+ *
+ * Unsatisfiable ranges are skipped, the remaining ones are clamped to
+ * the file size.
+ * @param ranges Array of at least DFK_FILESERVER_MAX_RANGES elements
+ * @returns Number of satisfiable ranges stored into @p ranges, or -1 if
+ * the header is malformed or contains more than DFK_FILESERVER_MAX_RANGES
+ * ranges. Invalid Range header is ignored, as permitted by RFC 7233.
+ */
+int dfk__fileserver_parse_range(dfk_buf_t value, uint64_t size,
+    dfk_fileserver_range_t* ranges);
+
+/**
+ * Parse HTTP-date in the preferred IMF-fixdate format
+ *
+ * @returns 0 if @p value is not a valid date.
+ */
+int dfk__fileserver_parse_date(dfk_buf_t value, time_t* res);
+
+/**
+ * Check if comma-separated list of entity tags contains @p etag
+ *
+ * Weak comparison is used, as required for If-None-Match.
+ */
+int dfk__fileserver_etag_match(const char* etag, size_t etaglen,
+    dfk_buf_t list);
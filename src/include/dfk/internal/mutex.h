@@ -0,0 +1,20 @@
+/**
+ * @file dfk/internal/mutex.h
+ * Contains private functions to deal with dfk_mutex_t.
+ *
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#pragma once
+#include <dfk/mutex.h>
+
+/**
+ * Same as dfk_mutex_unlock(), but switch to the next owner directly only
+ * if @p handoff is non-zero.
+ *
+ * Used by dfk_cond_wait - a fiber that is already enqueued to the wait
+ * queue of a condition variable can not be put to the run queue.
+ */
+void dfk__mutex_unlock(dfk_mutex_t* mutex, int handoff);
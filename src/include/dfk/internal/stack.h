@@ -0,0 +1,71 @@
+/**
+ * @file dfk/internal/stack.h
+ * Contains fiber stack allocation routines and a pool of reusable stacks.
+ *
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#pragma once
+#include <dfk/config.h>
+#include <dfk/context.h>
+#include <dfk/list.h>
+
+/**
+ * Fiber stack
+ *
+ * Memory layout, from lower to higher addresses:
+ * - guard pages (if #DFK_STACK_GUARD_SIZE is non-zero)
+ * - usable stack memory, [bottom, top)
+ * - dfk_stack_t object itself
+ */
+typedef struct dfk_stack_t {
+  /** Needed for the pool of spare stacks */
+  dfk_list_hook_t hook;
+  /** Beginning of the allocated memory region, including guard pages */
+  char* base;
+  /** Size of the allocated memory region */
+  size_t size;
+  /** Lowest usable address of the stack */
+  char* bottom;
+  /** Highest usable address of the stack */
+  char* top;
+} dfk_stack_t;
+
+/**
+ * Take a stack of @p size bytes from the pool, or allocate a new one
+ *
+ * @returns NULL and sets dfk->dfk_errno to dfk_err_nomem on failure
+ */
+dfk_stack_t* dfk__stack_alloc(dfk_t* dfk, size_t size);
+
+/**
+ * Return stack to the pool
+ *
+ * If the pool grows above dfk_t.stack_pool_high, it is shrunk down to
+ * dfk_t.stack_pool_low stacks. If #DFK_STACK is LAZY, memory of the stack
+ * pages deeper than dfk_t.stack_resident_size is released.
+ */
+void dfk__stack_free(dfk_t* dfk, dfk_stack_t* stack);
+
+/**
+ * Returns stack high-water mark - distance from the top of the stack to
+ * the lowest page that has ever been touched, in bytes
+ *
+ * Computed from page residency, therefore accurate up to a memory page.
+ * Returns the size of the whole stack if residency information is not
+ * available.
+ */
+size_t dfk__stack_hwm(dfk_stack_t* stack);
+
+/**
+ * Pre-allocate stacks of @p size bytes until the pool contains at least
+ * @p nstacks stacks.
+ */
+int dfk__stack_pool_reserve(dfk_t* dfk, size_t size, size_t nstacks);
+
+/**
+ * Release spare stacks until the pool contains at most @p nstacks stacks
+ */
+void dfk__stack_pool_shrink(dfk_t* dfk, size_t nstacks);
@@ -0,0 +1,22 @@
+/**
+ * @file dfk/internal/tcp_socket.h
+ * Contains private functions to deal with dfk_tcp_socket_t.
+ *
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#pragma once
+#include <dfk/tcp_socket.h>
+
+/**
+ * Same as dfk_tcp_socket_listen(), but also update accept loop counters
+ *
+ * @param stats Counters to update, can be NULL
+ */
+int dfk__tcp_socket_listen(dfk_tcp_socket_t* sock,
+    const char* endpoint, uint16_t port,
+    void (*callback)(dfk_fiber_t*, dfk_tcp_socket_t*, dfk_userdata_t),
+    dfk_userdata_t callback_ud, size_t backlog,
+    dfk_tcp_accept_stats_t* stats);
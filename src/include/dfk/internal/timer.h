@@ -0,0 +1,100 @@
+/**
+ * @file dfk/internal/timer.h
+ * Contains hierarchical timer wheel used by event loops.
+ *
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#pragma once
+#include <stdint.h>
+#include <dfk/config.h>
+#include <dfk/list.h>
+
+/** Duration of a single wheel tick, in nanoseconds */
+#define DFK_TIMER_RESOLUTION 1000000ULL
+
+/** log2 of the number of slots per wheel level */
+#define DFK_TIMER_WHEEL_BITS 6
+
+/** Number of slots per wheel level */
+#define DFK_TIMER_WHEEL_SIZE (1 << DFK_TIMER_WHEEL_BITS)
+
+/**
+ * Number of wheel levels
+ *
+ * Level N covers DFK_TIMER_WHEEL_SIZE^(N + 1) ticks, timers expiring
+ * later than that are parked in the last level and cascaded down as many
+ * times as needed.
+ */
+#define DFK_TIMER_WHEEL_LEVELS 4
+
+struct dfk_timer_t;
+
+typedef void (*dfk_timer_callback)(struct dfk_timer_t*);
+
+/**
+ * A timer, generally allocated on the stack of the waiting fiber
+ */
+typedef struct dfk_timer_t {
+  dfk_list_hook_t hook;
+  /** Wheel slot the timer belongs to, NULL if the timer is not armed */
+  dfk_list_t* slot;
+  /** Expiration time, in wheel ticks */
+  uint64_t expires;
+  /** Called by the event loop once the timer has expired */
+  dfk_timer_callback callback;
+  void* arg;
+} dfk_timer_t;
+
+typedef struct dfk_timer_wheel_t {
+  /** Monotonic time of tick 0, in nanoseconds */
+  uint64_t origin;
+  /** Next tick to be processed */
+  uint64_t now;
+  /** Number of armed timers */
+  size_t ntimers;
+  dfk_list_t slots[DFK_TIMER_WHEEL_LEVELS][DFK_TIMER_WHEEL_SIZE];
+} dfk_timer_wheel_t;
+
+/**
+ * Returns monotonic time, in nanoseconds
+ */
+uint64_t dfk__clock(void);
+
+void dfk__timer_init(dfk_timer_t* timer, dfk_timer_callback callback,
+    void* arg);
+
+void dfk__timer_wheel_init(dfk_timer_wheel_t* wheel);
+
+/**
+ * Arm the timer to expire at @p deadline, nanoseconds of monotonic time
+ *
+ * @pre Timer is not armed
+ */
+void dfk__timer_wheel_add(dfk_timer_wheel_t* wheel, dfk_timer_t* timer,
+    uint64_t deadline);
+
+/**
+ * Disarm the timer
+ *
+ * Does nothing if timer has already expired, or has never been armed.
+ */
+void dfk__timer_wheel_del(dfk_timer_wheel_t* wheel, dfk_timer_t* timer);
+
+/**
+ * Call callbacks of all timers that have expired by @p now
+ *
+ * Callbacks are called in the event loop fiber, therefore they should not
+ * block or arm new timers.
+ */
+void dfk__timer_wheel_advance(dfk_timer_wheel_t* wheel, uint64_t now);
+
+/**
+ * Returns number of nanoseconds the event loop may sleep without missing
+ * a timer, or -1 if no timers are armed.
+ *
+ * Returned value never exceeds one revolution of the lowest wheel level.
+ */
+int64_t dfk__timer_wheel_timeout(dfk_timer_wheel_t* wheel, uint64_t now);
@@ -6,7 +6,21 @@
 
 #pragma once
 #include <sys/types.h>
+#include <stdint.h>
 #include <dfk/context.h>
 
-ssize_t dfk__read(dfk_t* dfk, void* dfkhandle, int sock, char* buf, size_t nbytes);
+struct dfk_io_watch_t;
+
+/**
+ * Read from the non-blocking file descriptor, suspend if no data is available
+ *
+ * @param watch Registration of the descriptor in the event loop, or NULL
+ * if the descriptor is not registered. Ignored if #DFK_IO_WATCH is disabled.
+ * @param deadline Monotonic time, in nanoseconds, to give up waiting at.
+ * Zero value means no deadline. dfk_t.dfk_errno is set to dfk_err_timeout
+ * if the deadline has expired.
+ */
+ssize_t dfk__read(dfk_t* dfk, void* dfkhandle, int sock,
+    struct dfk_io_watch_t* watch, char* buf, size_t nbytes,
+    uint64_t deadline);
 
@@ -18,8 +18,10 @@
  * - dfk__terminate
  * - dfk__yielded
  * - dfk__this_fiber
+ * - dfk__this_eventloop
  * - dfk__suspend
  * - dfk__postpone
+ * - dfk__handoff
  */
 
 /**
@@ -54,6 +56,13 @@ void dfk__yielded(struct dfk_scheduler_t* scheduler, dfk_fiber_t* from,
  */
 dfk_fiber_t* dfk__this_fiber(struct dfk_scheduler_t* scheduler);
 
+/**
+ * Returns an eventloop that serves I/O requests of the current fiber
+ *
+ * @warning Returned value is valid only until the next context switch.
+ */
+struct dfk_eventloop_t* dfk__this_eventloop(struct dfk_scheduler_t* scheduler);
+
 /**
  * Suspend current fiber.
  *
@@ -85,3 +94,11 @@ void dfk__ioresume(struct dfk_scheduler_t* scheduler, dfk_fiber_t* fiber);
  */
 void dfk__postpone(struct dfk_scheduler_t* scheduler);
 
+/**
+ * Switch to the @p fiber directly, postpone current fiber.
+ *
+ * Falls back to dfk__resume if dfk_t.handoff_limit consecutive handoffs
+ * have been made since the scheduler had control last time.
+ */
+void dfk__handoff(struct dfk_scheduler_t* scheduler, dfk_fiber_t* fiber);
+
@@ -0,0 +1,192 @@
+/**
+ * @file mailbox.c
+ *
+ * Contains dfk_mailbox_t - a channel for waking fibers up from foreign
+ * threads.
+ *
+ * Producers push messages onto a lock-free stack with a compare-and-swap
+ * loop. Only a producer that has found the stack empty writes to the
+ * eventfd, therefore a batch of messages costs a single syscall. The
+ * dispatcher fiber takes the whole stack at once, reverses it to restore
+ * posting order and resumes receivers.
+ *
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LISENSE)
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <dfk/mailbox.h>
+#include <dfk/error.h>
+#include <dfk/internal.h>
+#include <dfk/read.h>
+#include <dfk/close.h>
+
+#if DFK_THREADS
+#define DFK_MAILBOX_GUARD(mailbox) pthread_mutex_lock(&(mailbox)->_guard)
+#define DFK_MAILBOX_UNGUARD(mailbox) pthread_mutex_unlock(&(mailbox)->_guard)
+#else
+#define DFK_MAILBOX_GUARD(mailbox)
+#define DFK_MAILBOX_UNGUARD(mailbox)
+#endif
+
+int dfk_mailbox_init(dfk_mailbox_t* mailbox, dfk_t* dfk)
+{
+  assert(mailbox);
+  assert(dfk);
+  mailbox->dfk = dfk;
+  atomic_init(&mailbox->_head, NULL);
+  mailbox->_nwaiting = 0;
+  mailbox->_dispatching = 0;
+  mailbox->_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (mailbox->_eventfd == -1) {
+    DFK_ERROR_SYSCALL(dfk, "eventfd");
+    return dfk_err_sys;
+  }
+#if DFK_THREADS
+  pthread_mutex_init(&mailbox->_guard, NULL);
+#endif
+  DFK_DBG(dfk, "{%p} eventfd %d", (void*) mailbox, mailbox->_eventfd);
+  return dfk_err_ok;
+}
+
+int dfk_mailbox_free(dfk_mailbox_t* mailbox)
+{
+  assert(mailbox);
+  DFK_DBG(mailbox->dfk, "{%p}", (void*) mailbox);
+#if DFK_THREADS
+  /* Wait until the dispatcher releases the guard */
+  pthread_mutex_lock(&mailbox->_guard);
+  assert(!mailbox->_nwaiting && "attempt to free busy mailbox");
+  pthread_mutex_unlock(&mailbox->_guard);
+  pthread_mutex_destroy(&mailbox->_guard);
+#else
+  assert(!mailbox->_nwaiting && "attempt to free busy mailbox");
+#endif
+  return dfk__close(mailbox->dfk, mailbox, mailbox->_eventfd);
+}
+
+void dfk_mailbox_msg_init(dfk_mailbox_msg_t* msg)
+{
+  assert(msg);
+  msg->_next = NULL;
+  msg->_fiber = NULL;
+  msg->_delivered = 0;
+}
+
+/**
+ * Receive posted messages and resume fibers waiting for them
+ *
+ * Runs until there are no waiting fibers left.
+ */
+static void dfk__mailbox_dispatch(dfk_fiber_t* fiber, void* arg)
+{
+  dfk_mailbox_t* mailbox = (dfk_mailbox_t*) arg;
+  dfk_t* dfk = fiber->dfk;
+  int done = 0;
+  while (!done) {
+    uint64_t counter;
+    ssize_t nread = dfk__read(dfk, mailbox, mailbox->_eventfd, NULL,
+        (char*) &counter, sizeof(counter), 0);
+    if (nread < 0) {
+      DFK_ERROR(dfk, "{%p} can not read eventfd", (void*) mailbox);
+    }
+    /* Take all posted messages at once, restore posting order */
+    dfk_mailbox_msg_t* msg = atomic_exchange(&mailbox->_head, NULL);
+    dfk_mailbox_msg_t* received = NULL;
+    while (msg) {
+      dfk_mailbox_msg_t* next = msg->_next;
+      msg->_next = received;
+      received = msg;
+      msg = next;
+    }
+    size_t nresumed = 0;
+    DFK_MAILBOX_GUARD(mailbox);
+    while (received) {
+      /* Message could be released as soon as its fiber is resumed */
+      dfk_mailbox_msg_t* next = received->_next;
+      received->_delivered = 1;
+      if (received->_fiber) {
+        DFK_RESUME(received->_fiber);
+        mailbox->_nwaiting--;
+        nresumed++;
+      }
+      received = next;
+    }
+    done = !mailbox->_nwaiting;
+    if (done) {
+      mailbox->_dispatching = 0;
+    }
+    DFK_MAILBOX_UNGUARD(mailbox);
+    DFK_DBG(dfk, "{%p} resumed %lu fiber(s), %s", (void*) mailbox,
+        (unsigned long) nresumed, done ? "done" : "continue");
+  }
+}
+
+int dfk_mailbox_wait(dfk_mailbox_t* mailbox, dfk_mailbox_msg_t* msg)
+{
+  assert(mailbox);
+  assert(msg);
+  dfk_t* dfk = mailbox->dfk;
+  dfk_fiber_t* this = DFK_THIS_FIBER(dfk);
+  DFK_MAILBOX_GUARD(mailbox);
+  if (msg->_delivered) {
+    DFK_MAILBOX_UNGUARD(mailbox);
+    DFK_DBG(dfk, "{%p} message %p is already received", (void*) mailbox,
+        (void*) msg);
+    return dfk_err_ok;
+  }
+  if (!mailbox->_dispatching) {
+    dfk_fiber_t* dispatcher = dfk_spawn(dfk, dfk__mailbox_dispatch,
+        mailbox, 0);
+    if (!dispatcher) {
+      DFK_MAILBOX_UNGUARD(mailbox);
+      DFK_ERROR(dfk, "{%p} can not spawn dispatcher fiber", (void*) mailbox);
+      return dfk->dfk_errno;
+    }
+    dfk_fiber_name(dispatcher, "mailbox");
+    /* Completions are delivered ahead of regular fibers */
+    dfk_fiber_priority(dispatcher, dfk_fiber_priority_control);
+    mailbox->_dispatching = 1;
+  }
+  msg->_fiber = this;
+  mailbox->_nwaiting++;
+  DFK_MAILBOX_UNGUARD(mailbox);
+  DFK_DBG(dfk, "{%p} {%p} waits for message %p", (void*) mailbox,
+      (void*) this, (void*) msg);
+  DFK_SUSPEND(dfk);
+  return dfk_err_ok;
+}
+
+int dfk_mailbox_post(dfk_mailbox_t* mailbox, dfk_mailbox_msg_t* msg)
+{
+  assert(mailbox);
+  assert(msg);
+  dfk_mailbox_msg_t* head = atomic_load(&mailbox->_head);
+  do {
+    msg->_next = head;
+  } while (!atomic_compare_exchange_weak(&mailbox->_head, &head, msg));
+  if (head) {
+    /* Stack was not empty, eventfd has been already signalled */
+    return dfk_err_ok;
+  }
+  uint64_t one = 1;
+  if (write(mailbox->_eventfd, &one, sizeof(one)) != sizeof(one)) {
+    DFK_ERROR_SYSCALL(mailbox->dfk, "write");
+    return dfk_err_sys;
+  }
+  return dfk_err_ok;
+}
+
+size_t dfk_mailbox_sizeof(void)
+{
+  return sizeof(dfk_mailbox_t);
+}
+
+size_t dfk_mailbox_msg_sizeof(void)
+{
+  return sizeof(dfk_mailbox_msg_t);
+}
@@ -4,22 +4,145 @@
  * Licensed under the MIT License (see LICENSE)
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/dir.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <dfk/config.h>
 #include <dfk/error.h>
+#include <dfk/blocking.h>
 #include <dfk/middleware/fileserver.h>
 #include <dfk/internal.h>
+#include <dfk/internal/http/response.h>
+#include <dfk/internal/middleware/fileserver.h>
+
+#define FILESERVER_HEADER(request, name) \
+  dfk_strmap_get(&(request)->headers, (name), sizeof(name) - 1)
+
+/**
+ * Content codings of the precompressed variants
+ */
+typedef enum fileserver_encoding_e {
+  FILESERVER_IDENTITY = 0,
+  FILESERVER_GZIP,
+  FILESERVER_BR,
+  _FILESERVER_NENCODINGS
+} fileserver_encoding_e;
+
+/** Content-Encoding header values, indexed by fileserver_encoding_e */
+static const char* const fileserver_encoding_names[] = {NULL, "gzip", "br"};
+
+/** File name suffixes of the variants, indexed by fileserver_encoding_e */
+static const char* const fileserver_encoding_suffixes[] = {NULL, ".gz", ".br"};
+
+/** Maximum length of a suffix in fileserver_encoding_suffixes */
+#define FILESERVER_SUFFIX_MAX 3
+
+#define TO_ENTRY(expr) DFK_CONTAINER_OF((expr), fileserver_entry_t, hook)
+#define LRU_TO_ENTRY(expr) DFK_CONTAINER_OF((expr), fileserver_entry_t, lru)
+#define TO_VARIANTS(expr) DFK_CONTAINER_OF((expr), fileserver_variants_t, hook)
+#define LRU_TO_VARIANTS(expr) \
+  DFK_CONTAINER_OF((expr), fileserver_variants_t, lru)
+
+/**
+ * A file or a directory being served
+ *
+ * Entries are kept in the dfk_fileserver_t cache and shared between
+ * requests, including requests served by other threads. Entry is released
+ * when it is evicted from the cache and the last request using it
+ * completes.
+ */
+typedef struct fileserver_entry_t {
+  dfk_avltree_hook_t hook;
+  dfk_list_hook_t lru;
+  /** NULL-terminated full path, allocated together with the entry */
+  char* path;
+  size_t pathlen;
+  /** Entry is a precompressed variant of another file, if not identity */
+  fileserver_encoding_e encoding;
+  /**
+   * Precompressed variants found next to an identity-encoded regular file,
+   * a bit (1 << encoding) is set for each of them
+   */
+  unsigned variants;
+  struct stat statinfo;
+  /** Descriptor of a regular file, -1 for directories */
+  int fd;
+  /** Rendered index page of a directory */
+  char* body;
+  size_t bodysize;
+  char etag[64];
+  size_t etaglen;
+  char last_modified[64];
+  size_t last_modified_len;
+  /** Pre-built response of a small file, NULL if not kept in memory */
+  char* response;
+  size_t responsesize;
+  /** Entry is revalidated after this moment, see dfk_now() */
+  uint64_t expires;
+  /** Number of requests using the entry */
+  size_t nrefs;
+  /** Entry is in the cache */
+  int cached;
+} fileserver_entry_t;
+
+/**
+ * Precompressed variants found next to a regular file
+ *
+ * Records are kept in the variants cache of dfk_fileserver_t, which is
+ * independent of the open file cache.
+ */
+typedef struct fileserver_variants_t {
+  dfk_avltree_hook_t hook;
+  dfk_list_hook_t lru;
+  /** Path of the identity-encoded file, allocated together with the record */
+  char* path;
+  size_t pathlen;
+  /** A bit (1 << encoding) is set for each variant */
+  unsigned variants;
+  /** Record is revalidated after this moment, see dfk_now() */
+  uint64_t expires;
+} fileserver_variants_t;
+
+/**
+ * Key of the fileserver cache
+ */
+typedef struct fileserver_key_t {
+  const char* path;
+  size_t pathlen;
+  fileserver_encoding_e encoding;
+} fileserver_key_t;
 
 typedef struct dirent_list_item_t {
   dfk_list_hook_t hook;
   struct dirent de;
 } dirent_list_item_t;
 
+/**
+ * Arguments and results of the filesystem calls offloaded by
+ * dfk_blocking_call()
+ */
+typedef struct fileserver_io_t {
+  const char* path;
+  struct stat* statinfo;
+  int fd;
+  char* buf;
+  size_t size;
+  /** Used by readdir_call to allocate list items */
+  dfk_arena_t* arena;
+  dfk_list_t* filelist;
+  /** Result of the call, -1 or NULL indicate an error */
+  ssize_t ret;
+  int err;
+} fileserver_io_t;
+
 static const char autoindex_header_1[] =
   "<html>\n"
   "  <head>\n"
@@ -55,6 +178,1152 @@ static int ignore_file(struct dirent* de)
 #endif
 }
 
+static void stat_call(void* arg)
+{
+  fileserver_io_t* io = (fileserver_io_t*) arg;
+  io->ret = stat(io->path, io->statinfo);
+  io->err = errno;
+}
+
+/**
+ * Open io->path and fstat the descriptor into io->statinfo
+ *
+ * Metadata is taken from the opened descriptor, so that it matches the
+ * contents being served even if the path is replaced concurrently.
+ */
+static void open_call(void* arg)
+{
+  fileserver_io_t* io = (fileserver_io_t*) arg;
+  io->fd = open(io->path, O_RDONLY | O_CLOEXEC);
+  io->err = errno;
+  if (io->fd != -1 && fstat(io->fd, io->statinfo) == -1) {
+    io->err = errno;
+    close(io->fd);
+    io->fd = -1;
+  }
+}
+
+/**
+ * Look for precompressed variants of io->path, store bitmask into io->ret
+ *
+ * io->buf should be large enough to store the path with the longest suffix.
+ */
+static void probe_call(void* arg)
+{
+  fileserver_io_t* io = (fileserver_io_t*) arg;
+  memcpy(io->buf, io->path, io->size);
+  io->ret = 0;
+  for (int i = FILESERVER_IDENTITY + 1; i < _FILESERVER_NENCODINGS; ++i) {
+    strcpy(io->buf + io->size, fileserver_encoding_suffixes[i]);
+    struct stat st;
+    if (!stat(io->buf, &st) && S_ISREG(st.st_mode)) {
+      io->ret |= 1 << i;
+    }
+  }
+}
+
+static void pread_call(void* arg)
+{
+  fileserver_io_t* io = (fileserver_io_t*) arg;
+  size_t nread = 0;
+  io->ret = 0;
+  while (nread < io->size) {
+    ssize_t ret = pread(io->fd, io->buf + nread, io->size - nread, nread);
+    if (ret <= 0) {
+      io->ret = -1;
+      io->err = ret ? errno : EIO;
+      return;
+    }
+    nread += ret;
+  }
+}
+
+/**
+ * Read the whole directory into io->filelist
+ *
+ * Calling fiber is suspended meanwhile, so that the request arena is not
+ * accessed concurrently.
+ */
+static void readdir_call(void* arg)
+{
+  fileserver_io_t* io = (fileserver_io_t*) arg;
+  io->ret = -1;
+  DIR* dp = opendir(io->path);
+  if (dp == NULL) {
+    io->err = errno;
+    return;
+  }
+  struct dirent* res;
+  do {
+    dirent_list_item_t* dei = dfk_arena_alloc(io->arena, sizeof(dirent_list_item_t));
+    if (!dei) {
+      io->err = ENOMEM;
+      closedir(dp);
+      return;
+    }
+    dfk_list_hook_init(&dei->hook);
+    do {
+      int err = readdir_r(dp, &dei->de, &res);
+      if (err != 0) {
+        io->err = err;
+        closedir(dp);
+        return;
+      }
+      if (res && !ignore_file(res)) {
+        assert(res == &dei->de);
+        dfk_list_append(io->filelist, &dei->hook);
+        break;
+      }
+    } while (res);
+  } while (res);
+  closedir(dp);
+  io->ret = 0;
+}
+
+static int fileserver_path_cmp(const char* l, size_t llen,
+    const char* r, size_t rlen)
+{
+  int res = memcmp(l, r, DFK_MIN(llen, rlen));
+  if (res) {
+    return res;
+  }
+  return (llen > rlen) - (llen < rlen);
+}
+
+static int fileserver_entry_lookup_cmp(dfk_avltree_hook_t* l, void* r)
+{
+  assert(l);
+  assert(r);
+  fileserver_entry_t* entry = TO_ENTRY(l);
+  fileserver_key_t* key = (fileserver_key_t*) r;
+  int res = fileserver_path_cmp(entry->path, entry->pathlen,
+      key->path, key->pathlen);
+  if (res) {
+    return res;
+  }
+  /* File foo.gz requested directly is not the gzip variant of foo */
+  return (int) entry->encoding - (int) key->encoding;
+}
+
+static int fileserver_entry_cmp(dfk_avltree_hook_t* l, dfk_avltree_hook_t* r)
+{
+  assert(r);
+  fileserver_entry_t* entry = TO_ENTRY(r);
+  fileserver_key_t key = {entry->path, entry->pathlen, entry->encoding};
+  return fileserver_entry_lookup_cmp(l, &key);
+}
+
+static int fileserver_variants_lookup_cmp(dfk_avltree_hook_t* l, void* r)
+{
+  assert(l);
+  assert(r);
+  fileserver_variants_t* rec = TO_VARIANTS(l);
+  fileserver_key_t* key = (fileserver_key_t*) r;
+  return fileserver_path_cmp(rec->path, rec->pathlen, key->path, key->pathlen);
+}
+
+static int fileserver_variants_cmp(dfk_avltree_hook_t* l, dfk_avltree_hook_t* r)
+{
+  assert(r);
+  fileserver_variants_t* rec = TO_VARIANTS(r);
+  fileserver_key_t key = {rec->path, rec->pathlen, FILESERVER_IDENTITY};
+  return fileserver_variants_lookup_cmp(l, &key);
+}
+
+static void fileserver_lock(dfk_fileserver_t* fs)
+{
+#if DFK_THREADS
+  pthread_mutex_lock(&fs->_cache_lock);
+#else
+  DFK_UNUSED(fs);
+#endif
+}
+
+static void fileserver_unlock(dfk_fileserver_t* fs)
+{
+#if DFK_THREADS
+  pthread_mutex_unlock(&fs->_cache_lock);
+#else
+  DFK_UNUSED(fs);
+#endif
+}
+
+static void fileserver_entry_free(dfk_fileserver_t* fs, fileserver_entry_t* entry)
+{
+  assert(!entry->nrefs);
+  assert(!entry->cached);
+  DFK_DBG(fs->dfk, "{%p} release '%s'", (void*) fs, entry->path);
+  if (entry->fd != -1) {
+    close(entry->fd);
+  }
+  if (entry->body) {
+    fs->dfk->free(fs->dfk, entry->body);
+  }
+  if (entry->response) {
+    fs->dfk->free(fs->dfk, entry->response);
+  }
+  fs->dfk->free(fs->dfk, entry);
+}
+
+/**
+ * Remove entry from the cache, release it if not used
+ *
+ * @pre Cache lock is held
+ */
+static void fileserver_uncache(dfk_fileserver_t* fs, fileserver_entry_t* entry)
+{
+  assert(entry->cached);
+  dfk_avltree_erase(&fs->_cache, &entry->hook);
+  dfk_list_it it;
+  dfk_list_it_from_value(&fs->_cache_lru, &entry->lru, &it);
+  dfk_list_erase(&fs->_cache_lru, &it);
+  fs->_cache_nentries--;
+  fs->_cache_nbytes -= entry->responsesize;
+  entry->cached = 0;
+  if (!entry->nrefs) {
+    fileserver_entry_free(fs, entry);
+  }
+}
+
+/**
+ * Find an up to date cache entry for @p path and acquire it
+ *
+ * Returns NULL if entry is not found.
+ */
+static fileserver_entry_t* fileserver_lookup(dfk_fileserver_t* fs,
+    const char* path, size_t pathlen, fileserver_encoding_e encoding)
+{
+  if (!fs->cache_size) {
+    return NULL;
+  }
+  uint64_t now = dfk_now(fs->dfk);
+  fileserver_key_t key = {path, pathlen, encoding};
+  fileserver_entry_t* entry = NULL;
+  fileserver_lock(fs);
+  dfk_avltree_hook_t* hook = dfk_avltree_find(&fs->_cache, &key,
+      fileserver_entry_lookup_cmp);
+  if (hook) {
+    entry = TO_ENTRY(hook);
+    if (entry->expires <= now) {
+      DFK_DBG(fs->dfk, "{%p} '%s' is expired", (void*) fs, path);
+      fileserver_uncache(fs, entry);
+      entry = NULL;
+    } else {
+      DFK_DBG(fs->dfk, "{%p} '%s' is found in cache", (void*) fs, path);
+      entry->nrefs++;
+      dfk_list_it it;
+      dfk_list_it_from_value(&fs->_cache_lru, &entry->lru, &it);
+      dfk_list_erase(&fs->_cache_lru, &it);
+      dfk_list_prepend(&fs->_cache_lru, &entry->lru);
+    }
+  }
+  fileserver_unlock(fs);
+  return entry;
+}
+
+/**
+ * Put a freshly loaded entry into the cache, evict least recently used ones
+ */
+static void fileserver_cache(dfk_fileserver_t* fs, fileserver_entry_t* entry)
+{
+  assert(fs->cache_size);
+  entry->expires = dfk_now(fs->dfk) + fs->cache_ttl * 1000000;
+  fileserver_key_t key = {entry->path, entry->pathlen, entry->encoding};
+  fileserver_lock(fs);
+  dfk_avltree_hook_t* hook = dfk_avltree_find(&fs->_cache, &key,
+      fileserver_entry_lookup_cmp);
+  if (hook) {
+    /* Loaded concurrently by another request, keep the newest one */
+    fileserver_uncache(fs, TO_ENTRY(hook));
+  }
+  dfk_avltree_insert(&fs->_cache, &entry->hook);
+  dfk_list_prepend(&fs->_cache_lru, &entry->lru);
+  fs->_cache_nentries++;
+  fs->_cache_nbytes += entry->responsesize;
+  entry->cached = 1;
+  while (fs->_cache_nentries > fs->cache_size
+      || fs->_cache_nbytes > fs->cache_memory) {
+    fileserver_entry_t* lru = LRU_TO_ENTRY(dfk_list_back(&fs->_cache_lru));
+    assert(lru != entry);
+    DFK_DBG(fs->dfk, "{%p} evict '%s'", (void*) fs, lru->path);
+    fileserver_uncache(fs, lru);
+  }
+  fileserver_unlock(fs);
+}
+
+static void fileserver_release(dfk_fileserver_t* fs, fileserver_entry_t* entry)
+{
+  fileserver_lock(fs);
+  assert(entry->nrefs);
+  entry->nrefs--;
+  int unused = !entry->nrefs && !entry->cached;
+  fileserver_unlock(fs);
+  if (unused) {
+    fileserver_entry_free(fs, entry);
+  }
+}
+
+/**
+ * Remove record from the variants cache and release it
+ *
+ * @pre Cache lock is held
+ */
+static void fileserver_variants_uncache(dfk_fileserver_t* fs,
+    fileserver_variants_t* rec)
+{
+  dfk_avltree_erase(&fs->_variants, &rec->hook);
+  dfk_list_it it;
+  dfk_list_it_from_value(&fs->_variants_lru, &rec->lru, &it);
+  dfk_list_erase(&fs->_variants_lru, &it);
+  fs->_variants_nentries--;
+  fs->dfk->free(fs->dfk, rec);
+}
+
+/**
+ * Find out which variants of @p path exist from the variants cache
+ *
+ * Returns 0 if there is no up to date record for @p path.
+ */
+static int fileserver_variants_lookup(dfk_fileserver_t* fs, const char* path,
+    size_t pathlen, unsigned* variants)
+{
+  if (!fs->variants_cache_size) {
+    return 0;
+  }
+  uint64_t now = dfk_now(fs->dfk);
+  fileserver_key_t key = {path, pathlen, FILESERVER_IDENTITY};
+  int found = 0;
+  fileserver_lock(fs);
+  dfk_avltree_hook_t* hook = dfk_avltree_find(&fs->_variants, &key,
+      fileserver_variants_lookup_cmp);
+  if (hook) {
+    fileserver_variants_t* rec = TO_VARIANTS(hook);
+    if (rec->expires <= now) {
+      fileserver_variants_uncache(fs, rec);
+    } else {
+      *variants = rec->variants;
+      found = 1;
+      dfk_list_it it;
+      dfk_list_it_from_value(&fs->_variants_lru, &rec->lru, &it);
+      dfk_list_erase(&fs->_variants_lru, &it);
+      dfk_list_prepend(&fs->_variants_lru, &rec->lru);
+    }
+  }
+  fileserver_unlock(fs);
+  return found;
+}
+
+/**
+ * Put variants of @p path into the variants cache, evict least recently
+ * used records
+ *
+ * Failure is not fatal, variants are looked up on disk next time.
+ */
+static void fileserver_variants_cache(dfk_fileserver_t* fs, const char* path,
+    size_t pathlen, unsigned variants)
+{
+  if (!fs->variants_cache_size) {
+    return;
+  }
+  fileserver_variants_t* rec = fs->dfk->malloc(fs->dfk,
+      sizeof(fileserver_variants_t) + pathlen + 1);
+  if (!rec) {
+    return;
+  }
+  dfk_avltree_hook_init(&rec->hook);
+  dfk_list_hook_init(&rec->lru);
+  rec->path = (char*) (rec + 1);
+  memcpy(rec->path, path, pathlen);
+  rec->path[pathlen] = '\0';
+  rec->pathlen = pathlen;
+  rec->variants = variants;
+  rec->expires = dfk_now(fs->dfk) + fs->cache_ttl * 1000000;
+  fileserver_key_t key = {path, pathlen, FILESERVER_IDENTITY};
+  fileserver_lock(fs);
+  dfk_avltree_hook_t* hook = dfk_avltree_find(&fs->_variants, &key,
+      fileserver_variants_lookup_cmp);
+  if (hook) {
+    /* Probed concurrently by another request, keep the newest one */
+    fileserver_variants_uncache(fs, TO_VARIANTS(hook));
+  }
+  dfk_avltree_insert(&fs->_variants, &rec->hook);
+  dfk_list_prepend(&fs->_variants_lru, &rec->lru);
+  fs->_variants_nentries++;
+  while (fs->_variants_nentries > fs->variants_cache_size) {
+    fileserver_variants_uncache(fs,
+        LRU_TO_VARIANTS(dfk_list_back(&fs->_variants_lru)));
+  }
+  fileserver_unlock(fs);
+}
+
+/**
+ * Render index page of the directory into entry->body
+ */
+static dfk_http_status_e fileserver_autoindex(dfk_fileserver_t* fs,
+    dfk_http_request_t* request, fileserver_entry_t* entry)
+{
+  dfk_list_t filelist;
+  dfk_list_init(&filelist);
+  fileserver_io_t io = {
+    .path = entry->path,
+    .arena = request->_request_arena,
+    .filelist = &filelist
+  };
+  if (dfk_blocking_call(fs->dfk, readdir_call, &io) != dfk_err_ok
+      || io.ret == -1) {
+    return DFK_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  size_t niov = 6 + 6 * dfk_list_size(&filelist);
+  int add_separator_after_path = request->path.data[request->path.size - 1] != '/';
+  if (add_separator_after_path) {
+    niov += dfk_list_size(&filelist);
+  }
+  dfk_iovec_t* iov = dfk_arena_alloc(request->_request_arena, niov * sizeof(dfk_iovec_t));
+  if (!iov) {
+    return DFK_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  size_t iiov = 0;
+  iov[iiov++] = (dfk_iovec_t) {(char*) autoindex_header_1, DFK_SIZE(autoindex_header_1) - 1};
+  iov[iiov++] = (dfk_iovec_t) {request->path.data, request->path.size};
+  iov[iiov++] = (dfk_iovec_t) {(char*) autoindex_header_2, DFK_SIZE(autoindex_header_2) - 1};
+  iov[iiov++] = (dfk_iovec_t) {request->path.data, request->path.size};
+  iov[iiov++] = (dfk_iovec_t) {(char*) autoindex_header_3, DFK_SIZE(autoindex_header_3) - 1};
+  dfk_list_it it, end;
+  dfk_list_begin(&filelist, &it);
+  dfk_list_end(&filelist, &end);
+  while (!dfk_list_it_equal(&it, &end)) {
+    dirent_list_item_t* i = (dirent_list_item_t*) it.value;
+    iov[iiov++] = (dfk_iovec_t) {"      <li><a href=\"", 19};
+    iov[iiov++] = (dfk_iovec_t) {request->path.data, request->path.size};
+    if (add_separator_after_path) {
+      iov[iiov++] = (dfk_iovec_t) {"/", 1};
+    }
+#if __APPLE__
+    const size_t namelen = i->de.d_namlen;
+#else
+    const size_t namelen = strnlen(i->de.d_name, sizeof(i->de.d_name));
+#endif
+    iov[iiov++] = (dfk_iovec_t) {i->de.d_name, namelen};
+    iov[iiov++] = (dfk_iovec_t) {"\">", 2};
+    iov[iiov++] = (dfk_iovec_t) {i->de.d_name, namelen};
+    iov[iiov++] = (dfk_iovec_t) {"</a></li>\n", 10};
+    dfk_list_it_next(&it);
+  }
+  iov[iiov++] = (dfk_iovec_t) {(char*) autoindex_footer, DFK_SIZE(autoindex_footer) - 1};
+  /* Page is kept in a single buffer to be served from the cache */
+  size_t bodysize = 0;
+  for (size_t i = 0; i < niov; ++i) {
+    bodysize += iov[i].size;
+  }
+  entry->body = fs->dfk->malloc(fs->dfk, bodysize);
+  if (!entry->body) {
+    DFK_ERROR(fs->dfk, "out of memory");
+    return DFK_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  for (size_t i = 0; i < niov; ++i) {
+    memcpy(entry->body + entry->bodysize, iov[i].data, iov[i].size);
+    entry->bodysize += iov[i].size;
+  }
+  return DFK_HTTP_OK;
+}
+
+/**
+ * Open a regular file, read its metadata, and render validators
+ *
+ * entry->statinfo is overwritten with the metadata of the opened file.
+ */
+static dfk_http_status_e fileserver_open(dfk_fileserver_t* fs,
+    fileserver_entry_t* entry)
+{
+  struct stat* st = &entry->statinfo;
+  fileserver_io_t io = {.path = entry->path, .statinfo = st};
+  if (dfk_blocking_call(fs->dfk, open_call, &io) != dfk_err_ok) {
+    return DFK_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  if (io.fd == -1) {
+    if (io.err == ENOENT || io.err == ENOTDIR) {
+      /* Removed since stat */
+      return DFK_HTTP_NOT_FOUND;
+    }
+    fs->dfk->sys_errno = io.err;
+    DFK_ERROR(fs->dfk, "can not open file '%s': %s", entry->path,
+        dfk_strerr(fs->dfk, dfk_err_sys));
+    return DFK_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  entry->fd = io.fd;
+  if (!S_ISREG(st->st_mode)) {
+    /* Replaced by a directory or a special file since stat */
+    DFK_DBG(fs->dfk, "{%p} '%s' is not a regular file", (void*) fs,
+        entry->path);
+    return DFK_HTTP_NOT_FOUND;
+  }
+  entry->etaglen = snprintf(entry->etag, sizeof(entry->etag),
+      "\"%llx-%llx-%llx\"", (unsigned long long) st->st_ino,
+      (unsigned long long) st->st_mtime, (unsigned long long) st->st_size);
+  struct tm tm;
+  gmtime_r(&st->st_mtime, &tm);
+  entry->last_modified_len = strftime(entry->last_modified,
+      sizeof(entry->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return DFK_HTTP_OK;
+}
+
+/**
+ * Find out which precompressed variants of a regular file exist
+ *
+ * Variants cache is consulted first, disk is probed on cache miss. Failure
+ * is not fatal, identity-encoded file is sent in that case.
+ */
+static void fileserver_probe(dfk_fileserver_t* fs, dfk_http_request_t* request,
+    fileserver_entry_t* entry)
+{
+  if (fileserver_variants_lookup(fs, entry->path, entry->pathlen,
+        &entry->variants)) {
+    return;
+  }
+  fileserver_io_t io = {
+    .path = entry->path,
+    .buf = dfk_arena_alloc(request->_request_arena,
+        entry->pathlen + FILESERVER_SUFFIX_MAX + 1),
+    .size = entry->pathlen
+  };
+  if (!io.buf || dfk_blocking_call(fs->dfk, probe_call, &io) != dfk_err_ok) {
+    return;
+  }
+  entry->variants = io.ret;
+  DFK_DBG(fs->dfk, "{%p} '%s' has variants 0x%x", (void*) fs, entry->path,
+      entry->variants);
+  fileserver_variants_cache(fs, entry->path, entry->pathlen, entry->variants);
+}
+
+/**
+ * Build complete response for a small file and keep it in entry->response
+ *
+ * Failure is not fatal, the file is sent from disk in that case.
+ */
+static void fileserver_prebuild(dfk_fileserver_t* fs, fileserver_entry_t* entry)
+{
+  size_t filesize = entry->statinfo.st_size;
+  char encoding[64] = "";
+  if (entry->encoding != FILESERVER_IDENTITY) {
+    snprintf(encoding, sizeof(encoding), DFK_HTTP_CONTENT_ENCODING ": %s\r\n",
+        fileserver_encoding_names[entry->encoding]);
+  }
+  int vary = entry->encoding != FILESERVER_IDENTITY || entry->variants;
+  char headers[320];
+  int headerssize = snprintf(headers, sizeof(headers),
+      "HTTP/1.1 200 OK\r\n"
+      DFK_HTTP_CONTENT_LENGTH ": %llu\r\n"
+      DFK_HTTP_LAST_MODIFIED ": %.*s\r\n"
+      DFK_HTTP_ETAG ": %.*s\r\n"
+      DFK_HTTP_ACCEPT_RANGES ": bytes\r\n"
+      "%s%s"
+      "\r\n",
+      (unsigned long long) filesize,
+      (int) entry->last_modified_len, entry->last_modified,
+      (int) entry->etaglen, entry->etag,
+      encoding, vary ? DFK_HTTP_VARY ": " DFK_HTTP_ACCEPT_ENCODING "\r\n" : "");
+  assert(headerssize > 0 && (size_t) headerssize < sizeof(headers));
+  size_t responsesize = headerssize + filesize;
+  if (responsesize > fs->cache_memory) {
+    return;
+  }
+  char* response = fs->dfk->malloc(fs->dfk, responsesize);
+  if (!response) {
+    DFK_WARNING(fs->dfk, "{%p} out of memory, '%s' is not kept in memory",
+        (void*) fs, entry->path);
+    return;
+  }
+  memcpy(response, headers, headerssize);
+  if (filesize) {
+    fileserver_io_t io = {
+      .fd = entry->fd,
+      .buf = response + headerssize,
+      .size = filesize
+    };
+    if (dfk_blocking_call(fs->dfk, pread_call, &io) != dfk_err_ok
+        || io.ret == -1) {
+      DFK_WARNING(fs->dfk, "{%p} can not read '%s', it is not kept in memory",
+          (void*) fs, entry->path);
+      fs->dfk->free(fs->dfk, response);
+      return;
+    }
+  }
+  DFK_DBG(fs->dfk, "{%p} '%s' is kept in memory, %llu bytes", (void*) fs,
+      entry->path, (unsigned long long) responsesize);
+  entry->response = response;
+  entry->responsesize = responsesize;
+}
+
+/**
+ * Load a file or a directory from disk
+ *
+ * On success, *res is set to the acquired entry, and it is put into the
+ * cache, if enabled.
+ */
+static dfk_http_status_e fileserver_load(dfk_fileserver_t* fs,
+    dfk_http_request_t* request, const char* path, size_t pathlen,
+    fileserver_encoding_e encoding, fileserver_entry_t** res)
+{
+  DFK_DBG(fs->dfk, "get stat of '%s'", path);
+  struct stat statinfo;
+  memset(&statinfo, 0, sizeof(statinfo));
+  fileserver_io_t io = {.path = path, .statinfo = &statinfo};
+  if (dfk_blocking_call(fs->dfk, stat_call, &io) != dfk_err_ok) {
+    return DFK_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  if (io.ret == -1) {
+    if (io.err == ENOENT || io.err == ENOTDIR) {
+      DFK_DBG(fs->dfk, "file not found");
+      return DFK_HTTP_NOT_FOUND;
+    }
+    return DFK_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  if (S_ISDIR(statinfo.st_mode)
+      && (!fs->autoindex || encoding != FILESERVER_IDENTITY)) {
+    return DFK_HTTP_NOT_FOUND;
+  }
+  if (!S_ISDIR(statinfo.st_mode) && !S_ISREG(statinfo.st_mode)) {
+    /* Opening a FIFO would block */
+    return DFK_HTTP_NOT_FOUND;
+  }
+  fileserver_entry_t* entry = fs->dfk->malloc(fs->dfk,
+      sizeof(fileserver_entry_t) + pathlen + 1);
+  if (!entry) {
+    DFK_ERROR(fs->dfk, "out of memory");
+    return DFK_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  memset(entry, 0, sizeof(*entry));
+  dfk_avltree_hook_init(&entry->hook);
+  dfk_list_hook_init(&entry->lru);
+  entry->path = (char*) (entry + 1);
+  memcpy(entry->path, path, pathlen);
+  entry->path[pathlen] = '\0';
+  entry->pathlen = pathlen;
+  entry->encoding = encoding;
+  entry->statinfo = statinfo;
+  entry->fd = -1;
+  dfk_http_status_e status = S_ISDIR(statinfo.st_mode)
+    ? fileserver_autoindex(fs, request, entry)
+    : fileserver_open(fs, entry);
+  if (status != DFK_HTTP_OK) {
+    fileserver_entry_free(fs, entry);
+    return status;
+  }
+  if (fs->precompressed && entry->fd != -1
+      && encoding == FILESERVER_IDENTITY) {
+    fileserver_probe(fs, request, entry);
+  }
+  entry->nrefs = 1;
+  if (fs->cache_size) {
+    if (entry->fd != -1
+        && (size_t) entry->statinfo.st_size <= fs->cache_file_size) {
+      fileserver_prebuild(fs, entry);
+    }
+    fileserver_cache(fs, entry);
+  }
+  *res = entry;
+  return DFK_HTTP_OK;
+}
+
+int dfk__fileserver_parse_date(dfk_buf_t value, time_t* res)
+{
+  char buf[64];
+  if (value.size >= sizeof(buf)) {
+    return 0;
+  }
+  memcpy(buf, value.data, value.size);
+  buf[value.size] = '\0';
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char* end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (!end || *end) {
+    return 0;
+  }
+  *res = timegm(&tm);
+  return 1;
+}
+
+int dfk__fileserver_etag_match(const char* etag, size_t etaglen,
+    dfk_buf_t list)
+{
+  const char* i = list.data;
+  const char* end = list.data + list.size;
+  while (i < end) {
+    while (i < end && (*i == ' ' || *i == '\t' || *i == ',')) {
+      ++i;
+    }
+    if (i == end) {
+      break;
+    }
+    if (*i == '*') {
+      return 1;
+    }
+    if (end - i >= 2 && i[0] == 'W' && i[1] == '/') {
+      i += 2;
+    }
+    const char* tag = i;
+    while (i < end && *i != ',') {
+      ++i;
+    }
+    size_t taglen = i - tag;
+    while (taglen && (tag[taglen - 1] == ' ' || tag[taglen - 1] == '\t')) {
+      --taglen;
+    }
+    if (taglen == etaglen && !memcmp(tag, etag, taglen)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Evaluate If-None-Match and If-Modified-Since preconditions
+ *
+ * Returns non-zero value if the client copy is up to date.
+ */
+static int fileserver_not_modified(fileserver_entry_t* entry,
+    dfk_http_request_t* request)
+{
+  dfk_buf_t inm = FILESERVER_HEADER(request, DFK_HTTP_IF_NONE_MATCH);
+  if (inm.size) {
+    /* If-Modified-Since is ignored if If-None-Match is present */
+    return dfk__fileserver_etag_match(entry->etag, entry->etaglen, inm);
+  }
+  dfk_buf_t ims = FILESERVER_HEADER(request, DFK_HTTP_IF_MODIFIED_SINCE);
+  time_t since;
+  if (ims.size && dfk__fileserver_parse_date(ims, &since)) {
+    return entry->statinfo.st_mtime <= since;
+  }
+  return 0;
+}
+
+/**
+ * Evaluate If-Range precondition
+ *
+ * Returns zero if Range header should be ignored, and the whole file sent.
+ */
+static int fileserver_if_range(fileserver_entry_t* entry,
+    dfk_http_request_t* request)
+{
+  dfk_buf_t ifrange = FILESERVER_HEADER(request, DFK_HTTP_IF_RANGE);
+  if (!ifrange.size) {
+    return 1;
+  }
+  if (ifrange.data[0] == '"') {
+    /* Strong comparison */
+    return ifrange.size == entry->etaglen
+      && !memcmp(ifrange.data, entry->etag, entry->etaglen);
+  }
+  time_t date;
+  return dfk__fileserver_parse_date(ifrange, &date)
+    && date == entry->statinfo.st_mtime;
+}
+
+/**
+ * Parse decimal number at *i, advance *i past it
+ *
+ * Returns 1 if a number is parsed, 0 if there are no digits at *i,
+ * -1 on overflow.
+ */
+static int fileserver_parse_uint(const char** i, const char* end, uint64_t* res)
+{
+  const char* begin = *i;
+  *res = 0;
+  while (*i < end && **i >= '0' && **i <= '9') {
+    if (*res > (UINT64_MAX - 9) / 10) {
+      return -1;
+    }
+    *res = *res * 10 + (**i - '0');
+    ++*i;
+  }
+  return *i != begin;
+}
+
+int dfk__fileserver_parse_range(dfk_buf_t value, uint64_t size,
+    dfk_fileserver_range_t* ranges)
+{
+  static const char unit[] = "bytes=";
+  if (value.size < sizeof(unit) - 1
+      || strncmp(value.data, unit, sizeof(unit) - 1)) {
+    return -1;
+  }
+  const char* i = value.data + sizeof(unit) - 1;
+  const char* end = value.data + value.size;
+  int nranges = 0;
+  size_t nspecs = 0;
+  while (i < end) {
+    while (i < end && (*i == ' ' || *i == '\t' || *i == ',')) {
+      ++i;
+    }
+    if (i == end) {
+      break;
+    }
+    if (++nspecs > DFK_FILESERVER_MAX_RANGES) {
+      return -1;
+    }
+    uint64_t first;
+    uint64_t last;
+    int havefirst = fileserver_parse_uint(&i, end, &first);
+    if (havefirst < 0 || i == end || *i != '-') {
+      return -1;
+    }
+    ++i;
+    int havelast = fileserver_parse_uint(&i, end, &last);
+    if (havelast < 0 || (!havefirst && !havelast)) {
+      return -1;
+    }
+    while (i < end && (*i == ' ' || *i == '\t')) {
+      ++i;
+    }
+    if (i < end && *i != ',') {
+      return -1;
+    }
+    if (!havefirst) {
+      /* Suffix range, last N bytes */
+      if (!last || !size) {
+        continue;
+      }
+      ranges[nranges++] = (dfk_fileserver_range_t) {
+        size - DFK_MIN(last, size), size - 1};
+    } else {
+      if (havelast && last < first) {
+        return -1;
+      }
+      if (first >= size) {
+        continue;
+      }
+      ranges[nranges++] = (dfk_fileserver_range_t) {
+        first, havelast ? DFK_MIN(last, size - 1) : size - 1};
+    }
+  }
+  return nspecs ? nranges : -1;
+}
+
+/**
+ * Parse qvalue of an Accept-Encoding element, in thousandths
+ *
+ * Returns -1 if @p value is not a valid qvalue.
+ */
+static int fileserver_parse_qvalue(const char* value, size_t size)
+{
+  if (!size || (value[0] != '0' && value[0] != '1')) {
+    return -1;
+  }
+  int q = (value[0] - '0') * 1000;
+  if (size == 1) {
+    return q;
+  }
+  if (value[1] != '.' || size > 5) {
+    return -1;
+  }
+  int scale = 100;
+  for (size_t i = 2; i < size; ++i, scale /= 10) {
+    if (value[i] < '0' || value[i] > '9') {
+      return -1;
+    }
+    q += (value[i] - '0') * scale;
+  }
+  return q > 1000 ? -1 : q;
+}
+
+/**
+ * Choose the most acceptable precompressed variant of the entry
+ *
+ * Returns FILESERVER_IDENTITY if no variant is acceptable for the client.
+ */
+static fileserver_encoding_e fileserver_negotiate(fileserver_entry_t* entry,
+    dfk_http_request_t* request)
+{
+  dfk_buf_t value = FILESERVER_HEADER(request, DFK_HTTP_ACCEPT_ENCODING);
+  if (!value.size) {
+    return FILESERVER_IDENTITY;
+  }
+  /* Weights of the encodings and of the "*" element, -1 if not listed */
+  int qvalues[_FILESERVER_NENCODINGS];
+  int qany = -1;
+  for (int i = 0; i < _FILESERVER_NENCODINGS; ++i) {
+    qvalues[i] = -1;
+  }
+  const char* i = value.data;
+  const char* end = value.data + value.size;
+  while (i < end) {
+    while (i < end && (*i == ' ' || *i == '\t' || *i == ',')) {
+      ++i;
+    }
+    const char* coding = i;
+    while (i < end && *i != ',' && *i != ';' && *i != ' ' && *i != '\t') {
+      ++i;
+    }
+    size_t codinglen = i - coding;
+    int q = 1000;
+    while (i < end && *i != ',') {
+      /* Parameters, only "q" is recognized */
+      while (i < end && (*i == ' ' || *i == '\t' || *i == ';')) {
+        ++i;
+      }
+      const char* param = i;
+      while (i < end && *i != ',' && *i != ';' && *i != ' ' && *i != '\t') {
+        ++i;
+      }
+      if (i - param > 2 && (param[0] == 'q' || param[0] == 'Q')
+          && param[1] == '=') {
+        q = fileserver_parse_qvalue(param + 2, i - param - 2);
+      }
+    }
+    if (!codinglen || q < 0) {
+      continue;
+    }
+    if (codinglen == 1 && coding[0] == '*') {
+      qany = q;
+      continue;
+    }
+    for (int e = FILESERVER_IDENTITY + 1; e < _FILESERVER_NENCODINGS; ++e) {
+      const char* name = fileserver_encoding_names[e];
+      if (strlen(name) == codinglen && !strncasecmp(name, coding, codinglen)) {
+        qvalues[e] = q;
+      }
+    }
+    if (codinglen == 6 && !strncasecmp("x-gzip", coding, codinglen)) {
+      qvalues[FILESERVER_GZIP] = q;
+    }
+  }
+  fileserver_encoding_e best = FILESERVER_IDENTITY;
+  int bestq = 0;
+  for (int e = FILESERVER_IDENTITY + 1; e < _FILESERVER_NENCODINGS; ++e) {
+    int q = qvalues[e] >= 0 ? qvalues[e] : qany;
+    /* Later encodings compress better, they win ties */
+    if ((entry->variants & (1u << e)) && q > 0 && q >= bestq) {
+      best = (fileserver_encoding_e) e;
+      bestq = q;
+    }
+  }
+  return best;
+}
+
+/**
+ * Send @p nbytes of the file starting from @p offset
+ */
+static int fileserver_sendfile(dfk_fileserver_t* fs, fileserver_entry_t* entry,
+    dfk_http_response_t* response, uint64_t offset, uint64_t nbytes)
+{
+  /* File contents is copied to the socket by the kernel */
+  ssize_t nsent = dfk_http_response_sendfile(response, entry->fd,
+      (off_t) offset, nbytes);
+  if (nsent < 0) {
+    return fs->dfk->dfk_errno;
+  }
+  if ((uint64_t) nsent < nbytes) {
+    /* File was truncated after stat, Content-Length can not be met */
+    DFK_ERROR(fs->dfk, "file '%s' is truncated, %llu of %llu bytes sent",
+        entry->path, (unsigned long long) nsent,
+        (unsigned long long) nbytes);
+    return dfk_err_eof;
+  }
+  return dfk_err_ok;
+}
+
+/**
+ * Send several ranges of the file as a multipart/byteranges response
+ */
+static int fileserver_respond_multipart(dfk_fileserver_t* fs,
+    fileserver_entry_t* entry, dfk_http_request_t* request,
+    dfk_http_response_t* response, dfk_fileserver_range_t* ranges, int nranges)
+{
+  unsigned long long size = entry->statinfo.st_size;
+  /* Entity tag without quotes makes boundary unlikely to appear in the file */
+  char boundary[80];
+  int boundarylen = snprintf(boundary, sizeof(boundary), "dfk-byteranges-%.*s",
+      (int) entry->etaglen - 2, entry->etag + 1);
+  dfk_iovec_t* parts = dfk_arena_alloc(request->_request_arena,
+      nranges * sizeof(dfk_iovec_t));
+  if (!parts) {
+    response->status = DFK_HTTP_INTERNAL_SERVER_ERROR;
+    return dfk_err_ok;
+  }
+  uint64_t content_length = 0;
+  for (int i = 0; i < nranges; ++i) {
+    const size_t partsize = 160;
+    char* part = dfk_arena_alloc(request->_request_arena, partsize);
+    if (!part) {
+      response->status = DFK_HTTP_INTERNAL_SERVER_ERROR;
+      return dfk_err_ok;
+    }
+    int len = snprintf(part, partsize, "\r\n--%.*s\r\n"
+        DFK_HTTP_CONTENT_RANGE ": bytes %llu-%llu/%llu\r\n\r\n",
+        boundarylen, boundary, (unsigned long long) ranges[i].first,
+        (unsigned long long) ranges[i].last, size);
+    assert(len > 0 && (size_t) len < partsize);
+    parts[i] = (dfk_iovec_t) {part, len};
+    content_length += len + ranges[i].last - ranges[i].first + 1;
+  }
+  char tail[96];
+  int taillen = snprintf(tail, sizeof(tail), "\r\n--%.*s--\r\n",
+      boundarylen, boundary);
+  content_length += taillen;
+
+  char content_type[128];
+  int content_type_len = snprintf(content_type, sizeof(content_type),
+      "multipart/byteranges; boundary=%.*s", boundarylen, boundary);
+  dfk_http_response_set_copy_value(response,
+      DFK_HTTP_CONTENT_TYPE, sizeof(DFK_HTTP_CONTENT_TYPE) - 1,
+      content_type, content_type_len);
+  response->status = DFK_HTTP_PARTIAL_CONTENT;
+  response->content_length = content_length;
+  for (int i = 0; i < nranges; ++i) {
+    if (dfk_http_response_write(response, parts[i].data, parts[i].size) < 0) {
+      return fs->dfk->dfk_errno;
+    }
+    int err = fileserver_sendfile(fs, entry, response, ranges[i].first,
+        ranges[i].last - ranges[i].first + 1);
+    if (err != dfk_err_ok) {
+      return err;
+    }
+  }
+  if (dfk_http_response_write(response, tail, taillen) < 0) {
+    return fs->dfk->dfk_errno;
+  }
+  return dfk_err_ok;
+}
+
+static int fileserver_respond_file(dfk_fileserver_t* fs,
+    fileserver_entry_t* entry, dfk_http_request_t* request,
+    dfk_http_response_t* response)
+{
+  uint64_t size = entry->statinfo.st_size;
+  int notmodified = fileserver_not_modified(entry, request);
+  dfk_buf_t range = {NULL, 0};
+  if (!notmodified) {
+    range = FILESERVER_HEADER(request, DFK_HTTP_RANGE);
+  }
+  /*
+   * Pre-built response has no Connection header, which is fine for
+   * a keepalive HTTP/1.1 connection only
+   */
+  if (entry->response && !notmodified && !range.size
+      && response->major_version == 1 && response->minor_version == 1
+      && response->keepalive
+      && !dfk_strmap_size(&response->headers)) {
+    /* Status line, headers and body are sent with a single writev */
+    response->content_length = size;
+    dfk_iovec_t iov = {entry->response, entry->responsesize};
+    if (dfk__http_response_write_prebuilt(response, &iov, 1) < 0) {
+      return fs->dfk->dfk_errno;
+    }
+    return dfk_err_ok;
+  }
+  /* Headers could be flushed after the entry is released */
+  dfk_http_response_set_copy_value(response,
+      DFK_HTTP_LAST_MODIFIED, sizeof(DFK_HTTP_LAST_MODIFIED) - 1,
+      entry->last_modified, entry->last_modified_len);
+  dfk_http_response_set_copy_value(response,
+      DFK_HTTP_ETAG, sizeof(DFK_HTTP_ETAG) - 1, entry->etag, entry->etaglen);
+  dfk_http_response_set(response,
+      DFK_HTTP_ACCEPT_RANGES, sizeof(DFK_HTTP_ACCEPT_RANGES) - 1, "bytes", 5);
+  if (entry->encoding != FILESERVER_IDENTITY) {
+    const char* name = fileserver_encoding_names[entry->encoding];
+    dfk_http_response_set(response,
+        DFK_HTTP_CONTENT_ENCODING, sizeof(DFK_HTTP_CONTENT_ENCODING) - 1,
+        name, strlen(name));
+  }
+  if (entry->encoding != FILESERVER_IDENTITY || entry->variants) {
+    /* Caches should not serve a compressed variant to any client */
+    dfk_http_response_set(response,
+        DFK_HTTP_VARY, sizeof(DFK_HTTP_VARY) - 1,
+        DFK_HTTP_ACCEPT_ENCODING, sizeof(DFK_HTTP_ACCEPT_ENCODING) - 1);
+  }
+  if (notmodified) {
+    DFK_DBG(fs->dfk, "{%p} '%s' is not modified", (void*) fs, entry->path);
+    response->status = DFK_HTTP_NOT_MODIFIED;
+    return dfk_err_ok;
+  }
+
+  dfk_fileserver_range_t ranges[DFK_FILESERVER_MAX_RANGES];
+  int nranges = -1;
+  if (range.size && fileserver_if_range(entry, request)) {
+    nranges = dfk__fileserver_parse_range(range, size, ranges);
+  }
+  DFK_DBG(fs->dfk, "{%p} '%s', %d ranges requested", (void*) fs, entry->path,
+      nranges);
+  if (!nranges) {
+    char content_range[64];
+    int len = snprintf(content_range, sizeof(content_range), "bytes */%llu",
+        (unsigned long long) size);
+    dfk_http_response_set_copy_value(response,
+        DFK_HTTP_CONTENT_RANGE, sizeof(DFK_HTTP_CONTENT_RANGE) - 1,
+        content_range, len);
+    response->status = DFK_HTTP_RANGE_NOT_SATISFIABLE;
+    response->content_length = 0;
+    return dfk_err_ok;
+  }
+  if (nranges == 1) {
+    char content_range[96];
+    int len = snprintf(content_range, sizeof(content_range),
+        "bytes %llu-%llu/%llu", (unsigned long long) ranges[0].first,
+        (unsigned long long) ranges[0].last, (unsigned long long) size);
+    dfk_http_response_set_copy_value(response,
+        DFK_HTTP_CONTENT_RANGE, sizeof(DFK_HTTP_CONTENT_RANGE) - 1,
+        content_range, len);
+    response->status = DFK_HTTP_PARTIAL_CONTENT;
+    response->content_length = ranges[0].last - ranges[0].first + 1;
+    return fileserver_sendfile(fs, entry, response, ranges[0].first,
+        response->content_length);
+  }
+  if (nranges > 1) {
+    return fileserver_respond_multipart(fs, entry, request, response,
+        ranges, nranges);
+  }
+  response->status = DFK_HTTP_OK;
+  response->content_length = size;
+  if (!size) {
+    return dfk_err_ok;
+  }
+  return fileserver_sendfile(fs, entry, response, 0, size);
+}
+
+static int fileserver_respond(dfk_fileserver_t* fs, fileserver_entry_t* entry,
+    dfk_http_request_t* request, dfk_http_response_t* response)
+{
+  if (entry->fd != -1) {
+    return fileserver_respond_file(fs, entry, request, response);
+  }
+  response->status = DFK_HTTP_OK;
+  response->content_length = entry->bodysize;
+  if (dfk_http_response_write(response, entry->body, entry->bodysize) < 0) {
+    return fs->dfk->dfk_errno;
+  }
+  return dfk_err_ok;
+}
+
+/**
+ * Acquire precompressed variant of the file, load it if not cached
+ *
+ * Returns NULL if the variant can not be loaded, identity-encoded file
+ * should be sent in that case.
+ */
+static fileserver_entry_t* fileserver_variant(dfk_fileserver_t* fs,
+    dfk_http_request_t* request, const char* path, size_t pathlen,
+    fileserver_encoding_e encoding)
+{
+  const char* suffix = fileserver_encoding_suffixes[encoding];
+  size_t suffixlen = strlen(suffix);
+  char* varpath = dfk_arena_alloc(request->_request_arena,
+      pathlen + suffixlen + 1);
+  if (!varpath) {
+    return NULL;
+  }
+  memcpy(varpath, path, pathlen);
+  memcpy(varpath + pathlen, suffix, suffixlen + 1);
+  fileserver_entry_t* entry = fileserver_lookup(fs, varpath,
+      pathlen + suffixlen, encoding);
+  if (!entry && fileserver_load(fs, request, varpath, pathlen + suffixlen,
+        encoding, &entry) != DFK_HTTP_OK) {
+    /* Variant was removed since the file was probed */
+    DFK_DBG(fs->dfk, "{%p} can not load '%s'", (void*) fs, varpath);
+    return NULL;
+  }
+  return entry;
+}
+
 int dfk_fileserver_init(dfk_fileserver_t* fs, dfk_t* dfk, const char* basepath, ssize_t basepathlen)
 {
   assert(fs);
@@ -66,14 +1335,40 @@ int dfk_fileserver_init(dfk_fileserver_t* fs, dfk_t* dfk, const char* basepath,
   }
   memcpy(fs->_basepath, basepath, basepathlen);
   fs->_basepathlen = basepathlen;
+  dfk_avltree_init(&fs->_cache, fileserver_entry_cmp);
+  dfk_list_init(&fs->_cache_lru);
+  fs->_cache_nentries = 0;
+  fs->_cache_nbytes = 0;
+  dfk_avltree_init(&fs->_variants, fileserver_variants_cmp);
+  dfk_list_init(&fs->_variants_lru);
+  fs->_variants_nentries = 0;
+#if DFK_THREADS
+  pthread_mutex_init(&fs->_cache_lock, NULL);
+#endif
   fs->dfk = dfk;
   fs->io_buf_size = DFK_FILESERVER_BUFFER_SIZE;
+  fs->cache_size = DFK_FILESERVER_CACHE_SIZE;
+  fs->cache_ttl = DFK_FILESERVER_CACHE_TTL;
+  fs->cache_memory = DFK_FILESERVER_CACHE_MEMORY;
+  fs->cache_file_size = DFK_FILESERVER_CACHE_FILE_SIZE;
+  fs->precompressed = DFK_FILESERVER_PRECOMPRESSED;
+  fs->variants_cache_size = DFK_FILESERVER_VARIANTS_CACHE_SIZE;
   fs->autoindex |= 1;
   return dfk_err_ok;
 }
 
 int dfk_fileserver_free(dfk_fileserver_t* fs)
 {
+  while (!dfk_list_empty(&fs->_cache_lru)) {
+    fileserver_uncache(fs, LRU_TO_ENTRY(dfk_list_front(&fs->_cache_lru)));
+  }
+  while (!dfk_list_empty(&fs->_variants_lru)) {
+    fileserver_variants_uncache(fs,
+        LRU_TO_VARIANTS(dfk_list_front(&fs->_variants_lru)));
+  }
+#if DFK_THREADS
+  pthread_mutex_destroy(&fs->_cache_lock);
+#endif
   fs->dfk->free(fs->dfk, fs->_basepath);
   return dfk_err_ok;
 }
@@ -88,153 +1383,42 @@ int dfk_fileserver_handler(dfk_userdata_t ud, dfk_http_t* http,
 {
   DFK_UNUSED(http);
   dfk_fileserver_t* fs = (dfk_fileserver_t*) ud.data;
-  if (request->method == DFK_HTTP_GET) {
-    size_t fullpathlen = fs->_basepathlen + request->path.size + 1;
-    char* fullpath = dfk_arena_alloc(request->_request_arena, fullpathlen);
-    if (fullpath == NULL) {
-      DFK_ERROR(fs->dfk, "out of memory");
-      response->status = DFK_HTTP_INTERNAL_SERVER_ERROR;
-      return dfk_err_ok;
-    }
-    memcpy(fullpath, fs->_basepath, fs->_basepathlen);
-    memcpy(fullpath + fs->_basepathlen, request->path.data, request->path.size);
-    fullpath[fullpathlen - 1] = '\0';
-    DFK_DBG(fs->dfk, "get stat of '%s'", fullpath);
-    struct stat statinfo;
-    memset(&statinfo, 0, sizeof(statinfo));
-    if (stat(fullpath, &statinfo) == -1) {
-      if (errno == ENOENT || errno == ENOTDIR) {
-        DFK_DBG(fs->dfk, "file not found");
-        response->status = DFK_HTTP_NOT_FOUND;
-      } else {
-        response->status = DFK_HTTP_INTERNAL_SERVER_ERROR;
-      }
+  if (request->method != DFK_HTTP_GET) {
+    response->status = DFK_HTTP_METHOD_NOT_ALLOWED;
+    return dfk_err_ok;
+  }
+  size_t fullpathlen = fs->_basepathlen + request->path.size + 1;
+  char* fullpath = dfk_arena_alloc(request->_request_arena, fullpathlen);
+  if (fullpath == NULL) {
+    DFK_ERROR(fs->dfk, "out of memory");
+    response->status = DFK_HTTP_INTERNAL_SERVER_ERROR;
+    return dfk_err_ok;
+  }
+  memcpy(fullpath, fs->_basepath, fs->_basepathlen);
+  memcpy(fullpath + fs->_basepathlen, request->path.data, request->path.size);
+  fullpath[fullpathlen - 1] = '\0';
+  fileserver_entry_t* entry = fileserver_lookup(fs, fullpath, fullpathlen - 1,
+      FILESERVER_IDENTITY);
+  if (!entry) {
+    dfk_http_status_e status = fileserver_load(fs, request, fullpath,
+        fullpathlen - 1, FILESERVER_IDENTITY, &entry);
+    if (status != DFK_HTTP_OK) {
+      response->status = status;
       return dfk_err_ok;
     }
-    if (statinfo.st_mode & S_IFDIR) {
-      if (!fs->autoindex) {
-        response->status = DFK_HTTP_NOT_FOUND;
-        return dfk_err_ok;
-      } else {
-        DIR* dp = opendir(fullpath);
-        dfk_list_t filelist;
-        dfk_list_init(&filelist);
-        if (dp == NULL) {
-          response->status = DFK_HTTP_INTERNAL_SERVER_ERROR;
-          return dfk_err_ok;
-        }
-        struct dirent* res;
-        do {
-          dirent_list_item_t* dei = dfk_arena_alloc(request->_request_arena, sizeof(dirent_list_item_t));
-          if (!dei) {
-            closedir(dp);
-            response->status = DFK_HTTP_INTERNAL_SERVER_ERROR;
-            return dfk_err_ok;
-          }
-          dfk_list_hook_init(&dei->hook);
-          do {
-            if (readdir_r(dp, &dei->de, &res) != 0) {
-              closedir(dp);
-              response->status = DFK_HTTP_INTERNAL_SERVER_ERROR;
-              return dfk_err_ok;
-            }
-            if (res && !ignore_file(res)) {
-              assert(res == &dei->de);
-              dfk_list_append(&filelist, &dei->hook);
-              break;
-            }
-          } while (res);
-        } while (res);
-        closedir(dp);
-        size_t niov = 6 + 6 * dfk_list_size(&filelist);
-        int add_separator_after_path = request->path.data[request->path.size - 1] != '/';
-        if (add_separator_after_path) {
-          niov += dfk_list_size(&filelist);
-        }
-        dfk_iovec_t* iov = dfk_arena_alloc(request->_request_arena, niov * sizeof(dfk_iovec_t));
-        if (!iov) {
-          response->status = DFK_HTTP_INTERNAL_SERVER_ERROR;
-          return dfk_err_ok;
-        }
-        size_t iiov = 0;
-        iov[iiov++] = (dfk_iovec_t) {(char*) autoindex_header_1, DFK_SIZE(autoindex_header_1)};
-        iov[iiov++] = (dfk_iovec_t) {request->path.data, request->path.size};
-        iov[iiov++] = (dfk_iovec_t) {(char*) autoindex_header_2, DFK_SIZE(autoindex_header_2)};
-        iov[iiov++] = (dfk_iovec_t) {request->path.data, request->path.size};
-        iov[iiov++] = (dfk_iovec_t) {(char*) autoindex_header_3, DFK_SIZE(autoindex_header_3)};
-        dfk_list_it it, end;
-        dfk_list_begin(&filelist, &it);
-        dfk_list_end(&filelist, &end);
-        while (!dfk_list_it_equal(&it, &end)) {
-          dirent_list_item_t* i = (dirent_list_item_t*) it.value;
-          iov[iiov++] = (dfk_iovec_t) {"      <li><a href=\"", 19};
-          iov[iiov++] = (dfk_iovec_t) {request->path.data, request->path.size};
-          if (add_separator_after_path) {
-            iov[iiov++] = (dfk_iovec_t) {"/", 1};
-          }
-#if __APPLE__
-          const size_t namelen = i->de.d_namlen;
-#else
-          const size_t namelen = strnlen(i->de.d_name, sizeof(i->de.d_name));
-#endif
-          iov[iiov++] = (dfk_iovec_t) {i->de.d_name, namelen};
-          iov[iiov++] = (dfk_iovec_t) {"\">", 2};
-          iov[iiov++] = (dfk_iovec_t) {i->de.d_name, namelen};
-          iov[iiov++] = (dfk_iovec_t) {"</a></li>\n", 10};
-          dfk_list_it_next(&it);
-        }
-        iov[iiov++] = (dfk_iovec_t) {(char*) autoindex_footer, DFK_SIZE(autoindex_footer)};
-        size_t content_length = 0;
-        for (size_t i = 0; i < niov; ++i) {
-          content_length += iov[i].size;
-        }
-        response->content_length = content_length;
-        dfk_http_response_writev(response, iov, niov);
-        response->status = DFK_HTTP_OK;
-        return dfk_err_ok;
-      }
-    } else {
-      size_t towrite = statinfo.st_size;
-      response->content_length = towrite;
-      FILE* f = fopen(fullpath, "r");
-      if (f == NULL) {
-        DFK_ERROR(fs->dfk, "can not open file '%s'", fullpath);
-        response->status = DFK_HTTP_INTERNAL_SERVER_ERROR;
-        return dfk_err_ok;
-      }
-      char* buffer = fs->dfk->malloc(fs->dfk, fs->io_buf_size);
-      if (buffer == NULL) {
-        DFK_ERROR(fs->dfk, "out of memory");
-        fclose(f);
-        response->status = DFK_HTTP_INTERNAL_SERVER_ERROR;
-        return dfk_err_ok;
-      }
-      while (towrite) {
-        DFK_DBG(fs->dfk, "need to write %llu bytes", (unsigned long long) towrite);
-        size_t toread = DFK_MIN(fs->io_buf_size, towrite);
-        size_t nread = fread(buffer, 1, toread, f);
-        if (nread < toread) {
-          fs->dfk->sys_errno = errno;
-          DFK_ERROR(fs->dfk, "error reading file: %s", dfk_strerr(fs->dfk, dfk_err_sys));
-          fclose(f);
-          fs->dfk->free(fs->dfk, buffer);
-          return dfk_err_sys;
-        }
-        ssize_t nwritten = dfk_http_response_write(response, buffer, nread);
-        if (nwritten < 0) {
-          fclose(f);
-          fs->dfk->free(fs->dfk, buffer);
-          return fs->dfk->dfk_errno;
-        }
-        assert(nwritten <= (ssize_t) towrite);
-        towrite -= nwritten;
+  }
+  if (fs->precompressed && entry->variants) {
+    fileserver_encoding_e encoding = fileserver_negotiate(entry, request);
+    if (encoding != FILESERVER_IDENTITY) {
+      fileserver_entry_t* variant = fileserver_variant(fs, request, fullpath,
+          fullpathlen - 1, encoding);
+      if (variant) {
+        fileserver_release(fs, entry);
+        entry = variant;
       }
-      fclose(f);
-      fs->dfk->free(fs->dfk, buffer);
     }
-  } else {
-    response->status = DFK_HTTP_METHOD_NOT_ALLOWED;
   }
-  return dfk_err_ok;
+  int err = fileserver_respond(fs, entry, request, response);
+  fileserver_release(fs, entry);
+  return err;
 }
-
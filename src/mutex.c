@@ -8,10 +8,19 @@
 #include <dfk/error.h>
 #include <dfk/mutex.h>
 #include <dfk/internal.h>
+#include <dfk/internal/mutex.h>
 #include <dfk/scheduler.h>
 
 #define TO_FIBER(expr) DFK_CONTAINER_OF((expr), dfk_fiber_t, _hook)
 
+#if DFK_THREADS
+#define DFK_MUTEX_GUARD(mutex) pthread_mutex_lock(&(mutex)->_guard)
+#define DFK_MUTEX_UNGUARD(mutex) pthread_mutex_unlock(&(mutex)->_guard)
+#else
+#define DFK_MUTEX_GUARD(mutex)
+#define DFK_MUTEX_UNGUARD(mutex)
+#endif
+
 void dfk_mutex_init(dfk_mutex_t* mutex, dfk_t* dfk)
 {
   assert(mutex);
@@ -20,6 +29,9 @@ void dfk_mutex_init(dfk_mutex_t* mutex, dfk_t* dfk)
   dfk_list_init(&mutex->_waitqueue);
   mutex->_owner = NULL;
   mutex->dfk = dfk;
+#if DFK_THREADS
+  pthread_mutex_init(&mutex->_guard, NULL);
+#endif
 }
 
 void dfk_mutex_free(dfk_mutex_t* mutex)
@@ -29,6 +41,9 @@ void dfk_mutex_free(dfk_mutex_t* mutex)
   assert(dfk_list_empty(&mutex->_waitqueue)
       && "attempt to free busy mutex");
   assert(!mutex->_owner && "attempt to free locked mutex");
+#if DFK_THREADS
+  pthread_mutex_destroy(&mutex->_guard);
+#endif
   DFK_IF_DEBUG(mutex->dfk = DFK_PDEADBEEF);
   DFK_IF_DEBUG(mutex->_owner = DFK_PDEADBEEF);
 }
@@ -40,18 +55,22 @@ void dfk_mutex_lock(dfk_mutex_t* mutex)
   dfk_t* dfk = mutex->dfk;
   dfk_fiber_t* this = dfk__this_fiber(dfk->_scheduler);
   DFK_DBG(dfk, "{%p} lock attempt by {%p}", (void*) mutex, (void*) this);
+  DFK_MUTEX_GUARD(mutex);
   if (!mutex->_owner) {
     DFK_DBG(dfk, "{%p} is spare, acquire lock", (void*) mutex);
     mutex->_owner = this;
+    DFK_MUTEX_UNGUARD(mutex);
   } else {
     if (mutex->_owner == this) {
       DFK_DBG(dfk, "{%p} is locked by the caller, recursive lock",
           (void*) mutex);
+      DFK_MUTEX_UNGUARD(mutex);
     } else {
       DFK_DBG(dfk, "{%p} is already locked by {%p}, wait queue size %llu",
           (void*) mutex, (void*) mutex->_owner,
           (unsigned long long) dfk_list_size(&mutex->_waitqueue));
       dfk_list_append(&mutex->_waitqueue, &this->_hook);
+      DFK_MUTEX_UNGUARD(mutex);
       dfk__suspend(dfk->_scheduler);
     }
   }
@@ -60,7 +79,7 @@ void dfk_mutex_lock(dfk_mutex_t* mutex)
       (void*) mutex->_owner);
 }
 
-void dfk_mutex_unlock(dfk_mutex_t* mutex)
+void dfk__mutex_unlock(dfk_mutex_t* mutex, int handoff)
 {
   assert(mutex);
   dfk_t* dfk = mutex->dfk;
@@ -68,10 +87,12 @@ void dfk_mutex_unlock(dfk_mutex_t* mutex)
   assert(mutex->_owner);
   /* Attempt to unlock mutex locked by another fiber */
   assert(mutex->_owner == dfk__this_fiber(dfk->_scheduler));
+  DFK_MUTEX_GUARD(mutex);
   if (dfk_list_empty(&mutex->_waitqueue)) {
     DFK_DBG(dfk, "{%p} is now unlocked, no fiber is waiting for lock",
         (void*) mutex);
     mutex->_owner = NULL;
+    DFK_MUTEX_UNGUARD(mutex);
   } else {
     dfk_fiber_t* next = TO_FIBER(dfk_list_front(&mutex->_waitqueue));
     dfk_list_pop_front(&mutex->_waitqueue);
@@ -79,10 +100,20 @@ void dfk_mutex_unlock(dfk_mutex_t* mutex)
         (void*) mutex, (void*) next,
         (unsigned long long) dfk_list_size(&mutex->_waitqueue));
     mutex->_owner = next;
-    dfk__resume(dfk->_scheduler, next);
+    DFK_MUTEX_UNGUARD(mutex);
+    if (handoff) {
+      dfk__handoff(dfk->_scheduler, next);
+    } else {
+      dfk__resume(dfk->_scheduler, next);
+    }
   }
 }
 
+void dfk_mutex_unlock(dfk_mutex_t* mutex)
+{
+  dfk__mutex_unlock(mutex, 1);
+}
+
 int dfk_mutex_trylock(dfk_mutex_t* mutex)
 {
   assert(mutex);
@@ -90,20 +121,24 @@ int dfk_mutex_trylock(dfk_mutex_t* mutex)
   dfk_fiber_t* this = dfk__this_fiber(dfk->_scheduler);
   DFK_DBG(mutex->dfk, "{%p} trylock attempt by {%p}",
       (void*) mutex, (void*) this);
+  DFK_MUTEX_GUARD(mutex);
   if (mutex->_owner) {
     if (mutex->_owner == this) {
       DFK_DBG(dfk, "{%p} is locked by the caller, recursive lock",
           (void*) mutex);
+      DFK_MUTEX_UNGUARD(mutex);
       return dfk_err_ok;
     } else {
       DFK_DBG(mutex->dfk, "{%p} is already locked by {%p}, dfk_err_busy",
-          (void*) mutex, (void*) TO_FIBER(dfk_list_front(&mutex->_waitqueue)));
+          (void*) mutex, (void*) mutex->_owner);
+      DFK_MUTEX_UNGUARD(mutex);
       return dfk_err_busy;
     }
   }
   DFK_DBG(mutex->dfk, "{%p} is spare, acquire lock by {%p}", (void*) mutex,
       (void*) this);
   mutex->_owner = this;
+  DFK_MUTEX_UNGUARD(mutex);
   return dfk_err_ok;
 }
 
@@ -11,12 +11,16 @@
 #include <dfk/error.h>
 #include <dfk/internal.h>
 
-ssize_t dfk__read(dfk_t* dfk, void* dfkhandle, int fd, char* buf, size_t nbytes)
+ssize_t dfk__read(dfk_t* dfk, void* dfkhandle, int fd,
+    struct dfk_io_watch_t* watch, char* buf, size_t nbytes, uint64_t deadline)
 {
   assert(buf);
   assert(nbytes);
   assert(dfk);
   DFK_UNUSED(dfkhandle);
+#if !DFK_IO_WATCH
+  DFK_UNUSED(watch);
+#endif
 
   ssize_t nread = read(fd, buf, nbytes);
   DFK_DBG(dfk, "{%p} read (possibly blocking) attempt returned %lld, "
@@ -32,20 +36,41 @@ ssize_t dfk__read(dfk_t* dfk, void* dfkhandle, int fd, char* buf, size_t nbytes)
     dfk->dfk_errno = dfk_err_sys;
     return -1;
   }
-  int ioret = DFK_IO(dfk, fd, DFK_IO_IN);
-#if DFK_DEBUG
-  char strev[16];
-  size_t nwritten = dfk__io_events_to_str(ioret, strev, DFK_SIZE(strev));
-  DFK_DBG(dfk, "{%p} DFK_IO returned %d (%.*s)", (void*) dfkhandle, ioret,
-      (int) nwritten, strev);
-#endif
-  if (ioret & DFK_IO_ERR) {
-    DFK_ERROR_SYSCALL(dfk, "read");
-    dfk->dfk_errno = dfk_err_sys;
+#if DFK_EVENT_LOOP_HAVE_RW
+  nread = DFK_IO_READ(dfk, fd, buf, nbytes, deadline);
+  if (nread < 0 && errno == ETIMEDOUT) {
+    DFK_DBG(dfk, "{%p} deadline expired", (void*) dfkhandle);
+    dfk->dfk_errno = dfk_err_timeout;
     return -1;
   }
-  assert(ioret & DFK_IO_IN);
-  nread = read(fd, buf, nbytes);
+#else
+  do {
+#if DFK_IO_WATCH
+    int ioret = watch ? dfk__io_watch_wait(watch, DFK_IO_IN, deadline)
+                      : DFK_IO_DEADLINE(dfk, fd, DFK_IO_IN, deadline);
+#else
+    int ioret = DFK_IO_DEADLINE(dfk, fd, DFK_IO_IN, deadline);
+#endif
+#if DFK_DEBUG
+    char strev[16];
+    size_t nwritten = dfk__io_events_to_str(ioret, strev, DFK_SIZE(strev));
+    DFK_DBG(dfk, "{%p} DFK_IO returned %d (%.*s)", (void*) dfkhandle, ioret,
+        (int) nwritten, strev);
+#endif
+    if (!ioret) {
+      DFK_DBG(dfk, "{%p} deadline expired", (void*) dfkhandle);
+      dfk->dfk_errno = dfk_err_timeout;
+      return -1;
+    }
+    if (ioret & DFK_IO_ERR) {
+      DFK_ERROR_SYSCALL(dfk, "read");
+      dfk->dfk_errno = dfk_err_sys;
+      return -1;
+    }
+    nread = read(fd, buf, nbytes);
+    /* Spurious wake up is possible for edge-triggered notifications */
+  } while (nread < 0 && errno == EAGAIN);
+#endif
   DFK_DBG(dfk, "{%p} read returned %lld", (void*) dfkhandle, (long long) nread);
   if (nread < 0) {
     DFK_ERROR_SYSCALL(dfk, "read");
@@ -1,8 +1,22 @@
 /**
  * @file scheduler.c
  *
- * Contains default scheduler implementation. Default scheduler is rather naive,
- * namely is does not support multithreading, has only one eventloop.
+ * Contains default scheduler implementation.
+ *
+ * If #DFK_THREADS is disabled, default scheduler is rather naive, namely it
+ * has only one run queue and one eventloop.
+ *
+ * Run queue is split into lanes, one per fiber priority class, plus an
+ * earliest-deadline-first lane for fibers with a deadline. Each scheduler
+ * iteration executes at most as many fibers as were runnable when the
+ * iteration started, always picking the head of the highest non-empty lane.
+ *
+ * If #DFK_THREADS is enabled, dfk_t.nworkers worker threads are started. Each
+ * worker owns a dfk_scheduler_t object with a separate run queue and a
+ * separate eventloop. A worker that has neither runnable, nor I/O waiting
+ * fibers steals runnable fibers from the other workers. dfk_t._scheduler
+ * points to the first worker and is used as a handle only - scheduler
+ * functions operate on the worker of the calling thread.
  *
  * @copyright
  * Copyright (c) 2017 Stanislav Ivochkin
@@ -10,11 +24,50 @@
  */
 
 #include <dfk/list.h>
+#include <dfk/malloc.h>
+#include <dfk/error.h>
 #include <dfk/scheduler.h>
 #include <dfk/eventloop.h>
 #include <dfk/internal.h>
 #include <dfk/internal/fiber.h>
 
+#if DFK_THREADS
+#include <pthread.h>
+#endif
+
+#define TO_FIBER(expr) DFK_CONTAINER_OF((expr), dfk_fiber_t, _hook)
+
+/** Run queue lanes, in order of decreasing priority */
+#define DFK_LANE_CONTROL 0
+#define DFK_LANE_DEADLINE 1
+#define DFK_LANE_REQUEST 2
+#define DFK_LANE_BACKGROUND 3
+#define DFK_NLANES 4
+
+#if DFK_THREADS
+/**
+ * State shared by all worker threads
+ */
+typedef struct dfk_workers_t {
+  /** An array of schedulers, one per worker thread */
+  struct dfk_scheduler_t* schedulers;
+  size_t nworkers;
+  /**
+   * Protects done member and updates of nidle
+   *
+   * Pushing workers read nidle without the lock, an idle worker re-checks
+   * the run queues with the lock held before it waits.
+   */
+  pthread_mutex_t lock;
+  /** Signalled when runnable fibers appear, or when job is done */
+  pthread_cond_t wakeup;
+  /** Number of workers that have neither runnable, nor I/O waiting fibers */
+  dfk_atomic_size_t nidle;
+  /** Set to 1 once all workers are idle simultaneously */
+  int done;
+} dfk_workers_t;
+#endif
+
 /**
  * Default scheduler object
  */
@@ -25,23 +78,304 @@ typedef struct dfk_scheduler_t {
   dfk_fiber_t* current;
   /** Fiber for the eventloop */
   dfk_fiber_t* eventloop;
-  /** List of fibers waiting for CPU */
-  dfk_list_t pending;
+  /** Eventloop object served by the eventloop fiber */
+  dfk_eventloop_t loop;
+  /** Lists of fibers waiting for CPU, one per lane */
+  dfk_list_t pending[DFK_NLANES];
+  /** Total number of fibers waiting for CPU */
+  size_t npending;
   /** Number of fibers waiting for IO */
   size_t iowait;
   /** List of terminated fibers, they wait for scheduler to clean them up */
   dfk_list_t terminated;
+  /** Number of direct handoffs since the scheduler had control last time */
+  size_t nhandoffs;
+#if DFK_THREADS
+  /** Protects pending lists against concurrent access by other workers */
+  pthread_mutex_t lock;
+  /**
+   * A fiber that has yielded back to the scheduler.
+   *
+   * Fiber's context is known to be saved only when the scheduler regains
+   * control, since then the fiber is allowed to run on another worker.
+   */
+  dfk_fiber_t* yielded;
+  dfk_workers_t* workers;
+  /** Index of the scheduler within dfk_workers_t.schedulers */
+  size_t index;
+  pthread_t thread;
+  /** A coro object the worker thread has started from */
+  struct coro_context comeback;
+#endif
 } dfk_scheduler_t;
 
-static void dfk__scheduler_init(dfk_scheduler_t* scheduler,
-    dfk_fiber_t* self, dfk_fiber_t* eventloop)
+#if DFK_THREADS
+/**
+ * Scheduler of the worker thread, NULL for non-worker threads
+ */
+static _Thread_local dfk_scheduler_t* dfk__current_worker;
+#endif
+
+/**
+ * Returns scheduler that drives the calling thread
+ *
+ * @warning Do not use value returned by this function after context switch -
+ * fiber could be resumed by another worker.
+ */
+static dfk_scheduler_t* dfk__worker(dfk_scheduler_t* scheduler)
 {
+#if DFK_THREADS
+  if (dfk__current_worker) {
+    return dfk__current_worker;
+  }
+#endif
+  return scheduler;
+}
+
+static int dfk__scheduler_init(dfk_scheduler_t* scheduler, dfk_fiber_t* self)
+{
+  dfk_t* dfk = self->dfk;
   scheduler->fiber = self;
   scheduler->current = NULL;
-  scheduler->eventloop = eventloop;
-  dfk_list_init(&scheduler->pending);
+  for (size_t i = 0; i < DFK_NLANES; ++i) {
+    dfk_list_init(scheduler->pending + i);
+  }
+  scheduler->npending = 0;
+  scheduler->nhandoffs = 0;
   dfk_list_init(&scheduler->terminated);
   scheduler->iowait = 0;
+  scheduler->eventloop = dfk__spawn(dfk, dfk__eventloop_main,
+      &scheduler->loop, 0);
+  if (!scheduler->eventloop) {
+    DFK_ERROR(dfk, "can not spawn fiber for eventloop");
+    return dfk->dfk_errno;
+  }
+  dfk_fiber_name(scheduler->eventloop, "eventloop");
+  int err = dfk__eventloop_init(&scheduler->loop, dfk);
+  if (err != dfk_err_ok) {
+    dfk__fiber_free(dfk, scheduler->eventloop);
+    return err;
+  }
+#if DFK_THREADS
+  pthread_mutex_init(&scheduler->lock, NULL);
+  scheduler->yielded = NULL;
+  scheduler->workers = NULL;
+  scheduler->index = 0;
+  memset(&scheduler->comeback, 0, sizeof(scheduler->comeback));
+#endif
+  return dfk_err_ok;
+}
+
+static void dfk__scheduler_free(dfk_scheduler_t* scheduler)
+{
+  dfk_t* dfk = scheduler->fiber->dfk;
+  dfk__eventloop_free(&scheduler->loop);
+  dfk__fiber_free(dfk, scheduler->eventloop);
+#if DFK_THREADS
+  pthread_mutex_destroy(&scheduler->lock);
+#endif
+  DFK_IF_DEBUG(scheduler->eventloop = DFK_PDEADBEEF);
+}
+
+#if DFK_THREADS
+static void dfk__workers_notify(dfk_workers_t* workers)
+{
+  if (!workers || !workers->nidle) {
+    return;
+  }
+  pthread_mutex_lock(&workers->lock);
+  pthread_cond_signal(&workers->wakeup);
+  pthread_mutex_unlock(&workers->lock);
+}
+#endif
+
+/**
+ * Returns the run queue lane the fiber belongs to
+ */
+static size_t dfk__scheduler_lane(dfk_fiber_t* fiber)
+{
+  switch (fiber->_priority) {
+    case dfk_fiber_priority_control:
+      return DFK_LANE_CONTROL;
+    case dfk_fiber_priority_background:
+      return fiber->_deadline ? DFK_LANE_DEADLINE : DFK_LANE_BACKGROUND;
+    default:
+      return fiber->_deadline ? DFK_LANE_DEADLINE : DFK_LANE_REQUEST;
+  }
+}
+
+/**
+ * Append fiber to the run queue of the scheduler
+ */
+static void dfk__scheduler_push(dfk_scheduler_t* scheduler,
+    dfk_fiber_t* fiber)
+{
+  size_t lane = dfk__scheduler_lane(fiber);
+  dfk_list_t* pending = scheduler->pending + lane;
+#if DFK_THREADS
+  pthread_mutex_lock(&scheduler->lock);
+#endif
+  if (lane == DFK_LANE_DEADLINE) {
+    /*
+     * Keep the lane sorted by deadline. Search from the back, since new
+     * deadlines are likely to be the latest ones.
+     */
+    dfk_list_rit it, end;
+    dfk_list_rbegin(pending, &it);
+    dfk_list_rend(pending, &end);
+    while (!dfk_list_rit_equal(&it, &end)
+        && TO_FIBER(it.value)->_deadline > fiber->_deadline) {
+      dfk_list_rit_next(&it);
+    }
+    dfk_list_rinsert(pending, &fiber->_hook, &it);
+  } else {
+    dfk_list_append(pending, &fiber->_hook);
+  }
+  scheduler->npending++;
+#if DFK_THREADS
+  pthread_mutex_unlock(&scheduler->lock);
+  dfk__workers_notify(scheduler->workers);
+#endif
+}
+
+/**
+ * Pop fiber from the highest non-empty lane of the run queue, returns NULL
+ * if the queue is empty
+ *
+ * Owner of the queue pops from the front, while other workers steal from
+ * the back.
+ */
+static dfk_fiber_t* dfk__scheduler_pop(dfk_scheduler_t* scheduler, int back)
+{
+  dfk_fiber_t* fiber = NULL;
+#if DFK_THREADS
+  pthread_mutex_lock(&scheduler->lock);
+#endif
+  for (size_t i = 0; i < DFK_NLANES && scheduler->npending; ++i) {
+    dfk_list_t* pending = scheduler->pending + i;
+    if (dfk_list_empty(pending)) {
+      continue;
+    }
+    if (back) {
+      fiber = TO_FIBER(dfk_list_back(pending));
+      dfk_list_pop_back(pending);
+    } else {
+      fiber = TO_FIBER(dfk_list_front(pending));
+      dfk_list_pop_front(pending);
+    }
+    scheduler->npending--;
+    break;
+  }
+#if DFK_THREADS
+  pthread_mutex_unlock(&scheduler->lock);
+#endif
+  return fiber;
+}
+
+static size_t dfk__scheduler_npending(dfk_scheduler_t* scheduler)
+{
+#if DFK_THREADS
+  pthread_mutex_lock(&scheduler->lock);
+  size_t npending = scheduler->npending;
+  pthread_mutex_unlock(&scheduler->lock);
+  return npending;
+#else
+  return scheduler->npending;
+#endif
+}
+
+#if DFK_THREADS
+/**
+ * Move one runnable fiber from another worker's run queue
+ *
+ * Returns 1 if a fiber was stolen, 0 otherwise.
+ */
+static int dfk__scheduler_steal(dfk_scheduler_t* scheduler)
+{
+  dfk_workers_t* workers = scheduler->workers;
+  for (size_t i = 1; i < workers->nworkers; ++i) {
+    dfk_scheduler_t* victim =
+      workers->schedulers + (scheduler->index + i) % workers->nworkers;
+    dfk_fiber_t* fiber = dfk__scheduler_pop(victim, 1);
+    if (fiber) {
+      DFK_DBG(fiber->dfk, "worker %lu stole {%p} from worker %lu",
+          (unsigned long) scheduler->index, (void*) fiber,
+          (unsigned long) victim->index);
+      dfk__scheduler_push(scheduler, fiber);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Called by the worker that has nothing to do.
+ *
+ * Returns 1 if all workers are idle, therefore job is done, 0 otherwise.
+ */
+static int dfk__scheduler_idle(dfk_scheduler_t* scheduler)
+{
+  dfk_workers_t* workers = scheduler->workers;
+  if (dfk__scheduler_steal(scheduler)) {
+    return 0;
+  }
+  pthread_mutex_lock(&workers->lock);
+  ++workers->nidle;
+  /*
+   * A fiber pushed after the steal attempt would not wake this worker up,
+   * since the pushing worker may have seen nidle == 0. Fibers pushed after
+   * the check below are signalled, which happens once the wait has started,
+   * since workers->lock is held until then.
+   */
+  for (size_t i = 0; i < workers->nworkers; ++i) {
+    if (dfk__scheduler_npending(workers->schedulers + i)) {
+      workers->nidle--;
+      pthread_mutex_unlock(&workers->lock);
+      return 0;
+    }
+  }
+  if (workers->nidle == workers->nworkers) {
+    DFK_DBG(scheduler->fiber->dfk, "all %lu workers are idle, terminate",
+        (unsigned long) workers->nworkers);
+    workers->done = 1;
+    pthread_cond_broadcast(&workers->wakeup);
+  } else {
+    pthread_cond_wait(&workers->wakeup, &workers->lock);
+  }
+  int done = workers->done;
+  if (!done) {
+    workers->nidle--;
+  }
+  pthread_mutex_unlock(&workers->lock);
+  return done;
+}
+#endif
+
+/**
+ * Transfer control to the fiber, return when it yields back
+ */
+static void dfk__scheduler_run(dfk_scheduler_t* scheduler, dfk_fiber_t* fiber)
+{
+  dfk_t* dfk = scheduler->fiber->dfk;
+  DFK_DBG(dfk, "{%p} next fiber to run {%p}", (void*) dfk, (void*) fiber);
+#if DFK_THREADS
+  /*
+   * Fiber could be resumed by another worker before it has yielded back to
+   * the scheduler of that worker. Wait until fiber's context is saved.
+   */
+  while (atomic_exchange(&fiber->_busy, 1)) {
+  }
+#endif
+  scheduler->current = fiber;
+  scheduler->nhandoffs = 0;
+  dfk_yield(scheduler->fiber, fiber);
+#if DFK_THREADS
+  if (scheduler->yielded) {
+    atomic_store(&scheduler->yielded->_busy, 0);
+    scheduler->yielded = NULL;
+  }
+#endif
+  DFK_DBG(dfk, "{%p} back in scheduler", (void*) dfk);
 }
 
 /**
@@ -52,15 +386,20 @@ static int dfk__scheduler(dfk_scheduler_t* scheduler)
   dfk_t* dfk = scheduler->fiber->dfk;
 
   DFK_DBG(dfk, "fibers pending: %lu, terminated: %lu, iowait: %lu",
-      (unsigned long) dfk_list_size(&scheduler->pending),
+      (unsigned long) dfk__scheduler_npending(scheduler),
       (unsigned long) dfk_list_size(&scheduler->terminated),
       (unsigned long) scheduler->iowait);
 
   if (dfk_list_empty(&scheduler->terminated)
-      && dfk_list_empty(&scheduler->pending)
+      && !dfk__scheduler_npending(scheduler)
       && !scheduler->iowait) {
+#if DFK_THREADS
+    DFK_DBG(dfk, "{%p} no pending fibers, try to steal", (void*) dfk);
+    return dfk__scheduler_idle(scheduler);
+#else
     DFK_DBG(dfk, "{%p} no pending fibers, terminate", (void*) dfk);
     return 1;
+#endif
   }
 
   DFK_DBG(dfk, "{%p} cleanup %lu terminated fiber(s)", (void*) dfk,
@@ -74,41 +413,52 @@ static int dfk__scheduler(dfk_scheduler_t* scheduler)
     dfk__fiber_free(dfk, fiber);
   }
 
-  DFK_DBG(dfk, "{%p} execute %lu CPU hungry fiber(s)", (void*) dfk,
-      (unsigned long) dfk_list_size(&scheduler->pending));
   {
     /*
-     * Move scheduler->pending list into a local copy, to prevent iteration over
-     * a list that is modified in progress. New elements could be added to
-     * scheduler->pending list when any fiber woren up calls dfk_run().
+     * Run at most npending fibers, the ones added to the run queue in
+     * progress will be executed during the next iteration, unless they
+     * belong to a higher priority lane. Fibers are popped one by one to
+     * keep them available for stealing.
      */
-    dfk_list_t pending;
-    dfk_list_init(&pending);
-    dfk_list_move(&scheduler->pending, &pending);
-    while (!dfk_list_empty(&pending)) {
-      dfk_fiber_t* fiber = DFK_CONTAINER_OF(dfk_list_front(&pending),
-          dfk_fiber_t, _hook);
-      dfk_list_pop_front(&pending);
-      DFK_DBG(dfk, "{%p} next fiber to run {%p}", (void*) dfk, (void*) fiber);
-      scheduler->current = fiber;
-      dfk_yield(scheduler->fiber, fiber);
-      DFK_DBG(dfk, "{%p} back in scheduler", (void*) dfk);
+    size_t npending = dfk__scheduler_npending(scheduler);
+    DFK_DBG(dfk, "{%p} execute %lu CPU hungry fiber(s)", (void*) dfk,
+        (unsigned long) npending);
+    dfk_fiber_t* fiber;
+    while (npending-- && (fiber = dfk__scheduler_pop(scheduler, 0))) {
+      dfk__scheduler_run(scheduler, fiber);
     }
   }
 
-  if (dfk_list_empty(&scheduler->pending) && scheduler->iowait) {
+  if (!dfk__scheduler_npending(scheduler) && scheduler->iowait) {
     /*
      * Pending fibers list is empty, while IO hungry fibers
      * exist - switch to IO with possible blocking.
      */
     DFK_DBG(dfk, "no pending fibers, %lu I/O hungry fibers, will do I/O",
         (unsigned long) scheduler->iowait);
-    scheduler->current = scheduler->eventloop;
-    dfk_yield(scheduler->fiber, scheduler->eventloop);
+    dfk__scheduler_run(scheduler, scheduler->eventloop);
   }
   return 0;
 }
 
+static void dfk__scheduler_loop(dfk_scheduler_t* scheduler)
+{
+  dfk_t* dfk = scheduler->fiber->dfk;
+#if DFK_THREADS
+  dfk__current_worker = scheduler;
+#endif
+  int ret = 0;
+  while (!ret) {
+    ret = dfk__scheduler(scheduler);
+    DFK_DBG(dfk, "schedule returned %d, %s", ret,
+        ret ? "terminating" : "continue spinning");
+  }
+  scheduler->current = NULL;
+#if DFK_THREADS
+  dfk__current_worker = NULL;
+#endif
+}
+
 void dfk__resume(dfk_scheduler_t* scheduler, dfk_fiber_t* fiber)
 {
   assert(fiber);
@@ -119,13 +469,14 @@ void dfk__resume(dfk_scheduler_t* scheduler, dfk_fiber_t* fiber)
    */
   assert(scheduler);
   DFK_DBG(fiber->dfk, "{%p}", (void*) fiber);
-  dfk_list_append(&scheduler->pending, &fiber->_hook);
+  dfk__scheduler_push(dfk__worker(scheduler), fiber);
 }
 
 void dfk__terminate(dfk_scheduler_t* scheduler, dfk_fiber_t* fiber)
 {
   assert(scheduler);
   assert(fiber);
+  scheduler = dfk__worker(scheduler);
   dfk_list_append(&scheduler->terminated, &fiber->_hook);
   DFK_DBG(fiber->dfk, "{%p}", (void*) fiber);
   /*
@@ -139,7 +490,13 @@ void dfk__terminate(dfk_scheduler_t* scheduler, dfk_fiber_t* fiber)
 dfk_fiber_t* dfk__this_fiber(dfk_scheduler_t* scheduler)
 {
   assert(scheduler);
-  return scheduler->current;
+  return dfk__worker(scheduler)->current;
+}
+
+dfk_eventloop_t* dfk__this_eventloop(dfk_scheduler_t* scheduler)
+{
+  assert(scheduler);
+  return &dfk__worker(scheduler)->loop;
 }
 
 void dfk__yielded(dfk_scheduler_t* scheduler, dfk_fiber_t* from,
@@ -148,15 +505,23 @@ void dfk__yielded(dfk_scheduler_t* scheduler, dfk_fiber_t* from,
   assert(scheduler);
   assert(from);
   assert(to);
+  scheduler = dfk__worker(scheduler);
+#if DFK_THREADS
+  if (to == scheduler->fiber) {
+    scheduler->yielded = from;
+  }
+#else
   DFK_UNUSED(from);
+#endif
   scheduler->current = to;
 }
 
 void dfk__suspend(dfk_scheduler_t* scheduler)
 {
   assert(scheduler);
+  scheduler = dfk__worker(scheduler);
   dfk_t* dfk = scheduler->fiber->dfk;
-  dfk_fiber_t* this = dfk__this_fiber(scheduler);
+  dfk_fiber_t* this = scheduler->current;
   DFK_DBG(dfk, "{%p}", (void*) this);
   dfk_yield(this, scheduler->fiber);
 }
@@ -164,8 +529,9 @@ void dfk__suspend(dfk_scheduler_t* scheduler)
 void dfk__iosuspend(dfk_scheduler_t* scheduler)
 {
   assert(scheduler);
+  scheduler = dfk__worker(scheduler);
   dfk_t* dfk = scheduler->fiber->dfk;
-  dfk_fiber_t* this = dfk__this_fiber(scheduler);
+  dfk_fiber_t* this = scheduler->current;
   DFK_DBG(dfk, "{%p}", (void*) this);
   scheduler->iowait++;
   dfk_yield(this, scheduler->fiber);
@@ -175,21 +541,178 @@ void dfk__ioresume(struct dfk_scheduler_t* scheduler, dfk_fiber_t* fiber)
 {
   assert(scheduler);
   assert(fiber);
+  scheduler = dfk__worker(scheduler);
   DFK_DBG(fiber->dfk, "{%p}", (void*) fiber);
   scheduler->iowait--;
-  dfk_list_append(&scheduler->pending, &fiber->_hook);
+  dfk__scheduler_push(scheduler, fiber);
 }
 
 void dfk__postpone(dfk_scheduler_t* scheduler)
 {
   assert(scheduler);
+  scheduler = dfk__worker(scheduler);
   dfk_t* dfk = scheduler->fiber->dfk;
-  dfk_fiber_t* this = dfk__this_fiber(scheduler);
+  dfk_fiber_t* this = scheduler->current;
   DFK_DBG(dfk, "{%p}", (void*) this);
-  dfk_list_append(&scheduler->pending, &this->_hook);
+  dfk__scheduler_push(scheduler, this);
   dfk_yield(this, scheduler->fiber);
 }
 
+void dfk__handoff(dfk_scheduler_t* scheduler, dfk_fiber_t* fiber)
+{
+  assert(scheduler);
+  assert(fiber);
+  scheduler = dfk__worker(scheduler);
+#if DFK_THREADS
+  /*
+   * Postponed fiber could be stolen by another worker before its context
+   * is saved, direct handoff is not supported.
+   */
+  dfk__scheduler_push(scheduler, fiber);
+#else
+  dfk_t* dfk = scheduler->fiber->dfk;
+  dfk_fiber_t* this = scheduler->current;
+  if (scheduler->nhandoffs >= dfk->handoff_limit
+      || this == scheduler->eventloop) {
+    DFK_DBG(dfk, "{%p} handoff limit reached, resume {%p}", (void*) this,
+        (void*) fiber);
+    dfk__scheduler_push(scheduler, fiber);
+    return;
+  }
+  scheduler->nhandoffs++;
+  DFK_DBG(dfk, "{%p} handoff to {%p}, %lu in a row", (void*) this,
+      (void*) fiber, (unsigned long) scheduler->nhandoffs);
+  dfk__scheduler_push(scheduler, this);
+  dfk_yield(this, fiber);
+#endif
+}
+
+#if DFK_THREADS
+/**
+ * Entry point for the schedulers of the worker threads, except the first one
+ */
+static void dfk__worker_main(dfk_fiber_t* fiber, void* arg)
+{
+  dfk_scheduler_t* scheduler = (dfk_scheduler_t*) arg;
+  DFK_DBG(fiber->dfk, "worker %lu started", (unsigned long) scheduler->index);
+  dfk__scheduler_loop(scheduler);
+  DFK_DBG(fiber->dfk, "worker %lu done", (unsigned long) scheduler->index);
+  coro_transfer(&fiber->_ctx, &scheduler->comeback);
+} /* LCOV_EXCL_LINE */
+
+static void* dfk__worker_thread(void* arg)
+{
+  dfk_scheduler_t* scheduler = (dfk_scheduler_t*) arg;
+  coro_transfer(&scheduler->comeback, &scheduler->fiber->_ctx);
+  return NULL;
+}
+
+/**
+ * Initialize schedulers for worker threads, start all workers but the first.
+ *
+ * The first worker is executed by the thread that has called dfk_work().
+ */
+static int dfk__workers_start(dfk_workers_t* workers, dfk_fiber_t* self)
+{
+  dfk_t* dfk = self->dfk;
+  size_t nworkers = DFK_MAX(dfk->nworkers, (size_t) 1);
+  workers->schedulers = dfk__malloc(dfk, nworkers * sizeof(dfk_scheduler_t));
+  if (!workers->schedulers) {
+    return dfk_err_nomem;
+  }
+  workers->nworkers = 0;
+  workers->nidle = 0;
+  workers->done = 0;
+  pthread_mutex_init(&workers->lock, NULL);
+  pthread_cond_init(&workers->wakeup, NULL);
+
+  int err = dfk_err_ok;
+  for (size_t i = 0; i < nworkers; ++i) {
+    dfk_scheduler_t* scheduler = workers->schedulers + i;
+    dfk_fiber_t* fiber = self;
+    if (i) {
+      fiber = dfk__spawn(dfk, dfk__worker_main, scheduler, 0);
+      if (!fiber) {
+        err = dfk->dfk_errno;
+        break;
+      }
+      dfk_fiber_name(fiber, "scheduler-%lu", (unsigned long) i);
+    }
+    err = dfk__scheduler_init(scheduler, fiber);
+    if (err != dfk_err_ok) {
+      if (i) {
+        dfk__fiber_free(dfk, fiber);
+      }
+      break;
+    }
+    scheduler->workers = workers;
+    scheduler->index = i;
+    workers->nworkers++;
+  }
+
+  if (err == dfk_err_ok) {
+    dfk->_scheduler = workers->schedulers;
+    dfk->_eventloop = &workers->schedulers[0].loop;
+  }
+
+  /*
+   * Start threads only when all schedulers are initialized, since workers
+   * access each other's run queues.
+   */
+  for (size_t i = 1; err == dfk_err_ok && i < workers->nworkers; ++i) {
+    dfk_scheduler_t* scheduler = workers->schedulers + i;
+    int ret = pthread_create(&scheduler->thread, NULL,
+        dfk__worker_thread, scheduler);
+    if (ret) {
+      DFK_ERROR(dfk, "pthread_create failed, errno=%d %s", ret, strerror(ret));
+      dfk->sys_errno = ret;
+      /*
+       * Proceed with the threads started so far - all of them need
+       * to be joined anyway.
+       */
+      for (size_t j = i; j < workers->nworkers; ++j) {
+        dfk__scheduler_free(workers->schedulers + j);
+        dfk__fiber_free(dfk, workers->schedulers[j].fiber);
+      }
+      workers->nworkers = i;
+      break;
+    }
+  }
+
+  if (err != dfk_err_ok) {
+    for (size_t i = 0; i < workers->nworkers; ++i) {
+      dfk__scheduler_free(workers->schedulers + i);
+      if (i) {
+        dfk__fiber_free(dfk, workers->schedulers[i].fiber);
+      }
+    }
+    pthread_cond_destroy(&workers->wakeup);
+    pthread_mutex_destroy(&workers->lock);
+    dfk__free(dfk, workers->schedulers);
+    dfk->_scheduler = NULL;
+    dfk->_eventloop = NULL;
+  }
+  return err;
+}
+
+static void dfk__workers_join(dfk_workers_t* workers)
+{
+  dfk_t* dfk = workers->schedulers[0].fiber->dfk;
+  for (size_t i = 1; i < workers->nworkers; ++i) {
+    pthread_join(workers->schedulers[i].thread, NULL);
+  }
+  for (size_t i = 0; i < workers->nworkers; ++i) {
+    dfk__scheduler_free(workers->schedulers + i);
+    if (i) {
+      dfk__fiber_free(dfk, workers->schedulers[i].fiber);
+    }
+  }
+  pthread_cond_destroy(&workers->wakeup);
+  pthread_mutex_destroy(&workers->lock);
+  dfk__free(dfk, workers->schedulers);
+}
+#endif
+
 void dfk__scheduler_main(dfk_fiber_t* fiber, void* arg)
 {
   assert(fiber);
@@ -199,35 +722,40 @@ void dfk__scheduler_main(dfk_fiber_t* fiber, void* arg)
   dfk_t* dfk = fiber->dfk;
   dfk_fiber_t* mainf = (dfk_fiber_t*) arg;
 
-  dfk_eventloop_t eventloop;
-  dfk_fiber_t* loopf = dfk__spawn(dfk, dfk__eventloop_main, &eventloop, 0);
-  if (!loopf) {
-    DFK_ERROR(dfk, "can not spawn fiber for eventloop");
+#if DFK_THREADS
+  dfk_workers_t workers;
+  if (dfk__workers_start(&workers, fiber) != dfk_err_ok) {
+    DFK_ERROR(dfk, "can not start worker threads");
     dfk__fiber_free(dfk, mainf);
     /* A proper way of terminating scheduler */
     coro_transfer(&fiber->_ctx, &dfk->_comeback);
   }
-  dfk_fiber_name(loopf, "eventloop");
-  dfk__eventloop_init(&eventloop, dfk);
-
-  dfk_scheduler_t scheduler;
-  dfk__scheduler_init(&scheduler, fiber, loopf);
-  dfk->_scheduler = &scheduler;
-  dfk->_eventloop = &eventloop;
+  dfk_scheduler_t* scheduler = workers.schedulers;
+  DFK_INFO(dfk, "{%p} %lu worker thread(s) started", (void*) dfk,
+      (unsigned long) workers.nworkers);
+#else
+  dfk_scheduler_t schedulerobj;
+  dfk_scheduler_t* scheduler = &schedulerobj;
+  if (dfk__scheduler_init(scheduler, fiber) != dfk_err_ok) {
+    dfk__fiber_free(dfk, mainf);
+    /* A proper way of terminating scheduler */
+    coro_transfer(&fiber->_ctx, &dfk->_comeback);
+  }
+#endif
+  dfk->_scheduler = scheduler;
+  dfk->_eventloop = &scheduler->loop;
 
   /* Scheduler is initialized - now we can schedule main fiber manually */
-  dfk__resume(&scheduler, mainf);
+  dfk__resume(scheduler, mainf);
 
-  int ret = 0;
-  while (!ret) {
-    ret = dfk__scheduler(&scheduler);
-    DFK_DBG(dfk, "schedule returned %d, %s", ret,
-        ret ? "terminating" : "continue spinning");
-  }
+  dfk__scheduler_loop(scheduler);
   DFK_INFO(dfk, "no pending fibers left in execution queue, job is done");
-  scheduler.current = NULL;
 
-  dfk__eventloop_free(&eventloop);
+#if DFK_THREADS
+  dfk__workers_join(&workers);
+#else
+  dfk__scheduler_free(scheduler);
+#endif
 
   /* Same format as in fiber.c */
 #if DFK_NAMED_FIBERS
@@ -235,8 +763,6 @@ void dfk__scheduler_main(dfk_fiber_t* fiber, void* arg)
 #else
   DFK_DBG(dfk, "context switch {%p} -> {init}", (void*) dfk->_scheduler);
 #endif
-  dfk__fiber_free(dfk, loopf);
   /* Story ends, main character rudes into the sunset */
   coro_transfer(&fiber->_ctx, &dfk->_comeback);
 } /* LCOV_EXCL_LINE */
-
@@ -39,6 +39,8 @@ int dfk__eventloop_init(dfk_eventloop_t* loop, dfk_t* dfk)
   assert(dfk);
   loop->dfk = dfk;
   dfk_list_init(&loop->fds);
+  loop->idle_since = 0;
+  dfk__timer_wheel_init(&loop->timers);
   return 0;
 }
 
@@ -60,9 +62,10 @@ void dfk__eventloop_main(dfk_fiber_t* fiber, void* arg)
   fd_set writefds;
   fd_set exceptfds;
   while (1) {
-    if (dfk_list_empty(&loop->fds)) {
+    if (dfk_list_empty(&loop->fds) && !loop->timers.ntimers) {
       DFK_DBG(dfk, "{%p} no fd needs IO, suspend", (void*) loop);
       DFK_SUSPEND(dfk);
+      continue;
     }
     FD_ZERO(&readfds);
     FD_ZERO(&writefds);
@@ -86,7 +89,17 @@ void dfk__eventloop_main(dfk_fiber_t* fiber, void* arg)
       }
     }
     DFK_DBG(dfk, "{%p} call select with max fd = %d", (void*) loop, maxfd);
-    int nfd = select(maxfd + 1, &readfds, &writefds, &exceptfds, NULL);
+    struct timeval tv;
+    struct timeval* timeout = NULL;
+    int64_t nsec = dfk__eventloop_timeout(dfk, &loop->idle_since,
+        &loop->timers);
+    if (nsec >= 0) {
+      tv.tv_sec = (time_t) (nsec / 1000000000);
+      /* Round up, so that timers do not fire prematurely */
+      tv.tv_usec = (suseconds_t) ((nsec % 1000000000 + 999) / 1000);
+      timeout = &tv;
+    }
+    int nfd = select(maxfd + 1, &readfds, &writefds, &exceptfds, timeout);
     if (nfd == -1) {
       if (errno == EINTR) {
         DFK_INFO(dfk, "{%p} select() interrupted by signal, restarting",
@@ -98,11 +111,12 @@ void dfk__eventloop_main(dfk_fiber_t* fiber, void* arg)
     }
     if (nfd == 0) {
       DFK_DBG(dfk, "{%p} select returned 0, susped IO", (void*) loop);
+      dfk__timer_wheel_advance(&loop->timers, dfk__clock());
       DFK_SUSPEND(dfk);
       continue;
     }
+    loop->idle_since = 0;
     {
-      int any_ready = 0;
       dfk_list_it it, end;
       dfk_list_begin(&loop->fds, &it);
       dfk_list_end(&loop->fds, &end);
@@ -134,22 +148,34 @@ void dfk__eventloop_main(dfk_fiber_t* fiber, void* arg)
           dfk_list_it itcopy = it;
           dfk_list_it_next(&it);
           dfk_list_erase(&loop->fds, &itcopy);
+          dfk__timer_wheel_del(&loop->timers, &e->timer);
           DFK_IORESUME(e->yieldback);
-          any_ready = 1;
         } else {
           DFK_DBG(dfk, "{%p} no events received for fd %d",
               (void*) loop, e->fd);
           dfk_list_it_next(&it);
         }
       }
-      if (any_ready) {
-        DFK_SUSPEND(dfk);
-      }
     }
+    dfk__timer_wheel_advance(&loop->timers, dfk__clock());
+    DFK_SUSPEND(dfk);
   }
 }
 
-int dfk__io(dfk_eventloop_t* loop, int socket, int events)
+static void dfk__io_expired(dfk_timer_t* timer)
+{
+  dfk_eventloop_t* loop = (dfk_eventloop_t*) timer->arg;
+  dfk_fdlist_element_t* e =
+    DFK_CONTAINER_OF(timer, dfk_fdlist_element_t, timer);
+  DFK_DBG(loop->dfk, "{%p} deadline for fd %d expired", (void*) loop, e->fd);
+  dfk_list_it it;
+  dfk_list_it_from_value(&loop->fds, &e->hook, &it);
+  dfk_list_erase(&loop->fds, &it);
+  e->events = 0;
+  DFK_IORESUME(e->yieldback);
+}
+
+int dfk__io(dfk_eventloop_t* loop, int socket, int events, uint64_t deadline)
 {
   assert(loop);
   assert(socket);
@@ -162,6 +188,10 @@ int dfk__io(dfk_eventloop_t* loop, int socket, int events)
     .yieldback = DFK_THIS_FIBER(dfk),
   };
   dfk_list_append(&loop->fds, &e.hook);
+  dfk__timer_init(&e.timer, dfk__io_expired, loop);
+  if (deadline) {
+    dfk__timer_wheel_add(&loop->timers, &e.timer, deadline);
+  }
 #if DFK_DEBUG
   char strev[16];
   size_t nwritten = dfk__io_events_to_str(events, strev, DFK_SIZE(strev));
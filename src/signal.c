@@ -126,12 +126,17 @@ static int dfk__sigwait(dfk_t* dfk, size_t nsignals, int* signum)
     }
   }
 
+  /* Signal watchers are woken up ahead of regular fibers */
+  dfk_fiber_t* this = DFK_THIS_FIBER(dfk);
+  dfk_fiber_priority_e priority = this->_priority;
+  dfk_fiber_priority(this, dfk_fiber_priority_control);
   char c;
   int finalerr = dfk_err_ok;
-  ssize_t nread = dfk__read(dfk, NULL, pipefd[0], &c, 1);
+  ssize_t nread = dfk__read(dfk, NULL, pipefd[0], NULL, &c, 1, 0);
   if (nread < 0) {
     finalerr = dfk_err_sys;
   }
+  dfk_fiber_priority(this, priority);
 
   dfk_list_it it;
   dfk_list_it_from_value(&waiting_fibers, &wf.hook, &it);
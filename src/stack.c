@@ -0,0 +1,270 @@
+/**
+ * @file stack.c
+ *
+ * Contains fiber stack allocation routines.
+ *
+ * Stacks are allocated with mmap, guard pages are protected once upon
+ * allocation. Stacks of terminated fibers are returned to the per-context
+ * pool, so that spawning a fiber rarely requires a syscall and touches
+ * already faulted-in memory.
+ *
+ * If #DFK_STACK is LAZY, stacks are reserved with MAP_NORESERVE and pages
+ * are committed on demand. Once a stack is returned to the pool, pages
+ * below dfk_t.stack_resident_size are released with madvise, so that
+ * resident memory tracks the actual depth of the stack.
+ *
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LISENSE)
+ */
+
+#include <assert.h>
+#include <dfk/config.h>
+#include <dfk/error.h>
+#include <dfk/malloc.h>
+#include <dfk/internal.h>
+#include <dfk/internal/stack.h>
+
+#if DFK_HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#if DFK_STACK_LAZY
+#include <errno.h>
+#endif
+
+#define TO_STACK(expr) DFK_CONTAINER_OF((expr), dfk_stack_t, hook)
+
+#define DFK_ROUND_UP(x, y) (((x) + (y) - 1) / (y) * (y))
+
+#if DFK_THREADS
+#define DFK_STACK_POOL_LOCK(dfk) pthread_mutex_lock(&(dfk)->_stack_pool_lock)
+#define DFK_STACK_POOL_UNLOCK(dfk) \
+  pthread_mutex_unlock(&(dfk)->_stack_pool_lock)
+#else
+#define DFK_STACK_POOL_LOCK(dfk)
+#define DFK_STACK_POOL_UNLOCK(dfk)
+#endif
+
+static dfk_stack_t* dfk__stack_new(dfk_t* dfk, size_t size, int populate)
+{
+#if DFK_HAVE_SYS_MMAN_H
+  size = DFK_ROUND_UP(size, (size_t) DFK_PAGE_SIZE);
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if DFK_STACK_LAZY
+  /* Address space is reserved, memory is committed on demand */
+  flags |= MAP_NORESERVE;
+  DFK_UNUSED(populate);
+#elif defined(MAP_POPULATE)
+  if (populate) {
+    flags |= MAP_POPULATE;
+  }
+#else
+  DFK_UNUSED(populate);
+#endif
+  char* base = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (base == MAP_FAILED) {
+    DFK_ERROR_SYSCALL(dfk, "mmap");
+    dfk->dfk_errno = dfk_err_nomem;
+    return NULL;
+  }
+#if DFK_STACK_LAZY && defined(MADV_NOHUGEPAGE)
+  /* Transparent huge pages would commit stack memory in 2MB chunks */
+  if (madvise(base, size, MADV_NOHUGEPAGE) == -1) {
+    DFK_DBG(dfk, "madvise(MADV_NOHUGEPAGE) failed, errno %d", errno);
+  }
+#endif
+  char* bottom = base;
+#if DFK_STACK_GUARD_SIZE
+  {
+    size_t guard = DFK_ROUND_UP((size_t) DFK_STACK_GUARD_SIZE,
+        (size_t) DFK_PAGE_SIZE);
+    if (mprotect(base, guard, PROT_NONE) == -1) {
+      DFK_ERROR_SYSCALL(dfk, "mprotect");
+      munmap(base, size);
+      dfk->dfk_errno = dfk_err_sys;
+      return NULL;
+    }
+    bottom += guard;
+  }
+#endif
+#else
+  DFK_UNUSED(populate);
+  char* base = dfk__malloc(dfk, size);
+  if (!base) {
+    dfk->dfk_errno = dfk_err_nomem;
+    return NULL;
+  }
+  char* bottom = base;
+#endif
+  /* dfk_stack_t object is placed at the very top of the stack */
+  char* top = base + size - sizeof(dfk_stack_t);
+  top -= (ptrdiff_t) top % DFK_MALLOC_ALIGNMENT;
+  assert(top > bottom);
+  dfk_stack_t* stack = (dfk_stack_t*) top;
+  dfk_list_hook_init(&stack->hook);
+  stack->base = base;
+  stack->size = size;
+  stack->bottom = bottom;
+  stack->top = top;
+  DFK_DBG(dfk, "{%p} new stack [%p, %p)", (void*) stack, (void*) bottom,
+      (void*) top);
+  return stack;
+}
+
+static void dfk__stack_delete(dfk_t* dfk, dfk_stack_t* stack)
+{
+  DFK_DBG(dfk, "{%p} release stack", (void*) stack);
+#if DFK_HAVE_SYS_MMAN_H
+  if (munmap(stack->base, stack->size) == -1) {
+    DFK_ERROR_SYSCALL(dfk, "munmap");
+  }
+#else
+  dfk__free(dfk, stack->base);
+#endif
+}
+
+/**
+ * Whether a stack allocated for @p size bytes request can be reused
+ */
+static int dfk__stack_fits(dfk_stack_t* stack, size_t size)
+{
+#if DFK_HAVE_SYS_MMAN_H
+  size = DFK_ROUND_UP(size, (size_t) DFK_PAGE_SIZE);
+#endif
+  return stack->size == size;
+}
+
+dfk_stack_t* dfk__stack_alloc(dfk_t* dfk, size_t size)
+{
+  assert(dfk);
+  assert(size);
+  dfk_stack_t* stack = NULL;
+  DFK_STACK_POOL_LOCK(dfk);
+  while (!dfk_list_empty(&dfk->_stack_pool)) {
+    stack = TO_STACK(dfk_list_back(&dfk->_stack_pool));
+    dfk_list_pop_back(&dfk->_stack_pool);
+    if (dfk__stack_fits(stack, size)) {
+      break;
+    }
+    /* dfk_t.default_stack_size has been changed, discard obsolete stack */
+    dfk__stack_delete(dfk, stack);
+    stack = NULL;
+  }
+  DFK_STACK_POOL_UNLOCK(dfk);
+  if (stack) {
+    DFK_DBG(dfk, "{%p} reuse stack from the pool", (void*) stack);
+    return stack;
+  }
+  return dfk__stack_new(dfk, size, 0);
+}
+
+size_t dfk__stack_hwm(dfk_stack_t* stack)
+{
+  assert(stack);
+#if DFK_HAVE_SYS_MMAN_H && DFK_HAVE_MINCORE
+  /* Find the lowest resident page, scanning from the bottom of the stack */
+  unsigned char vec[64];
+  const size_t chunk = DFK_SIZE(vec) * (size_t) DFK_PAGE_SIZE;
+  char* page = stack->bottom;
+  while (page < stack->top) {
+    size_t len = DFK_MIN(chunk, (size_t) (stack->top - page));
+    if (mincore(page, len, vec) == -1) {
+      break;
+    }
+    size_t npages = (len + DFK_PAGE_SIZE - 1) / DFK_PAGE_SIZE;
+    for (size_t i = 0; i < npages; ++i) {
+      if (vec[i] & 1) {
+        return stack->top - (page + i * DFK_PAGE_SIZE);
+      }
+    }
+    page += len;
+  }
+#endif
+  return stack->top - stack->bottom;
+}
+
+#if DFK_STACK_LAZY
+/**
+ * Release memory of the stack pages deeper than dfk_t.stack_resident_size
+ */
+static void dfk__stack_reclaim(dfk_t* dfk, dfk_stack_t* stack)
+{
+  size_t hwm = dfk__stack_hwm(stack);
+  if (hwm <= dfk->stack_resident_size) {
+    return;
+  }
+  /* Both addresses are page-aligned, since stack->bottom is */
+  char* begin = stack->top - hwm;
+  char* end = stack->top - dfk->stack_resident_size;
+  end -= (end - stack->bottom) % DFK_PAGE_SIZE;
+  if (end <= begin) {
+    return;
+  }
+  DFK_DBG(dfk, "{%p} stack high-water mark is %lu bytes, release %lu bytes",
+      (void*) stack, (unsigned long) hwm, (unsigned long) (end - begin));
+  if (madvise(begin, end - begin, MADV_DONTNEED) == -1) {
+    DFK_ERROR_SYSCALL(dfk, "madvise");
+  }
+}
+#endif
+
+void dfk__stack_free(dfk_t* dfk, dfk_stack_t* stack)
+{
+  assert(dfk);
+  assert(stack);
+#if DFK_STACK_LAZY
+  dfk__stack_reclaim(dfk, stack);
+#endif
+  DFK_STACK_POOL_LOCK(dfk);
+  dfk_list_append(&dfk->_stack_pool, &stack->hook);
+  size_t npooled = dfk_list_size(&dfk->_stack_pool);
+  DFK_STACK_POOL_UNLOCK(dfk);
+  DFK_DBG(dfk, "{%p} returned to the pool, %lu stacks pooled",
+      (void*) stack, (unsigned long) npooled);
+  if (npooled > dfk->stack_pool_high) {
+    dfk__stack_pool_shrink(dfk, dfk->stack_pool_low);
+  }
+}
+
+int dfk__stack_pool_reserve(dfk_t* dfk, size_t size, size_t nstacks)
+{
+  assert(dfk);
+  DFK_STACK_POOL_LOCK(dfk);
+  size_t npooled = dfk_list_size(&dfk->_stack_pool);
+  DFK_STACK_POOL_UNLOCK(dfk);
+  DFK_DBG(dfk, "reserve %lu stacks, %lu stacks pooled",
+      (unsigned long) nstacks, (unsigned long) npooled);
+  for (size_t i = npooled; i < nstacks; ++i) {
+    dfk_stack_t* stack = dfk__stack_new(dfk, size, 1);
+    if (!stack) {
+      return dfk->dfk_errno;
+    }
+    DFK_STACK_POOL_LOCK(dfk);
+    dfk_list_append(&dfk->_stack_pool, &stack->hook);
+    DFK_STACK_POOL_UNLOCK(dfk);
+  }
+  return dfk_err_ok;
+}
+
+void dfk__stack_pool_shrink(dfk_t* dfk, size_t nstacks)
+{
+  assert(dfk);
+  DFK_STACK_POOL_LOCK(dfk);
+  dfk_list_t released;
+  dfk_list_init(&released);
+  while (dfk_list_size(&dfk->_stack_pool) > nstacks) {
+    /* Most recently used stacks are at the back, release the oldest ones */
+    dfk_list_hook_t* hook = dfk_list_front(&dfk->_stack_pool);
+    dfk_list_pop_front(&dfk->_stack_pool);
+    dfk_list_append(&released, hook);
+  }
+  DFK_STACK_POOL_UNLOCK(dfk);
+  DFK_DBG(dfk, "release %lu stacks, %lu stacks left",
+      (unsigned long) dfk_list_size(&released), (unsigned long) nstacks);
+  while (!dfk_list_empty(&released)) {
+    dfk_stack_t* stack = TO_STACK(dfk_list_front(&released));
+    dfk_list_pop_front(&released);
+    dfk__stack_delete(dfk, stack);
+  }
+}
@@ -22,10 +22,9 @@ static int dfk__strmap_lookup_cmp(dfk_avltree_hook_t* l, void* r)
   int res = strncmp(lh->key.data, rh->data, tocmp);
   if (res) {
     return res;
-  } else {
-    return lh->key.size > rh->size;
   }
-  return res;
+  /* Key that is a prefix of another one goes first */
+  return (lh->key.size > rh->size) - (lh->key.size < rh->size);
 }
 
 static int dfk__strmap_cmp(dfk_avltree_hook_t* l, dfk_avltree_hook_t* r)
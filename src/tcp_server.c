@@ -1,15 +1,18 @@
 #include <assert.h>
+#include <sys/socket.h>
 #include <dfk/error.h>
 #include <dfk/cond.h>
 #include <dfk/internal.h>
 #include <dfk/tcp_server.h>
+#include <dfk/internal/tcp_socket.h>
 
 enum {
   DFK_TCP_SERVER_INITIALIZED = 0,
   DFK_TCP_SERVER_SERVING = 1,
   DFK_TCP_SERVER_STOP_REQUESTED = 2,
-  DFK_TCP_SERVER_STOP_WAIT_CONNECTIONS = 3,
-  DFK_TCP_SERVER_STOPPED = 4
+  DFK_TCP_SERVER_STOP_WAIT_LISTENERS = 3,
+  DFK_TCP_SERVER_STOP_WAIT_CONNECTIONS = 4,
+  DFK_TCP_SERVER_STOPPED = 5
 };
 
 void dfk_tcp_server_init(dfk_tcp_server_t* server, dfk_t* dfk)
@@ -17,7 +20,13 @@ void dfk_tcp_server_init(dfk_tcp_server_t* server, dfk_t* dfk)
   assert(server);
   assert(dfk);
   server->dfk = dfk;
+  server->reuseport = DFK_TCP_REUSEPORT;
+  server->accept_stats.naccepted = 0;
+  server->accept_stats.nwakeups = 0;
+  server->accept_stats.nyields = 0;
   dfk_list_hook_init(&server->_hook);
+  server->_listeners = NULL;
+  server->_nlisteners = 0;
   server->_active_connections = 0;
   server->_state = DFK_TCP_SERVER_INITIALIZED;
 }
@@ -54,6 +63,62 @@ static void dfk_tcp_server_callback(dfk_fiber_t* fiber,
   }
 }
 
+typedef struct listener_arg {
+  dfk_tcp_socket_t* sock;
+  const char* endpoint;
+  uint16_t port;
+  size_t backlog;
+  listen_ud* lud;
+} listener_arg;
+
+/**
+ * Entry point of a fiber serving one of additional listening sockets
+ */
+static void dfk__tcp_server_listener(dfk_fiber_t* fiber, void* arg)
+{
+  listener_arg* a = (listener_arg*) arg;
+  dfk_tcp_server_t* server = a->lud->server;
+  dfk_fiber_priority(fiber, dfk_fiber_priority_control);
+  int err = dfk__tcp_socket_listen(a->sock, a->endpoint, a->port,
+      dfk_tcp_server_callback, (dfk_userdata_t) {.data = a->lud},
+      a->backlog, &server->accept_stats);
+  if (err != dfk_err_ok && !dfk_tcp_server_is_stopping(server)) {
+    DFK_ERROR(fiber->dfk, "{%p} listener {%p} failed: %s", (void*) server,
+        (void*) a->sock, dfk_strerr(fiber->dfk, err));
+  }
+  if (--server->_nlisteners == 0
+      && server->_state == DFK_TCP_SERVER_STOP_WAIT_LISTENERS) {
+    DFK_RESUME(a->lud->serve_fiber);
+  }
+}
+
+/**
+ * Initialize a listening socket, set SO_REUSEPORT if requested
+ */
+static int dfk__tcp_server_socket_init(dfk_tcp_server_t* server,
+    dfk_tcp_socket_t* sock)
+{
+  dfk_t* dfk = server->dfk;
+  int err = dfk_tcp_socket_init(sock, dfk);
+  if (err != dfk_err_ok || !server->reuseport) {
+    return err;
+  }
+#if DFK_HAVE_SO_REUSEPORT
+  int enable = 1;
+  if (setsockopt(sock->_socket, SOL_SOCKET, SO_REUSEPORT, &enable,
+        sizeof(enable)) < 0) {
+    DFK_ERROR_SYSCALL(dfk, "setsockopt");
+    dfk_tcp_socket_close(sock);
+    return dfk_err_sys;
+  }
+  return dfk_err_ok;
+#else
+  DFK_ERROR(dfk, "{%p} SO_REUSEPORT is not supported", (void*) server);
+  dfk_tcp_socket_close(sock);
+  return dfk_err_not_implemented;
+#endif
+}
+
 int dfk_tcp_serve(dfk_tcp_server_t* server,
     const char* endpoint,
     uint16_t port,
@@ -70,17 +135,74 @@ int dfk_tcp_serve(dfk_tcp_server_t* server,
     .ud = handler_ud
   };
 
-  int err = dfk_tcp_socket_init(&server->_s, server->dfk);
+  int err = dfk__tcp_server_socket_init(server, &server->_s);
   if (err != dfk_err_ok) {
     return err;
   }
 
+  size_t nlisteners = server->reuseport ? server->reuseport - 1 : 0;
+  if (nlisteners) {
+    server->_listeners = dfk->malloc(dfk,
+        nlisteners * sizeof(dfk_tcp_socket_t));
+    if (!server->_listeners) {
+      dfk_tcp_socket_close(&server->_s);
+      return dfk_err_nomem;
+    }
+    for (size_t i = 0; i < nlisteners; ++i) {
+      err = dfk__tcp_server_socket_init(server, server->_listeners + i);
+      if (err != dfk_err_ok) {
+        while (i--) {
+          dfk_tcp_socket_close(server->_listeners + i);
+        }
+        dfk->free(dfk, server->_listeners);
+        server->_listeners = NULL;
+        dfk_tcp_socket_close(&server->_s);
+        return err;
+      }
+    }
+  }
+
   server->_state = DFK_TCP_SERVER_SERVING;
 
-  err = dfk_tcp_socket_listen(&server->_s, endpoint, port,
-      dfk_tcp_server_callback, (dfk_userdata_t) {.data = &lud}, backlog);
-  if (err != dfk_err_ok) {
-    return err;
+  for (size_t i = 0; i < nlisteners; ++i) {
+    listener_arg arg = {
+      .sock = server->_listeners + i,
+      .endpoint = endpoint,
+      .port = port,
+      .backlog = backlog,
+      .lud = &lud
+    };
+    dfk_fiber_t* listener = dfk_spawn(dfk, dfk__tcp_server_listener,
+        &arg, sizeof(arg));
+    if (!listener) {
+      DFK_ERROR(dfk, "{%p} can not spawn listener fiber", (void*) server);
+      continue;
+    }
+    dfk_fiber_name(listener, "listener");
+    server->_nlisteners++;
+  }
+
+  /* Keep accepting connections while handler fibers saturate CPU */
+  dfk_fiber_priority_e priority = lud.serve_fiber->_priority;
+  dfk_fiber_priority(lud.serve_fiber, dfk_fiber_priority_control);
+  err = dfk__tcp_socket_listen(&server->_s, endpoint, port,
+      dfk_tcp_server_callback, (dfk_userdata_t) {.data = &lud}, backlog,
+      &server->accept_stats);
+  dfk_fiber_priority(lud.serve_fiber, priority);
+
+  /* Listening sockets are shut down by dfk_tcp_server_stop */
+  int stopped = dfk_tcp_server_is_stopping(server);
+  if (!stopped) {
+    DFK_ERROR(dfk, "{%p} listen failed: %s", (void*) server,
+        dfk_strerr(dfk, err));
+    for (size_t i = 0; i < nlisteners; ++i) {
+      dfk_tcp_socket_shutdown(server->_listeners + i, DFK_SHUT_RDWR);
+    }
+  }
+
+  if (server->_nlisteners) {
+    server->_state = DFK_TCP_SERVER_STOP_WAIT_LISTENERS;
+    DFK_SUSPEND(dfk);
   }
 
   if (server->_active_connections) {
@@ -88,19 +210,30 @@ int dfk_tcp_serve(dfk_tcp_server_t* server,
     DFK_SUSPEND(dfk);
   }
 
-  err = dfk_tcp_socket_close(&server->_s);
-  if (err != dfk_err_ok) {
-    return err;
+  for (size_t i = 0; i < nlisteners; ++i) {
+    int cerr = dfk_tcp_socket_close(server->_listeners + i);
+    if (cerr != dfk_err_ok && err == dfk_err_ok) {
+      err = cerr;
+    }
+  }
+  if (server->_listeners) {
+    dfk->free(dfk, server->_listeners);
+    server->_listeners = NULL;
+  }
+  int cerr = dfk_tcp_socket_close(&server->_s);
+  if (stopped) {
+    err = cerr;
   }
 
   server->_state = DFK_TCP_SERVER_STOPPED;
-  return dfk_err_ok;
+  return err;
 }
 
 int dfk_tcp_server_is_stopping(dfk_tcp_server_t* server)
 {
   assert(server);
   return server->_state == DFK_TCP_SERVER_STOP_REQUESTED
+    || server->_state == DFK_TCP_SERVER_STOP_WAIT_LISTENERS
     || server->_state == DFK_TCP_SERVER_STOP_WAIT_CONNECTIONS
     || server->_state == DFK_TCP_SERVER_STOPPED;
 }
@@ -109,11 +242,24 @@ int dfk_tcp_server_stop(dfk_tcp_server_t* server)
 {
   assert(server);
   assert(server->_state == DFK_TCP_SERVER_SERVING);
+  /*
+   * State is changed first - accept loop running on another worker fails
+   * as soon as the socket is shut down, and should see it as a stop
+   */
+  server->_state = DFK_TCP_SERVER_STOP_REQUESTED;
   int err = dfk_tcp_socket_shutdown(&server->_s, DFK_SHUT_RDWR);
   if (err != dfk_err_ok) {
+    server->_state = DFK_TCP_SERVER_SERVING;
     return err;
   }
-  server->_state = DFK_TCP_SERVER_STOP_REQUESTED;
+  /*
+   * Additional listeners are stopped on the best effort basis, some of
+   * them could have already failed to bind.
+   */
+  size_t nlisteners = server->reuseport ? server->reuseport - 1 : 0;
+  for (size_t i = 0; i < nlisteners && server->_listeners; ++i) {
+    dfk_tcp_socket_shutdown(server->_listeners + i, DFK_SHUT_RDWR);
+  }
   return dfk_err_ok;
 }
 
@@ -5,18 +5,57 @@
  */
 
 #define _BSD_SOURCE
+#define _GNU_SOURCE
 #include <assert.h>
+#include <limits.h>
+#include <dfk/config.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#if DFK_HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <dfk/tcp_socket.h>
+#include <dfk/internal/tcp_socket.h>
 #include <dfk/error.h>
 #include <dfk/internal.h>
 #include <dfk/make_nonblock.h>
 #include <dfk/read.h>
 #include <dfk/close.h>
 
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+/**
+ * Maximum number of buffers passed to a single readv(2) or writev(2) call
+ *
+ * Native iovec array is allocated on the fiber stack, hence the limit is
+ * lower than IOV_MAX on most systems.
+ */
+#define DFK_TCP_SOCKET_IOV_BATCH DFK_MIN(IOV_MAX, 64)
+
+/*
+ * Accept counters are shared by all listeners of a dfk_tcp_server_t, which
+ * may run on different worker threads
+ */
+#if DFK_THREADS
+#define DFK_ACCEPT_STATS_INC(counter) \
+  atomic_fetch_add_explicit(&(counter), 1, memory_order_relaxed)
+#else
+#define DFK_ACCEPT_STATS_INC(counter) ((counter)++)
+#endif
+
+#if !DFK_HAVE_SENDFILE
+/**
+ * Size of the stack buffer used by dfk_tcp_socket_sendfile if sendfile(2)
+ * is not available
+ */
+#define DFK_TCP_SOCKET_SENDFILE_BUFFER 4096
+#endif
+
 #if DFK_DEBUG
 static const char* dfk__str_shutdown_type(dfk_shutdown_type how)
 {
@@ -34,6 +73,35 @@ static const char* dfk__str_shutdown_type(dfk_shutdown_type how)
 }
 #endif
 
+/**
+ * Suspend current fiber until socket becomes ready for I/O
+ *
+ * @pre Non-blocking operation on the socket has returned EAGAIN
+ */
+static int dfk__tcp_socket_io(dfk_tcp_socket_t* sock, int events,
+    uint64_t deadline)
+{
+#if DFK_IO_WATCH
+  return dfk__io_watch_wait(&sock->_watch, events, deadline);
+#else
+  return DFK_IO_DEADLINE(sock->dfk, sock->_socket, events, deadline);
+#endif
+}
+
+/**
+ * Register socket in the event loop, if #DFK_IO_WATCH is enabled
+ */
+static int dfk__tcp_socket_watch(dfk_tcp_socket_t* sock)
+{
+#if DFK_IO_WATCH
+  return dfk__io_watch_init(dfk__this_eventloop(sock->dfk->_scheduler),
+      &sock->_watch, sock->_socket);
+#else
+  DFK_UNUSED(sock);
+  return dfk_err_ok;
+#endif
+}
+
 int dfk_tcp_socket_init(dfk_tcp_socket_t* sock, dfk_t* dfk)
 {
   assert(sock);
@@ -59,6 +127,11 @@ int dfk_tcp_socket_init(dfk_tcp_socket_t* sock, dfk_t* dfk)
 #endif
   sock->_socket = s;
   sock->dfk = dfk;
+  int err = dfk__tcp_socket_watch(sock);
+  if (err != dfk_err_ok) {
+    dfk__close(dfk, sock, s);
+    return err;
+  }
   return dfk_err_ok;
 }
 
@@ -67,6 +140,9 @@ int dfk_tcp_socket_close(dfk_tcp_socket_t* sock)
   assert(sock);
   assert(sock->dfk);
   DFK_DBG(sock->dfk, "{%p}", (void*) sock);
+#if DFK_IO_WATCH
+  dfk__io_watch_free(&sock->_watch);
+#endif
   return dfk__close(sock->dfk, sock, sock->_socket);
 }
 
@@ -91,7 +167,7 @@ int dfk_tcp_socket_connect(dfk_tcp_socket_t* sock,
     DFK_DBG(dfk, "{%p} connect returned -1, errno=%d: %s",
         (void*) sock, errno, strerror(errno));
     if (errno == EINPROGRESS) {
-      int ioret = DFK_IO(dfk, sock->_socket, DFK_IO_OUT);
+      int ioret = dfk__tcp_socket_io(sock, DFK_IO_OUT, 0);
 #if DFK_DEBUG
       char strev[16];
       size_t nwritten = dfk__io_events_to_str(ioret, strev, DFK_SIZE(strev));
@@ -129,15 +205,33 @@ int dfk_tcp_socket_connect(dfk_tcp_socket_t* sock,
 }
 
 ssize_t dfk_tcp_socket_read(dfk_tcp_socket_t* sock, char* buf, size_t nbytes)
+{
+  return dfk_tcp_socket_read_deadline(sock, buf, nbytes, 0);
+}
+
+ssize_t dfk_tcp_socket_read_deadline(dfk_tcp_socket_t* sock, char* buf,
+    size_t nbytes, uint64_t deadline)
 {
   assert(sock);
   assert(buf);
   assert(nbytes);
   assert(sock->dfk);
-  return dfk__read(sock->dfk, sock, sock->_socket, buf, nbytes);
+#if DFK_IO_WATCH
+  return dfk__read(sock->dfk, sock, sock->_socket, &sock->_watch, buf, nbytes,
+      deadline);
+#else
+  return dfk__read(sock->dfk, sock, sock->_socket, NULL, buf, nbytes,
+      deadline);
+#endif
 }
 
 ssize_t dfk_tcp_socket_write(dfk_tcp_socket_t* sock, char* buf, size_t nbytes)
+{
+  return dfk_tcp_socket_write_deadline(sock, buf, nbytes, 0);
+}
+
+ssize_t dfk_tcp_socket_write_deadline(dfk_tcp_socket_t* sock, char* buf,
+    size_t nbytes, uint64_t deadline)
 {
   assert(sock);
   assert(buf);
@@ -159,20 +253,36 @@ ssize_t dfk_tcp_socket_write(dfk_tcp_socket_t* sock, char* buf, size_t nbytes)
     dfk->dfk_errno = dfk_err_sys;
     return -1;
   }
-  int ioret = DFK_IO(dfk, sock->_socket, DFK_IO_OUT);
-#if DFK_DEBUG
-  char strev[16];
-  size_t strevlen = dfk__io_events_to_str(ioret, strev, DFK_SIZE(strev));
-  DFK_DBG(dfk, "{%p} DFK_IO returned %d (%.*s)", (void*) sock, ioret,
-      (int) strevlen, strev);
-#endif
-  if (ioret & DFK_IO_ERR) {
-    DFK_ERROR_SYSCALL(dfk, "write");
-    dfk->dfk_errno = dfk_err_sys;
+#if DFK_EVENT_LOOP_HAVE_RW
+  nwritten = DFK_IO_WRITE(dfk, sock->_socket, buf, nbytes, deadline);
+  if (nwritten < 0 && errno == ETIMEDOUT) {
+    DFK_DBG(dfk, "{%p} deadline expired", (void*) sock);
+    dfk->dfk_errno = dfk_err_timeout;
     return -1;
   }
-  assert(ioret & DFK_IO_OUT);
-  nwritten = write(sock->_socket, buf, nbytes);
+#else
+  do {
+    int ioret = dfk__tcp_socket_io(sock, DFK_IO_OUT, deadline);
+#if DFK_DEBUG
+    char strev[16];
+    size_t strevlen = dfk__io_events_to_str(ioret, strev, DFK_SIZE(strev));
+    DFK_DBG(dfk, "{%p} DFK_IO returned %d (%.*s)", (void*) sock, ioret,
+        (int) strevlen, strev);
+#endif
+    if (!ioret) {
+      DFK_DBG(dfk, "{%p} deadline expired", (void*) sock);
+      dfk->dfk_errno = dfk_err_timeout;
+      return -1;
+    }
+    if (ioret & DFK_IO_ERR) {
+      DFK_ERROR_SYSCALL(dfk, "write");
+      dfk->dfk_errno = dfk_err_sys;
+      return -1;
+    }
+    nwritten = write(sock->_socket, buf, nbytes);
+    /* Spurious wake up is possible for edge-triggered notifications */
+  } while (nwritten < 0 && errno == EAGAIN);
+#endif
   DFK_DBG(dfk, "{%p} write returned %lld", (void*) sock, (long long) nwritten);
   if (nwritten < 0) {
     DFK_ERROR_SYSCALL(dfk, "write");
@@ -194,13 +304,23 @@ static void dfk__tcp_socket_accepted_main(dfk_fiber_t* fiber, void* arg)
   assert(fiber);
   assert(a);
   assert(a->callback);
+  /*
+   * Socket object has been copied onto the fiber's stack, so it is
+   * registered in the event loop only now.
+   */
+  int err = dfk__tcp_socket_watch(&a->socket);
+  if (err != dfk_err_ok) {
+    dfk__close(fiber->dfk, &a->socket, a->socket._socket);
+    return;
+  }
   a->callback(fiber, &a->socket, a->callback_ud);
 }
 
-int dfk_tcp_socket_listen(dfk_tcp_socket_t* sock,
+int dfk__tcp_socket_listen(dfk_tcp_socket_t* sock,
     const char* endpoint, uint16_t port,
     void (*callback)(dfk_fiber_t*, dfk_tcp_socket_t*, dfk_userdata_t),
-    dfk_userdata_t callback_ud, size_t backlog)
+    dfk_userdata_t callback_ud, size_t backlog,
+    dfk_tcp_accept_stats_t* stats)
 {
   assert(sock);
   assert(endpoint);
@@ -232,12 +352,23 @@ int dfk_tcp_socket_listen(dfk_tcp_socket_t* sock,
     return dfk_err_sys;
   }
 
+  /* Number of connections accepted since the last yield */
+  size_t burst = 0;
   while (1) {
     struct sockaddr_in client;
+    sockaddr_size = sizeof(client);
+#if DFK_HAVE_ACCEPT4
+    int s = accept4(sock->_socket, (struct sockaddr*) &client, &sockaddr_size,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
     int s = accept(sock->_socket, (struct sockaddr*) &client, &sockaddr_size);
+#endif
     if (s < 0) {
-      if (errno == EWOULDBLOCK) {
-        int ioret = DFK_IO(dfk, sock->_socket, DFK_IO_IN);
+      if (errno == EWOULDBLOCK || errno == EAGAIN) {
+        DFK_DBG(dfk, "{%p} backlog is drained, %lu accepted in a row",
+            (void*) sock, (unsigned long) burst);
+        burst = 0;
+        int ioret = dfk__tcp_socket_io(sock, DFK_IO_IN, 0);
 #if DFK_DEBUG
         char strev[16];
         size_t nwritten = dfk__io_events_to_str(ioret, strev, DFK_SIZE(strev));
@@ -248,18 +379,26 @@ int dfk_tcp_socket_listen(dfk_tcp_socket_t* sock,
           DFK_ERROR_SYSCALL(dfk, "accept");
           return dfk_err_sys;
         }
+        if (stats) {
+          DFK_ACCEPT_STATS_INC(stats->nwakeups);
+        }
       } else {
         DFK_ERROR_SYSCALL(dfk, "accept");
         return dfk_err_sys;
       }
       continue;
     }
+#if !DFK_HAVE_ACCEPT4
     DFK_DBG(dfk, "switch socket %d to non-blocking mode", s);
     int err = dfk__make_nonblock(dfk, s);
     if (err != dfk_err_ok) {
       dfk__close(dfk, NULL, s);
       continue;
     }
+#endif
+    if (stats) {
+      DFK_ACCEPT_STATS_INC(stats->naccepted);
+    }
     dfk_tcp_socket_accepted_main_arg_t arg = {
       .socket = {
         .dfk = dfk,
@@ -269,9 +408,39 @@ int dfk_tcp_socket_listen(dfk_tcp_socket_t* sock,
       .callback_ud = callback_ud
     };
     dfk_spawn(dfk, dfk__tcp_socket_accepted_main, &arg, sizeof(arg));
+    if (++burst >= dfk->accept_burst) {
+      /* Let the new connections be served before accepting more */
+      DFK_DBG(dfk, "{%p} accept burst of %lu connections, yield",
+          (void*) sock, (unsigned long) burst);
+      burst = 0;
+      if (stats) {
+        DFK_ACCEPT_STATS_INC(stats->nyields);
+      }
+      /*
+       * Control lane is always picked first, a postponed control fiber
+       * would run again ahead of the handlers it has just spawned. Yield
+       * from the request lane instead, behind the new connections.
+       */
+      dfk_fiber_t* this = DFK_THIS_FIBER(dfk);
+      dfk_fiber_priority_e priority = this->_priority;
+      if (priority == dfk_fiber_priority_control) {
+        dfk_fiber_priority(this, dfk_fiber_priority_request);
+      }
+      DFK_POSTPONE(dfk);
+      dfk_fiber_priority(this, priority);
+    }
   }
 }
 
+int dfk_tcp_socket_listen(dfk_tcp_socket_t* sock,
+    const char* endpoint, uint16_t port,
+    void (*callback)(dfk_fiber_t*, dfk_tcp_socket_t*, dfk_userdata_t),
+    dfk_userdata_t callback_ud, size_t backlog)
+{
+  return dfk__tcp_socket_listen(sock, endpoint, port, callback, callback_ud,
+      backlog, NULL);
+}
+
 int dfk_tcp_socket_shutdown(dfk_tcp_socket_t* sock, dfk_shutdown_type how)
 {
   assert(sock);
@@ -299,25 +468,67 @@ int dfk_tcp_socket_shutdown(dfk_tcp_socket_t* sock, dfk_shutdown_type how)
   return dfk_err_ok;
 }
 
+/**
+ * Fill native iovec array with at most DFK_TCP_SOCKET_IOV_BATCH buffers
+ *
+ * First @p offset bytes of the first buffer are skipped.
+ * Returns number of elements filled.
+ */
+static size_t dfk__tcp_socket_iov(struct iovec* native, dfk_iovec_t* iov,
+    size_t niov, size_t offset)
+{
+  size_t n = DFK_MIN(niov, (size_t) DFK_TCP_SOCKET_IOV_BATCH);
+  for (size_t i = 0; i < n; ++i) {
+    native[i].iov_base = iov[i].data;
+    native[i].iov_len = iov[i].size;
+  }
+  assert(offset <= native[0].iov_len);
+  native[0].iov_base = (char*) native[0].iov_base + offset;
+  native[0].iov_len -= offset;
+  return n;
+}
+
 ssize_t dfk_tcp_socket_readv(dfk_tcp_socket_t* sock,
     dfk_iovec_t* iov, size_t niov)
 {
   assert(sock);
   assert(iov);
   assert(niov);
+  assert(sock->dfk);
 
-  ssize_t totalread = 0;
-  for (size_t i = 0; i < niov; ++i) {
-    ssize_t nread = dfk_tcp_socket_read(sock, iov[i].data, iov[i].size);
-    if (nread < 0) {
-      return nread;
+  dfk_t* dfk = sock->dfk;
+  struct iovec native[DFK_TCP_SOCKET_IOV_BATCH];
+  size_t nnative = dfk__tcp_socket_iov(native, iov, niov, 0);
+  ssize_t nread = readv(sock->_socket, native, nnative);
+  DFK_DBG(dfk, "{%p} readv (possibly blocking) of %lu buffers returned %lld, "
+      "errno=%d", (void*) sock, (unsigned long) nnative, (long long) nread,
+      errno);
+  while (nread < 0 && errno == EAGAIN) {
+    int ioret = dfk__tcp_socket_io(sock, DFK_IO_IN, 0);
+#if DFK_DEBUG
+    char strev[16];
+    size_t strevlen = dfk__io_events_to_str(ioret, strev, DFK_SIZE(strev));
+    DFK_DBG(dfk, "{%p} DFK_IO returned %d (%.*s)", (void*) sock, ioret,
+        (int) strevlen, strev);
+#endif
+    if (!ioret) {
+      DFK_DBG(dfk, "{%p} deadline expired", (void*) sock);
+      dfk->dfk_errno = dfk_err_timeout;
+      return -1;
     }
-    totalread += nread;
-    if ((size_t) nread != iov[i].size) {
-      return totalread;
+    if (ioret & DFK_IO_ERR) {
+      break;
     }
+    /* Spurious wake up is possible for edge-triggered notifications */
+    nread = readv(sock->_socket, native, nnative);
+  }
+  DFK_DBG(dfk, "{%p} readv returned %lld", (void*) sock, (long long) nread);
+  if (nread < 0) {
+    DFK_ERROR_SYSCALL(dfk, "readv");
+    dfk->dfk_errno = dfk_err_sys;
+    return -1;
   }
-  return totalread;
+  return nread;
 }
 
 ssize_t dfk_tcp_socket_writev(dfk_tcp_socket_t* sock,
@@ -326,18 +537,131 @@ ssize_t dfk_tcp_socket_writev(dfk_tcp_socket_t* sock,
   assert(sock);
   assert(iov);
   assert(niov);
+  assert(sock->dfk);
 
+  dfk_t* dfk = sock->dfk;
+  struct iovec native[DFK_TCP_SOCKET_IOV_BATCH];
   ssize_t totalwritten = 0;
-  for (size_t i = 0; i < niov; ++i) {
-    ssize_t nwritten = dfk_tcp_socket_write(sock, iov[i].data, iov[i].size);
+  /* Buffers before iov[i] and first offset bytes of iov[i] are written */
+  size_t i = 0;
+  size_t offset = 0;
+  while (i < niov && !iov[i].size) {
+    ++i;
+  }
+  while (i < niov) {
+    size_t nnative = dfk__tcp_socket_iov(native, iov + i, niov - i, offset);
+    ssize_t nwritten = writev(sock->_socket, native, nnative);
+    DFK_DBG(dfk, "{%p} writev (possibly blocking) of %lu buffers returned %lld, "
+        "errno=%d", (void*) sock, (unsigned long) nnative,
+        (long long) nwritten, errno);
     if (nwritten < 0) {
-      return nwritten;
+      if (errno != EAGAIN) {
+        DFK_ERROR_SYSCALL(dfk, "writev");
+        dfk->dfk_errno = dfk_err_sys;
+        return -1;
+      }
+      int ioret = dfk__tcp_socket_io(sock, DFK_IO_OUT, 0);
+#if DFK_DEBUG
+      char strev[16];
+      size_t strevlen = dfk__io_events_to_str(ioret, strev, DFK_SIZE(strev));
+      DFK_DBG(dfk, "{%p} DFK_IO returned %d (%.*s)", (void*) sock, ioret,
+          (int) strevlen, strev);
+#endif
+      if (!ioret) {
+        DFK_DBG(dfk, "{%p} deadline expired", (void*) sock);
+        dfk->dfk_errno = dfk_err_timeout;
+        return -1;
+      }
+      if (ioret & DFK_IO_ERR) {
+        DFK_ERROR_SYSCALL(dfk, "writev");
+        dfk->dfk_errno = dfk_err_sys;
+        return -1;
+      }
+      /* Spurious wake up is possible for edge-triggered notifications */
+      continue;
     }
     totalwritten += nwritten;
-    if ((size_t) nwritten != iov[i].size) {
-      return nwritten;
+    /* Skip buffers written completely, resume from the middle of a partially
+     * written one */
+    size_t left = (size_t) nwritten;
+    while (i < niov && left >= iov[i].size - offset) {
+      left -= iov[i].size - offset;
+      offset = 0;
+      ++i;
     }
+    offset += left;
   }
+  DFK_DBG(dfk, "{%p} writev of %lu buffers complete, %lld bytes written",
+      (void*) sock, (unsigned long) niov, (long long) totalwritten);
   return totalwritten;
 }
 
+
+ssize_t dfk_tcp_socket_sendfile(dfk_tcp_socket_t* sock, int fd, off_t offset,
+    size_t nbytes)
+{
+  assert(sock);
+  assert(fd >= 0);
+  assert(nbytes);
+  assert(sock->dfk);
+
+  dfk_t* dfk = sock->dfk;
+  size_t totalsent = 0;
+  while (totalsent < nbytes) {
+#if DFK_HAVE_SENDFILE
+    ssize_t nsent = sendfile(sock->_socket, fd, &offset, nbytes - totalsent);
+    DFK_DBG(dfk, "{%p} sendfile (possibly blocking) attempt returned %lld, "
+        "errno=%d", (void*) sock, (long long) nsent, errno);
+    if (nsent < 0) {
+      if (errno != EAGAIN) {
+        DFK_ERROR_SYSCALL(dfk, "sendfile");
+        dfk->dfk_errno = dfk_err_sys;
+        return -1;
+      }
+      int ioret = dfk__tcp_socket_io(sock, DFK_IO_OUT, 0);
+#if DFK_DEBUG
+      char strev[16];
+      size_t strevlen = dfk__io_events_to_str(ioret, strev, DFK_SIZE(strev));
+      DFK_DBG(dfk, "{%p} DFK_IO returned %d (%.*s)", (void*) sock, ioret,
+          (int) strevlen, strev);
+#endif
+      if (!ioret) {
+        DFK_DBG(dfk, "{%p} deadline expired", (void*) sock);
+        dfk->dfk_errno = dfk_err_timeout;
+        return -1;
+      }
+      if (ioret & DFK_IO_ERR) {
+        DFK_ERROR_SYSCALL(dfk, "sendfile");
+        dfk->dfk_errno = dfk_err_sys;
+        return -1;
+      }
+      /* Spurious wake up is possible for edge-triggered notifications */
+      continue;
+    }
+#else
+    char buf[DFK_TCP_SOCKET_SENDFILE_BUFFER];
+    size_t toread = DFK_MIN(sizeof(buf), nbytes - totalsent);
+    ssize_t nsent = pread(fd, buf, toread, offset);
+    if (nsent < 0) {
+      DFK_ERROR_SYSCALL(dfk, "pread");
+      dfk->dfk_errno = dfk_err_sys;
+      return -1;
+    }
+    if (nsent) {
+      dfk_iovec_t iov = {buf, (size_t) nsent};
+      if (dfk_tcp_socket_writev(sock, &iov, 1) < 0) {
+        return -1;
+      }
+      offset += nsent;
+    }
+#endif
+    if (!nsent) {
+      DFK_DBG(dfk, "{%p} end of file reached", (void*) sock);
+      break;
+    }
+    totalsent += (size_t) nsent;
+  }
+  DFK_DBG(dfk, "{%p} %llu bytes sent from fd %d", (void*) sock,
+      (unsigned long long) totalsent, fd);
+  return (ssize_t) totalsent;
+}
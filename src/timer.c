@@ -0,0 +1,217 @@
+/**
+ * @file timer.c
+ *
+ * Contains hierarchical timer wheel and fiber-aware sleep.
+ *
+ * Each event loop owns a wheel of DFK_TIMER_WHEEL_LEVELS levels, each level
+ * consists of DFK_TIMER_WHEEL_SIZE slots. Arming and disarming a timer costs
+ * O(1), a timer is moved down to the lower level at most
+ * DFK_TIMER_WHEEL_LEVELS - 1 times during its lifetime.
+ *
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LISENSE)
+ */
+
+#include <assert.h>
+#include <time.h>
+#include <dfk/config.h>
+#include <dfk/error.h>
+#include <dfk/eventloop.h>
+#include <dfk/internal.h>
+#include <dfk/internal/timer.h>
+
+#define TO_TIMER(expr) DFK_CONTAINER_OF((expr), dfk_timer_t, hook)
+
+#define DFK_TIMER_WHEEL_MASK ((uint64_t) DFK_TIMER_WHEEL_SIZE - 1)
+
+/** Number of ticks covered by the wheel levels [0, level] */
+#define DFK_TIMER_WHEEL_SPAN(level) \
+  (1ULL << (DFK_TIMER_WHEEL_BITS * ((level) + 1)))
+
+uint64_t dfk__clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void dfk__timer_init(dfk_timer_t* timer, dfk_timer_callback callback,
+    void* arg)
+{
+  assert(timer);
+  assert(callback);
+  dfk_list_hook_init(&timer->hook);
+  timer->slot = NULL;
+  timer->expires = 0;
+  timer->callback = callback;
+  timer->arg = arg;
+}
+
+void dfk__timer_wheel_init(dfk_timer_wheel_t* wheel)
+{
+  assert(wheel);
+  wheel->origin = dfk__clock();
+  wheel->now = 0;
+  wheel->ntimers = 0;
+  for (size_t i = 0; i < DFK_TIMER_WHEEL_LEVELS; ++i) {
+    for (size_t j = 0; j < DFK_TIMER_WHEEL_SIZE; ++j) {
+      dfk_list_init(&wheel->slots[i][j]);
+    }
+  }
+}
+
+/**
+ * Put the timer into a slot according to its expiration time
+ */
+static void dfk__timer_wheel_insert(dfk_timer_wheel_t* wheel,
+    dfk_timer_t* timer)
+{
+  uint64_t expires = DFK_MAX(timer->expires, wheel->now);
+  uint64_t delta = expires - wheel->now;
+  size_t level = 0;
+  while (level < DFK_TIMER_WHEEL_LEVELS - 1
+      && delta >= DFK_TIMER_WHEEL_SPAN(level)) {
+    ++level;
+  }
+  if (delta >= DFK_TIMER_WHEEL_SPAN(level)) {
+    /* Too far in the future, will be cascaded once again */
+    expires = wheel->now + DFK_TIMER_WHEEL_SPAN(level) - 1;
+  }
+  uint64_t index = (expires >> (DFK_TIMER_WHEEL_BITS * level))
+    & DFK_TIMER_WHEEL_MASK;
+  timer->slot = &wheel->slots[level][index];
+  dfk_list_append(timer->slot, &timer->hook);
+}
+
+void dfk__timer_wheel_add(dfk_timer_wheel_t* wheel, dfk_timer_t* timer,
+    uint64_t deadline)
+{
+  assert(wheel);
+  assert(timer);
+  assert(!timer->slot);
+  /* Round up, so that timer never expires before the deadline */
+  timer->expires = deadline > wheel->origin
+    ? (deadline - wheel->origin + DFK_TIMER_RESOLUTION - 1)
+      / DFK_TIMER_RESOLUTION
+    : 0;
+  dfk__timer_wheel_insert(wheel, timer);
+  wheel->ntimers++;
+}
+
+void dfk__timer_wheel_del(dfk_timer_wheel_t* wheel, dfk_timer_t* timer)
+{
+  assert(wheel);
+  assert(timer);
+  if (!timer->slot) {
+    return;
+  }
+  dfk_list_it it;
+  dfk_list_it_from_value(timer->slot, &timer->hook, &it);
+  dfk_list_erase(timer->slot, &it);
+  timer->slot = NULL;
+  wheel->ntimers--;
+}
+
+/**
+ * Move timers from the current slot of the @p level to the lower levels
+ *
+ * @returns Index of the cascaded slot
+ */
+static uint64_t dfk__timer_wheel_cascade(dfk_timer_wheel_t* wheel,
+    size_t level)
+{
+  uint64_t index = (wheel->now >> (DFK_TIMER_WHEEL_BITS * level))
+    & DFK_TIMER_WHEEL_MASK;
+  dfk_list_t timers;
+  dfk_list_init(&timers);
+  dfk_list_move(&wheel->slots[level][index], &timers);
+  while (!dfk_list_empty(&timers)) {
+    dfk_timer_t* timer = TO_TIMER(dfk_list_front(&timers));
+    dfk_list_pop_front(&timers);
+    dfk__timer_wheel_insert(wheel, timer);
+  }
+  return index;
+}
+
+void dfk__timer_wheel_advance(dfk_timer_wheel_t* wheel, uint64_t now)
+{
+  assert(wheel);
+  uint64_t target = now > wheel->origin
+    ? (now - wheel->origin) / DFK_TIMER_RESOLUTION
+    : 0;
+  while (wheel->now <= target) {
+    if (!wheel->ntimers) {
+      /* Nothing to cascade, nothing to expire */
+      wheel->now = target + 1;
+      break;
+    }
+    uint64_t index = wheel->now & DFK_TIMER_WHEEL_MASK;
+    if (!index) {
+      for (size_t level = 1; level < DFK_TIMER_WHEEL_LEVELS; ++level) {
+        if (dfk__timer_wheel_cascade(wheel, level)) {
+          break;
+        }
+      }
+    }
+    dfk_list_t* slot = &wheel->slots[0][index];
+    while (!dfk_list_empty(slot)) {
+      dfk_timer_t* timer = TO_TIMER(dfk_list_front(slot));
+      dfk_list_pop_front(slot);
+      timer->slot = NULL;
+      wheel->ntimers--;
+      timer->callback(timer);
+    }
+    wheel->now++;
+  }
+}
+
+int64_t dfk__timer_wheel_timeout(dfk_timer_wheel_t* wheel, uint64_t now)
+{
+  assert(wheel);
+  if (!wheel->ntimers) {
+    return -1;
+  }
+  /*
+   * Find either the nearest non-empty slot of the lowest level, or the
+   * nearest cascade point, whatever comes first.
+   */
+  uint64_t tick = wheel->now;
+  while ((tick & DFK_TIMER_WHEEL_MASK)
+      && dfk_list_empty(&wheel->slots[0][tick & DFK_TIMER_WHEEL_MASK])) {
+    ++tick;
+  }
+  uint64_t wakeup = wheel->origin + tick * DFK_TIMER_RESOLUTION;
+  return wakeup > now ? (int64_t) (wakeup - now) : 0;
+}
+
+static void dfk__sleep_expired(dfk_timer_t* timer)
+{
+  dfk_fiber_t* fiber = (dfk_fiber_t*) timer->arg;
+  DFK_DBG(fiber->dfk, "{%p} wake up", (void*) fiber);
+  DFK_IORESUME(fiber);
+}
+
+int dfk_sleep(dfk_t* dfk, uint64_t nsec)
+{
+  assert(dfk);
+  if (!nsec) {
+    DFK_POSTPONE(dfk);
+    return dfk_err_ok;
+  }
+  dfk_fiber_t* this = DFK_THIS_FIBER(dfk);
+  DFK_DBG(dfk, "{%p} sleep for %llu ns", (void*) this,
+      (unsigned long long) nsec);
+  dfk_timer_t timer;
+  dfk__timer_init(&timer, dfk__sleep_expired, this);
+  dfk__timer_wheel_add(&dfk__this_eventloop(dfk->_scheduler)->timers,
+      &timer, dfk__clock() + nsec);
+  DFK_IOSUSPEND(dfk);
+  return dfk_err_ok;
+}
+
+uint64_t dfk_now(dfk_t* dfk)
+{
+  DFK_UNUSED(dfk);
+  return dfk__clock();
+}
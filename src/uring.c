@@ -0,0 +1,429 @@
+/**
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LISENSE)
+ */
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <dfk/eventloop.h>
+#include <dfk/internal.h>
+#include <dfk/error.h>
+
+/*
+ * Submission and completion queues are shared with the kernel, therefore
+ * head and tail indices should be accessed with proper memory ordering.
+ */
+#define DFK_URING_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define DFK_URING_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/**
+ * A completion context of the I/O request, allocated on the fiber's stack
+ */
+typedef struct dfk_uring_arg_t {
+  dfk_fiber_t* yieldback;
+  int res;
+} dfk_uring_arg_t;
+
+static int dfk__io_uring_setup(unsigned int entries,
+    struct io_uring_params* params)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int dfk__io_uring_enter(int fd, unsigned int to_submit,
+    unsigned int min_complete, unsigned int flags)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+      flags, NULL, 0);
+}
+
+int dfk__eventloop_init(dfk_eventloop_t* loop, dfk_t* dfk)
+{
+  assert(loop);
+  assert(dfk);
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = dfk__io_uring_setup(DFK_URING_ENTRIES, &params);
+  if (fd == -1) {
+    DFK_ERROR_SYSCALL(dfk, "io_uring_setup(2)");
+    return dfk_err_sys;
+  }
+
+  loop->dfk = dfk;
+  loop->fd = fd;
+  loop->entries = params.sq_entries;
+  loop->nqueued = 0;
+  loop->idle_since = 0;
+  dfk__timer_wheel_init(&loop->timers);
+  loop->sqring_size = params.sq_off.array
+    + params.sq_entries * sizeof(unsigned int);
+  loop->cqring_size = params.cq_off.cqes
+    + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    loop->sqring_size = DFK_MAX(loop->sqring_size, loop->cqring_size);
+    loop->cqring_size = loop->sqring_size;
+  }
+
+  loop->sqring = mmap(NULL, loop->sqring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (loop->sqring == MAP_FAILED) {
+    DFK_ERROR_SYSCALL(dfk, "mmap(2)");
+    goto cleanup_fd;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    loop->cqring = loop->sqring;
+  } else {
+    loop->cqring = mmap(NULL, loop->cqring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (loop->cqring == MAP_FAILED) {
+      DFK_ERROR_SYSCALL(dfk, "mmap(2)");
+      goto cleanup_sqring;
+    }
+  }
+  loop->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+      IORING_OFF_SQES);
+  if (loop->sqes == MAP_FAILED) {
+    DFK_ERROR_SYSCALL(dfk, "mmap(2)");
+    goto cleanup_cqring;
+  }
+
+  char* sq = (char*) loop->sqring;
+  loop->sqhead = (unsigned int*) (sq + params.sq_off.head);
+  loop->sqtail = (unsigned int*) (sq + params.sq_off.tail);
+  loop->sqmask = (unsigned int*) (sq + params.sq_off.ring_mask);
+  loop->sqarray = (unsigned int*) (sq + params.sq_off.array);
+  char* cq = (char*) loop->cqring;
+  loop->cqhead = (unsigned int*) (cq + params.cq_off.head);
+  loop->cqtail = (unsigned int*) (cq + params.cq_off.tail);
+  loop->cqmask = (unsigned int*) (cq + params.cq_off.ring_mask);
+  loop->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+  DFK_DBG(dfk, "{%p} io_uring_setup() = %d, %u sq entries, %u cq entries",
+      (void*) loop, fd, params.sq_entries, params.cq_entries);
+  return dfk_err_ok;
+
+cleanup_cqring:
+  if (loop->cqring != loop->sqring) {
+    munmap(loop->cqring, loop->cqring_size);
+  }
+cleanup_sqring:
+  munmap(loop->sqring, loop->sqring_size);
+cleanup_fd:
+  close(fd);
+  return dfk_err_sys;
+}
+
+int dfk__eventloop_free(dfk_eventloop_t* loop)
+{
+  assert(loop);
+  assert(loop->fd);
+  munmap(loop->sqes, loop->entries * sizeof(struct io_uring_sqe));
+  if (loop->cqring != loop->sqring) {
+    munmap(loop->cqring, loop->cqring_size);
+  }
+  munmap(loop->sqring, loop->sqring_size);
+  int ret = close(loop->fd);
+  if (ret < 0) {
+    DFK_ERROR_SYSCALL(loop->dfk, "close(2)");
+    return dfk_err_sys;
+  }
+  DFK_IF_DEBUG(loop->sqes = DFK_PDEADBEEF);
+  DFK_IF_DEBUG(loop->cqes = DFK_PDEADBEEF);
+  return dfk_err_ok;
+}
+
+/**
+ * Pass queued submission entries to the kernel, optionally wait for
+ * completions.
+ */
+static int dfk__uring_submit(dfk_eventloop_t* loop, unsigned int min_complete)
+{
+  unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+  while (1) {
+    int ret = dfk__io_uring_enter(loop->fd, loop->nqueued, min_complete,
+        flags);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        DFK_INFO(loop->dfk, "{%p} io_uring_enter() interrupted by signal, "
+            "restarting", (void*) loop);
+        continue;
+      }
+      DFK_ERROR_SYSCALL(loop->dfk, "io_uring_enter(2)");
+      return dfk_err_sys;
+    }
+    DFK_DBG(loop->dfk, "{%p} %d of %u entries submitted", (void*) loop,
+        ret, loop->nqueued);
+    loop->nqueued -= (unsigned int) ret;
+    return dfk_err_ok;
+  }
+}
+
+/**
+ * Returns a spare submission queue entry.
+ *
+ * If less than @p nsqes entries are spare, queued entries are submitted to
+ * the kernel. Therefore, caller may take @p nsqes - 1 more entries without
+ * triggering a submission, which is required for linked requests.
+ */
+static struct io_uring_sqe* dfk__uring_sqe(dfk_eventloop_t* loop,
+    unsigned int nsqes)
+{
+  unsigned int tail = *loop->sqtail;
+  if (loop->entries - (tail - DFK_URING_LOAD(loop->sqhead)) < nsqes) {
+    DFK_DBG(loop->dfk, "{%p} submission queue is full", (void*) loop);
+    if (dfk__uring_submit(loop, 0) != dfk_err_ok) {
+      return NULL;
+    }
+    if (loop->entries - (tail - DFK_URING_LOAD(loop->sqhead)) < nsqes) {
+      return NULL;
+    }
+  }
+  struct io_uring_sqe* sqe = loop->sqes + (tail & *loop->sqmask);
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+/**
+ * Make submission queue entry visible to the kernel
+ *
+ * Entry will be submitted by the event loop fiber with a single
+ * io_uring_enter call along with the other requests.
+ */
+static void dfk__uring_queue(dfk_eventloop_t* loop, struct io_uring_sqe* sqe)
+{
+  unsigned int tail = *loop->sqtail;
+  loop->sqarray[tail & *loop->sqmask] = (unsigned int) (sqe - loop->sqes);
+  DFK_URING_STORE(loop->sqtail, tail + 1);
+  loop->nqueued++;
+}
+
+/**
+ * Queue a request that completes either after @p nsec nanoseconds, or once
+ * any other request completes.
+ *
+ * Wakes up the event loop in time for the nearest timer.
+ */
+static int dfk__uring_timeout(dfk_eventloop_t* loop, int64_t nsec)
+{
+  struct io_uring_sqe* sqe = dfk__uring_sqe(loop, 1);
+  if (!sqe) {
+    return dfk_err_sys;
+  }
+  loop->timeout.tv_sec = nsec / 1000000000;
+  loop->timeout.tv_nsec = nsec % 1000000000;
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t) (uintptr_t) &loop->timeout;
+  sqe->len = 1;
+  /* Number of completions to wait for */
+  sqe->off = 1;
+  sqe->user_data = 0;
+  dfk__uring_queue(loop, sqe);
+  return dfk_err_ok;
+}
+
+void dfk__eventloop_main(dfk_fiber_t* fiber, void* arg)
+{
+  assert(fiber);
+  dfk_t* dfk = fiber->dfk;
+  dfk_eventloop_t* loop = (dfk_eventloop_t*) arg;
+  assert(dfk);
+  assert(loop);
+  assert(loop->dfk == dfk);
+  assert(loop->fd);
+
+  while (1) {
+    int64_t timeout = dfk__eventloop_timeout(dfk, &loop->idle_since,
+        &loop->timers);
+    if (timeout > 0 && dfk__uring_timeout(loop, timeout) != dfk_err_ok) {
+      timeout = 0;
+    }
+    if (dfk__uring_submit(loop, timeout ? 1 : 0) != dfk_err_ok) {
+      break;
+    }
+    unsigned int head = *loop->cqhead;
+    unsigned int tail = DFK_URING_LOAD(loop->cqtail);
+    DFK_DBG(dfk, "%u completions ready", tail - head);
+    if (head == tail) {
+      dfk__timer_wheel_advance(&loop->timers, dfk__clock());
+      DFK_SUSPEND(dfk);
+      continue;
+    }
+    loop->idle_since = 0;
+    if (tail - head > dfk->io_maxevents) {
+      tail = head + (unsigned int) DFK_MAX(dfk->io_maxevents, 1);
+    }
+    while (head != tail) {
+      struct io_uring_cqe* cqe = loop->cqes + (head & *loop->cqmask);
+      if (!cqe->user_data) {
+        /* Completion of a timeout request, nobody waits for it */
+        ++head;
+        continue;
+      }
+      dfk_uring_arg_t* arg = (dfk_uring_arg_t*) (uintptr_t) cqe->user_data;
+      arg->res = cqe->res;
+      DFK_DBG(dfk, "{%p} result %d, yieldback fiber %p",
+          (void*) loop, arg->res, (void*) arg->yieldback);
+      DFK_IORESUME(arg->yieldback);
+      ++head;
+    }
+    DFK_URING_STORE(loop->cqhead, head);
+    dfk__timer_wheel_advance(&loop->timers, dfk__clock());
+    DFK_SUSPEND(dfk);
+  }
+}
+
+/**
+ * Queue request and suspend current fiber until it is completed
+ *
+ * If @p deadline is non-zero, request is linked with a timeout, and
+ * is cancelled with -ECANCELED once the deadline has expired.
+ *
+ * @pre If @p deadline is non-zero, @p sqe has been obtained by
+ * dfk__uring_sqe(loop, 2) to leave room for the linked timeout.
+ *
+ * @returns cqe->res value
+ */
+static int dfk__uring_do(dfk_eventloop_t* loop, struct io_uring_sqe* sqe,
+    uint64_t deadline)
+{
+  dfk_t* dfk = loop->dfk;
+  dfk_uring_arg_t arg = {
+    .yieldback = DFK_THIS_FIBER(dfk),
+    .res = 0,
+  };
+  /* Kernel reads timespec upon submission, fiber's stack is intact by then */
+  struct __kernel_timespec ts;
+  sqe->user_data = (uint64_t) (uintptr_t) &arg;
+  if (deadline) {
+    sqe->flags |= IOSQE_IO_LINK;
+  }
+  dfk__uring_queue(loop, sqe);
+  if (deadline) {
+    struct io_uring_sqe* tsqe = dfk__uring_sqe(loop, 1);
+    assert(tsqe);
+    ts.tv_sec = (int64_t) (deadline / 1000000000);
+    ts.tv_nsec = (long long) (deadline % 1000000000);
+    tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+    tsqe->fd = -1;
+    tsqe->addr = (uint64_t) (uintptr_t) &ts;
+    tsqe->len = 1;
+    /* Absolute time of CLOCK_MONOTONIC, same as dfk_now() */
+    tsqe->timeout_flags = IORING_TIMEOUT_ABS;
+    tsqe->user_data = 0;
+    dfk__uring_queue(loop, tsqe);
+  }
+  DFK_IOSUSPEND(dfk);
+  return arg.res;
+}
+
+int dfk__io(dfk_eventloop_t* loop, int socket, int events, uint64_t deadline)
+{
+  assert(loop);
+  dfk_t* dfk = loop->dfk;
+  assert(dfk);
+  struct io_uring_sqe* sqe = dfk__uring_sqe(loop, deadline ? 2 : 1);
+  if (!sqe) {
+    dfk->dfk_errno = dfk_err_sys;
+    return DFK_IO_ERR;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = socket;
+  sqe->poll32_events = (uint32_t) events;
+#if DFK_DEBUG
+  char strev[16];
+  size_t nwritten = dfk__io_events_to_str(events, strev, DFK_SIZE(strev));
+  DFK_DBG(dfk, "{%p} poll fd %d, events %d (%.*s)", (void*) loop,
+      socket, events, (int) nwritten, strev);
+#endif
+  int res = dfk__uring_do(loop, sqe, deadline);
+  if (res == -ECANCELED && deadline) {
+    DFK_DBG(dfk, "{%p} deadline for fd %d expired", (void*) loop, socket);
+    return 0;
+  }
+  if (res < 0) {
+    errno = -res;
+    DFK_ERROR_SYSCALL(dfk, "poll");
+    dfk->dfk_errno = dfk_err_sys;
+    return DFK_IO_ERR;
+  }
+  return res;
+}
+
+static ssize_t dfk__uring_rw(dfk_eventloop_t* loop, int opcode, int fd,
+    char* buf, size_t nbytes, uint64_t deadline)
+{
+  assert(loop);
+  assert(buf);
+  struct io_uring_sqe* sqe = dfk__uring_sqe(loop, deadline ? 2 : 1);
+  if (!sqe) {
+    errno = EBUSY;
+    return -1;
+  }
+  sqe->opcode = (uint8_t) opcode;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) buf;
+  sqe->len = (uint32_t) DFK_MIN(nbytes, (size_t) UINT32_MAX);
+  /* Use current file position, same as read(2) and write(2) */
+  sqe->off = (uint64_t) -1;
+  DFK_DBG(loop->dfk, "{%p} %s fd %d, %llu bytes", (void*) loop,
+      opcode == IORING_OP_READ ? "read" : "write", fd,
+      (unsigned long long) nbytes);
+  int res = dfk__uring_do(loop, sqe, deadline);
+  if (res == -ECANCELED && deadline) {
+    res = -ETIMEDOUT;
+  }
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+  return res;
+}
+
+ssize_t dfk__io_read(dfk_eventloop_t* loop, int fd, char* buf, size_t nbytes,
+    uint64_t deadline)
+{
+  ssize_t nread = dfk__uring_rw(loop, IORING_OP_READ, fd, buf, nbytes,
+      deadline);
+  if (nread < 0 && errno == EAGAIN) {
+    /*
+     * Kernel does not wait for O_NONBLOCK descriptors to become ready on
+     * some versions, fall back to poll + read. Fiber could have been moved
+     * to another worker, so the event loop is looked up once again.
+     */
+    int ioret = DFK_IO_DEADLINE(loop->dfk, fd, DFK_IO_IN, deadline);
+    if (!ioret) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    if (ioret & DFK_IO_ERR) {
+      errno = EIO;
+      return -1;
+    }
+    nread = read(fd, buf, nbytes);
+  }
+  return nread;
+}
+
+ssize_t dfk__io_write(dfk_eventloop_t* loop, int fd, char* buf, size_t nbytes,
+    uint64_t deadline)
+{
+  ssize_t nwritten = dfk__uring_rw(loop, IORING_OP_WRITE, fd, buf, nbytes,
+      deadline);
+  if (nwritten < 0 && errno == EAGAIN) {
+    int ioret = DFK_IO_DEADLINE(loop->dfk, fd, DFK_IO_OUT, deadline);
+    if (!ioret) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    if (ioret & DFK_IO_ERR) {
+      errno = EIO;
+      return -1;
+    }
+    nwritten = write(fd, buf, nbytes);
+  }
+  return nwritten;
+}
@@ -184,5 +184,78 @@ TEST_F(fixture, http_request, url_with_fragment)
 }
 
 
+static void expect_next_request(fixture_t* f, const char* path)
+{
+  dfk_arena_t arena;
+  dfk_arena_init(&arena, &f->dfk);
+  dfk_http_request_t next;
+  dfk__http_request_init(&next, &f->http, &arena, &f->conn_arena, &f->sock);
+  next._socket_mocked |= 1;
+  next._socket_mock = &f->reqbuf;
+  next._remainder = f->req._remainder;
+  EXPECT_OK(dfk__http_request_read_headers(&next));
+  EXPECT_BUFSTREQ(next.path, path);
+  EXPECT_OK(dfk__http_request_finish(&next));
+  EXPECT(!next._remainder.size);
+  dfk__http_request_free(&next);
+  dfk_arena_free(&arena);
+}
+
+
+TEST_F(fixture, http_request, pipelined)
+{
+  char request[] = "GET /first HTTP/1.1\r\n"
+                   "\r\n"
+                   "GET /second HTTP/1.1\r\n"
+                   "\r\n";
+  dfk__sponge_write(&fixture->reqbuf, request, sizeof(request) - 1);
+  EXPECT_OK(dfk__http_request_read_headers(&fixture->req));
+  EXPECT_BUFSTREQ(fixture->req.path, "/first");
+  EXPECT_OK(dfk__http_request_finish(&fixture->req));
+  EXPECT_BUFSTREQ(fixture->req._remainder, "GET /second HTTP/1.1\r\n\r\n");
+  expect_next_request(fixture, "/second");
+}
+
+
+TEST_F(fixture, http_request, pipelined_unread_body)
+{
+  char request[] = "POST /first HTTP/1.1\r\n"
+                   "Content-Length: 5\r\n"
+                   "\r\n"
+                   "Hello"
+                   "GET /second HTTP/1.1\r\n"
+                   "\r\n";
+  dfk__sponge_write(&fixture->reqbuf, request, sizeof(request) - 1);
+  EXPECT_OK(dfk__http_request_read_headers(&fixture->req));
+  char buf[2] = {0};
+  EXPECT(dfk_http_request_read(&fixture->req, buf, sizeof(buf)) == 2);
+  EXPECT(!strncmp(buf, "He", sizeof(buf)));
+  /* The rest of body is skipped */
+  EXPECT_OK(dfk__http_request_finish(&fixture->req));
+  expect_next_request(fixture, "/second");
+}
+
+
+TEST_F(fixture, http_request, pipelined_chunked_body)
+{
+  char request[] = "POST /first HTTP/1.1\r\n"
+                   "Transfer-Encoding: chunked\r\n"
+                   "\r\n"
+                   "5\r\n"
+                   "Hello\r\n"
+                   "0\r\n"
+                   "\r\n"
+                   "GET /second HTTP/1.1\r\n"
+                   "\r\n";
+  dfk__sponge_write(&fixture->reqbuf, request, sizeof(request) - 1);
+  EXPECT_OK(dfk__http_request_read_headers(&fixture->req));
+  char buf[64] = {0};
+  EXPECT(dfk_http_request_read(&fixture->req, buf, sizeof(buf)) == 5);
+  EXPECT(!strncmp(buf, "Hello", 5));
+  EXPECT_OK(dfk__http_request_finish(&fixture->req));
+  expect_next_request(fixture, "/second");
+}
+
+
 #endif /* DFK_MOCKS */
 
@@ -39,7 +39,7 @@ static void fixture_setup(fixture_t* f)
   f->req.minor_version = 0;
   f->req.major_version = 1;
   dfk__http_response_init(&f->resp, &f->req,
-      &f->req_arena, &f->conn_arena, &f->sock, 0);
+      &f->req_arena, &f->conn_arena, &f->sock, 0, NULL, 0);
   dfk__sponge_init(&f->respbuf, &f->dfk);
   f->resp._socket_mocked = 1;
   f->resp._socket_mock = &f->respbuf;
@@ -188,5 +188,116 @@ TEST_F(fixture, http_response, writev)
       "Hello world");
 }
 
+TEST_F(fixture, http_response, write_chunked)
+{
+  char buf[] = "Hello world";
+  fixture->resp.minor_version = 1;
+  EXPECT(dfk_http_response_write(&fixture->resp, buf, 6) == 6);
+  EXPECT(dfk_http_response_write(&fixture->resp, buf + 6, 5) == 5);
+  EXPECT_OK(dfk__http_response_flush(&fixture->resp));
+  expect_resp(&fixture->resp,
+      "HTTP/1.1 200 OK\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "\r\n"
+      "6\r\nHello \r\n"
+      "5\r\nworld\r\n"
+      "0\r\n\r\n");
+}
+
+TEST_F(fixture, http_response, write_unknown_length_http10)
+{
+  char buf[] = "Hello world";
+  fixture->resp.keepalive |= 1;
+  dfk_http_response_write(&fixture->resp, buf, sizeof(buf) - 1);
+  EXPECT_OK(dfk__http_response_flush(&fixture->resp));
+  /* Body is terminated by closing connection */
+  EXPECT(!fixture->resp.keepalive);
+  expect_resp(&fixture->resp,
+      "HTTP/1.0 200 OK\r\n"
+      "\r\n"
+      "Hello world");
+}
+
+TEST_F(fixture, http_response, flush_empty)
+{
+  EXPECT_OK(dfk__http_response_flush(&fixture->resp));
+  expect_resp(&fixture->resp,
+      "HTTP/1.0 200 OK\r\n"
+      "Content-Length: 0\r\n"
+      "\r\n");
+}
+
+TEST_F(fixture, http_response, flush_not_modified)
+{
+  fixture->resp.minor_version = 1;
+  fixture->resp.status = DFK_HTTP_NOT_MODIFIED;
+  EXPECT_OK(dfk__http_response_flush(&fixture->resp));
+  expect_resp(&fixture->resp,
+      "HTTP/1.1 304 Not Modified\r\n"
+      "\r\n");
+}
+
+TEST_F(fixture, http_response, buffered_write)
+{
+  char obuf[128];
+  char buf[] = "Hello world";
+  fixture->resp._obuf = obuf;
+  fixture->resp._obufsize = sizeof(obuf);
+  fixture->resp.content_length = sizeof(buf) - 1;
+  EXPECT(dfk_http_response_write(&fixture->resp, buf, 6) == 6);
+  EXPECT(dfk_http_response_write(&fixture->resp, buf + 6, 5) == 5);
+  /* Nothing is sent until the response is complete */
+  EXPECT(fixture->respbuf.size == 0);
+  EXPECT_OK(dfk__http_response_flush(&fixture->resp));
+  expect_resp(&fixture->resp,
+      "HTTP/1.0 200 OK\r\n"
+      "Content-Length: 11\r\n"
+      "\r\n"
+      "Hello world");
+}
+
+TEST_F(fixture, http_response, buffered_overflow)
+{
+  char obuf[56];
+  char buf[] = "Hello world";
+  fixture->resp._obuf = obuf;
+  fixture->resp._obufsize = sizeof(obuf);
+  fixture->resp.content_length = 2 * (sizeof(buf) - 1);
+  EXPECT(dfk_http_response_write(&fixture->resp, buf, sizeof(buf) - 1) == 11);
+  EXPECT(fixture->respbuf.size == 0);
+  /* Write does not fit, it is sent along with the buffered output */
+  EXPECT(dfk_http_response_write(&fixture->resp, buf, sizeof(buf) - 1) == 11);
+  EXPECT(fixture->respbuf.size == 61);
+  EXPECT_OK(dfk__http_response_flush(&fixture->resp));
+  expect_resp(&fixture->resp,
+      "HTTP/1.0 200 OK\r\n"
+      "Content-Length: 22\r\n"
+      "\r\n"
+      "Hello worldHello world");
+}
+
+TEST_F(fixture, http_response, complete_keeps_output)
+{
+  char obuf[128];
+  char buf[] = "Hello";
+  fixture->resp._obuf = obuf;
+  fixture->resp._obufsize = sizeof(obuf);
+  fixture->resp.content_length = sizeof(buf) - 1;
+  EXPECT(dfk_http_response_write(&fixture->resp, buf, sizeof(buf) - 1) == 5);
+  EXPECT_OK(dfk__http_response_complete(&fixture->resp));
+  /* Output is kept in the buffer for the next pipelined response */
+  EXPECT(fixture->respbuf.size == 0);
+  EXPECT(fixture->resp._obufnbytes == 43);
+  dfk_iovec_t prebuilt = {"HTTP/1.0 204 No Content\r\n\r\n", 27};
+  fixture->resp._headers_flushed = 0;
+  EXPECT(dfk__http_response_write_prebuilt(&fixture->resp, &prebuilt, 1) == 27);
+  expect_resp(&fixture->resp,
+      "HTTP/1.0 200 OK\r\n"
+      "Content-Length: 5\r\n"
+      "\r\n"
+      "Hello"
+      "HTTP/1.0 204 No Content\r\n\r\n");
+}
+
 #endif /* DFK_MOCKS */
 
@@ -182,3 +182,177 @@ TEST_F(fixture, arena, alloc_large_object)
   }
 }
 
+
+static void count_cleanup(dfk_arena_t* arena, void* p)
+{
+  DFK_UNUSED(arena);
+  (**(int**) p)++;
+}
+
+TEST_F(fixture, arena, reset_reuses_segment)
+{
+  dfk_arena_t* arena = &fixture->arena;
+  int ncleanups = 0;
+  int** pc = dfk_arena_alloc_ex(arena, sizeof(int*), count_cleanup);
+  EXPECT(pc);
+  *pc = &ncleanups;
+  char* p1 = dfk_arena_alloc(arena, 10);
+  EXPECT(p1);
+  dfk_arena_reset(arena, 1);
+  EXPECT(ncleanups == 1);
+  /* Memory of the retained segment is handed out again */
+  fixture->dfk.malloc = out_of_memory;
+  char* p2 = dfk_arena_alloc(arena, (size_t) (0.5 * DFK_ARENA_SEGMENT_SIZE));
+  EXPECT(p2);
+  EXPECT(p2 <= p1);
+  EXPECT(!dfk_arena_alloc(arena, (size_t) (0.75 * DFK_ARENA_SEGMENT_SIZE)));
+  /* Cleanup is not invoked twice */
+  dfk_arena_reset(arena, 1);
+  EXPECT(ncleanups == 1);
+}
+
+/*
+ * Fill @p nsegments data segments with small objects, returns number of
+ * segments filled
+ */
+static int fill_segments(dfk_arena_t* arena, int nsegments)
+{
+  size_t count = DFK_ARENA_SEGMENT_SIZE / 5;
+  for (int i = 0; i < nsegments; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      if (!dfk_arena_alloc(arena, count)) {
+        return i;
+      }
+    }
+  }
+  return nsegments;
+}
+
+TEST_F(fixture, arena, reset_retains_nsegments)
+{
+  dfk_arena_t* arena = &fixture->arena;
+  /* Segments that are not retained should not be kept by the context */
+  fixture->dfk.buffer_pool_size = 0;
+  EXPECT(fill_segments(arena, 3) == 3);
+  EXPECT(arena->stats.nsegments == 3);
+  EXPECT(dfk_arena_alloc(arena, 2 * DFK_ARENA_SEGMENT_SIZE));
+  dfk_arena_reset(arena, 2);
+  fixture->dfk.malloc = out_of_memory;
+  EXPECT(fill_segments(arena, 3) == 2);
+}
+
+TEST_F(fixture, arena, reset_empty)
+{
+  dfk_arena_reset(&fixture->arena, 1);
+  EXPECT(dfk_arena_alloc(&fixture->arena, 10));
+}
+
+TEST_F(fixture, arena, rewind)
+{
+  dfk_arena_t* arena = &fixture->arena;
+  char* p0 = dfk_arena_alloc(arena, 10);
+  EXPECT(p0);
+  memset(p0, 'x', 10);
+  dfk_arena_mark_t mark;
+  dfk_arena_mark(arena, &mark);
+  int ncleanups = 0;
+  for (int i = 0; i < 2; ++i) {
+    char* p1 = dfk_arena_alloc(arena, 10);
+    EXPECT(p1);
+    int** pc = dfk_arena_alloc_ex(arena, sizeof(int*), count_cleanup);
+    EXPECT(pc);
+    *pc = &ncleanups;
+    dfk_arena_rewind(arena, &mark);
+    EXPECT(ncleanups == i + 1);
+    /* Same memory is handed out after rewind */
+    EXPECT(dfk_arena_alloc(arena, 10) == p1);
+    dfk_arena_rewind(arena, &mark);
+  }
+  for (int i = 0; i < 10; ++i) {
+    EXPECT(p0[i] == 'x');
+  }
+}
+
+TEST_F(fixture, arena, rewind_segments)
+{
+  dfk_arena_t* arena = &fixture->arena;
+  dfk_arena_mark_t mark;
+  dfk_arena_mark(arena, &mark);
+  EXPECT(fill_segments(arena, 2) == 2);
+  EXPECT(dfk_arena_alloc(arena, 2 * DFK_ARENA_SEGMENT_SIZE));
+  dfk_arena_rewind(arena, &mark);
+  /* Segments of the default size are retained */
+  fixture->dfk.malloc = out_of_memory;
+  EXPECT(fill_segments(arena, 3) == 2);
+}
+
+TEST_F(fixture, arena, alloc_aligned)
+{
+  dfk_arena_t* arena = &fixture->arena;
+  for (size_t i = 1; i < 20; ++i) {
+    char* p = dfk_arena_alloc(arena, i);
+    EXPECT(p);
+    EXPECT(!((uintptr_t) p % DFK_MALLOC_ALIGNMENT));
+  }
+  size_t alignments[] = {1, 2, 64, 4096};
+  for (size_t i = 0; i < DFK_SIZE(alignments); ++i) {
+    EXPECT(dfk_arena_alloc(arena, 3));
+    char* p = dfk_arena_alloc_aligned(arena, 10, alignments[i]);
+    EXPECT(p);
+    EXPECT(!((uintptr_t) p % alignments[i]));
+    memset(p, 0, 10);
+  }
+  char* p = dfk_arena_alloc_aligned(arena, DFK_ARENA_SEGMENT_SIZE, 4096);
+  EXPECT(p);
+  EXPECT(!((uintptr_t) p % 4096));
+  memset(p, 0, DFK_ARENA_SEGMENT_SIZE);
+}
+
+TEST_F(fixture, arena, alloc_ex_aligned)
+{
+  void* p = dfk_arena_alloc_ex(&fixture->arena, 10, no_cleaup);
+  EXPECT(p);
+  EXPECT(!((uintptr_t) p % DFK_MALLOC_ALIGNMENT));
+}
+
+TEST_F(fixture, arena, oversize_keeps_segment)
+{
+  dfk_arena_t* arena = &fixture->arena;
+  char* p1 = dfk_arena_alloc(arena, 16);
+  EXPECT(p1);
+  size_t count = (size_t) (0.75 * DFK_ARENA_SEGMENT_SIZE);
+  EXPECT(dfk_arena_alloc(arena, count) == p1 + 16);
+  /* Does not fit into the segment, but is not small enough to retire it */
+  EXPECT(dfk_arena_alloc(arena, count));
+  EXPECT(arena->stats.noversize == 1);
+  EXPECT(arena->stats.nsegments == 1);
+  /* Small objects are still allocated from the first segment */
+  EXPECT(dfk_arena_alloc(arena, 16) == p1 + 16 + count);
+  EXPECT(arena->stats.nbytes_allocated == 2 * count + 32);
+  EXPECT(arena->stats.nbytes_wasted == 0);
+}
+
+TEST_F(fixture, arena, oversize_rewind)
+{
+  dfk_arena_t* arena = &fixture->arena;
+  EXPECT(dfk_arena_alloc(arena, 16));
+  dfk_arena_mark_t mark;
+  dfk_arena_mark(arena, &mark);
+  EXPECT(dfk_arena_alloc(arena, 2 * DFK_ARENA_SEGMENT_SIZE));
+  dfk_arena_rewind(arena, &mark);
+  EXPECT(dfk_arena_alloc(arena, 2 * DFK_ARENA_SEGMENT_SIZE));
+  /* Valgrind should report no memory leak here */
+}
+
+TEST_F(fixture, arena, stats_waste)
+{
+  dfk_arena_t* arena = &fixture->arena;
+  EXPECT(dfk_arena_alloc(arena, 1));
+  EXPECT(dfk_arena_alloc(arena, 1));
+  EXPECT(arena->stats.nbytes_allocated == 2);
+  EXPECT(arena->stats.nbytes_wasted == DFK_MALLOC_ALIGNMENT - 1);
+  /* Tail of the first segment is wasted */
+  EXPECT(fill_segments(arena, 2) == 2);
+  EXPECT(arena->stats.nsegments == 2);
+  EXPECT(arena->stats.nbytes_wasted > DFK_MALLOC_ALIGNMENT - 1);
+}
@@ -0,0 +1,161 @@
+/**
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <dfk/context.h>
+#include <dfk/fiber.h>
+#include <dfk/blocking.h>
+#include <dfk/internal.h>
+#include <ut.h>
+
+#define MSEC 1000000ULL
+
+typedef struct offload_arg_t {
+  pthread_t caller;
+  int other_thread;
+  int nticks;
+  int nticks_seen;
+} offload_arg_t;
+
+static void offload_func(void* p)
+{
+  offload_arg_t* arg = (offload_arg_t*) p;
+  arg->other_thread = !pthread_equal(arg->caller, pthread_self());
+  struct timespec delay = {0, 30 * MSEC};
+  nanosleep(&delay, NULL);
+}
+
+static void offload_ticker(dfk_fiber_t* fiber, void* p)
+{
+  offload_arg_t* arg = (offload_arg_t*) p;
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_OK(dfk_sleep(fiber->dfk, 1 * MSEC));
+    arg->nticks++;
+  }
+}
+
+static void offload_main(dfk_fiber_t* fiber, void* p)
+{
+  offload_arg_t* arg = (offload_arg_t*) p;
+  arg->caller = pthread_self();
+  EXPECT(dfk_spawn(fiber->dfk, offload_ticker, arg, 0));
+  EXPECT_OK(dfk_blocking_call(fiber->dfk, offload_func, arg));
+  arg->nticks_seen = arg->nticks;
+}
+
+TEST(blocking, offload)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+#if DFK_THREADS
+  dfk.nworkers = 1;
+#endif
+  offload_arg_t arg = {.other_thread = 0, .nticks = 0, .nticks_seen = 0};
+  EXPECT_OK(dfk_work(&dfk, offload_main, &arg, 0));
+#if DFK_MAILBOX
+  EXPECT(arg.other_thread);
+  /* Event loop keeps running while the call is in progress */
+  EXPECT(arg.nticks_seen == 3);
+#endif
+  dfk_free(&dfk);
+}
+
+typedef struct bounded_arg_t {
+  pthread_mutex_t lock;
+  int nrunning;
+  int maxrunning;
+  int ndone;
+} bounded_arg_t;
+
+static void bounded_func(void* p)
+{
+  bounded_arg_t* arg = (bounded_arg_t*) p;
+  pthread_mutex_lock(&arg->lock);
+  arg->nrunning++;
+  arg->maxrunning = DFK_MAX(arg->maxrunning, arg->nrunning);
+  pthread_mutex_unlock(&arg->lock);
+  struct timespec delay = {0, 5 * MSEC};
+  nanosleep(&delay, NULL);
+  pthread_mutex_lock(&arg->lock);
+  arg->nrunning--;
+  arg->ndone++;
+  pthread_mutex_unlock(&arg->lock);
+}
+
+static void bounded_child(dfk_fiber_t* fiber, void* p)
+{
+  EXPECT_OK(dfk_blocking_call(fiber->dfk, bounded_func, p));
+}
+
+static void bounded_main(dfk_fiber_t* fiber, void* p)
+{
+  for (int i = 0; i < 8; ++i) {
+    EXPECT(dfk_spawn(fiber->dfk, bounded_child, p, 0));
+  }
+}
+
+TEST(blocking, bounded_pool)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+  dfk.blocking_threads = 2;
+  bounded_arg_t arg = {.nrunning = 0, .maxrunning = 0, .ndone = 0};
+  pthread_mutex_init(&arg.lock, NULL);
+  EXPECT_OK(dfk_work(&dfk, bounded_main, &arg, 0));
+  EXPECT(arg.ndone == 8);
+  EXPECT(arg.maxrunning <= 2);
+  pthread_mutex_destroy(&arg.lock);
+  dfk_free(&dfk);
+}
+
+static void inline_main(dfk_fiber_t* fiber, void* p)
+{
+  offload_arg_t* arg = (offload_arg_t*) p;
+  arg->caller = pthread_self();
+  EXPECT_OK(dfk_blocking_call(fiber->dfk, offload_func, arg));
+}
+
+TEST(blocking, no_threads)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+#if DFK_THREADS
+  dfk.nworkers = 1;
+#endif
+  dfk.blocking_threads = 0;
+  offload_arg_t arg = {.other_thread = 1};
+  EXPECT_OK(dfk_work(&dfk, inline_main, &arg, 0));
+  EXPECT(!arg.other_thread);
+  dfk_free(&dfk);
+}
+
+static void grow_main(dfk_fiber_t* fiber, void* p)
+{
+  EXPECT_OK(dfk_blocking_call(fiber->dfk, bounded_func, p));
+  /* Pool is already created, it keeps the initial number of threads */
+  fiber->dfk->blocking_threads = 8;
+  bounded_main(fiber, p);
+}
+
+TEST(blocking, threads_raised_after_first_call)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+#if DFK_THREADS
+  dfk.nworkers = 1;
+#endif
+  dfk.blocking_threads = 1;
+  bounded_arg_t arg = {.nrunning = 0, .maxrunning = 0, .ndone = 0};
+  pthread_mutex_init(&arg.lock, NULL);
+  EXPECT_OK(dfk_work(&dfk, grow_main, &arg, 0));
+  EXPECT(arg.ndone == 9);
+#if DFK_MAILBOX
+  EXPECT(arg.maxrunning == 1);
+#endif
+  pthread_mutex_destroy(&arg.lock);
+  dfk_free(&dfk);
+}
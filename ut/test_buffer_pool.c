@@ -0,0 +1,222 @@
+/**
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <dfk/arena.h>
+#include <dfk/context.h>
+#include <dfk/fiber.h>
+#include <dfk/tcp_socket.h>
+#include <dfk/http.h>
+#include <dfk/internal.h>
+#include <dfk/internal/buffer_pool.h>
+#include <ut.h>
+
+#define BUFFER_POOL_PORT 10027
+#define BUFSIZE 128
+#define NREQUESTS 8
+
+/**
+ * Allocator that counts calls, installed into dfk.malloc and dfk.free
+ */
+typedef struct counters_t {
+  size_t nmalloc;
+  size_t nfree;
+} counters_t;
+
+static void* counting_malloc(dfk_t* dfk, size_t size)
+{
+  ((counters_t*) dfk->user.data)->nmalloc++;
+  return malloc(size);
+}
+
+static void counting_free(dfk_t* dfk, void* p)
+{
+  ((counters_t*) dfk->user.data)->nfree++;
+  free(p);
+}
+
+typedef struct fixture_t {
+  dfk_t dfk;
+  counters_t counters;
+} fixture_t;
+
+static void fixture_setup(fixture_t* f)
+{
+  dfk_init(&f->dfk);
+  f->counters = (counters_t) {0, 0};
+  f->dfk.user.data = &f->counters;
+  f->dfk.malloc = counting_malloc;
+  f->dfk.free = counting_free;
+}
+
+static void fixture_teardown(fixture_t* f)
+{
+  dfk_free(&f->dfk);
+  EXPECT(f->counters.nmalloc == f->counters.nfree);
+}
+
+TEST_F(fixture, buffer_pool, reuse_same_size)
+{
+  void* buf = dfk__buffer_alloc(&fixture->dfk, BUFSIZE);
+  EXPECT(buf);
+  dfk__buffer_free(&fixture->dfk, buf, BUFSIZE);
+  EXPECT(dfk__buffer_alloc(&fixture->dfk, BUFSIZE) == buf);
+  EXPECT(fixture->counters.nmalloc == 1);
+  dfk__buffer_free(&fixture->dfk, buf, BUFSIZE);
+}
+
+TEST_F(fixture, buffer_pool, no_reuse_other_size)
+{
+  void* buf = dfk__buffer_alloc(&fixture->dfk, BUFSIZE);
+  EXPECT(buf);
+  dfk__buffer_free(&fixture->dfk, buf, BUFSIZE);
+  void* other = dfk__buffer_alloc(&fixture->dfk, 2 * BUFSIZE);
+  EXPECT(other);
+  EXPECT(other != buf);
+  EXPECT(fixture->counters.nmalloc == 2);
+  dfk__buffer_free(&fixture->dfk, other, 2 * BUFSIZE);
+}
+
+TEST_F(fixture, buffer_pool, full_pool)
+{
+  fixture->dfk.buffer_pool_size = 1;
+  void* first = dfk__buffer_alloc(&fixture->dfk, BUFSIZE);
+  void* second = dfk__buffer_alloc(&fixture->dfk, BUFSIZE);
+  EXPECT(first && second);
+  dfk__buffer_free(&fixture->dfk, first, BUFSIZE);
+  EXPECT(!fixture->counters.nfree);
+  /* Pool is full, buffer goes to the allocator */
+  dfk__buffer_free(&fixture->dfk, second, BUFSIZE);
+  EXPECT(fixture->counters.nfree == 1);
+  EXPECT(dfk_list_size(&fixture->dfk._buffer_pool) == 1);
+}
+
+TEST_F(fixture, buffer_pool, disabled)
+{
+  fixture->dfk.buffer_pool_size = 0;
+  void* buf = dfk__buffer_alloc(&fixture->dfk, BUFSIZE);
+  EXPECT(buf);
+  dfk__buffer_free(&fixture->dfk, buf, BUFSIZE);
+  EXPECT(fixture->counters.nfree == 1);
+}
+
+TEST_F(fixture, buffer_pool, shrink)
+{
+  void* bufs[4];
+  for (size_t i = 0; i < DFK_SIZE(bufs); ++i) {
+    bufs[i] = dfk__buffer_alloc(&fixture->dfk, BUFSIZE);
+    EXPECT(bufs[i]);
+  }
+  for (size_t i = 0; i < DFK_SIZE(bufs); ++i) {
+    dfk__buffer_free(&fixture->dfk, bufs[i], BUFSIZE);
+  }
+  dfk__buffer_pool_shrink(&fixture->dfk, 1);
+  EXPECT(dfk_list_size(&fixture->dfk._buffer_pool) == 1);
+  EXPECT(fixture->counters.nfree == 3);
+}
+
+TEST(buffer_pool, released_by_dfk_free)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+  counters_t counters = {0, 0};
+  dfk.user.data = &counters;
+  dfk.malloc = counting_malloc;
+  dfk.free = counting_free;
+  for (size_t i = 0; i < 4; ++i) {
+    void* buf = dfk__buffer_alloc(&dfk, BUFSIZE * (i + 1));
+    EXPECT(buf);
+    dfk__buffer_free(&dfk, buf, BUFSIZE * (i + 1));
+  }
+  EXPECT(!counters.nfree);
+  dfk_free(&dfk);
+  EXPECT(counters.nfree == 4);
+}
+
+typedef struct keepalive_arg_t {
+  fixture_t* fixture;
+  dfk_http_t http;
+  int serve_err;
+  /** Allocator calls made by the time the second response is received */
+  counters_t warm;
+  /** Allocator calls made by the time the last response is received */
+  counters_t last;
+} keepalive_arg_t;
+
+static int keepalive_handler(dfk_http_t* http, dfk_http_request_t* req,
+    dfk_http_response_t* resp, dfk_userdata_t ud)
+{
+  DFK_UNUSED(http);
+  DFK_UNUSED(ud);
+  /*
+   * Request arena retains a single segment between requests, the second
+   * one is returned to the buffer pool
+   */
+  for (int i = 0; i < 5; ++i) {
+    EXPECT(dfk_arena_alloc(req->_request_arena, DFK_ARENA_SEGMENT_SIZE / 5));
+  }
+  resp->content_length = 2;
+  EXPECT(dfk_http_response_write(resp, "ok", 2) == 2);
+  return dfk_err_ok;
+}
+
+static void keepalive_serve(dfk_fiber_t* fiber, void* p)
+{
+  DFK_UNUSED(fiber);
+  keepalive_arg_t* arg = (keepalive_arg_t*) p;
+  arg->serve_err = dfk_http_serve(&arg->http, "127.0.0.1", BUFFER_POOL_PORT,
+      16, keepalive_handler, (dfk_userdata_t) {NULL});
+}
+
+static void keepalive_main(dfk_fiber_t* fiber, void* p)
+{
+  dfk_t* dfk = fiber->dfk;
+  keepalive_arg_t* arg = (keepalive_arg_t*) p;
+  dfk_http_init(&arg->http, dfk);
+  EXPECT(dfk_spawn(dfk, keepalive_serve, arg, 0));
+  EXPECT_OK(dfk_sleep(dfk, 10000000));
+  dfk_tcp_socket_t sock;
+  EXPECT_OK(dfk_tcp_socket_init(&sock, dfk));
+  EXPECT_OK(dfk_tcp_socket_connect(&sock, "127.0.0.1", BUFFER_POOL_PORT));
+  static const char req[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  for (int i = 0; i < NREQUESTS; ++i) {
+    EXPECT(dfk_tcp_socket_write(&sock, (char*) req, sizeof(req) - 1)
+        == sizeof(req) - 1);
+    char buf[256];
+    size_t nread = 0;
+    while (nread < 6 || strncmp(buf + nread - 6, "\r\n\r\nok", 6)) {
+      ssize_t n = dfk_tcp_socket_read(&sock, buf + nread,
+          sizeof(buf) - nread);
+      EXPECT(n > 0);
+      if (n <= 0) {
+        break;
+      }
+      nread += n;
+    }
+    if (i == 1) {
+      arg->warm = arg->fixture->counters;
+    }
+  }
+  arg->last = arg->fixture->counters;
+  EXPECT_OK(dfk_tcp_socket_close(&sock));
+  EXPECT_OK(dfk_http_stop(&arg->http));
+}
+
+TEST_F(fixture, buffer_pool, keepalive_no_malloc)
+{
+#if DFK_THREADS
+  fixture->dfk.nworkers = 1;
+#endif
+  keepalive_arg_t arg = {.fixture = fixture, .serve_err = -1};
+  EXPECT_OK(dfk_work(&fixture->dfk, keepalive_main, &arg, 0));
+  EXPECT_OK(arg.serve_err);
+  dfk_http_free(&arg.http);
+  /* Pool is warm after the first request, the rest are served from it */
+  EXPECT(arg.warm.nmalloc);
+  EXPECT(arg.last.nmalloc == arg.warm.nmalloc);
+  EXPECT(arg.last.nfree == arg.warm.nfree);
+}
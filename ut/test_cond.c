@@ -342,3 +342,73 @@ TEST_F(cond_fixture, cond, broadcast_multi_wait)
   EXPECT(fixture->state == 5);
 }
 
+
+#if !DFK_THREADS
+typedef struct signal_handoff_data {
+  cond_fixture_t* f;
+  int order[3];
+  int n;
+} signal_handoff_data;
+
+static void signal_handoff_consumer(dfk_fiber_t* fiber, void* arg)
+{
+  DFK_UNUSED(fiber);
+  signal_handoff_data* d = arg;
+  dfk_mutex_lock(&d->f->mutex);
+  CHANGE_STATE(d->f->state, 0, 1);
+  while (d->f->state != 2) {
+    dfk_cond_wait(&d->f->cv, &d->f->mutex);
+  }
+  d->order[d->n++] = 1;
+  dfk_mutex_unlock(&d->f->mutex);
+}
+
+static void signal_handoff_bystander(dfk_fiber_t* fiber, void* arg)
+{
+  DFK_UNUSED(fiber);
+  signal_handoff_data* d = arg;
+  d->order[d->n++] = 2;
+}
+
+static void signal_handoff_main(dfk_fiber_t* fiber, void* arg)
+{
+  dfk_t* dfk = fiber->dfk;
+  signal_handoff_data* d = arg;
+  dfk_mutex_init(&d->f->mutex, dfk);
+  dfk_cond_init(&d->f->cv, dfk);
+  EXPECT(dfk_spawn(dfk, signal_handoff_consumer, d, 0));
+  while (d->f->state != 1) {
+    DFK_POSTPONE(dfk);
+  }
+  EXPECT(dfk_spawn(dfk, signal_handoff_bystander, d, 0));
+  dfk_mutex_lock(&d->f->mutex);
+  CHANGE_STATE(d->f->state, 1, 2);
+  dfk_cond_signal(&d->f->cv);
+  dfk_mutex_unlock(&d->f->mutex);
+  d->order[d->n++] = 3;
+  DFK_POSTPONE(dfk);
+  dfk_cond_free(&d->f->cv);
+  dfk_mutex_free(&d->f->mutex);
+}
+#endif
+
+/*
+ * States:
+ * 1 - consumer waits on cv
+ * 2 - main fiber submitted signal
+ */
+TEST_F(cond_fixture, cond, signal_handoff)
+{
+#if !DFK_THREADS
+  signal_handoff_data d = {.f = fixture, .n = 0};
+  fixture->dfk.handoff_limit = 16;
+  EXPECT_OK(dfk_work(&fixture->dfk, signal_handoff_main, &d, 0));
+  /* Consumer gets the mutex directly once the main fiber unlocks it */
+  EXPECT(d.n == 3);
+  EXPECT(d.order[0] == 1);
+  EXPECT(d.order[1] == 2);
+  EXPECT(d.order[2] == 3);
+#else
+  DFK_UNUSED(fixture);
+#endif
+}
@@ -6,7 +6,9 @@
 
 #include <dfk/context.h>
 #include <dfk/fiber.h>
+#include <dfk/mutex.h>
 #include <dfk/internal.h>
+#include <dfk/internal/stack.h>
 #include <ut.h>
 #include <allocators.h>
 
@@ -101,3 +103,212 @@ TEST(fiber, spawn_child_oom)
   dfk_free(&dfk);
 }
 
+
+static void spawn_many_main(dfk_fiber_t* fiber, void* arg)
+{
+  for (int i = 0; i < 20; ++i) {
+    EXPECT(dfk_spawn(fiber->dfk, noop_fiber, arg, 0));
+  }
+}
+
+TEST(fiber, stack_pool_watermarks)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+  dfk.stack_pool_high = 8;
+  dfk.stack_pool_low = 2;
+  EXPECT_OK(dfk_work(&dfk, spawn_many_main, NULL, 0));
+  EXPECT(dfk_list_size(&dfk._stack_pool) >= dfk.stack_pool_low);
+  EXPECT(dfk_list_size(&dfk._stack_pool) <= dfk.stack_pool_high);
+  dfk_free(&dfk);
+  EXPECT(dfk_list_empty(&dfk._stack_pool));
+}
+
+/**
+ * Touch at least @p depth kilobytes of the stack
+ */
+static size_t deep_recursion(size_t depth)
+{
+  volatile char buf[1024];
+  for (size_t i = 0; i < sizeof(buf); ++i) {
+    buf[i] = (char) i;
+  }
+  return depth ? buf[depth % sizeof(buf)] + deep_recursion(depth - 1) : 0;
+}
+
+static void stack_hwm_main(dfk_fiber_t* fiber, void* arg)
+{
+  size_t depth = *(size_t*) arg;
+  deep_recursion(depth);
+  EXPECT(dfk_fiber_stack_hwm(fiber) >= depth * 1024);
+}
+
+TEST(fiber, stack_hwm)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+  size_t depth = dfk.default_stack_size / 4096;
+  EXPECT_OK(dfk_work(&dfk, stack_hwm_main, &depth, sizeof(depth)));
+  dfk_free(&dfk);
+}
+
+TEST(fiber, stack_reclaim)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+  dfk_stack_t* stack = dfk__stack_alloc(&dfk, dfk.default_stack_size);
+  EXPECT(stack);
+  size_t touched = (stack->top - stack->bottom) / 2;
+  memset(stack->top - touched, 0xfe, touched);
+  EXPECT(dfk__stack_hwm(stack) >= touched);
+  dfk__stack_free(&dfk, stack);
+#if DFK_STACK_LAZY
+  EXPECT(dfk__stack_hwm(stack) <= dfk.stack_resident_size + DFK_PAGE_SIZE);
+#endif
+  dfk_free(&dfk);
+}
+
+typedef struct lanes_arg_t {
+  dfk_fiber_t* fibers[4];
+  int nsuspended;
+  int order[4];
+  int nfinished;
+} lanes_arg_t;
+
+typedef struct lanes_child_arg_t {
+  lanes_arg_t* shared;
+  int id;
+  dfk_fiber_priority_e priority;
+  uint64_t deadline;
+} lanes_child_arg_t;
+
+static void lanes_child(dfk_fiber_t* fiber, void* p)
+{
+  lanes_child_arg_t* arg = (lanes_child_arg_t*) p;
+  dfk_fiber_priority(fiber, arg->priority);
+  dfk_fiber_deadline(fiber, arg->deadline);
+  arg->shared->fibers[arg->shared->nsuspended++] = fiber;
+  DFK_SUSPEND(fiber->dfk);
+  arg->shared->order[arg->shared->nfinished++] = arg->id;
+}
+
+/**
+ * Spawn children, and resume them at once when all are suspended
+ */
+static void lanes_spawn(dfk_fiber_t* fiber, lanes_child_arg_t* args,
+    size_t nargs)
+{
+  lanes_arg_t* shared = args[0].shared;
+  for (size_t i = 0; i < nargs; ++i) {
+    EXPECT(dfk_spawn(fiber->dfk, lanes_child, args + i, sizeof(args[i])));
+  }
+  while (shared->nsuspended < (int) nargs) {
+    DFK_POSTPONE(fiber->dfk);
+  }
+  for (size_t i = 0; i < nargs; ++i) {
+    DFK_RESUME(shared->fibers[i]);
+  }
+}
+
+static void lanes_main(dfk_fiber_t* fiber, void* p)
+{
+  uint64_t now = dfk_now(fiber->dfk);
+  lanes_child_arg_t args[] = {
+    {p, 4, dfk_fiber_priority_background, 0},
+    {p, 3, dfk_fiber_priority_request, 0},
+    {p, 1, dfk_fiber_priority_control, 0},
+    {p, 2, dfk_fiber_priority_request, now + 1000000}
+  };
+  lanes_spawn(fiber, args, DFK_SIZE(args));
+}
+
+TEST(fiber, priority_lanes)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+#if DFK_THREADS
+  dfk.nworkers = 1;
+#endif
+  lanes_arg_t arg = {{NULL}, 0, {0}, 0};
+  EXPECT_OK(dfk_work(&dfk, lanes_main, &arg, 0));
+  EXPECT(arg.nfinished == 4);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT(arg.order[i] == i + 1);
+  }
+  dfk_free(&dfk);
+}
+
+static void deadlines_main(dfk_fiber_t* fiber, void* p)
+{
+  uint64_t now = dfk_now(fiber->dfk);
+  lanes_child_arg_t args[] = {
+    {p, 3, dfk_fiber_priority_background, now + 3000000},
+    {p, 1, dfk_fiber_priority_request, now + 1000000},
+    {p, 4, dfk_fiber_priority_request, 0},
+    {p, 2, dfk_fiber_priority_request, now + 2000000}
+  };
+  lanes_spawn(fiber, args, DFK_SIZE(args));
+}
+
+TEST(fiber, earliest_deadline_first)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+#if DFK_THREADS
+  dfk.nworkers = 1;
+#endif
+  lanes_arg_t arg = {{NULL}, 0, {0}, 0};
+  EXPECT_OK(dfk_work(&dfk, deadlines_main, &arg, 0));
+  EXPECT(arg.nfinished == 4);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT(arg.order[i] == i + 1);
+  }
+  dfk_free(&dfk);
+}
+
+typedef struct workers_arg_t {
+  dfk_mutex_t mutex;
+  dfk_atomic_size_t nfinished;
+  size_t counter;
+} workers_arg_t;
+
+static void workers_child(dfk_fiber_t* fiber, void* arg)
+{
+  workers_arg_t* warg = (workers_arg_t*) arg;
+  for (int i = 0; i < 10; ++i) {
+    dfk_mutex_lock(&warg->mutex);
+    warg->counter++;
+    dfk_mutex_unlock(&warg->mutex);
+    DFK_POSTPONE(fiber->dfk);
+  }
+  warg->nfinished++;
+}
+
+static void workers_main(dfk_fiber_t* fiber, void* arg)
+{
+  for (int i = 0; i < 100; ++i) {
+    EXPECT(dfk_spawn(fiber->dfk, workers_child, arg, 0));
+  }
+}
+
+/*
+ * If #DFK_THREADS is enabled, fibers are distributed among several worker
+ * threads, single-threaded execution is tested otherwise.
+ */
+TEST(fiber, multiple_workers)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+#if DFK_THREADS
+  dfk.nworkers = 4;
+#endif
+  workers_arg_t arg;
+  dfk_mutex_init(&arg.mutex, &dfk);
+  arg.nfinished = 0;
+  arg.counter = 0;
+  EXPECT_OK(dfk_work(&dfk, workers_main, &arg, 0));
+  EXPECT(arg.nfinished == 100);
+  EXPECT(arg.counter == 1000);
+  dfk_mutex_free(&arg.mutex);
+  dfk_free(&dfk);
+}
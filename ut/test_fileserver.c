@@ -0,0 +1,830 @@
+/**
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dfk/tcp_socket.h>
+#include <dfk/http/server.h>
+#include <dfk/middleware/fileserver.h>
+#include <dfk/internal.h>
+#include <dfk/internal/middleware/fileserver.h>
+#include <ut.h>
+
+#define FILESERVER_PORT 10031
+#define MSEC 1000000ULL
+
+/**
+ * Response received by fileserver_get()
+ */
+typedef struct response_t {
+  int status;
+  /** Status line, headers and body, NULL-terminated */
+  char data[65536];
+  size_t size;
+  char* body;
+  size_t bodysize;
+} response_t;
+
+typedef struct fixture_t {
+  dfk_t dfk;
+  dfk_http_t http;
+  dfk_fileserver_t fs;
+  /** Temporary directory served by fs */
+  char root[64];
+  /** Port to serve on, FILESERVER_PORT by default */
+  uint16_t port;
+  /** Test scenario, executed in a fiber while fileserver is running */
+  void (*client)(struct fixture_t*);
+  int serve_err;
+  response_t resp;
+} fixture_t;
+
+static void fixture_setup(fixture_t* f)
+{
+  dfk_init(&f->dfk);
+  strcpy(f->root, "/tmp/dfk-ut-fileserver-XXXXXX");
+  EXPECT(mkdtemp(f->root));
+  EXPECT_OK(dfk_fileserver_init(&f->fs, &f->dfk, f->root, strlen(f->root)));
+  f->port = FILESERVER_PORT;
+  f->serve_err = -1;
+}
+
+static int remove_file(const char* path, const struct stat* st, int flag,
+    struct FTW* ftw)
+{
+  DFK_UNUSED(st);
+  DFK_UNUSED(flag);
+  DFK_UNUSED(ftw);
+  return remove(path);
+}
+
+static void fixture_teardown(fixture_t* f)
+{
+  EXPECT_OK(dfk_fileserver_free(&f->fs));
+  EXPECT(!nftw(f->root, remove_file, 8, FTW_DEPTH | FTW_PHYS));
+  dfk_free(&f->dfk);
+}
+
+/**
+ * Write a file into the served directory, in place
+ */
+static void write_file(fixture_t* f, const char* name, const char* data)
+{
+  char path[128];
+  snprintf(path, sizeof(path), "%s/%s", f->root, name);
+  int fd = open(path, O_WRONLY | O_CREAT, 0644);
+  EXPECT(fd != -1);
+  size_t size = strlen(data);
+  EXPECT(write(fd, data, size) == (ssize_t) size);
+  EXPECT(!ftruncate(fd, size));
+  close(fd);
+}
+
+/**
+ * Replace a file in the served directory with a new one, the way atomic
+ * deployments do
+ */
+static void replace_file(fixture_t* f, const char* name, const char* data)
+{
+  char tmpname[64];
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", name);
+  write_file(f, tmpname, data);
+  char from[128];
+  char to[128];
+  snprintf(from, sizeof(from), "%s/%s", f->root, tmpname);
+  snprintf(to, sizeof(to), "%s/%s", f->root, name);
+  EXPECT(!rename(from, to));
+}
+
+static int fileserver_http_handler(dfk_http_t* http,
+    dfk_http_request_t* request, dfk_http_response_t* response,
+    dfk_userdata_t ud)
+{
+  return dfk_fileserver_handler(ud, http, request, response);
+}
+
+static void fileserver_serve(dfk_fiber_t* fiber, void* p)
+{
+  DFK_UNUSED(fiber);
+  fixture_t* f = (fixture_t*) p;
+  f->serve_err = dfk_http_serve(&f->http, "127.0.0.1", f->port, 16,
+      fileserver_http_handler, (dfk_userdata_t) {.data = &f->fs});
+}
+
+static void fileserver_main(dfk_fiber_t* fiber, void* p)
+{
+  fixture_t* f = (fixture_t*) p;
+  dfk_http_init(&f->http, fiber->dfk);
+  EXPECT(dfk_spawn(fiber->dfk, fileserver_serve, f, 0));
+  /* Let the server bind */
+  EXPECT_OK(dfk_sleep(fiber->dfk, 10 * MSEC));
+  f->client(f);
+  EXPECT_OK(dfk_http_stop(&f->http));
+}
+
+/**
+ * Serve the temporary directory while @p client is running
+ */
+static void fileserver_run(fixture_t* f, void (*client)(fixture_t*))
+{
+  f->client = client;
+  EXPECT_OK(dfk_work(&f->dfk, fileserver_main, f, 0));
+  EXPECT_OK(f->serve_err);
+  dfk_http_free(&f->http);
+}
+
+/**
+ * Returns value of the response header, empty buffer if not found
+ */
+static dfk_buf_t response_header(response_t* resp, const char* name)
+{
+  size_t namelen = strlen(name);
+  char* i = strstr(resp->data, "\r\n") + 2;
+  while (i < resp->body - 2) {
+    char* eol = strstr(i, "\r\n");
+    if (!strncasecmp(i, name, namelen) && i[namelen] == ':') {
+      char* value = i + namelen + 1;
+      while (*value == ' ') {
+        ++value;
+      }
+      return (dfk_buf_t) {value, eol - value};
+    }
+    i = eol + 2;
+  }
+  return (dfk_buf_t) {"", 0};
+}
+
+/**
+ * Send GET request with optional extra @p headers, receive response into
+ * f->resp
+ *
+ * Client closes connection first, so that the port is not in TIME_WAIT.
+ */
+static void fileserver_get(fixture_t* f, const char* path, const char* headers)
+{
+  response_t* resp = &f->resp;
+  resp->status = 0;
+  resp->size = 0;
+  resp->body = NULL;
+  resp->bodysize = 0;
+  char req[1024];
+  int reqlen = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\n%s\r\n",
+      path, headers ? headers : "");
+  dfk_tcp_socket_t sock;
+  EXPECT_OK(dfk_tcp_socket_init(&sock, &f->dfk));
+  EXPECT_OK(dfk_tcp_socket_connect(&sock, "127.0.0.1", f->port));
+  EXPECT(dfk_tcp_socket_write(&sock, req, reqlen) == reqlen);
+  size_t expected = (size_t) -1;
+  while (resp->size < expected) {
+    ssize_t nread = dfk_tcp_socket_read(&sock, resp->data + resp->size,
+        sizeof(resp->data) - 1 - resp->size);
+    EXPECT(nread > 0);
+    if (nread <= 0) {
+      break;
+    }
+    resp->size += nread;
+    resp->data[resp->size] = '\0';
+    char* eoh = strstr(resp->data, "\r\n\r\n");
+    if (eoh && !resp->body) {
+      resp->body = eoh + 4;
+      EXPECT(sscanf(resp->data, "HTTP/1.1 %d", &resp->status) == 1);
+      dfk_buf_t cl = response_header(resp, "Content-Length");
+      size_t bodysize = resp->status == 304 ? 0 : strtoull(cl.data, NULL, 10);
+      expected = (resp->body - resp->data) + bodysize;
+    }
+  }
+  EXPECT(resp->size == expected);
+  if (resp->body) {
+    resp->bodysize = resp->size - (resp->body - resp->data);
+  }
+  EXPECT_OK(dfk_tcp_socket_close(&sock));
+}
+
+#define EXPECT_RESPONSE(f, status_, body_) \
+{ \
+  EXPECT((f)->resp.status == (status_)); \
+  EXPECT((f)->resp.body); \
+  if ((f)->resp.body) { \
+    EXPECT_BUFSTREQ(((dfk_buf_t) {(f)->resp.body, (f)->resp.bodysize}), \
+        (body_)); \
+  } \
+}
+
+static void not_found_client(fixture_t* f)
+{
+  fileserver_get(f, "/missing", NULL);
+  EXPECT(f->resp.status == 404);
+}
+
+TEST_F(fixture, fileserver, not_found)
+{
+  fileserver_run(fixture, not_found_client);
+}
+
+static void cache_hit_client(fixture_t* f)
+{
+  write_file(f, "a", "old");
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "old");
+  replace_file(f, "a", "newer");
+  /* Cached descriptor refers to the replaced file */
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "old");
+}
+
+TEST_F(fixture, fileserver, cache_hit)
+{
+  fixture->fs.cache_size = 4;
+  fixture->fs.cache_ttl = 60000;
+  fileserver_run(fixture, cache_hit_client);
+}
+
+static void no_cache_client(fixture_t* f)
+{
+  write_file(f, "a", "old");
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "old");
+  replace_file(f, "a", "newer");
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "newer");
+}
+
+TEST_F(fixture, fileserver, no_cache)
+{
+  fixture->fs.cache_size = 0;
+  fileserver_run(fixture, no_cache_client);
+}
+
+static void cache_ttl_client(fixture_t* f)
+{
+  write_file(f, "a", "old");
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "old");
+  replace_file(f, "a", "newer");
+  EXPECT_OK(dfk_sleep(&f->dfk, 100 * MSEC));
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "newer");
+}
+
+TEST_F(fixture, fileserver, cache_ttl)
+{
+  fixture->fs.cache_size = 4;
+  fixture->fs.cache_ttl = 50;
+  fileserver_run(fixture, cache_ttl_client);
+}
+
+static void cache_lru_client(fixture_t* f)
+{
+  write_file(f, "a", "old a");
+  write_file(f, "b", "old b");
+  write_file(f, "c", "old c");
+  fileserver_get(f, "/a", NULL);
+  fileserver_get(f, "/b", NULL);
+  fileserver_get(f, "/a", NULL);
+  /* Evicts b, the least recently used one */
+  fileserver_get(f, "/c", NULL);
+  replace_file(f, "a", "new a");
+  replace_file(f, "b", "new b");
+  replace_file(f, "c", "new c");
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "old a");
+  fileserver_get(f, "/c", NULL);
+  EXPECT_RESPONSE(f, 200, "old c");
+  fileserver_get(f, "/b", NULL);
+  EXPECT_RESPONSE(f, 200, "new b");
+}
+
+TEST_F(fixture, fileserver, cache_lru)
+{
+  fixture->fs.cache_size = 2;
+  fixture->fs.cache_ttl = 60000;
+  fileserver_run(fixture, cache_lru_client);
+}
+
+static void validators_client(fixture_t* f)
+{
+  write_file(f, "a", "0123456789");
+  struct stat st;
+  char path[128];
+  snprintf(path, sizeof(path), "%s/a", f->root);
+  EXPECT(!stat(path, &st));
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "0123456789");
+  char etag[64];
+  snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx\"",
+      (unsigned long long) st.st_ino, (unsigned long long) st.st_mtime,
+      (unsigned long long) st.st_size);
+  EXPECT_BUFSTREQ(response_header(&f->resp, "ETag"), etag);
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Content-Length"), "10");
+}
+
+TEST_F(fixture, fileserver, validators)
+{
+  fileserver_run(fixture, validators_client);
+}
+
+static void precompressed_client(fixture_t* f)
+{
+  write_file(f, "a", "plain");
+  write_file(f, "a.gz", "gzipped");
+  write_file(f, "a.br", "brotli");
+  fileserver_get(f, "/a", "Accept-Encoding: gzip\r\n");
+  EXPECT_RESPONSE(f, 200, "gzipped");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Content-Encoding"), "gzip");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Vary"), "Accept-Encoding");
+  fileserver_get(f, "/a", "Accept-Encoding: gzip, br\r\n");
+  EXPECT_RESPONSE(f, 200, "brotli");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Content-Encoding"), "br");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Vary"), "Accept-Encoding");
+  fileserver_get(f, "/a", "Accept-Encoding: br;q=0.5, gzip\r\n");
+  EXPECT_RESPONSE(f, 200, "gzipped");
+  fileserver_get(f, "/a", "Accept-Encoding: deflate\r\n");
+  EXPECT_RESPONSE(f, 200, "plain");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Content-Encoding"), "");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Vary"), "Accept-Encoding");
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "plain");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Vary"), "Accept-Encoding");
+  /* Variant requested directly is not encoded */
+  fileserver_get(f, "/a.gz", "Accept-Encoding: gzip\r\n");
+  EXPECT_RESPONSE(f, 200, "gzipped");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Content-Encoding"), "");
+}
+
+TEST_F(fixture, fileserver, precompressed)
+{
+  fileserver_run(fixture, precompressed_client);
+}
+
+TEST_F(fixture, fileserver, precompressed_cached)
+{
+  fixture->fs.cache_size = 8;
+  fileserver_run(fixture, precompressed_client);
+}
+
+static void precompressed_disabled_client(fixture_t* f)
+{
+  write_file(f, "a", "plain");
+  write_file(f, "a.gz", "gzipped");
+  fileserver_get(f, "/a", "Accept-Encoding: gzip\r\n");
+  EXPECT_RESPONSE(f, 200, "plain");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Content-Encoding"), "");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Vary"), "");
+}
+
+TEST_F(fixture, fileserver, precompressed_disabled)
+{
+  fixture->fs.precompressed = 0;
+  fileserver_run(fixture, precompressed_disabled_client);
+}
+
+static void variants_cache_client(fixture_t* f)
+{
+  write_file(f, "a", "plain");
+  write_file(f, "a.gz", "gzipped");
+  fileserver_get(f, "/a", "Accept-Encoding: gzip, br\r\n");
+  EXPECT_RESPONSE(f, 200, "gzipped");
+  /* Not noticed until the variants cache record expires */
+  write_file(f, "a.br", "brotli");
+  fileserver_get(f, "/a", "Accept-Encoding: gzip, br\r\n");
+  EXPECT_RESPONSE(f, 200, "gzipped");
+  EXPECT_OK(dfk_sleep(&f->dfk, 100 * MSEC));
+  fileserver_get(f, "/a", "Accept-Encoding: gzip, br\r\n");
+  EXPECT_RESPONSE(f, 200, "brotli");
+}
+
+TEST_F(fixture, fileserver, variants_cache)
+{
+  /* Variants are remembered even if the open file cache is disabled */
+  fixture->fs.cache_size = 0;
+  fixture->fs.cache_ttl = 50;
+  fixture->fs.variants_cache_size = 16;
+  fileserver_run(fixture, variants_cache_client);
+}
+
+static void variants_cache_lru_client(fixture_t* f)
+{
+  write_file(f, "a", "plain a");
+  write_file(f, "a.gz", "gzipped a");
+  write_file(f, "b", "plain b");
+  fileserver_get(f, "/a", "Accept-Encoding: gzip, br\r\n");
+  EXPECT_RESPONSE(f, 200, "gzipped a");
+  /* Evicts the record of a */
+  fileserver_get(f, "/b", "Accept-Encoding: gzip, br\r\n");
+  EXPECT_RESPONSE(f, 200, "plain b");
+  write_file(f, "a.br", "brotli a");
+  write_file(f, "b.br", "brotli b");
+  fileserver_get(f, "/a", "Accept-Encoding: gzip, br\r\n");
+  EXPECT_RESPONSE(f, 200, "brotli a");
+  fileserver_get(f, "/b", "Accept-Encoding: gzip, br\r\n");
+  EXPECT_RESPONSE(f, 200, "brotli b");
+}
+
+TEST_F(fixture, fileserver, variants_cache_lru)
+{
+  fixture->fs.cache_size = 0;
+  fixture->fs.cache_ttl = 60000;
+  fixture->fs.variants_cache_size = 1;
+  fileserver_run(fixture, variants_cache_lru_client);
+}
+
+static void variants_cache_disabled_client(fixture_t* f)
+{
+  write_file(f, "a", "plain");
+  write_file(f, "a.gz", "gzipped");
+  fileserver_get(f, "/a", "Accept-Encoding: gzip, br\r\n");
+  EXPECT_RESPONSE(f, 200, "gzipped");
+  write_file(f, "a.br", "brotli");
+  fileserver_get(f, "/a", "Accept-Encoding: gzip, br\r\n");
+  EXPECT_RESPONSE(f, 200, "brotli");
+}
+
+TEST_F(fixture, fileserver, variants_cache_disabled)
+{
+  fixture->fs.cache_size = 0;
+  fixture->fs.variants_cache_size = 0;
+  fileserver_run(fixture, variants_cache_disabled_client);
+}
+
+#define PREBUILT_RESPONSE_PREFIX \
+  "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nLast-Modified: "
+
+static void prebuilt_client(fixture_t* f)
+{
+  write_file(f, "a", "12345");
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "12345");
+  EXPECT(!strncmp(f->resp.data, PREBUILT_RESPONSE_PREFIX,
+        sizeof(PREBUILT_RESPONSE_PREFIX) - 1));
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Accept-Ranges"), "bytes");
+  /* Contents are sent from memory, not from the open descriptor */
+  write_file(f, "a", "abcde");
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "12345");
+  EXPECT(!strncmp(f->resp.data, PREBUILT_RESPONSE_PREFIX,
+        sizeof(PREBUILT_RESPONSE_PREFIX) - 1));
+  /* Partial responses are rendered as usual */
+  fileserver_get(f, "/a", "Range: bytes=1-2\r\n");
+  EXPECT_RESPONSE(f, 206, "bc");
+}
+
+TEST_F(fixture, fileserver, prebuilt)
+{
+  fixture->fs.cache_size = 4;
+  fixture->fs.cache_ttl = 60000;
+  fileserver_run(fixture, prebuilt_client);
+}
+
+static void prebuilt_connection_close_client(fixture_t* f)
+{
+  write_file(f, "a", "12345");
+  fileserver_get(f, "/a", NULL);
+  EXPECT(!strncmp(f->resp.data, PREBUILT_RESPONSE_PREFIX,
+        sizeof(PREBUILT_RESPONSE_PREFIX) - 1));
+  /* Pre-built response is not used if connection is to be closed */
+  fileserver_get(f, "/a", "Connection: close\r\n");
+  EXPECT_RESPONSE(f, 200, "12345");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Connection"), "close");
+  /* Connection is closed after the first request */
+  f->http.keepalive_requests = 1;
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "12345");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Connection"), "close");
+}
+
+TEST_F(fixture, fileserver, prebuilt_connection_close)
+{
+  fixture->fs.cache_size = 4;
+  fixture->fs.cache_ttl = 60000;
+  /* Server closes connections first, TIME_WAIT would block FILESERVER_PORT */
+  fixture->port = FILESERVER_PORT + 1;
+  fileserver_run(fixture, prebuilt_connection_close_client);
+}
+
+static void not_prebuilt_client(fixture_t* f)
+{
+  write_file(f, "a", "12345");
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "12345");
+  EXPECT(strncmp(f->resp.data, PREBUILT_RESPONSE_PREFIX,
+        sizeof(PREBUILT_RESPONSE_PREFIX) - 1));
+  write_file(f, "a", "abcde");
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "abcde");
+}
+
+TEST_F(fixture, fileserver, prebuilt_file_too_large)
+{
+  fixture->fs.cache_size = 4;
+  fixture->fs.cache_ttl = 60000;
+  fixture->fs.cache_file_size = 4;
+  fileserver_run(fixture, not_prebuilt_client);
+}
+
+TEST_F(fixture, fileserver, prebuilt_out_of_budget)
+{
+  fixture->fs.cache_size = 4;
+  fixture->fs.cache_ttl = 60000;
+  fixture->fs.cache_memory = 64;
+  fileserver_run(fixture, not_prebuilt_client);
+}
+
+static void prebuilt_budget_client(fixture_t* f)
+{
+  write_file(f, "a", "12345");
+  write_file(f, "b", "67890");
+  fileserver_get(f, "/a", NULL);
+  fileserver_get(f, "/b", NULL);
+  EXPECT(f->fs._cache_nbytes <= f->fs.cache_memory);
+  /* Only b fits into the budget, a is evicted */
+  EXPECT(f->fs._cache_nentries == 1);
+  write_file(f, "a", "abcde");
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "abcde");
+}
+
+TEST_F(fixture, fileserver, prebuilt_budget)
+{
+  fixture->fs.cache_size = 4;
+  fixture->fs.cache_ttl = 60000;
+  fixture->fs.cache_memory = 256;
+  fileserver_run(fixture, prebuilt_budget_client);
+}
+
+typedef struct range_case_t {
+  const char* value;
+  uint64_t size;
+  int nranges;
+  dfk_fileserver_range_t ranges[2];
+} range_case_t;
+
+static const range_case_t range_cases[] = {
+  {"bytes=0-4", 10, 1, {{0, 4}}},
+  {"bytes=5-", 10, 1, {{5, 9}}},
+  {"bytes=2-100", 10, 1, {{2, 9}}},
+  {"bytes= 0-0 ", 10, 1, {{0, 0}}},
+  /* Suffix ranges */
+  {"bytes=-3", 10, 1, {{7, 9}}},
+  {"bytes=-20", 10, 1, {{0, 9}}},
+  {"bytes=-0", 10, 0, {{0, 0}}},
+  {"bytes=-1", 0, 0, {{0, 0}}},
+  /* first >= size is not satisfiable */
+  {"bytes=10-", 10, 0, {{0, 0}}},
+  {"bytes=10-20", 10, 0, {{0, 0}}},
+  {"bytes=0-", 0, 0, {{0, 0}}},
+  {"bytes=0-1, 4-5", 10, 2, {{0, 1}, {4, 5}}},
+  {"bytes=0-1,20-30,-2", 10, 2, {{0, 1}, {8, 9}}},
+  {"bytes=0-1,,", 10, 1, {{0, 1}}},
+  /* last < first */
+  {"bytes=5-4", 10, -1, {{0, 0}}},
+  {"bytes=0-1,5-4", 10, -1, {{0, 0}}},
+  {"items=0-1", 10, -1, {{0, 0}}},
+  {"bytes=", 10, -1, {{0, 0}}},
+  {"bytes", 10, -1, {{0, 0}}},
+  {"bytes=-", 10, -1, {{0, 0}}},
+  {"bytes=1", 10, -1, {{0, 0}}},
+  {"bytes=a-1", 10, -1, {{0, 0}}},
+  {"bytes=0-1x", 10, -1, {{0, 0}}},
+  {"bytes=0-1 2-3", 10, -1, {{0, 0}}},
+  {"bytes=99999999999999999999-", 10, -1, {{0, 0}}},
+};
+
+TEST(fileserver, parse_range)
+{
+  for (size_t i = 0; i < DFK_SIZE(range_cases); ++i) {
+    const range_case_t* c = range_cases + i;
+    dfk_fileserver_range_t ranges[DFK_FILESERVER_MAX_RANGES];
+    int nranges = dfk__fileserver_parse_range(
+        (dfk_buf_t) {(char*) c->value, strlen(c->value)}, c->size, ranges);
+    EXPECT(nranges == c->nranges);
+    for (int j = 0; j < c->nranges && j < nranges; ++j) {
+      EXPECT(ranges[j].first == c->ranges[j].first);
+      EXPECT(ranges[j].last == c->ranges[j].last);
+    }
+  }
+}
+
+TEST(fileserver, parse_range_max_ranges)
+{
+  char value[256] = "bytes=0-0";
+  for (int i = 1; i < DFK_FILESERVER_MAX_RANGES; ++i) {
+    snprintf(value + strlen(value), sizeof(value) - strlen(value), ",%d-%d",
+        i, i);
+  }
+  dfk_fileserver_range_t ranges[DFK_FILESERVER_MAX_RANGES];
+  EXPECT(dfk__fileserver_parse_range((dfk_buf_t) {value, strlen(value)},
+        100, ranges) == DFK_FILESERVER_MAX_RANGES);
+  EXPECT(ranges[DFK_FILESERVER_MAX_RANGES - 1].first
+      == DFK_FILESERVER_MAX_RANGES - 1);
+  strcat(value, ",99-99");
+  EXPECT(dfk__fileserver_parse_range((dfk_buf_t) {value, strlen(value)},
+        100, ranges) == -1);
+}
+
+typedef struct date_case_t {
+  const char* value;
+  int valid;
+  time_t expected;
+} date_case_t;
+
+static const date_case_t date_cases[] = {
+  {"Sun, 06 Nov 1994 08:49:37 GMT", 1, 784111777},
+  {"Thu, 01 Jan 1970 00:00:00 GMT", 1, 0},
+  /* Obsolete RFC 850 and asctime formats are not accepted */
+  {"Sunday, 06-Nov-94 08:49:37 GMT", 0, 0},
+  {"Sun Nov  6 08:49:37 1994", 0, 0},
+  {"Sun, 06 Nov 1994 08:49:37 UTC", 0, 0},
+  {"Sun, 06 Nov 1994 08:49:37 GMT ", 0, 0},
+  {"Sun, 06 Nov 1994", 0, 0},
+  {"", 0, 0},
+  {"Sun, 06 Nov 1994 08:49:37 GMT                                      ", 0, 0},
+};
+
+TEST(fileserver, parse_date)
+{
+  for (size_t i = 0; i < DFK_SIZE(date_cases); ++i) {
+    const date_case_t* c = date_cases + i;
+    time_t res = -1;
+    int valid = dfk__fileserver_parse_date(
+        (dfk_buf_t) {(char*) c->value, strlen(c->value)}, &res);
+    EXPECT(valid == c->valid);
+    if (valid && c->valid) {
+      EXPECT(res == c->expected);
+    }
+  }
+}
+
+typedef struct etag_case_t {
+  const char* list;
+  int match;
+} etag_case_t;
+
+static const etag_case_t etag_cases[] = {
+  {"\"abc\"", 1},
+  {"W/\"abc\"", 1},
+  {"*", 1},
+  {"\"x\", \"abc\"", 1},
+  {" \"abc\" ,\"y\"", 1},
+  {"\"x\",W/\"abc\"\t", 1},
+  {"\"abcd\"", 0},
+  {"\"ab\"", 0},
+  {"abc", 0},
+  {"\"x\", \"y\"", 0},
+  {"", 0},
+  {" , ", 0},
+};
+
+TEST(fileserver, etag_match)
+{
+  static const char etag[] = "\"abc\"";
+  for (size_t i = 0; i < DFK_SIZE(etag_cases); ++i) {
+    const etag_case_t* c = etag_cases + i;
+    EXPECT(dfk__fileserver_etag_match(etag, sizeof(etag) - 1,
+          (dfk_buf_t) {(char*) c->list, strlen(c->list)}) == c->match);
+  }
+}
+
+static void ranges_client(fixture_t* f)
+{
+  write_file(f, "a", "0123456789");
+  fileserver_get(f, "/a", "Range: bytes=2-4\r\n");
+  EXPECT_RESPONSE(f, 206, "234");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Content-Range"), "bytes 2-4/10");
+  fileserver_get(f, "/a", "Range: bytes=-3\r\n");
+  EXPECT_RESPONSE(f, 206, "789");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Content-Range"), "bytes 7-9/10");
+  fileserver_get(f, "/a", "Range: bytes=7-100\r\n");
+  EXPECT_RESPONSE(f, 206, "789");
+  fileserver_get(f, "/a", "Range: bytes=10-\r\n");
+  EXPECT_RESPONSE(f, 416, "");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Content-Range"), "bytes */10");
+  /* Invalid Range header is ignored */
+  fileserver_get(f, "/a", "Range: bytes=5-4\r\n");
+  EXPECT_RESPONSE(f, 200, "0123456789");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Content-Range"), "");
+  fileserver_get(f, "/a", "Range: bytes=0-0,1-1,2-2,3-3,4-4,5-5,6-6,7-7,8-8,"
+      "9-9,0-0,1-1,2-2,3-3,4-4,5-5,6-6\r\n");
+  EXPECT_RESPONSE(f, 200, "0123456789");
+}
+
+TEST_F(fixture, fileserver, ranges)
+{
+  fileserver_run(fixture, ranges_client);
+}
+
+TEST_F(fixture, fileserver, ranges_cached)
+{
+  fixture->fs.cache_size = 4;
+  fixture->fs.cache_ttl = 60000;
+  fileserver_run(fixture, ranges_client);
+}
+
+static void multipart_client(fixture_t* f)
+{
+  write_file(f, "a", "0123456789");
+  fileserver_get(f, "/a", "Range: bytes=0-1,20-30,-2\r\n");
+  EXPECT(f->resp.status == 206);
+  EXPECT_BUFSTREQ(response_header(&f->resp, "Content-Range"), "");
+  static const char prefix[] = "multipart/byteranges; boundary=";
+  dfk_buf_t content_type = response_header(&f->resp, "Content-Type");
+  EXPECT(content_type.size > sizeof(prefix) - 1);
+  EXPECT(!strncmp(content_type.data, prefix, sizeof(prefix) - 1));
+  int boundarylen = content_type.size - (sizeof(prefix) - 1);
+  const char* boundary = content_type.data + sizeof(prefix) - 1;
+  char expected[512];
+  snprintf(expected, sizeof(expected),
+      "\r\n--%.*s\r\nContent-Range: bytes 0-1/10\r\n\r\n01"
+      "\r\n--%.*s\r\nContent-Range: bytes 8-9/10\r\n\r\n89"
+      "\r\n--%.*s--\r\n",
+      boundarylen, boundary, boundarylen, boundary, boundarylen, boundary);
+  EXPECT_RESPONSE(f, 206, expected);
+}
+
+TEST_F(fixture, fileserver, multipart)
+{
+  fileserver_run(fixture, multipart_client);
+}
+
+static void conditional_client(fixture_t* f)
+{
+  write_file(f, "a", "0123456789");
+  fileserver_get(f, "/a", NULL);
+  EXPECT_RESPONSE(f, 200, "0123456789");
+  char etag[64];
+  char last_modified[64];
+  dfk_buf_t value = response_header(&f->resp, "ETag");
+  snprintf(etag, sizeof(etag), "%.*s", (int) value.size, value.data);
+  value = response_header(&f->resp, "Last-Modified");
+  snprintf(last_modified, sizeof(last_modified), "%.*s", (int) value.size,
+      value.data);
+  char headers[256];
+
+  snprintf(headers, sizeof(headers), "If-None-Match: %s\r\n", etag);
+  fileserver_get(f, "/a", headers);
+  EXPECT_RESPONSE(f, 304, "");
+  EXPECT_BUFSTREQ(response_header(&f->resp, "ETag"), etag);
+  snprintf(headers, sizeof(headers), "If-None-Match: \"x\", W/%s\r\n", etag);
+  fileserver_get(f, "/a", headers);
+  EXPECT_RESPONSE(f, 304, "");
+  fileserver_get(f, "/a", "If-None-Match: \"x\"\r\n");
+  EXPECT_RESPONSE(f, 200, "0123456789");
+
+  snprintf(headers, sizeof(headers), "If-Modified-Since: %s\r\n",
+      last_modified);
+  fileserver_get(f, "/a", headers);
+  EXPECT_RESPONSE(f, 304, "");
+  fileserver_get(f, "/a",
+      "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n");
+  EXPECT_RESPONSE(f, 200, "0123456789");
+  /* If-Modified-Since is ignored if If-None-Match is present */
+  snprintf(headers, sizeof(headers),
+      "If-None-Match: \"x\"\r\nIf-Modified-Since: %s\r\n", last_modified);
+  fileserver_get(f, "/a", headers);
+  EXPECT_RESPONSE(f, 200, "0123456789");
+  /* Range is not served if the client copy is up to date */
+  snprintf(headers, sizeof(headers),
+      "If-None-Match: %s\r\nRange: bytes=0-1\r\n", etag);
+  fileserver_get(f, "/a", headers);
+  EXPECT_RESPONSE(f, 304, "");
+
+  snprintf(headers, sizeof(headers),
+      "If-Range: %s\r\nRange: bytes=0-1\r\n", etag);
+  fileserver_get(f, "/a", headers);
+  EXPECT_RESPONSE(f, 206, "01");
+  snprintf(headers, sizeof(headers),
+      "If-Range: %s\r\nRange: bytes=0-1\r\n", last_modified);
+  fileserver_get(f, "/a", headers);
+  EXPECT_RESPONSE(f, 206, "01");
+  fileserver_get(f, "/a", "If-Range: \"x\"\r\nRange: bytes=0-1\r\n");
+  EXPECT_RESPONSE(f, 200, "0123456789");
+  /* Weak tags are not allowed in If-Range */
+  snprintf(headers, sizeof(headers),
+      "If-Range: W/%s\r\nRange: bytes=0-1\r\n", etag);
+  fileserver_get(f, "/a", headers);
+  EXPECT_RESPONSE(f, 200, "0123456789");
+  fileserver_get(f, "/a", "If-Range: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+      "Range: bytes=0-1\r\n");
+  EXPECT_RESPONSE(f, 200, "0123456789");
+}
+
+TEST_F(fixture, fileserver, conditional)
+{
+  fileserver_run(fixture, conditional_client);
+}
+
+TEST_F(fixture, fileserver, conditional_cached)
+{
+  fixture->fs.cache_size = 4;
+  fixture->fs.cache_ttl = 60000;
+  fileserver_run(fixture, conditional_client);
+}
@@ -0,0 +1,112 @@
+/**
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <dfk/context.h>
+#include <dfk/fiber.h>
+#include <dfk/mailbox.h>
+#include <dfk/internal.h>
+#include <ut.h>
+
+typedef struct job_t {
+  dfk_mailbox_t* mailbox;
+  dfk_mailbox_msg_t msg;
+  pthread_t thread;
+  int input;
+  int output;
+} job_t;
+
+static void* job_thread(void* arg)
+{
+  job_t* job = (job_t*) arg;
+  struct timespec delay = {0, 5000000};
+  nanosleep(&delay, NULL);
+  job->output = job->input * 2;
+  EXPECT_OK(dfk_mailbox_post(job->mailbox, &job->msg));
+  return NULL;
+}
+
+static void post_from_thread_main(dfk_fiber_t* fiber, void* arg)
+{
+  DFK_UNUSED(arg);
+  dfk_mailbox_t mailbox;
+  EXPECT_OK(dfk_mailbox_init(&mailbox, fiber->dfk));
+  job_t job = {.mailbox = &mailbox, .input = 21, .output = 0};
+  dfk_mailbox_msg_init(&job.msg);
+  EXPECT(!pthread_create(&job.thread, NULL, job_thread, &job));
+  EXPECT_OK(dfk_mailbox_wait(&mailbox, &job.msg));
+  EXPECT(job.output == 42);
+  pthread_join(job.thread, NULL);
+  EXPECT_OK(dfk_mailbox_free(&mailbox));
+}
+
+TEST(mailbox, post_from_thread)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+  EXPECT_OK(dfk_work(&dfk, post_from_thread_main, NULL, 0));
+  dfk_free(&dfk);
+}
+
+static void post_before_wait_main(dfk_fiber_t* fiber, void* arg)
+{
+  DFK_UNUSED(arg);
+  dfk_mailbox_t mailbox;
+  EXPECT_OK(dfk_mailbox_init(&mailbox, fiber->dfk));
+  dfk_mailbox_msg_t msg;
+  dfk_mailbox_msg_init(&msg);
+  EXPECT_OK(dfk_mailbox_post(&mailbox, &msg));
+  EXPECT_OK(dfk_mailbox_wait(&mailbox, &msg));
+  EXPECT_OK(dfk_mailbox_free(&mailbox));
+}
+
+TEST(mailbox, post_before_wait)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+  EXPECT_OK(dfk_work(&dfk, post_before_wait_main, NULL, 0));
+  dfk_free(&dfk);
+}
+
+typedef struct batch_arg_t {
+  dfk_mailbox_t mailbox;
+  job_t jobs[8];
+} batch_arg_t;
+
+static void batch_child(dfk_fiber_t* fiber, void* arg)
+{
+  DFK_UNUSED(fiber);
+  job_t* job = (job_t*) arg;
+  dfk_mailbox_msg_init(&job->msg);
+  EXPECT(!pthread_create(&job->thread, NULL, job_thread, job));
+  EXPECT_OK(dfk_mailbox_wait(job->mailbox, &job->msg));
+  EXPECT(job->output == job->input * 2);
+}
+
+static void batch_main(dfk_fiber_t* fiber, void* arg)
+{
+  batch_arg_t* batch = (batch_arg_t*) arg;
+  for (size_t i = 0; i < DFK_SIZE(batch->jobs); ++i) {
+    batch->jobs[i].mailbox = &batch->mailbox;
+    batch->jobs[i].input = (int) i;
+    EXPECT(dfk_spawn(fiber->dfk, batch_child, batch->jobs + i, 0));
+  }
+}
+
+TEST(mailbox, batch)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+  batch_arg_t batch;
+  EXPECT_OK(dfk_mailbox_init(&batch.mailbox, &dfk));
+  EXPECT_OK(dfk_work(&dfk, batch_main, &batch, 0));
+  for (size_t i = 0; i < DFK_SIZE(batch.jobs); ++i) {
+    pthread_join(batch.jobs[i].thread, NULL);
+  }
+  EXPECT_OK(dfk_mailbox_free(&batch.mailbox));
+  dfk_free(&dfk);
+}
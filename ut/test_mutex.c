@@ -177,3 +177,95 @@ TEST_F(mutex_fixture, mutex, try_lock)
   EXPECT_OK(dfk_work(&fixture->dfk, try_lock_main, data, 0));
 }
 
+#if !DFK_THREADS
+typedef struct handoff_data {
+  dfk_mutex_t mutex;
+  int order[4];
+  int n;
+} handoff_data;
+
+static void handoff_waiter(dfk_fiber_t* fiber, void* arg)
+{
+  DFK_UNUSED(fiber);
+  handoff_data* d = arg;
+  dfk_mutex_lock(&d->mutex);
+  dfk_mutex_unlock(&d->mutex);
+  d->order[d->n++] = 1;
+}
+
+static void handoff_bystander(dfk_fiber_t* fiber, void* arg)
+{
+  DFK_UNUSED(fiber);
+  handoff_data* d = arg;
+  d->order[d->n++] = 2;
+}
+
+static void handoff_main(dfk_fiber_t* fiber, void* arg)
+{
+  dfk_t* dfk = fiber->dfk;
+  handoff_data* d = arg;
+  dfk_mutex_init(&d->mutex, dfk);
+  dfk_mutex_lock(&d->mutex);
+  EXPECT(dfk_spawn(dfk, handoff_waiter, d, 0));
+  /* Let the waiter block on the mutex */
+  DFK_POSTPONE(dfk);
+  EXPECT(dfk_spawn(dfk, handoff_bystander, d, 0));
+  dfk_mutex_unlock(&d->mutex);
+  d->order[d->n++] = 3;
+  DFK_POSTPONE(dfk);
+  dfk_mutex_free(&d->mutex);
+}
+#endif
+
+TEST_F(mutex_fixture, mutex, unlock_handoff)
+{
+#if !DFK_THREADS
+  handoff_data d = {.n = 0};
+  fixture->dfk.handoff_limit = 16;
+  EXPECT_OK(dfk_work(&fixture->dfk, handoff_main, &d, 0));
+  /* Waiter is executed right away, the caller is postponed */
+  EXPECT(d.n == 3);
+  EXPECT(d.order[0] == 1);
+  EXPECT(d.order[1] == 2);
+  EXPECT(d.order[2] == 3);
+#else
+  DFK_UNUSED(fixture);
+#endif
+}
+
+#if !DFK_THREADS
+static void handoff_limit_main(dfk_fiber_t* fiber, void* arg)
+{
+  dfk_t* dfk = fiber->dfk;
+  handoff_data* d = arg;
+  dfk_mutex_init(&d->mutex, dfk);
+  dfk_mutex_lock(&d->mutex);
+  EXPECT(dfk_spawn(dfk, handoff_waiter, d, 0));
+  EXPECT(dfk_spawn(dfk, handoff_waiter, d, 0));
+  /* Let both waiters block on the mutex */
+  DFK_POSTPONE(dfk);
+  dfk_mutex_unlock(&d->mutex);
+  d->order[d->n++] = 3;
+  DFK_POSTPONE(dfk);
+  dfk_mutex_free(&d->mutex);
+}
+#endif
+
+TEST_F(mutex_fixture, mutex, handoff_limit)
+{
+#if !DFK_THREADS
+  handoff_data d = {.n = 0};
+  fixture->dfk.handoff_limit = 1;
+  EXPECT_OK(dfk_work(&fixture->dfk, handoff_limit_main, &d, 0));
+  /*
+   * The first waiter gets the lock directly, the second one is resumed
+   * via the run queue after the main fiber.
+   */
+  EXPECT(d.n == 3);
+  EXPECT(d.order[0] == 1);
+  EXPECT(d.order[1] == 3);
+  EXPECT(d.order[2] == 1);
+#else
+  DFK_UNUSED(fixture);
+#endif
+}
@@ -33,3 +33,19 @@ TEST_F(fixture, strmap, init_free)
   EXPECT(fixture);
 }
 
+
+TEST_F(fixture, strmap, prefix_keys)
+{
+  dfk_strmap_t* map = &fixture->map;
+  dfk_strmap_insert(map, dfk_strmap_item_acopy(&fixture->arena,
+        "Accept", 6, "a", 1));
+  dfk_strmap_insert(map, dfk_strmap_item_acopy(&fixture->arena,
+        "Accept-Encoding", 15, "b", 1));
+  EXPECT(dfk_strmap_size(map) == 2);
+  dfk_buf_t value = dfk_strmap_get(map, "Accept", 6);
+  EXPECT(value.size == 1 && value.data[0] == 'a');
+  value = dfk_strmap_get(map, "Accept-Encoding", 15);
+  EXPECT(value.size == 1 && value.data[0] == 'b');
+  EXPECT(!dfk_strmap_get(map, "Accept-Language", 15).data);
+  EXPECT(!dfk_strmap_get(map, "Acc", 3).data);
+}
@@ -0,0 +1,381 @@
+/**
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dfk/mutex.h>
+#include <dfk/tcp_server.h>
+#include <dfk/internal.h>
+#include <ut.h>
+
+#define NCLIENTS 6
+
+typedef struct serve_arg_t {
+  dfk_tcp_server_t server;
+  size_t reuseport;
+  size_t accept_burst;
+  uint16_t port;
+  int serve_err;
+  int nserved;
+  int nreplies;
+  /** Number of connections accepted when the first handler started */
+  size_t naccepted_first;
+} serve_arg_t;
+
+static void serve_handler(dfk_tcp_server_t* server, dfk_fiber_t* fiber,
+    dfk_tcp_socket_t* sock, dfk_userdata_t ud)
+{
+  DFK_UNUSED(fiber);
+  serve_arg_t* arg = (serve_arg_t*) ud.data;
+  if (!arg->nserved) {
+    arg->naccepted_first = server->accept_stats.naccepted;
+  }
+  arg->nserved++;
+  char reply = 'x';
+  EXPECT(dfk_tcp_socket_write(sock, &reply, 1) == 1);
+  /* Wait for the client to close first, so that port is not in TIME_WAIT */
+  EXPECT(dfk_tcp_socket_read(sock, &reply, 1) == 0);
+  EXPECT_OK(dfk_tcp_socket_close(sock));
+}
+
+static void serve_fiber(dfk_fiber_t* fiber, void* p)
+{
+  DFK_UNUSED(fiber);
+  serve_arg_t* arg = (serve_arg_t*) p;
+  arg->serve_err = dfk_tcp_serve(&arg->server, "127.0.0.1", arg->port, 16,
+      serve_handler, (dfk_userdata_t) {.data = arg});
+}
+
+static void client_fiber(dfk_fiber_t* fiber, void* p)
+{
+  serve_arg_t* arg = (serve_arg_t*) p;
+  dfk_tcp_socket_t sock;
+  EXPECT_OK(dfk_tcp_socket_init(&sock, fiber->dfk));
+  EXPECT_OK(dfk_tcp_socket_connect(&sock, "127.0.0.1", arg->port));
+  char reply = 0;
+  EXPECT(dfk_tcp_socket_read(&sock, &reply, 1) == 1);
+  EXPECT(reply == 'x');
+  arg->nreplies++;
+  EXPECT_OK(dfk_tcp_socket_close(&sock));
+}
+
+static void serve_main(dfk_fiber_t* fiber, void* p)
+{
+  dfk_t* dfk = fiber->dfk;
+  serve_arg_t* arg = (serve_arg_t*) p;
+  dfk_tcp_server_init(&arg->server, dfk);
+  arg->server.reuseport = arg->reuseport;
+  if (arg->accept_burst) {
+    dfk->accept_burst = arg->accept_burst;
+  }
+  EXPECT(dfk_spawn(dfk, serve_fiber, arg, 0));
+  /* Let the server and its listeners bind */
+  EXPECT_OK(dfk_sleep(dfk, 10000000));
+  for (int i = 0; i < NCLIENTS; ++i) {
+    EXPECT(dfk_spawn(dfk, client_fiber, arg, 0));
+  }
+  while (arg->nreplies < NCLIENTS) {
+    EXPECT_OK(dfk_sleep(dfk, 1000000));
+  }
+  EXPECT_OK(dfk_tcp_server_stop(&arg->server));
+}
+
+TEST(tcp_server, serve_stop)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+  serve_arg_t arg = {.reuseport = 0, .port = 10021, .serve_err = -1};
+  EXPECT_OK(dfk_work(&dfk, serve_main, &arg, 0));
+  EXPECT_OK(arg.serve_err);
+  EXPECT(arg.nserved == NCLIENTS);
+  EXPECT(arg.server.accept_stats.naccepted == NCLIENTS);
+  EXPECT(arg.server.accept_stats.nwakeups >= 1);
+  EXPECT(arg.server.accept_stats.nwakeups <= NCLIENTS);
+  dfk_tcp_server_free(&arg.server);
+  dfk_free(&dfk);
+}
+
+TEST(tcp_server, accept_burst)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+  serve_arg_t arg = {.accept_burst = 1, .port = 10023, .serve_err = -1};
+  EXPECT_OK(dfk_work(&dfk, serve_main, &arg, 0));
+  EXPECT_OK(arg.serve_err);
+  EXPECT(arg.nserved == NCLIENTS);
+  /* Accept loop yields after each connection */
+  EXPECT(arg.server.accept_stats.nyields == NCLIENTS);
+  /* Handler of the first connection runs before the second one is accepted */
+  EXPECT(arg.naccepted_first == 1);
+  dfk_tcp_server_free(&arg.server);
+  dfk_free(&dfk);
+}
+
+TEST(tcp_server, reuseport)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+  serve_arg_t arg = {.reuseport = 3, .port = 10022, .serve_err = -1};
+  EXPECT_OK(dfk_work(&dfk, serve_main, &arg, 0));
+  EXPECT_OK(arg.serve_err);
+  EXPECT(arg.nserved == NCLIENTS);
+  EXPECT(arg.server.accept_stats.naccepted == NCLIENTS);
+  dfk_tcp_server_free(&arg.server);
+  dfk_free(&dfk);
+}
+
+#define WRITEV_NIOV 300
+#define BULK_SIZE (4 * 1024 * 1024)
+
+typedef struct bulk_arg_t {
+  dfk_tcp_server_t server;
+  char* data;
+  /** Send contents of the file instead of data */
+  int fd;
+  uint16_t port;
+  int serve_err;
+  size_t nreceived;
+} bulk_arg_t;
+
+static void writev_handler(dfk_tcp_server_t* server, dfk_fiber_t* fiber,
+    dfk_tcp_socket_t* sock, dfk_userdata_t ud)
+{
+  DFK_UNUSED(server);
+  DFK_UNUSED(fiber);
+  bulk_arg_t* arg = (bulk_arg_t*) ud.data;
+  /* More buffers than fit into a single writev, some of them are empty */
+  dfk_iovec_t iov[WRITEV_NIOV];
+  size_t chunk = BULK_SIZE / (WRITEV_NIOV / 2);
+  size_t offset = 0;
+  for (size_t i = 0; i < WRITEV_NIOV; ++i) {
+    size_t size = (i % 2) ? DFK_MIN(chunk + i, BULK_SIZE - offset) : 0;
+    if (i == WRITEV_NIOV - 1) {
+      size = BULK_SIZE - offset;
+    }
+    iov[i] = (dfk_iovec_t) {arg->data + offset, size};
+    offset += size;
+  }
+  EXPECT(dfk_tcp_socket_writev(sock, iov, WRITEV_NIOV) == BULK_SIZE);
+  char c;
+  EXPECT(dfk_tcp_socket_read(sock, &c, 1) == 0);
+  EXPECT_OK(dfk_tcp_socket_close(sock));
+}
+
+static void sendfile_handler(dfk_tcp_server_t* server, dfk_fiber_t* fiber,
+    dfk_tcp_socket_t* sock, dfk_userdata_t ud)
+{
+  DFK_UNUSED(server);
+  DFK_UNUSED(fiber);
+  bulk_arg_t* arg = (bulk_arg_t*) ud.data;
+  /* Two parts, the second one exceeds end of file */
+  size_t half = BULK_SIZE / 2;
+  EXPECT(dfk_tcp_socket_sendfile(sock, arg->fd, 0, half) == (ssize_t) half);
+  EXPECT(dfk_tcp_socket_sendfile(sock, arg->fd, half, BULK_SIZE)
+      == (ssize_t) (BULK_SIZE - half));
+  char c;
+  EXPECT(dfk_tcp_socket_read(sock, &c, 1) == 0);
+  EXPECT_OK(dfk_tcp_socket_close(sock));
+}
+
+static void bulk_serve(dfk_fiber_t* fiber, void* p)
+{
+  DFK_UNUSED(fiber);
+  bulk_arg_t* arg = (bulk_arg_t*) p;
+  arg->serve_err = dfk_tcp_serve(&arg->server, "127.0.0.1", arg->port, 16,
+      arg->fd == -1 ? writev_handler : sendfile_handler,
+      (dfk_userdata_t) {.data = arg});
+}
+
+static void bulk_main(dfk_fiber_t* fiber, void* p)
+{
+  dfk_t* dfk = fiber->dfk;
+  bulk_arg_t* arg = (bulk_arg_t*) p;
+  dfk_tcp_server_init(&arg->server, dfk);
+  EXPECT(dfk_spawn(dfk, bulk_serve, arg, 0));
+  EXPECT_OK(dfk_sleep(dfk, 10000000));
+  dfk_tcp_socket_t sock;
+  EXPECT_OK(dfk_tcp_socket_init(&sock, dfk));
+  EXPECT_OK(dfk_tcp_socket_connect(&sock, "127.0.0.1", arg->port));
+  char buf[3000];
+  while (arg->nreceived < BULK_SIZE) {
+    dfk_iovec_t iov[] = {{buf, 1000}, {buf + 1000, 2000}};
+    ssize_t nread = dfk_tcp_socket_readv(&sock, iov, DFK_SIZE(iov));
+    EXPECT(nread > 0);
+    if (nread <= 0 || memcmp(buf, arg->data + arg->nreceived, nread)) {
+      EXPECT(0 && "unexpected data received");
+      break;
+    }
+    arg->nreceived += nread;
+  }
+  EXPECT_OK(dfk_tcp_socket_close(&sock));
+  EXPECT_OK(dfk_tcp_server_stop(&arg->server));
+}
+
+static char* bulk_data(void)
+{
+  char* data = malloc(BULK_SIZE);
+  EXPECT(data);
+  for (size_t i = 0; i < BULK_SIZE; ++i) {
+    data[i] = (char) (i % 251);
+  }
+  return data;
+}
+
+TEST(tcp_server, writev)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+  bulk_arg_t arg = {.fd = -1, .port = 10024, .serve_err = -1};
+  arg.data = bulk_data();
+  EXPECT_OK(dfk_work(&dfk, bulk_main, &arg, 0));
+  EXPECT_OK(arg.serve_err);
+  EXPECT(arg.nreceived == BULK_SIZE);
+  dfk_tcp_server_free(&arg.server);
+  free(arg.data);
+  dfk_free(&dfk);
+}
+
+TEST(tcp_server, sendfile)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+  bulk_arg_t arg = {.port = 10025, .serve_err = -1};
+  arg.data = bulk_data();
+  char path[] = "/tmp/dfk-ut-sendfile-XXXXXX";
+  arg.fd = mkstemp(path);
+  EXPECT(arg.fd != -1);
+  unlink(path);
+  EXPECT(write(arg.fd, arg.data, BULK_SIZE) == BULK_SIZE);
+  EXPECT_OK(dfk_work(&dfk, bulk_main, &arg, 0));
+  EXPECT_OK(arg.serve_err);
+  EXPECT(arg.nreceived == BULK_SIZE);
+  dfk_tcp_server_free(&arg.server);
+  close(arg.fd);
+  free(arg.data);
+  dfk_free(&dfk);
+}
+
+#define DEADLINE_NCLIENTS 8
+#define DEADLINE_NROUNDS 100
+
+typedef struct deadline_arg_t {
+  dfk_tcp_server_t server;
+  uint16_t port;
+  int serve_err;
+  dfk_mutex_t mutex;
+  int nfinished;
+} deadline_arg_t;
+
+static void echo_handler(dfk_tcp_server_t* server, dfk_fiber_t* fiber,
+    dfk_tcp_socket_t* sock, dfk_userdata_t ud)
+{
+  DFK_UNUSED(server);
+  DFK_UNUSED(fiber);
+  DFK_UNUSED(ud);
+  char buf[64];
+  ssize_t nread;
+  while ((nread = dfk_tcp_socket_read(sock, buf, sizeof(buf))) > 0) {
+    EXPECT(dfk_tcp_socket_write(sock, buf, nread) == nread);
+  }
+  EXPECT_OK(dfk_tcp_socket_close(sock));
+}
+
+static void deadline_serve(dfk_fiber_t* fiber, void* p)
+{
+  DFK_UNUSED(fiber);
+  deadline_arg_t* arg = (deadline_arg_t*) p;
+  arg->serve_err = dfk_tcp_serve(&arg->server, "127.0.0.1", arg->port, 16,
+      echo_handler, (dfk_userdata_t) {.data = arg});
+}
+
+/**
+ * Read echoed bytes with deadlines close to the round trip time, so that
+ * both IO readiness and timer expiry wake the fiber up
+ */
+static void deadline_client(dfk_fiber_t* fiber, void* p)
+{
+  dfk_t* dfk = fiber->dfk;
+  deadline_arg_t* arg = (deadline_arg_t*) p;
+  dfk_tcp_socket_t sock;
+  EXPECT_OK(dfk_tcp_socket_init(&sock, dfk));
+  EXPECT_OK(dfk_tcp_socket_connect(&sock, "127.0.0.1", arg->port));
+  char buf[64];
+  /*
+   * Nothing is sent yet. Note that dfk_t.dfk_errno is shared by the
+   * workers, hence it is not checked.
+   */
+  EXPECT(dfk_tcp_socket_read_deadline(&sock, buf, sizeof(buf),
+        dfk_now(dfk) + 1000000) == -1);
+  size_t nwritten = 0;
+  size_t nreceived = 0;
+  for (int i = 0; i < DEADLINE_NROUNDS; ++i) {
+    buf[0] = (char) i;
+    EXPECT(dfk_tcp_socket_write(&sock, buf, 1) == 1);
+    nwritten++;
+    uint64_t deadline = dfk_now(dfk) + (uint64_t) (i % 3) * 100000;
+    ssize_t nread = dfk_tcp_socket_read_deadline(&sock, buf, sizeof(buf),
+        deadline);
+    if (nread > 0) {
+      nreceived += nread;
+    }
+  }
+  while (nreceived < nwritten) {
+    ssize_t nread = dfk_tcp_socket_read_deadline(&sock, buf, sizeof(buf),
+        dfk_now(dfk) + 1000000000);
+    EXPECT(nread > 0);
+    if (nread <= 0) {
+      break;
+    }
+    nreceived += nread;
+  }
+  EXPECT(nreceived == nwritten);
+  EXPECT_OK(dfk_tcp_socket_close(&sock));
+  dfk_mutex_lock(&arg->mutex);
+  arg->nfinished++;
+  dfk_mutex_unlock(&arg->mutex);
+}
+
+static void deadline_main(dfk_fiber_t* fiber, void* p)
+{
+  dfk_t* dfk = fiber->dfk;
+  deadline_arg_t* arg = (deadline_arg_t*) p;
+  dfk_tcp_server_init(&arg->server, dfk);
+  EXPECT(dfk_spawn(dfk, deadline_serve, arg, 0));
+  EXPECT_OK(dfk_sleep(dfk, 10000000));
+  for (int i = 0; i < DEADLINE_NCLIENTS; ++i) {
+    EXPECT(dfk_spawn(dfk, deadline_client, arg, 0));
+  }
+  int nfinished = 0;
+  while (nfinished < DEADLINE_NCLIENTS) {
+    EXPECT_OK(dfk_sleep(dfk, 1000000));
+    dfk_mutex_lock(&arg->mutex);
+    nfinished = arg->nfinished;
+    dfk_mutex_unlock(&arg->mutex);
+  }
+  EXPECT_OK(dfk_tcp_server_stop(&arg->server));
+}
+
+/*
+ * If #DFK_THREADS is enabled, fibers waiting with a deadline are resumed
+ * by several worker threads
+ */
+TEST(tcp_server, concurrent_read_deadlines)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+#if DFK_THREADS
+  dfk.nworkers = 4;
+#endif
+  deadline_arg_t arg = {.port = 10026, .serve_err = -1};
+  dfk_mutex_init(&arg.mutex, &dfk);
+  EXPECT_OK(dfk_work(&dfk, deadline_main, &arg, 0));
+  EXPECT_OK(arg.serve_err);
+  EXPECT(arg.nfinished == DEADLINE_NCLIENTS);
+  dfk_mutex_free(&arg.mutex);
+  dfk_tcp_server_free(&arg.server);
+  dfk_free(&dfk);
+}
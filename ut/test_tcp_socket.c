@@ -107,6 +107,41 @@ TEST_F(echo_fixture, tcp_socket, single_write_read)
   dfk_work(&fixture->dfk, single_write_read, NULL, 0);
 }
 
+TEST_F(echo_fixture, tcp_socket, single_write_read_idle_spin)
+{
+  fixture->dfk.idle_spin_usec = 100000;
+  dfk_work(&fixture->dfk, single_write_read, NULL, 0);
+}
+
+static void read_deadline(dfk_fiber_t* fiber, void* p)
+{
+  DFK_UNUSED(p);
+  dfk_t* dfk = fiber->dfk;
+  dfk_tcp_socket_t sock;
+  EXPECT_OK(dfk_tcp_socket_init(&sock, dfk));
+  EXPECT_OK(dfk_tcp_socket_connect(&sock, "127.0.0.1", 10020));
+  char buffer[64];
+  /* Echo server does not send anything until it receives something */
+  uint64_t deadline = dfk_now(dfk) + 50000000;
+  EXPECT(dfk_tcp_socket_read_deadline(&sock, buffer, sizeof(buffer),
+        deadline) == -1);
+  EXPECT(dfk->dfk_errno == dfk_err_timeout);
+  EXPECT(dfk_now(dfk) >= deadline);
+  /* Socket is still usable */
+  memset(buffer, 42, sizeof(buffer));
+  EXPECT(dfk_tcp_socket_write_deadline(&sock, buffer, sizeof(buffer),
+        dfk_now(dfk) + 1000000000) == sizeof(buffer));
+  EXPECT(dfk_tcp_socket_read_deadline(&sock, buffer, sizeof(buffer),
+        dfk_now(dfk) + 1000000000) > 0);
+  EXPECT(buffer[0] == 42);
+  EXPECT_OK(dfk_tcp_socket_close(&sock));
+}
+
+TEST_F(echo_fixture, tcp_socket, read_deadline)
+{
+  dfk_work(&fixture->dfk, read_deadline, NULL, 0);
+}
+
 
 // static void multi_write_read(dfk_fiber_t* fiber, void* p)
 // {
@@ -0,0 +1,144 @@
+/**
+ * @copyright
+ * Copyright (c) 2017 Stanislav Ivochkin
+ * Licensed under the MIT License (see LICENSE)
+ */
+
+#include <dfk/context.h>
+#include <dfk/fiber.h>
+#include <dfk/internal.h>
+#include <dfk/internal/timer.h>
+#include <ut.h>
+
+#define MSEC 1000000ULL
+
+typedef struct expired_arg_t {
+  int nexpired;
+} expired_arg_t;
+
+static void on_expired(dfk_timer_t* timer)
+{
+  expired_arg_t* arg = (expired_arg_t*) timer->arg;
+  arg->nexpired++;
+}
+
+TEST(timer, wheel_expires_in_time)
+{
+  /* Ticks covering each level of the wheel, sorted ascending */
+  uint64_t ticks[] = {0, 1, 63, 64, 65, 4095, 4096, 300000, (1 << 24) + 5};
+  dfk_timer_wheel_t wheel;
+  dfk__timer_wheel_init(&wheel);
+  dfk_timer_t timers[DFK_SIZE(ticks)];
+  expired_arg_t args[DFK_SIZE(ticks)];
+  for (size_t i = 0; i < DFK_SIZE(ticks); ++i) {
+    args[i].nexpired = 0;
+    dfk__timer_init(timers + i, on_expired, args + i);
+    dfk__timer_wheel_add(&wheel, timers + i, wheel.origin + ticks[i] * MSEC);
+  }
+  EXPECT(wheel.ntimers == DFK_SIZE(ticks));
+  for (size_t i = 0; i < DFK_SIZE(ticks); ++i) {
+    if (ticks[i]) {
+      dfk__timer_wheel_advance(&wheel, wheel.origin + ticks[i] * MSEC - 1);
+      EXPECT(args[i].nexpired == 0);
+    }
+    dfk__timer_wheel_advance(&wheel, wheel.origin + ticks[i] * MSEC);
+    EXPECT(args[i].nexpired == 1);
+  }
+  EXPECT(wheel.ntimers == 0);
+}
+
+TEST(timer, wheel_del)
+{
+  dfk_timer_wheel_t wheel;
+  dfk__timer_wheel_init(&wheel);
+  expired_arg_t arg = {0};
+  dfk_timer_t timer;
+  dfk__timer_init(&timer, on_expired, &arg);
+  dfk__timer_wheel_add(&wheel, &timer, wheel.origin + 100 * MSEC);
+  dfk__timer_wheel_del(&wheel, &timer);
+  EXPECT(wheel.ntimers == 0);
+  dfk__timer_wheel_advance(&wheel, wheel.origin + 200 * MSEC);
+  EXPECT(arg.nexpired == 0);
+  /* Deleting expired, or not armed timer is a no-op */
+  dfk__timer_wheel_del(&wheel, &timer);
+  EXPECT(wheel.ntimers == 0);
+}
+
+TEST(timer, wheel_timeout)
+{
+  dfk_timer_wheel_t wheel;
+  dfk__timer_wheel_init(&wheel);
+  EXPECT(dfk__timer_wheel_timeout(&wheel, wheel.origin) == -1);
+  /* Tick 0 is a cascade point, event loop should process it at once */
+  expired_arg_t arg = {0};
+  dfk_timer_t timer;
+  dfk__timer_init(&timer, on_expired, &arg);
+  dfk__timer_wheel_add(&wheel, &timer, wheel.origin + 10 * MSEC);
+  EXPECT(dfk__timer_wheel_timeout(&wheel, wheel.origin) == 0);
+  dfk__timer_wheel_advance(&wheel, wheel.origin);
+  EXPECT(dfk__timer_wheel_timeout(&wheel, wheel.origin)
+      == (int64_t) (10 * MSEC));
+  dfk__timer_wheel_advance(&wheel, wheel.origin + 10 * MSEC);
+  EXPECT(arg.nexpired == 1);
+  /* Distant timers wake up the event loop at the nearest cascade point */
+  dfk__timer_wheel_add(&wheel, &timer, wheel.origin + 1000 * MSEC);
+  EXPECT(dfk__timer_wheel_timeout(&wheel, wheel.origin + 10 * MSEC)
+      == (int64_t) (54 * MSEC));
+}
+
+static void sleep_main(dfk_fiber_t* fiber, void* arg)
+{
+  uint64_t* slept = (uint64_t*) arg;
+  uint64_t started = dfk_now(fiber->dfk);
+  EXPECT_OK(dfk_sleep(fiber->dfk, 20 * MSEC));
+  *slept = dfk_now(fiber->dfk) - started;
+}
+
+TEST(timer, sleep)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+  uint64_t slept = 0;
+  EXPECT_OK(dfk_work(&dfk, sleep_main, &slept, 0));
+  EXPECT(slept >= 20 * MSEC);
+  dfk_free(&dfk);
+}
+
+typedef struct sleep_order_arg_t {
+  int order[3];
+  int nwoken;
+} sleep_order_arg_t;
+
+typedef struct sleep_child_arg_t {
+  sleep_order_arg_t* shared;
+  int id;
+} sleep_child_arg_t;
+
+static void sleep_order_child(dfk_fiber_t* fiber, void* p)
+{
+  sleep_child_arg_t* arg = (sleep_child_arg_t*) p;
+  EXPECT_OK(dfk_sleep(fiber->dfk, (uint64_t) arg->id * 10 * MSEC));
+  arg->shared->order[arg->shared->nwoken++] = arg->id;
+}
+
+static void sleep_order_main(dfk_fiber_t* fiber, void* p)
+{
+  int ids[] = {3, 1, 2};
+  for (size_t i = 0; i < DFK_SIZE(ids); ++i) {
+    sleep_child_arg_t arg = {(sleep_order_arg_t*) p, ids[i]};
+    EXPECT(dfk_spawn(fiber->dfk, sleep_order_child, &arg, sizeof(arg)));
+  }
+}
+
+TEST(timer, sleep_order)
+{
+  dfk_t dfk;
+  dfk_init(&dfk);
+  sleep_order_arg_t arg = {{0}, 0};
+  EXPECT_OK(dfk_work(&dfk, sleep_order_main, &arg, 0));
+  EXPECT(arg.nwoken == 3);
+  EXPECT(arg.order[0] == 1);
+  EXPECT(arg.order[1] == 2);
+  EXPECT(arg.order[2] == 3);
+  dfk_free(&dfk);
+}